@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+
+/* Benchmarks for the fs.h API.  Each workload runs on a freshly formatted
+ * image for every block size and prints one JSON object per line:
+ *
+ *   {"bench":"seqread","blksz":4096,"param":65536,"ops":512,
+ *    "secs":0.012,"ops_per_sec":42666.7,"mib_per_sec":2666.7,
+ *    "p50_us":18.1,"p99_us":40.2,"syscalls_per_op":1.00}
+ *
+ * =param is the I/O size for data workloads and the number of entries in
+ * the directory for dirscale.  Latencies are per call.  syscalls_per_op
+ * counts the read and write system calls (including their p* and *v
+ * variants) reported by /proc/self/io. */
+
+#define MIB (1024 * 1024)
+#define SEQ_IOSZ (64 * 1024)
+#define RAND_IOSZ 4096
+
+static const char *image = "bench.img";
+static uint64_t imagesz = 256 * MIB;
+static uint64_t nops = 2000;
+static int mode = FS_IO_PREAD;
+static uint64_t journal;
+static int format_flags;
+
+static long calls_overhead;
+
+void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-b blksz] [-s MiB] [-n ops] [-m pread|mmap|uring] [-j blocks] [-c] [image]\n", prog);
+	fprintf(stderr, "  -b blksz   run only this block size (default: from %d up to 64 KiB)\n", MIN_BLOCK_SIZE);
+	fprintf(stderr, "  -s MiB     size of the image (default: 256)\n");
+	fprintf(stderr, "  -n ops     operations per metadata and random workload (default: 2000)\n");
+	fprintf(stderr, "  -m mode    how the image is accessed, as fs_open_mode (default: pread)\n");
+	fprintf(stderr, "  -j blocks  give the image a journal of this many blocks\n");
+	fprintf(stderr, "  -c         format the image with FS_FMT_COMPACT\n");
+	fprintf(stderr, "  image      file to run on, removed afterwards (default: bench.img)\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Read and write system calls made so far by this process. */
+long io_syscalls(void) {
+	char buf[512];
+	int fd = open("/proc/self/io", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	char *r = strstr(buf, "syscr:");
+	char *w = strstr(buf, "syscw:");
+	return (r ? atol(r + 6) : 0) + (w ? atol(w + 6) : 0);
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* A workload being measured: latencies of each call, wall time and system
+ * calls of the whole run. */
+struct run {
+	double *lat;
+	uint64_t ops;
+	double start;
+	long calls;
+};
+
+void run_begin(struct run *r, uint64_t maxops) {
+	r->lat = malloc(maxops * sizeof(double));
+	r->ops = 0;
+	r->calls = io_syscalls();
+	r->start = now();
+}
+
+void report(struct run *r, const char *bench, uint64_t blksz, uint64_t param, uint64_t bytes) {
+	double secs = now() - r->start;
+	long calls = io_syscalls() - r->calls - calls_overhead;
+	qsort(r->lat, r->ops, sizeof(double), cmp_double);
+	double p50 = r->ops ? r->lat[r->ops / 2] : 0;
+	double p99 = r->ops ? r->lat[(r->ops * 99) / 100] : 0;
+
+	printf("{\"bench\":\"%s\",\"blksz\":%" PRIu64 ",\"param\":%" PRIu64 ",\"ops\":%" PRIu64
+	       ",\"secs\":%.6f,\"ops_per_sec\":%.1f,\"mib_per_sec\":%.1f"
+	       ",\"p50_us\":%.2f,\"p99_us\":%.2f,\"syscalls_per_op\":%.2f}\n",
+	       bench, blksz, param, r->ops, secs, r->ops / secs, bytes / secs / MIB,
+	       p50 * 1e6, p99 * 1e6, r->ops ? (double) calls / r->ops : 0);
+	fflush(stdout);
+	free(r->lat);
+}
+
+#define TIMED(r, call) do { \
+	double t0_ = now(); \
+	call; \
+	(r)->lat[(r)->ops++] = now() - t0_; \
+} while (0)
+
+#define CHECK(cond, what) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s: %s\n", what, strerror(errno)); \
+		exit(EXIT_FAILURE); \
+	} \
+} while (0)
+
+struct superblock *fresh_image(uint64_t blksz) {
+	unlink(image);
+	int fd = open(image, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	CHECK(fd >= 0 && ftruncate(fd, imagesz) == 0, image);
+	close(fd);
+	struct superblock *sb = fs_format_flags(image, blksz, format_flags);
+	CHECK(sb != NULL, "fs_format_flags");
+	if (journal > 0)
+		CHECK(fs_journal_enable(sb, journal) == 0, "fs_journal_enable");
+	fs_close(sb);
+	sb = fs_open_mode(image, mode);
+	CHECK(sb != NULL, "fs_open_mode");
+	return sb;
+}
+
+/* Close and reopen the image so no workload starts with a warm cache. */
+struct superblock *reopen(struct superblock *sb) {
+	fs_close(sb);
+	sb = fs_open_mode(image, mode);
+	CHECK(sb != NULL, "fs_open_mode");
+	return sb;
+}
+
+/* A permutation of 0..n-1, so lookups do not follow creation order. */
+uint64_t *shuffled(uint64_t n) {
+	uint64_t *p = malloc(n * sizeof(uint64_t));
+	uint64_t i;
+	for (i = 0; i < n; i++)
+		p[i] = i;
+	for (i = n; i > 1; i--) {
+		uint64_t j = random() % i;
+		uint64_t t = p[i - 1];
+		p[i - 1] = p[j];
+		p[j] = t;
+	}
+	return p;
+}
+
+void bench_meta(uint64_t blksz) {
+	struct superblock *sb = fresh_image(blksz);
+	CHECK(fs_mkdir(sb, "/d") == 0, "fs_mkdir");
+	// every file takes an inode and a nodeinfo block, or a single block
+	// in a compact image
+	uint64_t n = nops;
+	if (n > (sb->freeblks - 16) / 3)
+		n = (sb->freeblks - 16) / 3;
+	char name[64], data[1] = {'x'};
+	struct fs_dirent st;
+	struct run r;
+	uint64_t i;
+
+	run_begin(&r, n);
+	for (i = 0; i < n; i++) {
+		sprintf(name, "/d/f%" PRIu64, i);
+		TIMED(&r, CHECK(fs_write_file(sb, name, data, 1) == 0, "fs_write_file"));
+	}
+	report(&r, "create", blksz, 0, 0);
+
+	sb = reopen(sb);
+	uint64_t *order = shuffled(n);
+	run_begin(&r, n);
+	for (i = 0; i < n; i++) {
+		sprintf(name, "/d/f%" PRIu64, order[i]);
+		TIMED(&r, CHECK(fs_stat(sb, name, &st) == 0, "fs_stat"));
+	}
+	report(&r, "lookup", blksz, 0, 0);
+
+	run_begin(&r, n);
+	for (i = 0; i < n; i++) {
+		sprintf(name, "/d/f%" PRIu64, order[i]);
+		TIMED(&r, CHECK(fs_unlink(sb, name) == 0, "fs_unlink"));
+	}
+	report(&r, "unlink", blksz, 0, 0);
+	free(order);
+	fs_close(sb);
+}
+
+void bench_data(uint64_t blksz) {
+	struct superblock *sb = fresh_image(blksz);
+	// leave room for the file's own inodes
+	uint64_t filesz = (sb->freeblks * blksz) / 2;
+	if (filesz > 64 * MIB)
+		filesz = 64 * MIB;
+	filesz -= filesz % SEQ_IOSZ;
+	char *buf = malloc(SEQ_IOSZ);
+	uint64_t i, off;
+	for (i = 0; i < SEQ_IOSZ; i++)
+		buf[i] = (char) (i * 7 + (i >> 9));
+	struct run r;
+
+	struct fsfile *f = fs_file_open(sb, "/data", FS_CREAT);
+	CHECK(f != NULL, "fs_file_open");
+	run_begin(&r, filesz / SEQ_IOSZ);
+	for (off = 0; off < filesz; off += SEQ_IOSZ)
+		TIMED(&r, CHECK(fs_file_write(f, buf, SEQ_IOSZ) == SEQ_IOSZ, "fs_file_write"));
+	CHECK(fs_sync(sb) == 0, "fs_sync");
+	report(&r, "seqwrite", blksz, SEQ_IOSZ, filesz);
+	fs_file_close(f);
+
+	sb = reopen(sb);
+	f = fs_file_open(sb, "/data", 0);
+	CHECK(f != NULL, "fs_file_open");
+	run_begin(&r, filesz / SEQ_IOSZ);
+	for (off = 0; off < filesz; off += SEQ_IOSZ)
+		TIMED(&r, CHECK(fs_file_read(f, buf, SEQ_IOSZ) == SEQ_IOSZ, "fs_file_read"));
+	report(&r, "seqread", blksz, SEQ_IOSZ, filesz);
+
+	uint64_t slots = filesz / RAND_IOSZ;
+	run_begin(&r, nops);
+	for (i = 0; i < nops; i++) {
+		off = (random() % slots) * RAND_IOSZ;
+		TIMED(&r, CHECK(fs_file_pread(f, buf, RAND_IOSZ, off) == RAND_IOSZ, "fs_file_pread"));
+	}
+	report(&r, "randread", blksz, RAND_IOSZ, nops * RAND_IOSZ);
+
+	run_begin(&r, nops);
+	for (i = 0; i < nops; i++) {
+		off = (random() % slots) * RAND_IOSZ;
+		TIMED(&r, CHECK(fs_file_pwrite(f, buf, RAND_IOSZ, off) == RAND_IOSZ, "fs_file_pwrite"));
+	}
+	CHECK(fs_sync(sb) == 0, "fs_sync");
+	report(&r, "randwrite", blksz, RAND_IOSZ, nops * RAND_IOSZ);
+
+	fs_file_close(f);
+	free(buf);
+	fs_close(sb);
+}
+
+/* Lookups in directories of growing size, to show how they scale. */
+void bench_dirscale(uint64_t blksz) {
+	static const uint64_t sizes[] = {10, 100, 1000, 10000};
+	struct superblock *sb = fresh_image(blksz);
+	char name[64];
+	struct fs_dirent st;
+	struct run r;
+	uint64_t s, i, have = 0;
+
+	CHECK(fs_mkdir(sb, "/d") == 0, "fs_mkdir");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint64_t n = sizes[s];
+		if (n * 3 + 16 > sb->freeblks + have * 3)
+			break;
+		for (; have < n; have++) {
+			sprintf(name, "/d/e%" PRIu64, have);
+			CHECK(fs_mkdir(sb, name) == 0, "fs_mkdir");
+		}
+		sb = reopen(sb);
+		run_begin(&r, nops);
+		for (i = 0; i < nops; i++) {
+			sprintf(name, "/d/e%" PRIu64, (uint64_t) random() % n);
+			TIMED(&r, CHECK(fs_stat(sb, name, &st) == 0, "fs_stat"));
+		}
+		report(&r, "dirscale", blksz, n, 0);
+	}
+	fs_close(sb);
+}
+
+int main(int argc, char **argv) {
+	static const uint64_t blkszs[] = {MIN_BLOCK_SIZE, 512, 4096, 16384, 65536};
+	uint64_t only = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:s:n:m:j:c")) != -1) {
+		switch (opt) {
+		case 'b':
+			only = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			imagesz = strtoull(optarg, NULL, 10) * MIB;
+			break;
+		case 'n':
+			nops = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			if (strcmp(optarg, "pread") == 0)
+				mode = FS_IO_PREAD;
+			else if (strcmp(optarg, "mmap") == 0)
+				mode = FS_IO_MMAP;
+			else if (strcmp(optarg, "uring") == 0)
+				mode = FS_IO_URING;
+			else
+				usage(argv[0]);
+			break;
+		case 'j':
+			journal = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			format_flags = FS_FMT_COMPACT;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1 || nops == 0 || imagesz == 0)
+		usage(argv[0]);
+	if (optind == argc - 1)
+		image = argv[optind];
+	srandom(1);
+
+	// reading the counters costs system calls of its own
+	long c = io_syscalls();
+	calls_overhead = io_syscalls() - c;
+
+	size_t b, nblkszs = sizeof(blkszs) / sizeof(blkszs[0]);
+	for (b = 0; b < nblkszs; b++) {
+		uint64_t blksz = only ? only : blkszs[b];
+		bench_meta(blksz);
+		bench_data(blksz);
+		bench_dirscale(blksz);
+		if (only)
+			break;
+	}
+	unlink(image);
+	return 0;
+}
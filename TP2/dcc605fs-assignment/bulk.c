@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+
+/* Bulk copies between a host directory tree and an image:
+ *
+ *   bulk [options] import image hostdir [dir]
+ *   bulk [options] export image dir hostdir
+ *
+ * The source tree is walked first, creating the directories on the way
+ * and listing the regular files with their sizes, so an import knows
+ * before copying anything whether the image has room for it all.  Then a
+ * pool of worker threads copies the files, largest first so the long ones
+ * do not end up last.  Each worker streams its file through a chunk-sized
+ * buffer of its own, so at most =nthreads chunks are in flight and the
+ * host reads of some workers overlap the image writes of others.  A file
+ * of up to one chunk is written with a single fs_write_file, which
+ * reserves all its blocks as one contiguous run; a larger one goes
+ * through a handle a chunk at a time, each chunk reserved as a run of its
+ * own, so data reaches the image in large sequential writes. */
+
+#define MIB (1024 * 1024)
+#define MAX_THREADS 64
+
+/* A file to copy: =src is read and =dst written, host or image paths
+ * depending on the direction. */
+struct entry {
+	char *src;
+	char *dst;
+	uint64_t size;
+};
+
+struct bulk {
+	struct superblock *sb;
+	int export;
+	size_t chunk;
+	struct entry *files;
+	uint64_t nfiles;
+	uint64_t maxfiles;
+	char **dirs; /* image directories an import creates, parents first */
+	uint64_t ndirs;
+	uint64_t maxdirs;
+	uint64_t bytes; /* total size of =files */
+	uint64_t blocks; /* blocks an import needs, see import_estimate */
+	uint64_t next; /* next file for a worker, under =lock */
+	uint64_t done; /* bytes copied, under =lock */
+	uint64_t errors; /* under =lock */
+	pthread_mutex_t lock;
+};
+
+static int nthreads;
+static size_t chunk = 4 * MIB;
+static int mode = FS_IO_PREAD;
+static int verbose;
+
+void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-j threads] [-c KiB] [-m pread|mmap|uring] [-v] import image hostdir [dir]\n", prog);
+	fprintf(stderr, "       %s [-j threads] [-c KiB] [-m pread|mmap|uring] [-v] export image dir hostdir\n", prog);
+	fprintf(stderr, "  -j threads  copy with this many threads (default: one per CPU)\n");
+	fprintf(stderr, "  -c KiB      size of the chunks files are streamed in (default: 4096)\n");
+	fprintf(stderr, "  -m mode     how the image is accessed, as fs_open_mode (default: pread)\n");
+	fprintf(stderr, "  -v          print each file as it is copied\n");
+	exit(EXIT_FAILURE);
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fail(struct bulk *b, const char *path, int err) {
+	pthread_mutex_lock(&b->lock);
+	fprintf(stderr, "%s: %s\n", path, strerror(err));
+	b->errors++;
+	pthread_mutex_unlock(&b->lock);
+}
+
+/* Join =dir and =name into =path, which holds PATH_MAX bytes. */
+int join(char *path, const char *dir, const char *name) {
+	size_t len = strlen(dir);
+	int n = snprintf(path, PATH_MAX, "%s%s%s", dir, (len > 0 && dir[len - 1] == '/') ? "" : "/", name);
+	if (n < 0 || n >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+void add_file(struct bulk *b, const char *src, const char *dst, uint64_t size) {
+	if (b->nfiles == b->maxfiles) {
+		b->maxfiles = b->maxfiles ? 2 * b->maxfiles : 1024;
+		b->files = realloc(b->files, b->maxfiles * sizeof(struct entry));
+	}
+	struct entry *e = &b->files[b->nfiles++];
+	e->src = strdup(src);
+	e->dst = strdup(dst);
+	e->size = size;
+	b->bytes += size;
+}
+
+void add_dir(struct bulk *b, const char *dst) {
+	if (b->ndirs == b->maxdirs) {
+		b->maxdirs = b->maxdirs ? 2 * b->maxdirs : 256;
+		b->dirs = realloc(b->dirs, b->maxdirs * sizeof(char *));
+	}
+	b->dirs[b->ndirs++] = strdup(dst);
+}
+
+/* Create =dir in the image, unless it is there already. */
+int image_mkdir(struct superblock *sb, const char *dir) {
+	struct fs_dirent st;
+	if (fs_stat(sb, dir, &st) == 0) {
+		if (st.isdir)
+			return 0;
+		errno = ENOTDIR;
+		return -1;
+	}
+	return fs_mkdir(sb, dir);
+}
+
+/* Create =dir in the image, and any of its parents that are missing. */
+int image_mkdirs(struct superblock *sb, const char *dir) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", dir);
+	for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (image_mkdir(sb, path) < 0)
+			return -1;
+		*p = '/';
+	}
+	return image_mkdir(sb, path);
+}
+
+/* List the files and subdirectories under the host directory =src, to be
+ * copied under =dst in the image.  Anything but directories and regular
+ * files is skipped.  Nothing is created yet, so an import that does not
+ * fit leaves the image as it was. */
+void walk_host(struct bulk *b, const char *src, const char *dst) {
+	DIR *d = opendir(src);
+	if (d == NULL) {
+		fail(b, src, errno);
+		return;
+	}
+	char spath[PATH_MAX], dpath[PATH_MAX];
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		struct stat st;
+		if (join(spath, src, de->d_name) < 0 || lstat(spath, &st) < 0) {
+			fail(b, spath, errno);
+			continue;
+		}
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+			if (verbose)
+				fprintf(stderr, "%s: skipped, not a file or directory\n", spath);
+			continue;
+		}
+		if (strlen(de->d_name) >= FS_NAME_MAX || join(dpath, dst, de->d_name) < 0) {
+			fail(b, spath, ENAMETOOLONG);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			add_dir(b, dpath);
+			walk_host(b, spath, dpath);
+		} else {
+			add_file(b, spath, dpath, st.st_size);
+		}
+	}
+	closedir(d);
+}
+
+/* List the files under the image directory =src, creating its
+ * subdirectories under =dst on the host. */
+void walk_image(struct bulk *b, const char *src, const char *dst) {
+	struct fsdir *d = fs_opendir(b->sb, src);
+	if (d == NULL) {
+		fail(b, src, errno);
+		return;
+	}
+	char spath[PATH_MAX], dpath[PATH_MAX];
+	struct fs_dirent *de;
+	while ((de = fs_readdir(d)) != NULL) {
+		if (join(spath, src, de->name) < 0 || join(dpath, dst, de->name) < 0) {
+			fail(b, spath, errno);
+			continue;
+		}
+		if (de->isdir) {
+			if (mkdir(dpath, 0755) < 0 && errno != EEXIST) {
+				fail(b, dpath, errno);
+				continue;
+			}
+			b->ndirs++;
+			walk_image(b, spath, dpath);
+		} else {
+			add_file(b, spath, dpath, de->size);
+		}
+	}
+	fs_closedir(d);
+}
+
+/* Upper bound on the blocks an import takes: the data blocks, the inode
+ * and nodeinfo of each entry, a child inode per extent list or list of
+ * entries that outgrows its inode.  Each chunk is assumed to become an
+ * extent of its own, and each entry to have the longest name. */
+uint64_t import_estimate(struct bulk *b) {
+	uint64_t blksz = b->sb->blksz;
+	uint64_t meta = (b->sb->format == FORMAT_COMPACT) ? 1 : 2;
+	uint64_t per_node = blksz - 4 * sizeof(uint64_t);
+	uint64_t blocks = (b->nfiles + b->ndirs) * meta;
+	uint64_t runs = 0;
+	for (uint64_t i = 0; i < b->nfiles; i++) {
+		uint64_t size = b->files[i].size;
+		blocks += (size + blksz - 1) / blksz;
+		runs += (size + b->chunk - 1) / b->chunk;
+	}
+	blocks += (runs * 2 * sizeof(uint64_t) + per_node - 1) / per_node;
+	uint64_t entry = 2 * sizeof(uint64_t) + FS_NAME_MAX + 8;
+	blocks += ((b->nfiles + b->ndirs) * entry + per_node - 1) / per_node;
+	return blocks;
+}
+
+/* Read up to =cnt bytes at =offset of =fd, stopping only at the end of
+ * the file. */
+ssize_t pread_full(int fd, char *buf, size_t cnt, off_t offset) {
+	size_t done = 0;
+	while (done < cnt) {
+		ssize_t n = pread(fd, buf + done, cnt - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+ssize_t pwrite_full(int fd, const char *buf, size_t cnt, off_t offset) {
+	size_t done = 0;
+	while (done < cnt) {
+		ssize_t n = pwrite(fd, buf + done, cnt - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		done += n;
+	}
+	return done;
+}
+
+/* Copy the host file =e->src to =e->dst in the image.  Returns the bytes
+ * copied, or -1 with errno set. */
+int64_t import_file(struct bulk *b, struct entry *e, char *buf) {
+	int fd = open(e->src, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// small files go in one call; the size is read again, as the file
+	// may have changed since the walk
+	ssize_t n = pread_full(fd, buf, b->chunk, 0);
+	if (n < 0 || (size_t) n < b->chunk) {
+		int ret = (n < 0) ? -1 : fs_write_file(b->sb, e->dst, buf, n);
+		int err = errno;
+		close(fd);
+		errno = err;
+		return ret < 0 ? -1 : n;
+	}
+
+	struct fsfile *f = fs_file_open(b->sb, e->dst, FS_CREAT | FS_TRUNC);
+	if (f == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	uint64_t off = 0;
+	while (n > 0) {
+		if (fs_file_pwrite(f, buf, n, off) != n)
+			break;
+		off += n;
+		n = pread_full(fd, buf, b->chunk, off);
+	}
+	int err = errno;
+	fs_file_close(f);
+	close(fd);
+	errno = err;
+	return n == 0 ? (int64_t) off : -1;
+}
+
+/* Copy the image file =e->src to =e->dst on the host.  Returns the bytes
+ * copied, or -1 with errno set. */
+int64_t export_file(struct bulk *b, struct entry *e, char *buf) {
+	int fd = open(e->dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	int64_t ret = -1;
+	if (e->size < b->chunk) {
+		ssize_t n = fs_read_file(b->sb, e->src, buf, b->chunk);
+		if (n >= 0 && pwrite_full(fd, buf, n, 0) == n)
+			ret = n;
+	} else {
+		struct fsfile *f = fs_file_open(b->sb, e->src, 0);
+		if (f != NULL) {
+			uint64_t off = 0;
+			ssize_t n;
+			while ((n = fs_file_pread(f, buf, b->chunk, off)) > 0) {
+				if (pwrite_full(fd, buf, n, off) != n)
+					break;
+				off += n;
+			}
+			if (n == 0)
+				ret = off;
+			fs_file_close(f);
+		}
+	}
+	int err = errno;
+	if (close(fd) < 0 && ret >= 0)
+		ret = -1;
+	else
+		errno = err;
+	return ret;
+}
+
+void *worker(void *arg) {
+	struct bulk *b = arg;
+	char *buf = malloc(b->chunk);
+	if (buf == NULL) {
+		fail(b, "worker", ENOMEM);
+		return NULL;
+	}
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		struct entry *e = (b->next < b->nfiles) ? &b->files[b->next++] : NULL;
+		pthread_mutex_unlock(&b->lock);
+		if (e == NULL)
+			break;
+
+		int64_t n = b->export ? export_file(b, e, buf) : import_file(b, e, buf);
+		if (n < 0) {
+			fail(b, e->src, errno);
+			continue;
+		}
+		pthread_mutex_lock(&b->lock);
+		b->done += n;
+		if (verbose)
+			printf("%s -> %s (%" PRId64 " bytes)\n", e->src, e->dst, n);
+		pthread_mutex_unlock(&b->lock);
+	}
+	free(buf);
+	return NULL;
+}
+
+int cmp_size(const void *a, const void *b) {
+	uint64_t x = ((const struct entry *) a)->size, y = ((const struct entry *) b)->size;
+	return (x < y) - (x > y);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "j:c:m:v")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'c':
+			chunk = strtoull(optarg, NULL, 10) * 1024;
+			break;
+		case 'm':
+			if (strcmp(optarg, "pread") == 0)
+				mode = FS_IO_PREAD;
+			else if (strcmp(optarg, "mmap") == 0)
+				mode = FS_IO_MMAP;
+			else if (strcmp(optarg, "uring") == 0)
+				mode = FS_IO_URING;
+			else
+				usage(argv[0]);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	int nargs = argc - optind;
+	if (nargs < 3 || chunk == 0)
+		usage(argv[0]);
+	int export;
+	if (strcmp(argv[optind], "import") == 0 && nargs <= 4)
+		export = 0;
+	else if (strcmp(argv[optind], "export") == 0 && nargs == 4)
+		export = 1;
+	else
+		usage(argv[0]);
+	const char *image = argv[optind + 1];
+	const char *src = argv[optind + 2];
+	const char *dst = (nargs == 4) ? argv[optind + 3] : "/";
+	if (nthreads < 1)
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+
+	struct bulk b;
+	memset(&b, 0, sizeof(b));
+	b.export = export;
+	b.chunk = chunk;
+	pthread_mutex_init(&b.lock, NULL);
+	b.sb = fs_open_mode(image, mode);
+	if (b.sb == NULL) {
+		perror(image);
+		return EXIT_FAILURE;
+	}
+	double start = now();
+
+	if (export) {
+		if (mkdir(dst, 0755) < 0 && errno != EEXIST) {
+			perror(dst);
+			fs_close(b.sb);
+			return EXIT_FAILURE;
+		}
+		b.ndirs++;
+		walk_image(&b, src, dst);
+	} else {
+		struct stat st;
+		if (stat(src, &st) < 0 || !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "%s: %s\n", src, strerror(errno ? errno : ENOTDIR));
+			fs_close(b.sb);
+			return EXIT_FAILURE;
+		}
+		add_dir(&b, dst);
+		walk_host(&b, src, dst);
+		b.blocks = import_estimate(&b);
+		if (b.blocks > b.sb->freeblks) {
+			fprintf(stderr, "%s: %" PRIu64 " files need up to %" PRIu64 " blocks, %" PRIu64 " are free\n",
+			        image, b.nfiles, b.blocks, b.sb->freeblks);
+			fs_close(b.sb);
+			return EXIT_FAILURE;
+		}
+		// files under a directory that could not be made fail on their own
+		for (uint64_t d = 0; d < b.ndirs; d++) {
+			if ((d == 0 ? image_mkdirs(b.sb, b.dirs[d]) : image_mkdir(b.sb, b.dirs[d])) < 0)
+				fail(&b, b.dirs[d], errno);
+			free(b.dirs[d]);
+		}
+		free(b.dirs);
+	}
+	double walked = now();
+
+	qsort(b.files, b.nfiles, sizeof(struct entry), cmp_size);
+	int nworkers = (uint64_t) nthreads < b.nfiles ? nthreads : (int) b.nfiles;
+	pthread_t threads[MAX_THREADS];
+	int i;
+	for (i = 0; i < nworkers; i++)
+		pthread_create(&threads[i], NULL, worker, &b);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(threads[i], NULL);
+
+	// the copy is over once the image is on disk
+	struct fs_stats stats;
+	fs_sync(b.sb);
+	fs_stats_get(b.sb, &stats);
+	fs_close(b.sb);
+	double secs = now() - start;
+
+	printf("%" PRIu64 " directories, %" PRIu64 " files, %" PRIu64 " bytes copied with %d threads\n",
+	       b.ndirs, b.nfiles, b.done, nworkers);
+	printf("%.3f s (%.3f s walking), %.1f MiB/s, %" PRIu64 " image requests, %" PRIu64 " blocks %s\n",
+	       secs, walked - start, secs > 0 ? b.done / secs / MIB : 0, stats.io_requests,
+	       export ? stats.blk_reads : stats.blk_writes, export ? "read" : "written");
+	for (uint64_t f = 0; f < b.nfiles; f++) {
+		free(b.files[f].src);
+		free(b.files[f].dst);
+	}
+	free(b.files);
+	if (b.errors > 0) {
+		printf("%" PRIu64 " errors\n", b.errors);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
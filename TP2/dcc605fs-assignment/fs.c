@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -5,27 +6,669 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include "fs.h"
 
+/* Metadata blocks (inodes, nodeinfos and freepages) are kept in a block
+ * cache of CACHE_SLOTS slots in LRU order.  A block returned by get_block is
+ * pinned until release_block is called, and pinned slots are never evicted.
+ * Saving a block only marks its slot dirty; dirty slots reach the disk when
+ * they are evicted or when the cache is flushed.  Evicting a dirty slot
+ * writes back every unpinned dirty slot at once, sorted so that adjacent
+ * blocks go out in a single pwritev.  Misses and writebacks do their I/O
+ * without the cache lock, so other threads keep using the cache meanwhile
+ * (see cache_slot).
+ *
+ * File data normally bypasses the cache, but writes of small files (at most
+ * DELAY_MAX_BLOCKS blocks) are left in dirty slots marked =isdata and go to
+ * disk together with the file's metadata, which create_file places in the
+ * blocks right before them.  With a journal these slots are not logged:
+ * they are written in place before the transaction that refers to them.
+ *
+ * When the image is opened with FS_IO_MMAP the cache has no slots: the
+ * whole image is mapped and get_block returns pointers into the mapping, so
+ * blocks are read and modified in place and pinning is a no-op.  With
+ * FS_IO_URING the cache works as with FS_IO_PREAD, but see struct uring. */
+#define CACHE_SLOTS 256
+#define CACHE_MAX_SLOTS (4 * CACHE_SLOTS)
+#define CACHE_WAIT_MSECS 10
+#define DELAY_MAX_BLOCKS 4
+#define CACHE_BUCKETS 509
+
+struct cacheblk {
+    uint64_t block; /* zero if the slot is empty */
+    int refcnt;
+    int dirty;
+    int isdata; /* holds delayed file data rather than metadata */
+    int raw; /* not part of the tree (freepages, snapshot pages): never saved */
+    int loading; /* being read from disk: its contents are not there yet */
+    int writing; /* being written back by cache_writeback */
+    int copy; /* counted in the =pending copies of the snapshots, see snap_mark */
+    struct cacheblk *hnext; /* next slot in the same hash bucket */
+    struct cacheblk *prev; /* LRU list, most recently used first */
+    struct cacheblk *next;
+    char data[];
+};
+
+struct blkcache {
+    struct cacheblk *buckets[CACHE_BUCKETS];
+    struct cacheblk *head;
+    struct cacheblk *tail;
+    uint64_t nslots;
+    uint64_t ndirty; /* dirty slots, not counting delayed file data */
+    int sb_dirty; /* superblock must be written on the next flush */
+    uint64_t gen; /* bumped on every metadata update */
+    uint64_t evicted; /* slots of delayed data recycled, see overlay_cached_blocks */
+    pthread_mutex_t lock; /* guards all of the above and the slots */
+    pthread_cond_t cond; /* a slot was loaded, written back or unpinned */
+    int writing; /* writebacks running without =lock */
+    int werr; /* errno of the last failed write to the image, zero if none */
+    char *map; /* image mapping in FS_IO_MMAP mode, NULL otherwise */
+    size_t mapsz;
+    struct uring *ring; /* in FS_IO_URING mode, NULL otherwise */
+    /* journal state, see struct journal; =jlen is zero when not logging */
+    uint64_t jlen;
+    uint64_t jseq;
+    int jsynced; /* image synced since the last checkpoint */
+    struct timespec jlast; /* time of the last commit */
+    uint64_t *freed; /* extents freed since the last commit */
+    uint64_t nfreed;
+    uint64_t maxfreed;
+    /* snapshots of the image, see struct snapstate; NULL in a snapshot
+     * opened with fs_snapshot_open, which reads through =live instead */
+    struct snapstate *snap;
+    struct superblock *live;
+    uint64_t snapid; /* =id of the snapshot a view reads */
+    struct zcache *zcache; /* decompressed groups, see struct zcache */
+};
+
+/* Several threads may share a superblock.  Every operation holds the
+ * namespace lock =ns: shared while it looks up paths, creates entries or
+ * works on the contents of files, exclusive while it removes entries or
+ * flushes the cache, so a journal transaction never catches another
+ * operation halfway.  While =ns is shared, each directory and file is
+ * guarded by one of INODE_LOCK_STRIPES locks picked by its head inode:
+ * shared to read its entries or data, exclusive to change them.  A thread
+ * holds at most one of them at a time.  The free list and =freeblks are
+ * guarded by =alloc; the block cache, the directory index and the dentry
+ * cache have mutexes of their own, taken after any of these.  All disk
+ * accesses use pread/pwrite, so the file offset of =fd is never shared. */
+#define INODE_LOCK_STRIPES 64
+
+struct fslocks {
+    pthread_rwlock_t ns;
+    pthread_mutex_t alloc; /* the free list and =freeblks, see alloc_blocks */
+    pthread_rwlock_t inodes[INODE_LOCK_STRIPES];
+    uint64_t gens[INODE_LOCK_STRIPES]; /* bumped when a file in the stripe is remapped */
+    struct fsdir *dirs; /* open directory streams */
+    pthread_mutex_t dirs_lock; /* taken with =ns shared to change =dirs */
+};
+
+void locks_init(struct superblock* sb);
+void locks_destroy(struct superblock* sb);
+pthread_rwlock_t* inode_lock(struct superblock* sb, uint64_t block);
+uint64_t* inode_gen(struct superblock* sb, uint64_t block);
+uint64_t get_free_blocks(struct superblock* sb);
+uint64_t alloc_blocks(struct superblock* sb, uint64_t count, uint64_t* nblocks);
+int free_blocks(struct superblock* sb, uint64_t block, uint64_t nblocks);
+
+void stats_init(struct superblock* sb);
+void stats_destroy(struct superblock* sb);
+void stats_add(uint64_t* counter, uint64_t n);
+void stats_io(struct superblock* sb, int write, ssize_t bytes, uint64_t requests);
+uint64_t stats_clock(void);
+void stats_op(struct superblock* sb, int op, uint64_t start);
+
+/* Bodies of the public operations, which the fs_* functions time. */
+int write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt, int flags);
+ssize_t read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz);
+int make_dir(struct superblock *sb, const char *dname);
+char * list_dir(struct superblock *sb, const char *dname);
+struct fsdir * open_dir(struct superblock *sb, const char *dname);
+struct fs_dirent * read_dir(struct fsdir *d);
+int stat_entry(struct superblock *sb, const char *fname, struct fs_dirent *st);
+struct fsfile * file_open(struct superblock *sb, const char *fname, int flags);
+ssize_t file_pread(struct fsfile *f, void *buf, size_t cnt, uint64_t offset);
+ssize_t file_pwrite(struct fsfile *f, const void *buf, size_t cnt, uint64_t offset);
+
+int cache_init(struct superblock* sb, int mode);
+void cache_destroy(struct superblock* sb);
+void cache_flush(struct superblock* sb);
+void cache_drop(struct superblock* sb, uint64_t block);
+struct cacheblk* cache_slot(struct superblock* sb, uint64_t block, int fill);
+void lru_unlink(struct blkcache* cache, struct cacheblk* slot);
+void lru_push_front(struct blkcache* cache, struct cacheblk* slot);
+void hash_remove(struct blkcache* cache, struct cacheblk* slot);
+struct cacheblk* cache_lookup(struct blkcache* cache, uint64_t block);
+int cmp_slot_block(const void* a, const void* b);
+void* get_block(struct superblock* sb, uint64_t block);
+void* new_block(struct superblock* sb, uint64_t block);
+void release_block(struct superblock* sb, void* data);
+void write_block(struct superblock* sb, uint64_t block, const void* data, int raw);
+void read_data_block(struct superblock* sb, uint64_t block, void* buf, size_t nbytes);
+void write_data_block(struct superblock* sb, uint64_t block, const void* buf, size_t nbytes);
+void delay_data_block(struct superblock* sb, uint64_t block, const void* buf, size_t nbytes);
+void cache_writeback(struct superblock* sb);
+void cache_trim(struct blkcache* cache);
+void overlay_cached_blocks(struct superblock* sb, uint64_t block, char* buf, size_t nbytes, uint64_t evicted);
+void write_dirty_blocks(struct superblock* sb, struct cacheblk** dirty, uint64_t ndirty);
+void write_result(struct superblock* sb, ssize_t ret, size_t len);
+
+/* In FS_IO_URING mode, batches of reads and writes (the runs of a file
+ * being read, the dirty blocks of a cache flush) are queued on an io_uring
+ * and submitted with one system call, so the kernel has all of them in
+ * flight at once; the caller then waits for the whole batch.  The ring is
+ * set up with raw system calls.  If the kernel refuses to set it up, the
+ * image is accessed as in FS_IO_PREAD mode, and any request the ring fails
+ * or completes short is redone with pread/pwrite.  Setting DCC605FS_NO_URING
+ * in the environment makes uring_setup fail as on a kernel without io_uring,
+ * to exercise that fallback. */
+#define URING_ENTRIES 64
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_sz;
+    size_t cq_sz;
+    size_t sqes_sz;
+    unsigned queued; /* requests not submitted yet */
+    unsigned inflight; /* requests submitted and not completed */
+    int broken; /* io_uring_enter failed: use pread/pwrite from now on */
+    int *res; /* result of each request of the batch, by tag */
+    pthread_mutex_t lock; /* one batch at a time */
+};
+
+struct uring* uring_setup(void);
+void uring_teardown(struct uring* ring);
+void uring_queue(struct uring* ring, int op, int fd, void* addr, size_t len, uint64_t offset, uint64_t tag);
+void uring_wait(struct uring* ring);
+void uring_write_blocks(struct superblock* sb, struct cacheblk** dirty, uint64_t ndirty);
+
+/* With a journal, a flush of the cache writes the dirty blocks to the
+ * journal region first: descriptor blocks listing where each block goes
+ * (block zero stands for the superblock), then the blocks, then a commit
+ * block holding a checksum of both.  Only after that log is on disk are
+ * the blocks written in place.  Dirty blocks are never evicted in between,
+ * so nothing from an uncommitted transaction reaches the image.
+ *
+ * A block freed in the running transaction may still be in use in the
+ * committed image, so data written to it goes through the cache and the
+ * log too instead of straight to the disk.
+ *
+ * The last transaction stays in the log after its checkpoint.  Replaying
+ * it again at the next fs_open is harmless: any later change to those
+ * blocks belongs either to a later transaction, which would have replaced
+ * the log, or to blocks free in the committed image. */
+#define JOURNAL_DESC_MAGIC 0x6a64657363dc6050ULL
+#define JOURNAL_COMMIT_MAGIC 0x6a636f6d6dc60500ULL
+#define JOURNAL_COMMIT_BLOCKS 128 /* dirty blocks that trigger a commit */
+#define JOURNAL_COMMIT_SECS 5 /* age of the oldest update that triggers one */
+
+struct journal_desc {
+    uint64_t magic; /* JOURNAL_DESC_MAGIC */
+    uint64_t seq;
+    uint64_t count; /* blocks in the transaction */
+    uint64_t targets[]; /* where each block goes, continued in later descriptors */
+};
+
+struct journal_commit {
+    uint64_t magic; /* JOURNAL_COMMIT_MAGIC */
+    uint64_t seq;
+    uint64_t count;
+    uint64_t checksum; /* of the descriptors and the blocks */
+};
+
+uint64_t journal_desc_capacity(struct superblock* sb);
+uint64_t checksum_update(uint64_t sum, const void* data, size_t nbytes);
+void pwritev_all(int fd, struct iovec* iov, uint64_t niov, off_t offset);
+int journal_replay(struct superblock* sb);
+void journal_load(struct superblock* sb, int mode);
+void journal_commit(struct superblock* sb, struct cacheblk** dirty, uint64_t ndirty);
+void journal_op_begin(struct superblock* sb);
+void journal_note_free(struct superblock* sb, uint64_t block, uint64_t nblocks);
+int journal_is_freed(struct superblock* sb, uint64_t block);
+int journal_freed(struct blkcache* cache, uint64_t block);
+int journal_commit_due(struct superblock* sb);
+int journal_enable(struct superblock* sb, uint64_t nblocks);
+
+/* Snapshots are kept by copying blocks on their first write: the live tree
+ * never moves, and a snapshot is its root plus the old contents of the
+ * blocks changed since it was taken.  A block of the tree that is dirty in
+ * the cache and not =fresh (allocated, or already copied, since the newest
+ * snapshot was taken) still holds on disk what the snapshots see, so its
+ * slot is neither evicted nor written back.  cache_flush copies those
+ * blocks first (snap_flush): each one goes to a new block, and the pair is
+ * added to the =saved map of the newest snapshot.  Blocks of the tree that
+ * are freed while not =fresh are kept in =owned and added to the newest
+ * snapshot on the next flush, instead of going to the free list.
+ *
+ * A snapshot opened with fs_snapshot_open reads the image directly, block
+ * by block: a block is looked up in the =saved maps from its snapshot to
+ * the newest one, and read from where it was copied if found, from its
+ * own place otherwise.  =lock is taken shared for those reads, and
+ * exclusively while the maps change and until the flush that changed them
+ * has written its blocks.  The =fresh set is not kept on disk, so after
+ * fs_open every block of the tree is copied once more than needed.
+ *
+ * The copies are made at flush time, long after the writes that call for
+ * them have returned, so room for them is set aside beforehand: every slot
+ * that becomes dirty while its block is not =fresh counts in =pending, and
+ * allocations leave that many free blocks, plus SNAPSHOT_OP_BLOCKS for the
+ * running operation and as many for a later removal, and the snapshot
+ * pages they may take (see snap_held).  Operations that change the tree
+ * fail with ENOSPC up front when that room is not there.  Removals may use
+ * the room kept for them, and count what they free as room, so that a full
+ * image can be emptied (see snap_reserve_removal).  Should a flush still
+ * run out of space, the blocks it could not copy stay dirty in the cache
+ * instead of being written in place, and fs_sync or fs_close fails with
+ * ENOSPC. */
+#define SNAPSHOT_FLUSH_BLOCKS 128 /* dirty blocks that trigger a flush */
+#define SNAPSHOT_OP_BLOCKS 8 /* blocks of the tree one operation may dirty, besides file data */
+
+struct snapmem {
+    uint64_t id; /* never reused, so that a view can tell it was dropped */
+    uint64_t record; /* block of the struct snapshot */
+    uint64_t root;
+    char name[FS_NAME_MAX];
+    uint64_t *keys; /* =saved map, open addressing; zero keys are empty */
+    uint64_t *vals;
+    uint64_t nsaved;
+    uint64_t cap;
+    int views; /* open with fs_snapshot_open */
+};
+
+struct snapstate {
+    pthread_rwlock_t lock;
+    struct snapmem *snaps; /* newest first */
+    uint64_t nsnaps; /* changed with both =lock and the cache lock held */
+    uint64_t nextid;
+    uint64_t *fresh; /* sorted (first, length) extents, guarded by the cache lock */
+    uint64_t nfresh;
+    uint64_t maxfresh;
+    uint64_t *owned; /* extents freed since the last flush, guarded by =alloc */
+    uint64_t nowned;
+    uint64_t maxowned;
+    uint64_t pending; /* slots marked =copy; changed with the cache lock held */
+    int flushing; /* snap_flush is allocating copies, guarded by =alloc */
+};
+
+int snap_init(struct superblock* sb, int mode);
+void snap_destroy(struct snapstate* snap);
+int snap_find(struct snapstate* snap, const char* name);
+int snap_index(struct snapstate* snap, uint64_t id);
+int fresh_has(struct snapstate* snap, uint64_t block);
+void fresh_add(struct snapstate* snap, uint64_t block, uint64_t nblocks);
+int snap_unsaved(struct blkcache* cache, struct cacheblk* slot);
+int snap_unsaved_block(struct superblock* sb, uint64_t block);
+uint64_t fresh_search(struct snapstate* snap, uint64_t block);
+uint64_t savedmap_slot(const uint64_t* keys, uint64_t cap, uint64_t block);
+uint64_t savedmap_get(struct snapmem* sm, uint64_t block);
+void savedmap_put(struct snapmem* sm, uint64_t block, uint64_t copy);
+int snappage_add(struct superblock* sb, uint64_t record, int owned, uint64_t a, uint64_t b);
+int snap_fresh(struct snapstate* snap, uint64_t block);
+int put_blocks(struct superblock* sb, uint64_t block, uint64_t nblocks);
+int snap_flush(struct superblock* sb);
+void snap_mark(struct blkcache* cache, struct cacheblk* slot);
+void snap_recount(struct blkcache* cache);
+uint64_t snap_held(struct superblock* sb, uint64_t nblocks);
+int snap_reserve(struct superblock* sb, uint64_t nblocks);
+void snap_count_put(struct superblock* sb, uint64_t block, uint64_t nblocks, uint64_t* gain, uint64_t* kept);
+int snap_reserve_removal(struct superblock* sb, uint64_t blk);
+void snap_delete(struct superblock* sb, uint64_t index);
+void snap_drop_all(struct superblock* sb);
+void view_read(struct superblock* sb, uint64_t block, void* buf, size_t nbytes);
+int view_readonly(struct superblock* sb);
+int view_lost(struct superblock* sb);
+
+/* Reads of file data are batched: runs that are adjacent on disk, or that
+ * are separated by at most READ_GAP_BLOCKS blocks, are issued as a single
+ * preadv.  Blocks in the gaps (usually child inodes allocated in between
+ * two runs of data) are read into a scratch buffer and thrown away. */
+#define READ_GAP_BLOCKS 8
+
+struct readbatch {
+    uint64_t first; /* first block covered by the batch */
+    uint64_t end; /* block right after the last one covered */
+    size_t tail; /* bytes of the last iovec past a block boundary */
+    int niov;
+    struct iovec iov[IOV_MAX];
+    uint64_t iovblk[IOV_MAX]; /* first block of each iovec */
+    char *gap; /* scratch buffer for blocks in between runs */
+};
+
+void readbatch_add(struct superblock* sb, struct readbatch* rb, uint64_t block, char* buf, size_t nbytes);
+void readbatch_submit(struct superblock* sb, struct readbatch* rb);
+
+/* Walks the entries of a directory in either layout.  Packed directories
+ * (IMDIRENT) are listed from their own blocks; older directories need the
+ * inode and nodeinfo of every entry. */
+struct dircursor {
+    struct inode *node; /* inode of the directory chain being read */
+    uint64_t nodeblk; /* block of =node, zero past the end */
+    int packed;
+    size_t pos; /* byte offset in a packed node, link index otherwise */
+    uint64_t block; /* first inode of the current entry */
+    int isdir;
+    char *name; /* name of the current entry, blksz bytes */
+};
+
+int dircursor_open(struct superblock* sb, uint64_t dir_blk, struct dircursor* cur);
+int dircursor_next(struct superblock* sb, struct dircursor* cur);
+void dircursor_close(struct superblock* sb, struct dircursor* cur);
+void dircursor_readahead(struct superblock* sb, struct dircursor* cur);
+
+/* A directory stream (see fs_opendir) keeps no block pinned between calls,
+ * only the node and offset where its cursor stands.  Open streams are
+ * listed in =dirs of struct fslocks; removing an entry moves back the
+ * cursors standing past it in the same node, and unchaining a node moves
+ * the cursors in it to the next one, so a stream never skips or repeats
+ * an entry.  Adding entries moves none. */
+struct fsdir {
+    struct superblock *sb;
+    uint64_t blk; /* head inode of the directory */
+    struct dircursor cur;
+    struct fs_dirent ent;
+    struct fsdir *prev;
+    struct fsdir *next;
+};
+
+void dirstreams_shift(struct superblock* sb, uint64_t block, size_t pos, size_t delta);
+void dirstreams_skip(struct superblock* sb, uint64_t block, uint64_t next);
+
+/* An open file keeps the extent map of its data in memory, as (first file
+ * block, first disk block, length) triples in file order, so each access
+ * maps offsets to blocks without walking the inode chain. */
+struct fsfile {
+    struct superblock *sb;
+    uint64_t blk; /* head inode of the file */
+    uint64_t pos;
+    uint64_t gen; /* stripe generation the map was loaded at */
+    uint64_t size;
+    uint64_t nblocks; /* data blocks allocated to the file */
+    uint64_t nruns;
+    uint64_t maxruns;
+    uint64_t *runs;
+    int isinline; /* the contents are in the head inode, see IMINLINE */
+    char *bounce; /* one block, for partial block reads and writes */
+    /* for a compressed file (see IMZIP): the =group of its header, zero
+     * if the header is damaged, and the (offset in the data blocks,
+     * stored bytes) pair of each of its =ngroups groups */
+    int iszip;
+    uint64_t zgroup;
+    uint64_t ngroups;
+    uint64_t *zgroups;
+    char *zbuf; /* one group, compressed */
+    char *zdata; /* one group, decompressed */
+};
+
+void file_map_append(struct fsfile* f, uint64_t block, uint64_t nblocks);
+void file_load_map(struct fsfile* f);
+uint64_t file_map_lookup(struct fsfile* f, uint64_t fblk, uint64_t* nblocks);
+int convert_to_extents(struct fsfile* f);
+int file_reserve(struct fsfile* f, uint64_t nblocks);
+int file_uninline(struct fsfile* f);
+void file_write_range(struct fsfile* f, const char* buf, size_t cnt, uint64_t offset);
+void file_refresh(struct fsfile* f);
+void file_read_range(struct fsfile* f, char* buf, size_t cnt, uint64_t offset);
+void file_load_zip(struct fsfile* f);
+int file_read_group(struct fsfile* f, uint64_t group, char* out);
+ssize_t file_read_zip(struct fsfile* f, char* buf, size_t cnt, uint64_t offset);
+int file_unzip(struct fsfile* f);
+
+/* Compressed files (see IMZIP and struct zipheader) are cut in groups of
+ * ZIP_GROUP_BYTES, or of ZIP_MIN_GROUP_BLOCKS blocks if those are larger,
+ * and each group is compressed on its own, so any part of the file can be
+ * read by decompressing the groups that cover it.  The codec is an LZ77
+ * variant laid out like an LZ4 block: sequences of a token (literal and
+ * match lengths, four bits each), the literals, a two-byte offset back
+ * into the output and extra length bytes; the last sequence has literals
+ * only.  Matches are found through a hash table of the positions of
+ * LZ_HASH_BITS bits, without chains, which keeps compression fast.
+ *
+ * Reads through a handle that cover only part of a group go through a
+ * small cache of ZCACHE_SLOTS decompressed groups in LRU order, so
+ * reading a file in small pieces decompresses each group once.  Groups
+ * are looked up by the first block of their compressed bytes, which keep
+ * their place until the file's data blocks are freed; those blocks are
+ * then dropped from the cache, before they can be reused. */
+#define ZIP_GROUP_BYTES (64 * 1024)
+#define ZIP_MIN_GROUP_BLOCKS 4
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 /* a match never covers the end of the input */
+#define LZ_MATCH_LIMIT 12 /* nor starts this close to it */
+#define LZ_MAX_OFFSET 65535
+#define ZCACHE_SLOTS 8
+
+struct zslot {
+    uint64_t block; /* zero if the slot is empty */
+    uint64_t used; /* =tick of the last lookup that found it */
+    size_t len;
+    char *data;
+};
+
+struct zcache {
+    struct zslot slots[ZCACHE_SLOTS];
+    uint64_t tick;
+    pthread_mutex_t lock;
+};
+
+size_t lz_compress(const char* src, size_t nbytes, char* dst, size_t cap);
+ssize_t lz_decompress(const char* src, size_t nbytes, char* dst, size_t cap);
+int lz_put_sequence(unsigned char* out, size_t* op, size_t cap, const unsigned char* lit,
+        size_t nlit, size_t offset, size_t len);
+int lz_get_length(const unsigned char* in, size_t nbytes, size_t* ip, size_t* len);
+uint32_t lz_read32(const unsigned char* p);
+uint64_t get_zip_group(struct superblock* sb);
+size_t get_zip_header_size(uint64_t ngroups);
+char* zip_compress(struct superblock* sb, const char* buf, size_t cnt, size_t* zip_sz);
+ssize_t read_zip_data(struct superblock* sb, uint64_t file_blk, char* buf, uint64_t nbytes, uint64_t size);
+void zcache_init(struct superblock* sb);
+void zcache_destroy(struct superblock* sb);
+int zcache_read(struct superblock* sb, uint64_t block, char* buf, size_t offset, size_t cnt);
+void zcache_put(struct superblock* sb, uint64_t block, const char* data, size_t len);
+void zcache_drop(struct superblock* sb, uint64_t block, uint64_t nblocks);
+
+/* Directory entries are looked up through an in-memory hash index.  The
+ * first lookup in a directory scans its inode chain once and hashes the
+ * name of every entry; afterwards lookups in that directory do not read
+ * any block.  create_entity and unlink_node keep indexed directories up to
+ * date.  To bound memory the whole index is dropped once it holds more
+ * than DIRINDEX_MAX_ENTRIES names; it is then rebuilt on demand. */
+#define DIRINDEX_BUCKETS 1021
+#define DIRINDEX_MAX_ENTRIES (1 << 20)
+
+struct dirhash_ent {
+    uint64_t block; /* inode of the entry */
+    struct dirhash_ent *next;
+    char name[];
+};
+
+struct dirhash {
+    uint64_t dir_blk; /* head inode of the directory */
+    uint64_t nbuckets;
+    uint64_t nentries;
+    struct dirhash_ent **buckets;
+    struct dirhash *next; /* next directory in the same index bucket */
+};
+
+struct dirindex {
+    struct dirhash *dirs[DIRINDEX_BUCKETS];
+    uint64_t nentries;
+    pthread_mutex_t lock;
+};
+
+void dirindex_init(struct superblock* sb);
+void dirindex_destroy(struct superblock* sb);
+void dirindex_clear(struct dirindex* index);
+uint64_t hash_name(const char* name);
+struct dirhash* dirindex_get(struct superblock* sb, uint64_t dir_blk, int build);
+void dirhash_insert(struct dirindex* index, struct dirhash* dh, const char* name, uint64_t block);
+uint64_t dirindex_lookup(struct superblock* sb, uint64_t dir_blk, const char* name);
+void dirindex_add(struct superblock* sb, uint64_t dir_blk, const char* name, uint64_t block);
+void dirindex_remove(struct superblock* sb, uint64_t dir_blk, const char* name);
+void dirindex_drop(struct superblock* sb, uint64_t dir_blk);
+void dirindex_unlink(struct dirindex* index, uint64_t dir_blk);
+
+/* Resolved paths are remembered in a dentry cache so that repeated
+ * operations on the same path skip the walk from the root.  Keys are paths
+ * with redundant slashes removed ("/a//b/" becomes "/a/b").  Only paths
+ * that exist are cached, so creating an entry never leaves a stale
+ * mapping; fs_unlink and fs_rmdir drop the path they remove.  The cache is
+ * emptied once it holds more than DCACHE_MAX_ENTRIES paths. */
+#define DCACHE_BUCKETS 4093
+#define NAME_MAX_LEN FS_NAME_MAX
+#define DCACHE_MAX_ENTRIES 65536
+
+struct dcache {
+    struct dirhash_ent *buckets[DCACHE_BUCKETS];
+    uint64_t nentries;
+    pthread_mutex_t lock;
+};
+
+void dcache_init(struct superblock* sb);
+void dcache_destroy(struct superblock* sb);
+void dcache_clear(struct dcache* dc);
+void normalize_path(const char* full_path, char* key);
+uint64_t dcache_lookup(struct superblock* sb, const char* key);
+void dcache_add(struct superblock* sb, const char* key, uint64_t block);
+void dcache_remove(struct superblock* sb, const char* full_path);
+
+/* The consistency checker claims each block it reaches in a map holding
+ * what the block was found to be; a block claimed twice has two uses and
+ * a block never claimed is leaked.  Directories and files still to be
+ * checked are kept on a stack shared by the checking threads, which push
+ * the entries of each directory they check.  The threads read the image
+ * with pread, not through the cache, after the cache has been flushed, so
+ * they share nothing else.  =gen tells an online check whether the
+ * metadata changed since it began. */
+#define FSCK_MAX_THREADS 64
+
+#define FSCK_START 0 /* phases of a check, in order */
+#define FSCK_FREELIST 1
+#define FSCK_TREE 2
+#define FSCK_LEAKS 3
+#define FSCK_DONE 4
+
+#define FSCK_SUPER 1 /* uses of a block, see fsck_use_names */
+#define FSCK_JOURNAL 2
+#define FSCK_FREEPAGE 3
+#define FSCK_FREE 4
+#define FSCK_INODE 5
+#define FSCK_NODEINFO 6
+#define FSCK_DATA 7
+#define FSCK_SNAPSHOT 8
+
+struct fsck_item {
+    uint64_t block; /* head inode of the entity */
+    uint64_t parent; /* directory it was found in */
+    uint64_t type; /* IMDIR or IMREG as told by the entry, zero if unknown */
+    char name[NAME_MAX_LEN]; /* name in the entry, empty if unknown */
+};
+
+struct fsck {
+    struct superblock *sb;
+    struct superblock *super; /* block zero as read when the check began */
+    FILE *log;
+    int nthreads;
+    int phase;
+    uint64_t gen;
+    unsigned char *use; /* FSCK_* use of each block, zero if not seen */
+    uint64_t freepage; /* next freepage to check */
+    uint64_t nfree; /* free blocks found so far */
+    struct fsck_item *stack;
+    uint64_t nstack;
+    uint64_t maxstack;
+    int busy; /* threads checking an entity */
+    uint64_t budget; /* entities left for this step */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct fsck_report report;
+};
+
+void fsck_reset(struct fsck* ck);
+void fsck_error(struct fsck* ck, const char* fmt, ...);
+int fsck_read(struct fsck* ck, uint64_t block, void* buf);
+uint64_t fsck_claim(struct fsck* ck, uint64_t block, uint64_t nblocks, int use);
+void fsck_push(struct fsck* ck, uint64_t block, uint64_t parent, uint64_t type, const char* name);
+void fsck_start(struct fsck* ck);
+void fsck_snapshots(struct fsck* ck);
+void fsck_freelist(struct fsck* ck);
+void fsck_tree(struct fsck* ck);
+void* fsck_worker(void* arg);
+void fsck_entity(struct fsck* ck, struct fsck_item* item, char* buf);
+uint64_t fsck_dir_node(struct fsck* ck, uint64_t dir_blk, struct inode* node, int packed);
+uint64_t fsck_file_node(struct fsck* ck, struct inode* node, int extents);
+void fsck_leaks(struct fsck* ck);
+
 struct inode* retrieve_inode(struct superblock* sb, uint64_t block);
 struct nodeinfo* retrieve_nodeinfo(struct superblock* sb, uint64_t block);
+void release_nodeinfo(struct superblock* sb, struct nodeinfo* ni);
 struct freepage* retrieve_freepage(struct superblock* sb, uint64_t block);
 void save_superblock(struct superblock* sb);
+void superblock_image(struct superblock* sb, void* buf);
 void save_inode(struct superblock* sb, struct inode* node, uint64_t block);
 void save_nodeinfo(struct superblock* sb, struct nodeinfo* ni, uint64_t block);
 void save_freepage(struct superblock* sb, struct freepage* fp, uint64_t block);
+uint64_t get_max_extents_in_freepage(struct superblock* sb);
+void freepage_remove_extent(struct freepage* fp, uint64_t index);
+int freepage_merge_extent(struct freepage* fp, uint64_t block, uint64_t nblocks);
 uint64_t get_inode_block(struct superblock *sb, const char *full_path, int *full_match, char* path_left_over);
-int get_max_links_in_node(struct superblock* sb);
+uint64_t get_parent_block(struct superblock* sb, const char* path, char* name);
+int is_dir_block(struct superblock* sb, uint64_t block);
+int is_compact(struct superblock* sb);
+uint64_t get_meta_blocks(struct superblock* sb);
+size_t get_links_area(struct superblock* sb, struct inode* node);
+int get_max_links_in_node(struct superblock* sb, struct inode* node);
 int get_num_links_in_node(struct inode* node);
+int get_max_extents_in_node(struct superblock* sb, struct inode* node);
+int get_num_extents_in_node(struct superblock* sb, struct inode* node);
+size_t get_inline_capacity(struct superblock* sb);
+uint64_t extent_nodes_needed(struct superblock* sb, uint64_t file_blk, const uint64_t* runs, uint64_t nruns);
+uint64_t* reserve_nodes(struct superblock* sb, uint64_t n);
+void append_extents(struct superblock* sb, uint64_t file_blk, const uint64_t* runs, uint64_t nruns, const uint64_t* nodes);
+uint64_t read_file_data(struct superblock* sb, uint64_t file_blk, char* buf, uint64_t nbytes);
 uint64_t get_last_inode(struct superblock* sb, uint64_t block);
 uint64_t get_node_blk_with_space(struct superblock* sb, uint64_t block);
-void link_node_to_nodelist(struct superblock* sb, uint64_t ref_blk, uint64_t blk_to_link, uint64_t nbytes);
+int link_node_to_nodelist(struct superblock* sb, uint64_t ref_blk, uint64_t blk_to_link, uint64_t nbytes);
 void free_file_data_blocks(struct superblock* sb, uint64_t file_block);
-uint64_t create_entity(struct superblock* sb, uint64_t parent_blk, const char* ename, uint64_t mode);
-void write_to_file(struct superblock *sb, uint64_t file_blk, char *buf, size_t buf_sz); 
+uint64_t create_entity(struct superblock* sb, uint64_t parent_blk, const char* ename, uint64_t mode, uint64_t first);
+uint64_t create_file(struct superblock* sb, const char* fname, uint64_t ndata, uint64_t* data, int* created);
+void remove_new_file(struct superblock* sb, const char* fname, uint64_t file_blk);
+int unlink_file(struct superblock* sb, const char* fname);
+int remove_dir(struct superblock* sb, const char* dname);
+size_t get_direntry_size(const char* name);
+size_t get_direntry_area(struct superblock* sb, struct inode* node);
+size_t get_direntries_used(struct superblock* sb, struct inode* node);
+int add_dir_entry(struct superblock* sb, uint64_t dir_blk, const char* name, uint64_t blk, uint64_t mode);
+void remove_dir_entry(struct superblock* sb, uint64_t dir_blk, uint64_t blk);
+void unchain_child_node(struct superblock* sb, struct inode* node, uint64_t block);
+uint64_t* reserve_runs(struct superblock* sb, uint64_t nblocks, uint64_t first, uint64_t* nruns);
+void put_runs(struct superblock* sb, const uint64_t* runs, uint64_t nruns);
+void write_to_file(struct superblock *sb, uint64_t file_blk, char *buf, size_t buf_sz, const uint64_t* runs, uint64_t nruns, const uint64_t* nodes);
+void write_inline(struct superblock* sb, uint64_t file_blk, const char* buf, size_t cnt, uint64_t offset);
 void unlink_node(struct superblock* sb, uint64_t dir_blk, uint64_t blk_to_unlink);
 uint64_t get_file_size(struct superblock *sb, const char *fname);
 
@@ -37,9 +680,22 @@ uint64_t get_file_size(struct superblock *sb, const char *fname);
  * to the appropriate error code.  If the block size is smaller than
  * MIN_BLOCK_SIZE bytes, then the format fails and the function sets errno to
  * EINVAL.  If there is insufficient space to store MIN_BLOCK_COUNT blocks in
- * =fname, then the function fails and sets errno to ENOSPC. */
+ * =fname, then the function fails and sets errno to ENOSPC.  If the blocks
+ * of the new filesystem cannot be written, errno is set by the write.  Only
+ * the first few blocks are written, so formatting takes the same time
+ * whatever the size of =fname; the other blocks keep whatever they held. */
 struct superblock * fs_format(const char *fname, uint64_t blocksize) {
-    if (blocksize < MIN_BLOCK_SIZE) {
+    return fs_format_flags(fname, blocksize, 0);
+}
+
+/* Same as fs_format, but =flags selects optional features of the on-disk
+ * format (a combination of the FS_FMT_* constants).  With FS_FMT_COMPACT,
+ * block sizes that leave the head inode less room than the nodeinfo takes
+ * keep the classic layout; =format tells which one was used.  With
+ * FS_FMT_DISCARD, a hole is punched over the free blocks, and errno is set
+ * by fallocate if that fails.  Other =flags set errno to EINVAL. */
+struct superblock * fs_format_flags(const char *fname, uint64_t blocksize, int flags) {
+    if (blocksize < MIN_BLOCK_SIZE || (flags & ~(FS_FMT_COMPACT | FS_FMT_DISCARD)) != 0) {
         errno = EINVAL;
         return NULL;
     }
@@ -68,41 +724,82 @@ struct superblock * fs_format(const char *fname, uint64_t blocksize) {
 
     /* block 0 -> superblock
        block 1 -> root directory
-       block 2 -> metadata (nodeinfo) of the root directory */	
+       block 2 -> metadata (nodeinfo) of the root directory, unless it is
+                  kept in block 1 (compact format) */
+    int compact = (flags & FS_FMT_COMPACT) != 0
+                  && blocksize - sizeof(struct inode) >= 2 * COMPACT_INFO_SIZE;
+    uint64_t first_free = compact ? 2 : 3;
+
+    //free blocks are never read, so whatever the image held there can go:
+    //formatting a used image gives its storage back and leaves it sparse
+    if ((flags & FS_FMT_DISCARD) != 0
+            && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first_free * blocksize,
+                         (no_blocks - first_free) * blocksize) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
 
     struct superblock *sb = (struct superblock*) calloc(1, blocksize);
     sb->magic = 0xdcc605f5;
     sb->blks = no_blocks;
     sb->blksz = blocksize;
     sb->root = 1; //pointer to the block that contains the root directory
-    sb->freelist = 3;
-    sb->freeblks = sb->blks - 4;
-    sb->fd = fd;
+    sb->freelist = first_free;
+    sb->freeblks = sb->blks - first_free;
+    sb->format = compact ? FORMAT_COMPACT : 0;
+    sb->state = (struct fsstate*) calloc(1, sizeof(struct fsstate));
+    sb->state->fd = fd;
+    locks_init(sb);
+    stats_init(sb);
+    cache_init(sb, FS_IO_PREAD);
+    snap_init(sb, FS_IO_PREAD);
+    dirindex_init(sb);
+    dcache_init(sb);
     save_superblock(sb);
 
-    struct inode *root_dir = (struct inode*) calloc(1, blocksize);
+    struct inode *root_dir = (struct inode*) new_block(sb, sb->root);
     root_dir->mode = IMDIR;
     root_dir->parent = 1;
-    root_dir->meta = 2;
+    root_dir->meta = compact ? sb->root : 2;
     root_dir->next = 0; 
     save_inode(sb, root_dir, sb->root); 
 
-    struct nodeinfo *info = (struct nodeinfo*) calloc(1, blocksize);
+    struct nodeinfo *info = compact ? retrieve_nodeinfo(sb, root_dir->meta)
+                                    : (struct nodeinfo*) new_block(sb, root_dir->meta);
     info->size = 0;
     info->name[0] = '/';
     info->name[1] = '\0';
     save_nodeinfo(sb, info, root_dir->meta); 
 
-    struct freepage* fp = (struct freepage*) calloc(1, blocksize);
-	for (uint64_t cnt = sb->freelist; cnt < sb->blks; cnt++) {
-        fp->next = (cnt + 1 == sb->blks) ? 0 : cnt + 1;
-        save_freepage(sb, fp, cnt);
-    }
+    //every other block is free: a single extent in the first freepage
+    struct freepage* fp = (struct freepage*) new_block(sb, sb->freelist);
+    fp->next = 0;
+    fp->count = 1;
+    fp->links[0] = sb->freelist + 1;
+    fp->links[1] = sb->blks - sb->freelist - 1;
+    save_freepage(sb, fp, sb->freelist);
     
-	free(info);
-    free(fp);
-    free(root_dir);
+	release_block(sb, fp);
+	release_nodeinfo(sb, info);
+    release_block(sb, root_dir);
 
+    //the image must be consistent on disk once fs_format returns
+    cache_flush(sb);
+    int err = sb->state->cache->werr;
+    if (err != 0) {
+        cache_destroy(sb);
+        dirindex_destroy(sb);
+        dcache_destroy(sb);
+        stats_destroy(sb);
+        locks_destroy(sb);
+        close(fd);
+        free(sb->state);
+        free(sb);
+        errno = err;
+        return NULL;
+    }
     return sb;
 }
 
@@ -110,6 +807,19 @@ struct superblock * fs_format(const char *fname, uint64_t blocksize) {
  * error, and sets errno accordingly.  If =fname does not contain a
  * 0xdcc605fs, then errno is set to EBADF. */
 struct superblock * fs_open(const char *fname) {
+    return fs_open_mode(fname, FS_IO_PREAD);
+}
+
+/* Same as fs_open, but =mode selects how the image is accessed (one of the
+ * FS_IO_* constants).  If the image cannot be mapped in FS_IO_MMAP mode,
+ * NULL is returned and errno is set by mmap; an image with snapshots sets
+ * errno to EINVAL in that mode.  Any other =mode sets errno to EINVAL. */
+struct superblock * fs_open_mode(const char *fname, int mode) {
+    if (mode != FS_IO_PREAD && mode != FS_IO_MMAP && mode != FS_IO_URING) {
+        errno = EINVAL;
+        return NULL;
+    }
+
     //opens and locks the file. It prevents the file being open more than once,
     //avoid data corruption. LOCK_NB makes it a nonblocking request, so we get the
     //error instead of keep waiting for the look to be released
@@ -123,8 +833,7 @@ struct superblock * fs_open(const char *fname) {
     //blocksize > sizeof(struct superblock), so a reallocation
     //is going to be done bellow
     struct superblock* sb = (struct superblock*) malloc(sizeof (struct superblock));
-    lseek(fd, 0, SEEK_SET);
-    read(fd, sb, sizeof(struct superblock));
+    pread(fd, sb, sizeof(struct superblock), 0);
 
     //check if file was formated (look for dcc code)	
     if (sb->magic != 0xdcc605f5) {
@@ -135,14 +844,45 @@ struct superblock * fs_open(const char *fname) {
     }
 
     //After find out the block size for this file,
-    //read the full block and write it back to save =fd
+    //read the full block and attach the in-memory state to it
     sb = (struct superblock*) realloc(sb, sb->blksz);
-    lseek(fd, 0, SEEK_SET);
-    read(fd, sb, sb->blksz);
+    pread(fd, sb, sb->blksz, 0);
     
-    sb->fd = fd;
-    lseek(fd, 0, SEEK_SET);
-    write(fd, sb, sb->blksz);
+    struct fsstate* state = (struct fsstate*) calloc(1, sizeof(struct fsstate));
+    state->fd = fd;
+    sb->state = state;
+    if (journal_replay(sb) > 0) {
+        //the superblock may have been part of the transaction
+        pread(fd, sb, sb->blksz, 0);
+        sb->state = state;
+    }
+    locks_init(sb);
+    stats_init(sb);
+    if (cache_init(sb, mode) < 0) {
+        int err = errno;
+        stats_destroy(sb);
+        locks_destroy(sb);
+        close(fd);
+        free(state);
+        free(sb);
+        errno = err;
+        return NULL;
+    }
+    journal_load(sb, mode);
+    if (snap_init(sb, mode) < 0) {
+        //snapshots need every write to go through the cache
+        cache_destroy(sb);
+        stats_destroy(sb);
+        locks_destroy(sb);
+        close(fd);
+        free(state);
+        free(sb);
+        errno = EINVAL;
+        return NULL;
+    }
+    dirindex_init(sb);
+    dcache_init(sb);
+    save_superblock(sb);
 
     return sb;
 }
@@ -163,10 +903,32 @@ int fs_close(struct superblock *sb) {
         errno = EBADF;
         return -1;
     }
-    save_superblock(sb);
+    struct superblock* live = sb->state->cache->live;
+    if (live != NULL) {
+        //a snapshot shares the image's descriptor and writes nothing
+        struct snapstate* snap = live->state->cache->snap;
+        pthread_rwlock_wrlock(&snap->lock);
+        int index = snap_index(snap, sb->state->cache->snapid);
+        if (index >= 0) snap->snaps[index].views--;
+        pthread_rwlock_unlock(&snap->lock);
+    } else {
+        save_superblock(sb);
+        cache_flush(sb);
+    }
+    int err = sb->state->cache->werr;
+    cache_destroy(sb);
+    dirindex_destroy(sb);
+    dcache_destroy(sb);
+    stats_destroy(sb);
+    locks_destroy(sb);
 
-    close(sb->fd);
+    if (live == NULL) close(sb->state->fd);
+    free(sb->state);
     free(sb);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
     return 0;
 }
 
@@ -175,602 +937,1014 @@ int fs_close(struct superblock *sb) {
  * is returned.  If an error occurs, (uint64_t)-1 is returned and errno is set
  * appropriately. */
 uint64_t fs_get_block(struct superblock *sb) {
-    if (sb->freeblks == 0) {
-        return 0;
-    }
-
-    uint64_t block = sb->freelist;
-    struct freepage* fp = retrieve_freepage(sb, sb->freelist);
-    sb->freelist = fp->next;
-    sb->freeblks--;
-    
-    save_superblock(sb);
-    free(fp);
-    return block;
+    uint64_t nblocks;
+    return fs_get_blocks(sb, 1, &nblocks);
 }
 
 /* Put =block back into the filesystem as a free block.  Returns zero on
  * success or a negative value on error.  If there is an error, errno is set
  * accordingly. */
 int fs_put_block(struct superblock *sb, uint64_t block) {
+    return fs_put_blocks(sb, block, 1);
+}
 
-    struct freepage* fp = (struct freepage*) calloc(1, sb->blksz);
-    fp->next = sb->freelist;
-    save_freepage(sb, fp, block);
-    
-    sb->freelist = block;
-    sb->freeblks++;
-    save_superblock(sb);
+/* Get a run of up to =count free blocks that are contiguous on disk.  The
+ * first block of the run is returned and its length is stored in =nblocks,
+ * which may be smaller than =count when no free extent is long enough.  If
+ * there are no free blocks, zero is returned. */
+uint64_t fs_get_blocks(struct superblock *sb, uint64_t count, uint64_t *nblocks) {
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    uint64_t block = alloc_blocks(sb, count, nblocks);
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+    return block;
+}
 
-    return 0;
+/* Put the =nblocks blocks starting at =block back into the filesystem as
+ * free blocks.  Blocks that a snapshot still uses are kept for it instead
+ * (see fs_snapshot_create).  Returns zero on success or a negative value
+ * on error. */
+int fs_put_blocks(struct superblock *sb, uint64_t block, uint64_t nblocks) {
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    int ret = put_blocks(sb, block, nblocks);
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+    return ret;
 }
 
 int fs_write_file(struct superblock *sb, const char *fname, char *buf,
         size_t cnt) {
+    uint64_t start = stats_clock();
+    int ret = write_file(sb, fname, buf, cnt, 0);
+    stats_op(sb, FS_OP_WRITE_FILE, start);
+    return ret;
+}
 
-    uint64_t num_blocks = cnt / sb->blksz;
-    if (num_blocks == 0) num_blocks++;
-    if (num_blocks > sb->freeblks) {
-        errno = ENOSPC;
+/* Same as fs_write_file, but =flags selects how the file is stored (a
+ * combination of the FS_WR_* constants).  With FS_WR_COMPRESS the file
+ * is compressed before any lock is taken, and written as the header and
+ * groups of zip_compress would be written as a file's contents.  Other
+ * =flags set errno to EINVAL. */
+int fs_write_file_flags(struct superblock *sb, const char *fname, char *buf,
+        size_t cnt, int flags) {
+    if ((flags & ~FS_WR_COMPRESS) != 0) {
+        errno = EINVAL;
         return -1;
     }
+    uint64_t start = stats_clock();
+    int ret = write_file(sb, fname, buf, cnt, flags);
+    stats_op(sb, FS_OP_WRITE_FILE, start);
+    return ret;
+}
+
+int write_file(struct superblock *sb, const char *fname, char *buf,
+        size_t cnt, int flags) {
+    if (view_readonly(sb) < 0 || snap_reserve(sb, 0) < 0) return -1;
+
+    //contents that fit in the inode need no data block, and are never
+    //compressed; =data is what goes to the data blocks
+    int isinline = cnt <= get_inline_capacity(sb);
+    char* zip = NULL;
+    size_t zip_sz = 0;
+    if (!isinline && (flags & FS_WR_COMPRESS)) zip = zip_compress(sb, buf, cnt, &zip_sz);
+    char* data = (zip != NULL) ? zip : buf;
+    size_t data_sz = (zip != NULL) ? zip_sz : cnt;
 
+    journal_op_begin(sb);
+    uint64_t ndata = isinline ? 0 : (data_sz + sb->blksz - 1) / sb->blksz;
+
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
     int full_match = 0;
-    char file_short_name[50] = "";
-    uint64_t dir_or_file_blk = get_inode_block(sb, fname, &full_match, file_short_name);
-    
+    uint64_t file_blk = get_inode_block(sb, fname, &full_match, NULL);
+    uint64_t data_blk = 0;
+    int created = 0;
+
+    if (full_match != 0 && is_dir_block(sb, file_blk)) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        free(zip);
+        errno = EISDIR;
+        return -1;
+    }
+    //the data, and for a new file its nodeinfo, its inode and maybe an
+    //inode for the directory's entries; the child inodes that the extents
+    //need are only known once the data blocks are reserved
+    if (ndata + (full_match ? 0 : get_meta_blocks(sb) + 1) > get_free_blocks(sb)) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        free(zip);
+        errno = ENOSPC;
+        return -1;
+    }
     if (full_match == 0) {
         //file does not exist, so it has to be created
-        dir_or_file_blk = create_entity(sb, dir_or_file_blk, file_short_name, IMREG);
-    } else {
-        //file already exists, so it will be overrided
-        free_file_data_blocks(sb, dir_or_file_blk);
+        file_blk = create_file(sb, fname, ndata, &data_blk, &created);
+        if (file_blk == 0) {
+            pthread_rwlock_unlock(&sb->state->locks->ns);
+            free(zip);
+            return -1;
+        }
+        if (!created && is_dir_block(sb, file_blk)) {
+            pthread_rwlock_unlock(&sb->state->locks->ns);
+            free(zip);
+            errno = EISDIR;
+            return -1;
+        }
     }
-    write_to_file(sb, dir_or_file_blk, buf, cnt);
 
-    return 0;
+    //the new contents get their blocks before an existing file loses its
+    //old ones, so a write that fails leaves the file as it was
+    pthread_rwlock_t* lock = inode_lock(sb, file_blk);
+    pthread_rwlock_wrlock(lock);
+    int ret = 0;
+    uint64_t nruns = 0;
+    uint64_t* runs = NULL;
+    uint64_t* nodes = NULL;
+    if (!isinline) {
+        runs = reserve_runs(sb, ndata, data_blk, &nruns);
+        if (runs != NULL) {
+            //and the inodes that will hold the extents
+            nodes = reserve_nodes(sb, extent_nodes_needed(sb, 0, runs, nruns));
+            if (nodes == NULL) {
+                put_runs(sb, runs, nruns);
+                free(runs);
+                runs = NULL;
+            }
+        }
+        if (runs == NULL) ret = -1;
+    }
+    if (ret == 0) {
+        if (!created) free_file_data_blocks(sb, file_blk);
+        if (isinline) write_inline(sb, file_blk, buf, cnt, 0);
+        else write_to_file(sb, file_blk, data, data_sz, runs, nruns, nodes);
+    }
+    free(nodes);
+    free(runs);
+    if (ret == 0 && zip != NULL) {
+        //the size is that of the file, not of what the blocks hold
+        struct inode* file_node = retrieve_inode(sb, file_blk);
+        struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+        file_node->mode |= IMZIP;
+        save_inode(sb, file_node, file_blk);
+        file_info->size = cnt;
+        save_nodeinfo(sb, file_info, file_node->meta);
+        release_block(sb, file_node);
+        release_nodeinfo(sb, file_info);
+    }
+    (*inode_gen(sb, file_blk))++;
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    if (ret < 0 && created) remove_new_file(sb, fname, file_blk);
+    free(zip);
+    return ret;
 }
 
 ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
         size_t bufsz) {
-    // TODO create a limit with bufsz
-    
+    uint64_t start = stats_clock();
+    ssize_t ret = read_file(sb, fname, buf, bufsz);
+    stats_op(sb, FS_OP_READ_FILE, start);
+    return ret;
+}
+
+ssize_t read_file(struct superblock *sb, const char *fname, char *buf,
+        size_t bufsz) {
+    if (view_lost(sb)) return -1;
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
     int full_match = 0;
     uint64_t file_blk = get_inode_block(sb, fname, &full_match, NULL);
     
     if (full_match == 0) {
         //file does not exist
+        pthread_rwlock_unlock(&sb->state->locks->ns);
         errno = ENOENT;
         return -1;
     }
+    if (is_dir_block(sb, file_blk)) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = EISDIR;
+        return -1;
+    }
 
+    pthread_rwlock_t* lock = inode_lock(sb, file_blk);
+    pthread_rwlock_rdlock(lock);
     struct inode* file_node = retrieve_inode(sb, file_blk);
     struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
  
     uint64_t filesz = file_info->size;
-    // Must be started at zero when the file is too small
-    uint64_t ii = 0; 
-    uint64_t cnt_bufsz = 0;
+    int iszip = (file_node->mode & IMZIP) != 0;
+    release_block(sb, file_node);
+    release_nodeinfo(sb, file_info);
 
-    while (cnt_bufsz + sb->blksz < filesz) {
-        for (ii = 0; file_node->links[ii] != 0 && cnt_bufsz + sb->blksz < filesz; ii++) {
-            uint64_t blk = file_node->links[ii];
-            lseek(sb->fd, blk * sb->blksz, SEEK_SET);
-	        read(sb->fd, buf, sb->blksz);
-            cnt_bufsz += sb->blksz;
-            buf += sb->blksz;
-        }
-        if (file_node->next != 0) {
-            lseek(sb->fd, file_node->next * sb->blksz, SEEK_SET);
-	        read(sb->fd, file_node, sb->blksz);
-            ii = 0; //corner case: the remaining data is on the next node
-        }
-    }
-
-    //remaining data
-    size_t left_over = filesz - cnt_bufsz;
-    if (left_over != 0) {
-        uint64_t blk = file_node->links[ii];
-        lseek(sb->fd, blk * sb->blksz, SEEK_SET);
-        read(sb->fd, buf, left_over);
-        cnt_bufsz += left_over;
-    }
-    
-    free(file_node);
-    free(file_info);
+    //never write past the end of the caller's buffer
+    uint64_t nbytes = (filesz < bufsz) ? filesz : bufsz;
+    ssize_t cnt_bufsz = iszip ? read_zip_data(sb, file_blk, buf, nbytes, filesz)
+                              : (ssize_t) read_file_data(sb, file_blk, buf, nbytes);
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
 
     return cnt_bufsz;
 }
 
 int fs_unlink(struct superblock *sb, const char *fname) {
-    int full_match = 0;
-    uint64_t file_blk = get_inode_block(sb, fname, &full_match, NULL);
-    
-    if (full_match == 0) {
-        //file does not exist
-        errno = ENOENT;
-        return -1;
-    }
-    
-    free_file_data_blocks(sb, file_blk);
-
-    struct inode* file_node = retrieve_inode(sb, file_blk);
-    assert(file_node->next == 0);
-
-    //update parent dir
-    unlink_node(sb, file_node->parent, file_blk);
-
-    //remove inode root and metadata
-    fs_put_block(sb, file_node->meta);
-    fs_put_block(sb, file_blk);
-
-    free(file_node);
-    return 0;
+    if (view_readonly(sb) < 0) return -1;
+    uint64_t start = stats_clock();
+    journal_op_begin(sb);
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    int ret = unlink_file(sb, fname);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    stats_op(sb, FS_OP_UNLINK, start);
+    return ret;
 }
 
 int fs_mkdir(struct superblock *sb, const char *dname) {
+    uint64_t start = stats_clock();
+    int ret = make_dir(sb, dname);
+    stats_op(sb, FS_OP_MKDIR, start);
+    return ret;
+}
+
+int make_dir(struct superblock *sb, const char *dname) {
+    if (view_readonly(sb) < 0 || snap_reserve(sb, 0) < 0) return -1;
+    journal_op_begin(sb);
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
     int full_match = 0;
-    char dir_short_name[50];
-    uint64_t parent_dir_blk = get_inode_block(sb, dname, &full_match, dir_short_name);
-    
+    char dir_short_name[NAME_MAX_LEN];
+    get_inode_block(sb, dname, &full_match, NULL);
+    uint64_t parent_dir_blk = 0;
     if (full_match == 1) {
         //dir already exists
         errno = EEXIST;
+    } else {
+        parent_dir_blk = get_parent_block(sb, dname, dir_short_name);
+    }
+    if (parent_dir_blk == 0) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
         return -1;
     }
-    create_entity(sb, parent_dir_blk, dir_short_name, IMDIR);
-    return 0;
+
+    //someone else may have created it since the lookup
+    pthread_rwlock_t* lock = inode_lock(sb, parent_dir_blk);
+    pthread_rwlock_wrlock(lock);
+    int ret = -1;
+    if (dirindex_lookup(sb, parent_dir_blk, dir_short_name) != 0) {
+        errno = EEXIST;
+    } else if (create_entity(sb, parent_dir_blk, dir_short_name, IMDIR, 0) != 0) {
+        ret = 0;
+    }
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return ret;
 }
 
 int fs_rmdir(struct superblock *sb, const char *dname) {
+    if (view_readonly(sb) < 0) return -1;
+    uint64_t start = stats_clock();
+    journal_op_begin(sb);
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    int ret = remove_dir(sb, dname);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    stats_op(sb, FS_OP_RMDIR, start);
+    return ret;
+}
+
+char * fs_list_dir(struct superblock *sb, const char *dname) {
+    uint64_t start = stats_clock();
+    char* list = list_dir(sb, dname);
+    stats_op(sb, FS_OP_LIST_DIR, start);
+    return list;
+}
+
+char * list_dir(struct superblock *sb, const char *dname) {
+    if (view_lost(sb)) return NULL;
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
     int full_match = 0;
     uint64_t dir_blk = get_inode_block(sb, dname, &full_match, NULL);
     
     if (full_match == 0) {
         //dir does not exist
+        pthread_rwlock_unlock(&sb->state->locks->ns);
         errno = ENOENT;
-        return -1;
+        return NULL;
     }
-    struct inode* dir_node = retrieve_inode(sb, dir_blk);
-    
-    if (dir_node->mode != IMDIR) {
+
+    pthread_rwlock_t* lock = inode_lock(sb, dir_blk);
+    pthread_rwlock_rdlock(lock);
+    struct dircursor cur;
+    if (dircursor_open(sb, dir_blk, &cur) < 0) {
         //node is a file
-        free(dir_node);
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_unlock(&sb->state->locks->ns);
         errno = ENOTDIR;
-        return -1;
-    }
-    
-    struct nodeinfo* dir_info = retrieve_nodeinfo(sb, dir_node->meta);
-    if (dir_info->size != 0) {
-        //node is a file
-        free(dir_node);
-        free(dir_info);
-        errno = ENOTEMPTY;
-        return -1;
+        return NULL;
     }
-    assert(dir_node->next == 0);
+   
+    size_t len = 0;
+    size_t size = 64;
+    char* list = (char*) malloc(size);
+    list[0] = '\0';
 
-    //update parent dir
-    unlink_node(sb, dir_node->parent, dir_blk);
+    while (dircursor_next(sb, &cur)) {
+        //the name, a slash for directories and a space
+        size_t need = strlen(cur.name) + 2;
+        if (len + need + 1 > size) {
+            while (len + need + 1 > size) size *= 2;
+            list = (char*) realloc(list, size);
+        }
+        strcpy(list + len, cur.name);
+        len += strlen(cur.name);
+        if (cur.isdir) list[len++] = '/';
+        list[len++] = ' ';
+        list[len] = '\0';
+    }
+    dircursor_close(sb, &cur);
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
 
-    //remove node and metadata
-    fs_put_block(sb, dir_node->meta);
-    fs_put_block(sb, dir_blk);
+    if (len > 0) list[len - 1] = '\0';
+    return list;
+}
 
-    free(dir_node);
-    free(dir_info);
-    return 0;
+struct fsdir * fs_opendir(struct superblock *sb, const char *dname) {
+    uint64_t start = stats_clock();
+    struct fsdir* d = open_dir(sb, dname);
+    stats_op(sb, FS_OP_OPENDIR, start);
+    return d;
 }
 
-char * fs_list_dir(struct superblock *sb, const char *dname) {
+struct fsdir * open_dir(struct superblock *sb, const char *dname) {
+    if (view_lost(sb)) return NULL;
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
     int full_match = 0;
     uint64_t dir_blk = get_inode_block(sb, dname, &full_match, NULL);
-    
     if (full_match == 0) {
-        //dir does not exist
+        pthread_rwlock_unlock(&sb->state->locks->ns);
         errno = ENOENT;
         return NULL;
     }
-    struct inode* dir_node = retrieve_inode(sb, dir_blk);
-    
-    if (dir_node->mode != IMDIR) {
-        //node is a file
-        free(dir_node);
+
+    struct fsdir* d = (struct fsdir*) calloc(1, sizeof(struct fsdir));
+    pthread_rwlock_t* lock = inode_lock(sb, dir_blk);
+    pthread_rwlock_rdlock(lock);
+    if (dircursor_open(sb, dir_blk, &d->cur) < 0) {
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        free(d);
         errno = ENOTDIR;
         return NULL;
     }
-    
-    struct nodeinfo* dir_info = retrieve_nodeinfo(sb, dir_node->meta);
+    dircursor_readahead(sb, &d->cur);
+    release_block(sb, d->cur.node);
+    d->cur.node = NULL;
+    pthread_rwlock_unlock(lock);
 
-    struct inode* ent_node = (struct inode*) calloc(1, sb->blksz); 
-    struct nodeinfo* ent_info = (struct nodeinfo*) calloc(1, sb->blksz); 
-    struct inode *curr_node = (struct inode*) calloc(1, sb->blksz);
-    uint64_t curr_blk = dir_blk;
-   
-    //TODO: realloc array dynamically
-    char* list = (char*) malloc(1000 * sizeof(char*));
-    strcpy(list, "");
-    const uint64_t nelem_in_dir = dir_info->size;
-    uint64_t cnt = 0;
+    d->sb = sb;
+    d->blk = dir_blk;
+    pthread_mutex_lock(&sb->state->locks->dirs_lock);
+    d->next = sb->state->locks->dirs;
+    if (d->next != NULL) d->next->prev = d;
+    sb->state->locks->dirs = d;
+    pthread_mutex_unlock(&sb->state->locks->dirs_lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return d;
+}
 
-iterate_over_inode:
-    lseek(sb->fd, curr_blk * sb->blksz, SEEK_SET);
-    read(sb->fd, curr_node, sb->blksz);
-    
-    for (int index = 0; curr_node->links[index] != 0; index++) {
-        lseek(sb->fd, curr_node->links[index] * sb->blksz, SEEK_SET);
-        read(sb->fd, ent_node, sb->blksz);
-
-        lseek(sb->fd, ent_node->meta * sb->blksz, SEEK_SET);
-        read(sb->fd, ent_info, sb->blksz);
-        
-        strcat(list, ent_info->name);
-        if (ent_node->mode == IMDIR) {
-            strcat(list, "/ ");
-        } else {
-            strcat(list, " ");
-        }
-        cnt++;
+struct fs_dirent * fs_readdir(struct fsdir *d) {
+    uint64_t start = stats_clock();
+    struct fs_dirent* ent = read_dir(d);
+    stats_op(d->sb, FS_OP_READDIR, start);
+    return ent;
+}
+
+struct fs_dirent * read_dir(struct fsdir *d) {
+    struct superblock* sb = d->sb;
+    pthread_rwlock_t* lock = inode_lock(sb, d->blk);
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
+    pthread_rwlock_rdlock(lock);
+
+    uint64_t nodeblk = d->cur.nodeblk;
+    if (nodeblk != 0) {
+        d->cur.node = retrieve_inode(sb, nodeblk);
+        //an empty directory takes the packed layout on its first entry
+        if (nodeblk == d->blk) d->cur.packed = (d->cur.node->mode & IMDIRENT) != 0;
     }
 
-    //go to next inode in list
-    if (curr_node->next != 0) {
-        assert (cnt < nelem_in_dir);
-        curr_blk = curr_node->next;
-        goto iterate_over_inode;
+    struct fs_dirent* ent = NULL;
+    if (dircursor_next(sb, &d->cur)) {
+        if (d->cur.nodeblk != nodeblk) dircursor_readahead(sb, &d->cur);
+
+        struct inode* node = retrieve_inode(sb, d->cur.block);
+        struct nodeinfo* info = retrieve_nodeinfo(sb, node->meta);
+        d->ent.inode = d->cur.block;
+        d->ent.size = info->size;
+        d->ent.isdir = d->cur.isdir;
+        strcpy(d->ent.name, d->cur.name);
+        release_block(sb, node);
+        release_nodeinfo(sb, info);
+        ent = &d->ent;
+    }
+    if (d->cur.node != NULL) {
+        release_block(sb, d->cur.node);
+        d->cur.node = NULL;
     }
-    
-    assert (cnt == nelem_in_dir);
-
-    list[strlen(list) -1] = '\0'; 
-    free(dir_node);
-    free(dir_info);
-    free(ent_node);
-    free(ent_info);
-    free(curr_node);
-    return list;
-}
 
-struct inode* retrieve_inode(struct superblock* sb, uint64_t block) {
-    struct inode* node = (struct inode*) calloc(1, sb->blksz);
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	read(sb->fd, node, sb->blksz);
-    return node;
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return ent;
 }
 
-struct nodeinfo* retrieve_nodeinfo(struct superblock* sb, uint64_t block) {
-    struct nodeinfo* nodeinfo = (struct nodeinfo*) calloc(1, sb->blksz);
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	read(sb->fd, nodeinfo, sb->blksz);
-    return nodeinfo;
-}
+int fs_closedir(struct fsdir *d) {
+    struct superblock* sb = d->sb;
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
+    pthread_mutex_lock(&sb->state->locks->dirs_lock);
+    if (d->prev != NULL) d->prev->next = d->next;
+    else sb->state->locks->dirs = d->next;
+    if (d->next != NULL) d->next->prev = d->prev;
+    pthread_mutex_unlock(&sb->state->locks->dirs_lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
 
-struct freepage* retrieve_freepage(struct superblock* sb, uint64_t block) {
-    struct freepage* fp = (struct freepage*) calloc(1, sb->blksz);
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	read(sb->fd, fp, sb->blksz);
-    return fp;
+    dircursor_close(sb, &d->cur);
+    free(d);
+    return 0;
 }
 
-void save_superblock(struct superblock* sb) {
-    lseek(sb->fd, 0, SEEK_SET);
-	write(sb->fd, sb, sb->blksz);
+int fs_stat(struct superblock *sb, const char *fname, struct fs_dirent *st) {
+    uint64_t start = stats_clock();
+    int ret = stat_entry(sb, fname, st);
+    stats_op(sb, FS_OP_STAT, start);
+    return ret;
 }
 
-void save_inode(struct superblock* sb, struct inode* node, uint64_t block) {
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	write(sb->fd, node, sb->blksz);
-}
+int stat_entry(struct superblock *sb, const char *fname, struct fs_dirent *st) {
+    if (view_lost(sb)) return -1;
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
+    int full_match = 0;
+    uint64_t blk = get_inode_block(sb, fname, &full_match, NULL);
+    if (full_match == 0) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = ENOENT;
+        return -1;
+    }
 
-void save_nodeinfo(struct superblock* sb, struct nodeinfo* ni, uint64_t block) {
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	write(sb->fd, ni, sb->blksz);
+    pthread_rwlock_t* lock = inode_lock(sb, blk);
+    pthread_rwlock_rdlock(lock);
+    struct inode* node = retrieve_inode(sb, blk);
+    struct nodeinfo* info = retrieve_nodeinfo(sb, node->meta);
+    st->inode = blk;
+    st->size = info->size;
+    st->isdir = (node->mode & IMDIR) != 0;
+    strncpy(st->name, info->name, NAME_MAX_LEN - 1);
+    st->name[NAME_MAX_LEN - 1] = '\0';
+    release_block(sb, node);
+    release_nodeinfo(sb, info);
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return 0;
 }
 
-void save_freepage(struct superblock* sb, struct freepage* fp, uint64_t block) {
-    lseek(sb->fd, block * sb->blksz, SEEK_SET);
-	write(sb->fd, fp, sb->blksz);
+int fs_journal_enable(struct superblock *sb, uint64_t nblocks) {
+    if (view_readonly(sb) < 0) return -1;
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    int ret = journal_enable(sb, nblocks);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return ret;
 }
 
-
-/* This function returns the block number for the deepest matching token in the path
- * If the path was fully matched, it sets full_match to 1, otherwise 0 */
-uint64_t get_inode_block(struct superblock *sb, const char *full_path, int *full_match, char* path_left_over) {
-    *full_match = 1;
-    if (strcmp("/", full_path) == 0) {
-        return sb->root;
+int fs_journal_disable(struct superblock *sb) {
+    struct blkcache* cache = sb->state->cache;
+    if (view_readonly(sb) < 0) return -1;
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    if (sb->journal == 0 || cache->jlen == 0) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = EINVAL;
+        return -1;
     }
+    cache_flush(sb);
+    fdatasync(sb->state->fd);
 
-    struct inode *curr_node = (struct inode*) calloc(1, sb->blksz);
-    struct inode *subdir_or_file_node = (struct inode*) calloc(1, sb->blksz);
-    struct nodeinfo *nodeinfo = (struct nodeinfo*) calloc(1, sb->blksz);
+    //forget the journal before its blocks can be reused
+    uint64_t first = sb->journal;
+    uint64_t nblocks = cache->jlen;
+    pthread_mutex_lock(&cache->lock);
+    cache->jlen = 0;
+    pthread_mutex_unlock(&cache->lock);
+    sb->journal = 0;
+    save_superblock(sb);
+    cache_flush(sb);
+    fdatasync(sb->state->fd);
 
-    //starts from the root
-    uint64_t curr_block = sb->root;
-    lseek(sb->fd, curr_block * sb->blksz, SEEK_SET);
-    read(sb->fd, curr_node, sb->blksz);
+    //no snapshot ever uses journal blocks
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    free_blocks(sb, first, nblocks);
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+    cache_flush(sb);
+    fdatasync(sb->state->fd);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return 0;
+}
 
-    //for each token in the fullpath
-    //  look for its block
-    int token_matched = 0;
-    char* path = malloc(strlen(full_path) * sizeof(char));
-    strcpy(path, full_path);
-    char * pch;
-    for (pch = strtok(path, "/"); pch != NULL; pch = strtok(NULL, "/")) {
-        // printf ("Path token: %s\n", pch);
-        token_matched = 0;
-
-        //check if node is in curr_node linked list
-        //if not and curr_node->next != 0
-        //  go to next inode
-search_node_links:
-        for(int link_index = 0; curr_node->links[link_index] != 0; link_index++) {
-            lseek(sb->fd, curr_node->links[link_index] * sb->blksz, SEEK_SET);
-            read(sb->fd, subdir_or_file_node, sb->blksz);
-
-            lseek(sb->fd, subdir_or_file_node->meta * sb->blksz, SEEK_SET);
-            read(sb->fd, nodeinfo, sb->blksz);
-
-            // printf ("nodeinfo->name: %s\n", nodeinfo->name);
-            if (strcmp(nodeinfo->name, pch) == 0) {
-                token_matched = 1;
-
-                //goes down one level
-                curr_block = curr_node->links[link_index];
-                lseek(sb->fd, curr_node->links[link_index] * sb->blksz, SEEK_SET);
-                read(sb->fd, curr_node, sb->blksz);
-                break;
-            }
-        }
-        
-        if (token_matched == 1) continue;
+int fs_sync(struct superblock *sb) {
+    if (sb->state->cache->live != NULL) return 0;
+    uint64_t start = stats_clock();
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    save_superblock(sb);
+    cache_flush(sb);
+    if (sb->state->cache->map != NULL) {
+        msync(sb->state->cache->map, sb->state->cache->mapsz, MS_SYNC);
+    }
+    fdatasync(sb->state->fd);
+    int err = __atomic_exchange_n(&sb->state->cache->werr, 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    stats_op(sb, FS_OP_SYNC, start);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
 
-        if (curr_node->next != 0) {
-            lseek(sb->fd, curr_node->next, SEEK_SET);
-            read(sb->fd, curr_node, sb->blksz);
-            goto search_node_links;
-        } else {
-            break; //did not found subdir or file and there is no next node
-        }
+/* fs_journal_enable, with =ns held exclusively. */
+int journal_enable(struct superblock* sb, uint64_t nblocks) {
+    struct blkcache* cache = sb->state->cache;
+    if (cache->map != NULL || nblocks < JOURNAL_MIN_BLOCKS || nblocks >= sb->blks) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sb->journal != 0) {
+        errno = EEXIST;
+        return -1;
     }
 
-    //Assuming that the path is correct, if token_matched == 0, the file does not exist yet.
-    //Thus, returns the block for the directory that will store this file
-    *full_match = token_matched;
-    if (*full_match == 0 && path_left_over != NULL) {
-        // printf ("token left: %s\n", pch);
-        strcpy(path_left_over, pch);
+    uint64_t got;
+    uint64_t first = fs_get_blocks(sb, nblocks, &got);
+    if (got < nblocks) {
+        if (first != 0) fs_put_blocks(sb, first, got);
+        errno = ENOSPC;
+        return -1;
     }
 
-    free(subdir_or_file_node);
-    subdir_or_file_node = NULL;
+    //an empty log: the header and a zeroed first descriptor
+    char* buf = (char*) calloc(2, sb->blksz);
+    struct journal* hdr = (struct journal*) buf;
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->nblocks = nblocks;
+    hdr->seq = cache->jseq;
+    pwrite(sb->state->fd, buf, 2 * sb->blksz, first * sb->blksz);
+    free(buf);
 
-    free(nodeinfo);
-    free(curr_node);
-    return curr_block;
-}
+    //the journal only exists once it is on disk along with everything before it
+    sb->journal = first;
+    save_superblock(sb);
+    cache_flush(sb);
+    fdatasync(sb->state->fd);
 
-int get_max_links_in_node(struct superblock* sb) {
-    return ((sb->blksz - sizeof(struct inode)) / sizeof(uint64_t) - 1);
+    pthread_mutex_lock(&cache->lock);
+    cache->jlen = nblocks;
+    cache->jsynced = 1;
+    cache->nfreed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &cache->jlast);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
 }
 
-int get_num_links_in_node(struct inode* node) {
-    int cnt = 0;
-    while (node->links[cnt] != 0) cnt++;
-    return cnt;
-}
+int fs_snapshot_create(struct superblock *sb, const char *name) {
+    struct snapstate* snap = sb->state->cache->snap;
+    if (view_readonly(sb) < 0) return -1;
+    if (sb->state->cache->map != NULL || name[0] == '\0' || strchr(name, '/') != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (strlen(name) >= FS_NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
 
-uint64_t get_last_inode(struct superblock* sb, uint64_t block) {
-    struct inode* node = retrieve_inode(sb, block);
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    pthread_rwlock_rdlock(&snap->lock);
+    int exists = snap_find(snap, name) >= 0;
+    pthread_rwlock_unlock(&snap->lock);
+    if (exists) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = EEXIST;
+        return -1;
+    }
 
-    while (node->next != 0) {
-        block = node->next;
-        free(node);
-        node = retrieve_inode(sb, block);
+    //the snapshot is what is on disk once everything before it is there
+    cache_flush(sb);
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    uint64_t nblocks;
+    uint64_t record = alloc_blocks(sb, 1, &nblocks);
+    if (record == 0) {
+        pthread_mutex_unlock(&sb->state->locks->alloc);
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = ENOSPC;
+        return -1;
     }
-    free(node);
-    return block;
+    struct snapshot* rec = (struct snapshot*) new_block(sb, record);
+    rec->magic = SNAPSHOT_MAGIC;
+    rec->next = sb->snapshots;
+    rec->root = sb->root;
+    rec->created = (uint64_t) time(NULL);
+    strcpy(rec->name, name);
+    write_block(sb, record, rec, 1);
+    release_block(sb, rec);
+    sb->snapshots = record;
+    save_superblock(sb);
+
+    pthread_rwlock_wrlock(&snap->lock);
+    snap->snaps = (struct snapmem*) realloc(snap->snaps, (snap->nsnaps + 1) * sizeof(struct snapmem));
+    memmove(snap->snaps + 1, snap->snaps, snap->nsnaps * sizeof(struct snapmem));
+    struct snapmem* sm = &snap->snaps[0];
+    memset(sm, 0, sizeof(struct snapmem));
+    sm->id = ++snap->nextid;
+    sm->record = record;
+    sm->root = sb->root;
+    strcpy(sm->name, name);
+    //every block in use is now shared with the snapshot
+    pthread_mutex_lock(&sb->state->cache->lock);
+    snap->nsnaps++;
+    snap->nfresh = 0;
+    pthread_mutex_unlock(&sb->state->cache->lock);
+    pthread_rwlock_unlock(&snap->lock);
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+
+    cache_flush(sb);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return 0;
 }
 
-uint64_t get_node_blk_with_space(struct superblock* sb, uint64_t block) {
-    int max_links = get_max_links_in_node(sb);
-    struct inode* node = retrieve_inode(sb, block);
-    
-    if (get_num_links_in_node(node) < max_links) {
-        free(node);
-        return block;
-    }
+int fs_snapshot_delete(struct superblock *sb, const char *name) {
+    struct snapstate* snap = sb->state->cache->snap;
+    if (view_readonly(sb) < 0) return -1;
 
-    while (node->next != 0) {
-        block = node->next;
-        free(node);
-        node = retrieve_inode(sb, block);
-    
-        if (get_num_links_in_node(node) < max_links) {
-            free(node);
-            return block;
-        }
+    //copies and freed blocks still waiting go to their snapshot first
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    cache_flush(sb);
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    pthread_rwlock_wrlock(&snap->lock);
+    int index = snap_find(snap, name);
+    int err = 0;
+    if (index < 0) err = ENOENT;
+    else if (snap->snaps[index].views > 0) err = EBUSY;
+    else snap_delete(sb, index);
+    pthread_rwlock_unlock(&snap->lock);
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+
+    if (err == 0) cache_flush(sb);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    if (err != 0) {
+        errno = err;
+        return -1;
     }
-    free(node);
     return 0;
 }
 
-void link_node_to_nodelist(struct superblock* sb, uint64_t ref_blk, uint64_t blk_to_link, uint64_t nbytes) {
-    struct inode* ref_node = retrieve_inode(sb, ref_blk);
-    
-    if (ref_node->mode == IMCHILD) {
-        //get header node
-        ref_blk = ref_node->parent;
-        free(ref_node);
-        ref_node = retrieve_inode(sb, ref_blk);
+char * fs_snapshot_list(struct superblock *sb) {
+    size_t len = 0;
+    char* list = (char*) malloc(1);
+    list[0] = '\0';
+    struct snapstate* snap = sb->state->cache->snap;
+    if (snap == NULL) return list;
+
+    pthread_rwlock_rdlock(&snap->lock);
+    for (uint64_t ii = 0; ii < snap->nsnaps; ii++) {
+        size_t need = strlen(snap->snaps[ii].name) + 1;
+        list = (char*) realloc(list, len + need + 1);
+        if (len > 0) list[len++] = ' ';
+        strcpy(list + len, snap->snaps[ii].name);
+        len += need - 1;
     }
+    pthread_rwlock_unlock(&snap->lock);
+    return list;
+}
 
-    uint64_t blk_with_space = get_node_blk_with_space(sb, ref_blk);
+struct superblock * fs_snapshot_open(struct superblock *sb, const char *name) {
+    struct snapstate* snap = sb->state->cache->snap;
+    if (snap == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_rwlock_wrlock(&snap->lock);
+    int index = snap_find(snap, name);
+    if (index < 0) {
+        pthread_rwlock_unlock(&snap->lock);
+        errno = ENOENT;
+        return NULL;
+    }
+    snap->snaps[index].views++;
+    uint64_t id = snap->snaps[index].id;
+    uint64_t root = snap->snaps[index].root;
+    pthread_rwlock_unlock(&snap->lock);
 
-    if (blk_with_space != 0) {
-        struct inode* node_with_space = retrieve_inode(sb, blk_with_space);
-        uint64_t num_links = get_num_links_in_node(node_with_space);
+    //same geometry and descriptor, but locks and caches of its own
+    struct superblock* view = (struct superblock*) calloc(1, sb->blksz);
+    view->magic = sb->magic;
+    view->blks = sb->blks;
+    view->blksz = sb->blksz;
+    view->root = root;
+    view->format = sb->format;
+    view->state = (struct fsstate*) calloc(1, sizeof(struct fsstate));
+    view->state->fd = sb->state->fd;
+    locks_init(view);
+    stats_init(view);
+    cache_init(view, FS_IO_PREAD);
+    view->state->cache->live = sb;
+    view->state->cache->snapid = id;
+    dirindex_init(view);
+    dcache_init(view);
+    return view;
+}
 
-        
-        struct nodeinfo* tempmeta = retrieve_nodeinfo(sb, node_with_space->meta);
-        free(tempmeta);
+struct fsfile * fs_file_open(struct superblock *sb, const char *fname, int flags) {
+    uint64_t start = stats_clock();
+    struct fsfile* f = file_open(sb, fname, flags);
+    stats_op(sb, FS_OP_FILE_OPEN, start);
+    return f;
+}
 
-        node_with_space->links[num_links] = blk_to_link;
-        node_with_space->links[num_links + 1] = 0;
-        save_inode(sb, node_with_space, blk_with_space);
-        free(node_with_space);
+struct fsfile * file_open(struct superblock *sb, const char *fname, int flags) {
+    if ((flags != 0 && (view_readonly(sb) < 0 || snap_reserve(sb, 0) < 0)) || view_lost(sb)) return NULL;
+    journal_op_begin(sb);
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
+    int full_match = 0;
+    uint64_t file_blk = get_inode_block(sb, fname, &full_match, NULL);
+
+    if (full_match == 0) {
+        if ((flags & FS_CREAT) == 0) {
+            //file does not exist
+            pthread_rwlock_unlock(&sb->state->locks->ns);
+            errno = ENOENT;
+            return NULL;
+        }
+        uint64_t unused;
+        file_blk = create_file(sb, fname, 0, &unused, NULL);
+        if (file_blk == 0) {
+            pthread_rwlock_unlock(&sb->state->locks->ns);
+            return NULL;
+        }
+    }
+    if (is_dir_block(sb, file_blk)) {
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = EISDIR;
+        return NULL;
+    }
+
+    struct fsfile* f = (struct fsfile*) calloc(1, sizeof(struct fsfile));
+    f->sb = sb;
+    f->blk = file_blk;
+    f->bounce = (char*) malloc(sb->blksz);
+
+    pthread_rwlock_t* lock = inode_lock(sb, file_blk);
+    if (flags & FS_TRUNC) {
+        pthread_rwlock_wrlock(lock);
+        free_file_data_blocks(sb, file_blk);
+        (*inode_gen(sb, file_blk))++;
     } else {
-        uint64_t new_node_block = fs_get_block(sb);
-        uint64_t prev_node_block = get_last_inode(sb, ref_blk);
+        pthread_rwlock_rdlock(lock);
+    }
+    file_load_map(f);
+    f->gen = *inode_gen(sb, file_blk);
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return f;
+}
 
-        struct inode* prev_node = retrieve_inode(sb, prev_node_block);
-        prev_node->next = new_node_block;
-        save_inode(sb, prev_node, prev_node_block);
-        free(prev_node);
+int fs_file_close(struct fsfile *f) {
+    free(f->runs);
+    free(f->bounce);
+    free(f->zgroups);
+    free(f->zbuf);
+    free(f->zdata);
+    free(f);
+    return 0;
+}
 
-        struct inode* new_node = (struct inode*) calloc(1, sb->blksz);
-        new_node->mode = IMCHILD;
-        new_node->parent = ref_blk;
-        new_node->next = 0;
-        new_node->meta = prev_node_block;
-        new_node->links[0] = blk_to_link;
-        new_node->links[1] = 0;
-        save_inode(sb, new_node, new_node_block);
-        free(new_node);
+ssize_t fs_file_pread(struct fsfile *f, void *buf, size_t cnt, uint64_t offset) {
+    uint64_t start = stats_clock();
+    ssize_t ret = file_pread(f, buf, cnt, offset);
+    stats_op(f->sb, FS_OP_FILE_PREAD, start);
+    return ret;
+}
+
+ssize_t file_pread(struct fsfile *f, void *buf, size_t cnt, uint64_t offset) {
+    struct superblock* sb = f->sb;
+    pthread_rwlock_t* lock = inode_lock(sb, f->blk);
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
+    pthread_rwlock_rdlock(lock);
+    file_refresh(f);
+    if (offset >= f->size) cnt = 0;
+    else if (cnt > f->size - offset) cnt = f->size - offset;
+
+    if (f->isinline) {
+        struct inode* file_node = retrieve_inode(sb, f->blk);
+        memcpy(buf, (char*) file_node->links + offset, cnt);
+        release_block(sb, file_node);
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        return cnt;
     }
-    struct nodeinfo* metadata = retrieve_nodeinfo(sb, ref_node->meta);
-    metadata->size += (ref_node->mode == IMDIR) ? 1 : nbytes;
-    save_nodeinfo(sb, metadata, ref_node->meta);
 
-    free(ref_node);
-    free(metadata);
+    ssize_t ret = cnt;
+    if (f->iszip) ret = file_read_zip(f, (char*) buf, cnt, offset);
+    else file_read_range(f, (char*) buf, cnt, offset);
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return ret;
 }
 
-void free_file_data_blocks(struct superblock* sb, uint64_t file_block) {
-    struct inode* file_node = retrieve_inode(sb, file_block);
-    struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+ssize_t fs_file_pwrite(struct fsfile *f, const void *buf, size_t cnt, uint64_t offset) {
+    uint64_t start = stats_clock();
+    ssize_t ret = file_pwrite(f, buf, cnt, offset);
+    stats_op(f->sb, FS_OP_FILE_PWRITE, start);
+    return ret;
+}
 
-    for(int link_index = 0; file_node->links[link_index] != 0; link_index++) {
-        fs_put_block(sb, file_node->links[link_index]);
+ssize_t file_pwrite(struct fsfile *f, const void *buf, size_t cnt, uint64_t offset) {
+    struct superblock* sb = f->sb;
+    if (view_readonly(sb) < 0) return -1;
+    if (cnt == 0) return 0;
+    //blocks past the end are new, and never copied for a snapshot
+    uint64_t shared = (offset + cnt < f->size) ? offset + cnt : f->size;
+    shared = (offset < shared) ? (shared - 1) / sb->blksz - offset / sb->blksz + 1 : 0;
+    if (snap_reserve(sb, shared) < 0) return -1;
+    journal_op_begin(sb);
+    pthread_rwlock_t* lock = inode_lock(sb, f->blk);
+    pthread_rwlock_rdlock(&sb->state->locks->ns);
+    pthread_rwlock_wrlock(lock);
+    file_refresh(f);
+
+    uint64_t end = offset + cnt;
+    if ((f->isinline || f->nblocks == 0) && end <= get_inline_capacity(sb)) {
+        //still small enough to stay in the inode; the gap is already zeros
+        write_inline(sb, f->blk, (const char*) buf, cnt, offset);
+        f->isinline = 1;
+        if (end > f->size) f->size = end;
+        f->gen = ++(*inode_gen(sb, f->blk));
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        return cnt;
+    }
+    if ((f->isinline && file_uninline(f) < 0) || (f->iszip && file_unzip(f) < 0)) {
+        int err = f->iszip ? errno : ENOSPC;
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = err;
+        return -1;
+    }
+
+    uint64_t size = f->size;
+    uint64_t nblocks = f->nblocks;
+    uint64_t hole = (offset > f->size) ? f->size : offset;
+    uint64_t need = (end + sb->blksz - 1) / sb->blksz;
+    if (need > f->nblocks && file_reserve(f, need - f->nblocks) < 0) {
+        pthread_rwlock_unlock(lock);
+        pthread_rwlock_unlock(&sb->state->locks->ns);
+        errno = ENOSPC;
+        return -1;
     }
-    uint64_t next_blk = file_node->next;
 
-    while (next_blk != 0) {
-        struct inode* node = retrieve_inode(sb, next_blk);
-        for(int link_index = 0; node->links[link_index] != 0; link_index++) {
-            fs_put_block(sb, node->links[link_index]);
+    //zero the gap between the old end of the file and =offset
+    if (hole < offset) {
+        size_t zsz = (offset - hole < 64 * sb->blksz) ? offset - hole : 64 * sb->blksz;
+        char* zeros = (char*) calloc(1, zsz);
+        while (hole < offset) {
+            size_t nbytes = (offset - hole < zsz) ? offset - hole : zsz;
+            file_write_range(f, zeros, nbytes, hole);
+            hole += nbytes;
         }
-        uint64_t curr_blk = next_blk;
-        next_blk = node->next;
-        fs_put_block(sb, curr_blk);
-        free(node);
+        free(zeros);
     }
-    file_node->next = 0;
-    save_inode(sb, file_node, file_block);
+    file_write_range(f, (const char*) buf, cnt, offset);
 
-    file_info->size = 0;
-    save_nodeinfo(sb, file_info, file_node->meta);
-    
-    free(file_node);
-    free(file_info);
+    if (end > f->size) {
+        f->size = end;
+        struct inode* file_node = retrieve_inode(sb, f->blk);
+        struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+        file_info->size = end;
+        save_nodeinfo(sb, file_info, file_node->meta);
+        release_block(sb, file_node);
+        release_nodeinfo(sb, file_info);
+    }
+
+    //other handles on the file must reload its map and size
+    if (need > nblocks || end > size) f->gen = ++(*inode_gen(sb, f->blk));
+    pthread_rwlock_unlock(lock);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    return cnt;
 }
 
-uint64_t create_entity(struct superblock* sb, uint64_t parent_blk, const char* ename, uint64_t mode) {
-    uint64_t info_blk = fs_get_block(sb);
-    struct nodeinfo* info = (struct nodeinfo*) calloc(1, sb->blksz);
-    info->size = 0;
-    strcpy(info->name, ename);
-    save_nodeinfo(sb, info, info_blk);
-    
-    uint64_t e_blk = fs_get_block(sb);
-    struct inode *e_node = (struct inode*) calloc(1, sb->blksz);
-    e_node->mode = mode;
-    e_node->parent = parent_blk;
-    e_node->meta = info_blk;
-    e_node->next = 0;
-    e_node->links[0] = 0;
-    save_inode(sb, e_node, e_blk);
+ssize_t fs_file_read(struct fsfile *f, void *buf, size_t cnt) {
+    ssize_t ret = fs_file_pread(f, buf, cnt, f->pos);
+    if (ret > 0) f->pos += ret;
+    return ret;
+}
 
-    link_node_to_nodelist(sb, parent_blk, e_blk, 0); 
+ssize_t fs_file_write(struct fsfile *f, const void *buf, size_t cnt) {
+    ssize_t ret = fs_file_pwrite(f, buf, cnt, f->pos);
+    if (ret > 0) f->pos += ret;
+    return ret;
+}
 
-    free(e_node);
-    free(info);
-    return e_blk;
+int64_t fs_file_seek(struct fsfile *f, int64_t offset, int whence) {
+    int64_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = f->pos; break;
+        case SEEK_END: base = f->size; break;
+        default: errno = EINVAL; return -1;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = base + offset;
+    return f->pos;
 }
 
-void write_to_file(struct superblock *sb, uint64_t file_blk, char *buf, size_t buf_sz) { 
-    size_t cnt = 0;
-    while (cnt + sb->blksz < buf_sz) {
-        uint64_t blk = fs_get_block(sb);
-        lseek(sb->fd, blk * sb->blksz, SEEK_SET);
-	    write(sb->fd, buf, sb->blksz);
-        link_node_to_nodelist(sb, file_blk, blk, sb->blksz);
+uint64_t fs_file_size(struct fsfile *f) {
+    return f->size;
+}
 
-        cnt += sb->blksz;
-        buf += sb->blksz;
-    }
+int fs_fsck(struct superblock *sb, int nthreads, FILE *log, struct fsck_report *report) {
+    struct fsck* ck = fs_fsck_begin(sb, nthreads, log);
+    if (ck == NULL) return -1;
+    return fs_fsck_end(ck, report);
+}
 
-    //remaining data
-    size_t left_over = buf_sz - cnt;
-    if (left_over != 0) {
-        uint64_t blk = fs_get_block(sb);
-        lseek(sb->fd, blk * sb->blksz, SEEK_SET);
-	    write(sb->fd, buf, left_over);
-        link_node_to_nodelist(sb, file_blk, blk, left_over);
+struct fsck * fs_fsck_begin(struct superblock *sb, int nthreads, FILE *log) {
+    if (sb->state->cache->live != NULL) {
+        //a snapshot is checked along with its image
+        errno = EINVAL;
+        return NULL;
+    }
+    struct fsck* ck = (struct fsck*) calloc(1, sizeof(struct fsck));
+    if (ck == NULL) return NULL;
+    ck->use = (unsigned char*) malloc(sb->blks);
+    ck->super = (struct superblock*) malloc(sb->blksz);
+    if (ck->use == NULL || ck->super == NULL) {
+        free(ck->use);
+        free(ck->super);
+        free(ck);
+        errno = ENOMEM;
+        return NULL;
     }
+
+    if (nthreads < 1) nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > FSCK_MAX_THREADS) nthreads = FSCK_MAX_THREADS;
+    ck->sb = sb;
+    ck->log = log;
+    ck->nthreads = nthreads;
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+    fsck_reset(ck);
+    return ck;
 }
 
-void unlink_node(struct superblock* sb, uint64_t dir_blk, uint64_t blk_to_unlink) {
-    struct inode *curr_node = (struct inode*) calloc(1, sb->blksz);
-    uint64_t curr_blk = dir_blk;
-    int entity_index = -1;
+int fs_fsck_step(struct fsck *ck, uint64_t budget) {
+    if (ck->phase == FSCK_DONE) return 0;
 
-find_inode_to_unlink:    
-    lseek(sb->fd, curr_blk * sb->blksz, SEEK_SET);
-    read(sb->fd, curr_node, sb->blksz);
-    
-    for (int index = 0; curr_node->links[index] != 0; index++) {
-        if (blk_to_unlink == curr_node->links[index]) {
-            entity_index = index;
-            break;
-        }
+    //the checker reads the image from disk, which must be up to date
+    pthread_rwlock_wrlock(&ck->sb->state->locks->ns);
+    cache_flush(ck->sb);
+    if (ck->gen != ck->sb->state->cache->gen) {
+        fsck_reset(ck);
+        ck->report.restarts++;
     }
 
-    //go to next inode in list
-    if (entity_index < 0 && curr_node->next != 0) {
-        curr_blk = curr_node->next;
-        goto find_inode_to_unlink; 
+    ck->budget = budget;
+    while (ck->phase != FSCK_DONE && ck->budget > 0) {
+        switch (ck->phase) {
+        case FSCK_START:
+            fsck_start(ck);
+            break;
+        case FSCK_FREELIST:
+            fsck_freelist(ck);
+            break;
+        case FSCK_TREE:
+            fsck_tree(ck);
+            break;
+        case FSCK_LEAKS:
+            fsck_leaks(ck);
+            break;
+        }
     }
-    
-    assert (entity_index >= 0);
+    pthread_rwlock_unlock(&ck->sb->state->locks->ns);
+    return ck->phase != FSCK_DONE;
+}
 
-    //shift the array tail, so empty spaces are always in the end
-    for (int ii = entity_index; curr_node->links[ii] != 0; ii++) {
-        curr_node->links[ii] = curr_node->links[ii + 1];
-    }
-    save_inode(sb, curr_node, curr_blk);
-    
-    if (curr_node->links[0] == 0 && curr_node->mode == IMCHILD) {
-        //this node does not have to exist anymore
-        struct inode* prev_node = retrieve_inode(sb, curr_node->meta);
-        prev_node->next = 0;
-        save_inode(sb, prev_node, curr_node->meta);
-        
-        fs_put_block(sb, prev_node->next);
-        free(prev_node);
-    }
-    
-    struct inode* dir_header_node = retrieve_inode(sb, dir_blk); 
-    struct nodeinfo* dir_info = retrieve_nodeinfo(sb, dir_header_node->meta);
-    dir_info->size--;
-    save_nodeinfo(sb, dir_info, dir_header_node->meta);
+int fs_fsck_end(struct fsck *ck, struct fsck_report *report) {
+    while (fs_fsck_step(ck, UINT64_MAX) > 0) {}
+    if (report != NULL) *report = ck->report;
+    int ret = ck->report.errors > 0 ? 1 : 0;
 
-    free(curr_node);
-    free(dir_header_node);
-    free(dir_info);
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    free(ck->stack);
+    free(ck->use);
+    free(ck->super);
+    free(ck);
+    return ret;
 }
 
-uint64_t get_file_size(struct superblock *sb, const char *fname) {
+/* fs_unlink and fs_rmdir, with =ns held exclusively. */
+int unlink_file(struct superblock* sb, const char* fname) {
     int full_match = 0;
     uint64_t file_blk = get_inode_block(sb, fname, &full_match, NULL);
     
@@ -779,14 +1953,4502 @@ uint64_t get_file_size(struct superblock *sb, const char *fname) {
         errno = ENOENT;
         return -1;
     }
+    if (is_dir_block(sb, file_blk)) {
+        errno = EISDIR;
+        return -1;
+    }
+    if (snap_reserve_removal(sb, file_blk) < 0) return -1;
+    
+    free_file_data_blocks(sb, file_blk);
 
     struct inode* file_node = retrieve_inode(sb, file_blk);
-    struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
- 
-    uint64_t filesz = file_info->size;
+    assert(file_node->next == 0);
+
+    //update parent dir
+    unlink_node(sb, file_node->parent, file_blk);
+    dcache_remove(sb, fname);
+
+    //remove inode root and metadata
+    if (!is_compact(sb)) fs_put_block(sb, file_node->meta);
+    fs_put_block(sb, file_blk);
+
+    release_block(sb, file_node);
+    return 0;
+}
+
+int remove_dir(struct superblock* sb, const char* dname) {
+    int full_match = 0;
+    uint64_t dir_blk = get_inode_block(sb, dname, &full_match, NULL);
+    
+    if (full_match == 0) {
+        //dir does not exist
+        errno = ENOENT;
+        return -1;
+    }
+    struct inode* dir_node = retrieve_inode(sb, dir_blk);
+    
+    if ((dir_node->mode & IMDIR) == 0) {
+        //node is a file
+        release_block(sb, dir_node);
+        errno = ENOTDIR;
+        return -1;
+    }
     
-    free(file_node);
-    free(file_info);
+    struct nodeinfo* dir_info = retrieve_nodeinfo(sb, dir_node->meta);
+    if (dir_info->size != 0) {
+        //node is a file
+        release_block(sb, dir_node);
+        release_nodeinfo(sb, dir_info);
+        errno = ENOTEMPTY;
+        return -1;
+    }
+    assert(dir_node->next == 0);
+    if (snap_reserve_removal(sb, dir_blk) < 0) {
+        release_block(sb, dir_node);
+        release_nodeinfo(sb, dir_info);
+        return -1;
+    }
 
-    return filesz;
+    //update parent dir
+    unlink_node(sb, dir_node->parent, dir_blk);
+    dirindex_drop(sb, dir_blk);
+    dirstreams_skip(sb, dir_blk, 0);
+    dcache_remove(sb, dname);
+
+    //remove node and metadata
+    if (!is_compact(sb)) fs_put_block(sb, dir_node->meta);
+    fs_put_block(sb, dir_blk);
+
+    release_block(sb, dir_node);
+    release_nodeinfo(sb, dir_info);
+    return 0;
+}
+
+/* Create the regular file =fname, whose lookup just failed, and return its
+ * head inode.  If another thread created =fname in the meantime, that
+ * entity is returned instead.  Returns zero and sets errno on failure, as
+ * get_parent_block and create_entity do.
+ *
+ * The nodeinfo, the inode (one block in a compact image) and =ndata
+ * blocks for the file's contents are taken as a single run when one is
+ * free, so that a small file ends up in adjacent blocks and reaches the
+ * disk with a single write.  =*data is set
+ * to the first of the =ndata blocks, or to zero if they were not
+ * reserved.  =*created, unless =created is NULL, is set if the file was
+ * created here rather than found. */
+uint64_t create_file(struct superblock* sb, const char* fname, uint64_t ndata, uint64_t* data, int* created) {
+    *data = 0;
+    if (created != NULL) *created = 0;
+    char name[NAME_MAX_LEN];
+    uint64_t dir_blk = get_parent_block(sb, fname, name);
+    if (dir_blk == 0) return 0;
+
+    pthread_rwlock_t* lock = inode_lock(sb, dir_blk);
+    pthread_rwlock_wrlock(lock);
+    uint64_t file_blk = dirindex_lookup(sb, dir_blk, name);
+    if (file_blk == 0) {
+        uint64_t nmeta = get_meta_blocks(sb);
+        uint64_t first = 0, run_len = 0;
+        if (get_free_blocks(sb) >= nmeta + 1 + ndata) {
+            first = fs_get_blocks(sb, nmeta + ndata, &run_len);
+            if (first != 0 && run_len < nmeta + ndata) {
+                //fragmented free space: allocate block by block instead
+                fs_put_blocks(sb, first, run_len);
+                first = 0;
+            }
+        }
+        file_blk = create_entity(sb, dir_blk, name, IMREG | IMEXTENT, first);
+        if (file_blk == 0 && first != 0) {
+            fs_put_blocks(sb, first, run_len);
+        } else if (first != 0 && ndata > 0) {
+            *data = first + nmeta;
+        }
+        if (file_blk != 0 && created != NULL) *created = 1;
+    }
+    pthread_rwlock_unlock(lock);
+    return file_blk;
+}
+
+/* Remove the file =fname, which write_file created as =file_blk but could
+ * not write.  Runs without =ns, which it takes exclusively like fs_unlink;
+ * the file is kept if another thread wrote to or replaced it in between.
+ * errno is preserved. */
+void remove_new_file(struct superblock* sb, const char* fname, uint64_t file_blk) {
+    int err = errno;
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    int full_match = 0;
+    uint64_t blk = get_inode_block(sb, fname, &full_match, NULL);
+    if (full_match != 0 && blk == file_blk && !is_dir_block(sb, blk)) {
+        struct inode* file_node = retrieve_inode(sb, file_blk);
+        struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+        int empty = file_info->size == 0 && file_node->links[0] == 0;
+        release_block(sb, file_node);
+        release_nodeinfo(sb, file_info);
+        if (empty) unlink_file(sb, fname);
+    }
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+    errno = err;
+}
+
+void locks_init(struct superblock* sb) {
+    struct fslocks* locks = (struct fslocks*) calloc(1, sizeof(struct fslocks));
+    //a steady stream of readers must not starve unlinks and commits
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&locks->ns, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    pthread_mutex_init(&locks->alloc, NULL);
+    pthread_mutex_init(&locks->dirs_lock, NULL);
+    for (int ii = 0; ii < INODE_LOCK_STRIPES; ii++) {
+        pthread_rwlock_init(&locks->inodes[ii], NULL);
+    }
+    sb->state->locks = locks;
+}
+
+void locks_destroy(struct superblock* sb) {
+    struct fslocks* locks = sb->state->locks;
+    pthread_rwlock_destroy(&locks->ns);
+    pthread_mutex_destroy(&locks->alloc);
+    pthread_mutex_destroy(&locks->dirs_lock);
+    for (int ii = 0; ii < INODE_LOCK_STRIPES; ii++) {
+        pthread_rwlock_destroy(&locks->inodes[ii]);
+    }
+    free(locks);
+    sb->state->locks = NULL;
+}
+
+pthread_rwlock_t* inode_lock(struct superblock* sb, uint64_t block) {
+    return &sb->state->locks->inodes[block % INODE_LOCK_STRIPES];
+}
+
+/* Generation of the stripe of =block, guarded by its inode_lock.  Open
+ * handles reload their extent map when it changes. */
+uint64_t* inode_gen(struct superblock* sb, uint64_t block) {
+    return &sb->state->locks->gens[block % INODE_LOCK_STRIPES];
+}
+
+/* Free blocks that allocations may still hand out: =freeblks less what
+ * alloc_blocks leaves for the snapshots' copies. */
+uint64_t get_free_blocks(struct superblock* sb) {
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    uint64_t held = snap_held(sb, SNAPSHOT_OP_BLOCKS);
+    uint64_t freeblks = (sb->freeblks > held) ? sb->freeblks - held : 0;
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+    return freeblks;
+}
+
+static const char* stats_opnames[FS_NOPS] = {
+    "write_file", "read_file", "unlink", "mkdir", "rmdir", "list_dir",
+    "opendir", "readdir", "stat", "file_open", "file_pread", "file_pwrite",
+    "sync"
+};
+
+void stats_init(struct superblock* sb) {
+    sb->state->stats = (struct fs_stats*) calloc(1, sizeof(struct fs_stats));
+}
+
+void stats_destroy(struct superblock* sb) {
+    free(sb->state->stats);
+    sb->state->stats = NULL;
+}
+
+/* Counters are shared by every thread using the image; relaxed atomic
+ * adds keep them exact without ordering anything else. */
+void stats_add(uint64_t* counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Count a transfer of =bytes to (=write set) or from the image, made with
+ * =requests system calls or io_uring entries.  Failed calls count as
+ * requests only. */
+void stats_io(struct superblock* sb, int write, ssize_t bytes, uint64_t requests) {
+    struct fs_stats* st = sb->state->stats;
+    stats_add(&st->io_requests, requests);
+    if (bytes <= 0) return;
+    uint64_t blocks = (bytes + sb->blksz - 1) / sb->blksz;
+    stats_add(write ? &st->blk_writes : &st->blk_reads, blocks);
+    stats_add(write ? &st->bytes_written : &st->bytes_read, bytes);
+}
+
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count a call to the public operation =op that began at =start. */
+void stats_op(struct superblock* sb, int op, uint64_t start) {
+    stats_add(&sb->state->stats->ops[op].calls, 1);
+    stats_add(&sb->state->stats->ops[op].nsecs, stats_clock() - start);
+}
+
+void fs_stats_get(struct superblock *sb, struct fs_stats *st) {
+    uint64_t* src = (uint64_t*) sb->state->stats;
+    uint64_t* dst = (uint64_t*) st;
+    for (size_t ii = 0; ii < sizeof(struct fs_stats) / sizeof(uint64_t); ii++) {
+        dst[ii] = __atomic_load_n(&src[ii], __ATOMIC_RELAXED);
+    }
+}
+
+void fs_stats_reset(struct superblock *sb) {
+    uint64_t* ctr = (uint64_t*) sb->state->stats;
+    for (size_t ii = 0; ii < sizeof(struct fs_stats) / sizeof(uint64_t); ii++) {
+        __atomic_store_n(&ctr[ii], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void fs_stats_dump(struct superblock *sb, FILE *out) {
+    struct fs_stats st;
+    fs_stats_get(sb, &st);
+    uint64_t lookups = st.cache_hits + st.cache_misses;
+
+    fprintf(out, "read %" PRIu64 " blocks (%" PRIu64 " bytes), wrote %" PRIu64
+            " blocks (%" PRIu64 " bytes) in %" PRIu64 " requests\n",
+            st.blk_reads, st.bytes_read, st.blk_writes, st.bytes_written, st.io_requests);
+    fprintf(out, "cache %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hits)\n",
+            st.cache_hits, st.cache_misses, lookups ? 100.0 * st.cache_hits / lookups : 0.0);
+    fprintf(out, "allocator %" PRIu64 " calls, %" PRIu64 " blocks allocated, %" PRIu64 " freed\n",
+            st.alloc_calls, st.blk_allocs, st.blk_frees);
+    if (st.journal_commits != 0 || st.journal_overflows != 0) {
+        fprintf(out, "journal %" PRIu64 " commits, %" PRIu64 " too large and written in place\n",
+                st.journal_commits, st.journal_overflows);
+    }
+    for (int op = 0; op < FS_NOPS; op++) {
+        if (st.ops[op].calls == 0) continue;
+        fprintf(out, "%-12s %10" PRIu64 " calls %12.3f ms %10.2f us/call\n",
+                stats_opnames[op], st.ops[op].calls, st.ops[op].nsecs / 1e6,
+                st.ops[op].nsecs / 1e3 / st.ops[op].calls);
+    }
+}
+
+/* fs_get_blocks, with =alloc held. */
+uint64_t alloc_blocks(struct superblock* sb, uint64_t count, uint64_t* nblocks) {
+    stats_add(&sb->state->stats->alloc_calls, 1);
+    *nblocks = 0;
+    uint64_t held = snap_held(sb, SNAPSHOT_OP_BLOCKS);
+    if (sb->freeblks <= held || count == 0) {
+        return 0;
+    }
+    if (count > sb->freeblks - held) count = sb->freeblks - held;
+
+    uint64_t block;
+    struct freepage* fp = retrieve_freepage(sb, sb->freelist);
+
+    if (fp->count == 0) {
+        //no extents left in the first freepage, so hand out the page itself;
+        //the committed image may still read it as a freepage
+        block = sb->freelist;
+        sb->freelist = fp->next;
+        *nblocks = 1;
+        journal_note_free(sb, block, 1);
+    } else {
+        //first extent that fits the whole run, otherwise the longest one
+        uint64_t best = 0;
+        for (uint64_t ii = 0; ii < fp->count; ii++) {
+            if (fp->links[2 * ii + 1] >= count) {
+                best = ii;
+                break;
+            }
+            if (fp->links[2 * ii + 1] > fp->links[2 * best + 1]) best = ii;
+        }
+
+        block = fp->links[2 * best];
+        *nblocks = (fp->links[2 * best + 1] < count) ? fp->links[2 * best + 1] : count;
+        fp->links[2 * best] += *nblocks;
+        fp->links[2 * best + 1] -= *nblocks;
+        if (fp->links[2 * best + 1] == 0) {
+            freepage_remove_extent(fp, best);
+        }
+        save_freepage(sb, fp, sb->freelist);
+    }
+    release_block(sb, fp);
+
+    sb->freeblks -= *nblocks;
+    stats_add(&sb->state->stats->blk_allocs, *nblocks);
+    save_superblock(sb);
+
+    //no snapshot has seen the new blocks: they can be written in place
+    struct snapstate* snap = sb->state->cache->snap;
+    if (snap != NULL && snap->nsnaps > 0) {
+        pthread_mutex_lock(&sb->state->cache->lock);
+        fresh_add(snap, block, *nblocks);
+        pthread_mutex_unlock(&sb->state->cache->lock);
+    }
+    return block;
+}
+
+int free_blocks(struct superblock* sb, uint64_t block, uint64_t nblocks) {
+    if (nblocks == 0) {
+        return 0;
+    }
+    sb->freeblks += nblocks;
+    stats_add(&sb->state->stats->blk_frees, nblocks);
+    save_superblock(sb);
+    journal_note_free(sb, block, nblocks);
+
+    if (sb->freelist == 0) {
+        //the free list is empty, the first block becomes its only page
+        struct freepage* fp = (struct freepage*) new_block(sb, block);
+        fp->next = 0;
+        fp->count = 0;
+        save_freepage(sb, fp, block);
+        release_block(sb, fp);
+
+        sb->freelist = block;
+        block++;
+        nblocks--;
+        if (nblocks == 0) return 0;
+    }
+
+    struct freepage* fp = retrieve_freepage(sb, sb->freelist);
+    if (freepage_merge_extent(fp, block, nblocks)) {
+        save_freepage(sb, fp, sb->freelist);
+        release_block(sb, fp);
+        return 0;
+    }
+    if (fp->count < get_max_extents_in_freepage(sb)) {
+        fp->links[2 * fp->count] = block;
+        fp->links[2 * fp->count + 1] = nblocks;
+        fp->count++;
+        save_freepage(sb, fp, sb->freelist);
+        release_block(sb, fp);
+        return 0;
+    }
+    release_block(sb, fp);
+
+    //the first freepage is full: the run's first block becomes the new one
+    fp = (struct freepage*) new_block(sb, block);
+    fp->next = sb->freelist;
+    fp->count = 0;
+    if (nblocks > 1) {
+        fp->links[0] = block + 1;
+        fp->links[1] = nblocks - 1;
+        fp->count = 1;
+    }
+    save_freepage(sb, fp, block);
+    release_block(sb, fp);
+    sb->freelist = block;
+
+    return 0;
+}
+
+int cache_init(struct superblock* sb, int mode) {
+    struct blkcache* cache = (struct blkcache*) calloc(1, sizeof(struct blkcache));
+    sb->state->cache = cache;
+    zcache_init(sb);
+
+    if (mode == FS_IO_MMAP) {
+        cache->mapsz = sb->blks * sb->blksz;
+        cache->map = mmap(NULL, cache->mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, sb->state->fd, 0);
+        if (cache->map == MAP_FAILED) {
+            zcache_destroy(sb);
+            free(cache);
+            sb->state->cache = NULL;
+            return -1;
+        }
+        pthread_mutex_init(&cache->lock, NULL);
+        pthread_cond_init(&cache->cond, NULL);
+        return 0;
+    }
+
+    for (int ii = 0; ii < CACHE_SLOTS; ii++) {
+        struct cacheblk* slot = (struct cacheblk*) calloc(1, sizeof(struct cacheblk) + sb->blksz);
+        slot->next = cache->head;
+        if (cache->head != NULL) cache->head->prev = slot;
+        else cache->tail = slot;
+        cache->head = slot;
+    }
+    cache->nslots = CACHE_SLOTS;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    if (mode == FS_IO_URING) {
+        cache->ring = uring_setup();
+    }
+    return 0;
+}
+
+void cache_destroy(struct superblock* sb) {
+    if (sb->state->cache->map != NULL) {
+        munmap(sb->state->cache->map, sb->state->cache->mapsz);
+    }
+    struct cacheblk* slot = sb->state->cache->head;
+    while (slot != NULL) {
+        struct cacheblk* next = slot->next;
+        free(slot);
+        slot = next;
+    }
+    if (sb->state->cache->ring != NULL) {
+        uring_teardown(sb->state->cache->ring);
+    }
+    if (sb->state->cache->snap != NULL) {
+        snap_destroy(sb->state->cache->snap);
+    }
+    zcache_destroy(sb);
+    pthread_mutex_destroy(&sb->state->cache->lock);
+    pthread_cond_destroy(&sb->state->cache->cond);
+    free(sb->state->cache->freed);
+    free(sb->state->cache);
+    sb->state->cache = NULL;
+}
+
+void lru_unlink(struct blkcache* cache, struct cacheblk* slot) {
+    if (slot->prev != NULL) slot->prev->next = slot->next;
+    else cache->head = slot->next;
+    if (slot->next != NULL) slot->next->prev = slot->prev;
+    else cache->tail = slot->prev;
+    slot->prev = slot->next = NULL;
+}
+
+void lru_push_front(struct blkcache* cache, struct cacheblk* slot) {
+    slot->next = cache->head;
+    if (cache->head != NULL) cache->head->prev = slot;
+    else cache->tail = slot;
+    cache->head = slot;
+}
+
+void hash_remove(struct blkcache* cache, struct cacheblk* slot) {
+    struct cacheblk** pp = &cache->buckets[slot->block % CACHE_BUCKETS];
+    while (*pp != slot) pp = &(*pp)->hnext;
+    *pp = slot->hnext;
+    slot->hnext = NULL;
+}
+
+struct cacheblk* cache_lookup(struct blkcache* cache, uint64_t block) {
+    struct cacheblk* slot = cache->buckets[block % CACHE_BUCKETS];
+    while (slot != NULL && slot->block != block) slot = slot->hnext;
+    return slot;
+}
+
+/* Return the slot holding =block, moving it to the front of the LRU list.
+ * Called with the cache lock held, which is dropped while blocks are read
+ * or written back; slots being read or written are marked =loading or
+ * =writing, and whoever looks them up meanwhile waits, so that nobody
+ * changes a block while it is on its way to the disk.  On a miss the
+ * least recently used unpinned slot is recycled (writing it back first if
+ * dirty, see cache_writeback) and, if =fill is set, loaded from disk.
+ * With a journal, dirty slots count as pinned until they are committed,
+ * except those holding delayed file data; so do dirty blocks that a
+ * snapshot still needs, until they are copied.
+ * When every slot is pinned the cache grows by one slot.  Past
+ * CACHE_MAX_SLOTS it first waits up to CACHE_WAIT_MSECS for a slot to be
+ * released: the pins may belong to threads that wait for a lock the caller
+ * holds, so it cannot wait for good.  cache_flush gives the extra slots
+ * back. */
+struct cacheblk* cache_slot(struct superblock* sb, uint64_t block, int fill) {
+    struct blkcache* cache = sb->state->cache;
+    assert(block != 0 && block < sb->blks);
+
+    struct cacheblk* slot;
+    int waited = 0;
+    for (;;) {
+        slot = cache_lookup(cache, block);
+        if (slot != NULL && (slot->loading || slot->writing)) {
+            pthread_cond_wait(&cache->cond, &cache->lock);
+            continue;
+        }
+        if (slot != NULL) {
+            stats_add(&sb->state->stats->cache_hits, 1);
+            lru_unlink(cache, slot);
+            lru_push_front(cache, slot);
+            return slot;
+        }
+
+        int pinned = 0;
+        for (slot = cache->tail; slot != NULL; slot = slot->prev) {
+            if (slot->refcnt > 0) {
+                pinned = 1;
+                continue;
+            }
+            if (slot->dirty && snap_unsaved(cache, slot)) continue;
+            if (cache->jlen == 0 || slot->dirty == 0 || slot->isdata) break;
+        }
+        if (slot == NULL && pinned && cache->nslots >= CACHE_MAX_SLOTS && !waited) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += CACHE_WAIT_MSECS * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&cache->cond, &cache->lock, &until);
+            waited = 1;
+            continue;
+        }
+        if (slot == NULL) {
+            slot = (struct cacheblk*) calloc(1, sizeof(struct cacheblk) + sb->blksz);
+            cache->nslots++;
+            break;
+        }
+        if (slot->block != 0 && slot->dirty) {
+            //the lock is dropped while writing: =block may be loaded and
+            //the slot taken in the meantime, so start over
+            cache_writeback(sb);
+            continue;
+        }
+        if (slot->block != 0) {
+            if (slot->isdata) __atomic_add_fetch(&cache->evicted, 1, __ATOMIC_RELEASE);
+            hash_remove(cache, slot);
+        }
+        lru_unlink(cache, slot);
+        break;
+    }
+
+    slot->block = block;
+    slot->dirty = 0;
+    slot->isdata = 0;
+    slot->raw = 0;
+    slot->hnext = cache->buckets[block % CACHE_BUCKETS];
+    cache->buckets[block % CACHE_BUCKETS] = slot;
+    lru_push_front(cache, slot);
+
+    if (fill) {
+        stats_add(&sb->state->stats->cache_misses, 1);
+        slot->loading = 1;
+        slot->refcnt++;
+        pthread_mutex_unlock(&cache->lock);
+        if (cache->live != NULL) view_read(sb, block, slot->data, sb->blksz);
+        else stats_io(sb, 0, pread(sb->state->fd, slot->data, sb->blksz, block * sb->blksz), 1);
+        pthread_mutex_lock(&cache->lock);
+        slot->refcnt--;
+        slot->loading = 0;
+        pthread_cond_broadcast(&cache->cond);
+    }
+    return slot;
+}
+
+/* Drop =block from the cache without writing it back, so that a later
+ * access reads it from disk.  Used when a block is rewritten directly. */
+void cache_drop(struct superblock* sb, uint64_t block) {
+    struct blkcache* cache = sb->state->cache;
+    if (cache->map != NULL) return;
+
+    pthread_mutex_lock(&cache->lock);
+    struct cacheblk* slot = cache_lookup(cache, block);
+    while (slot != NULL && (slot->loading || slot->writing)) {
+        //the old contents must not land after the caller's write
+        pthread_cond_wait(&cache->cond, &cache->lock);
+        slot = cache_lookup(cache, block);
+    }
+    if (slot == NULL || slot->refcnt > 0) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    hash_remove(cache, slot);
+    slot->block = 0;
+    if (slot->dirty && !slot->isdata) cache->ndirty--;
+    slot->dirty = 0;
+    slot->isdata = 0;
+    lru_unlink(cache, slot);
+    slot->prev = cache->tail;
+    if (cache->tail != NULL) cache->tail->next = slot;
+    else cache->head = slot;
+    cache->tail = slot;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Free the least recently used unpinned slots beyond CACHE_SLOTS, which
+ * cache_slot added while every slot was pinned.  Called with the cache
+ * lock held, once every slot is clean. */
+void cache_trim(struct blkcache* cache) {
+    struct cacheblk* slot = cache->tail;
+    while (cache->nslots > CACHE_SLOTS && slot != NULL) {
+        struct cacheblk* prev = slot->prev;
+        if (slot->refcnt == 0 && !slot->dirty) {
+            if (slot->isdata) __atomic_add_fetch(&cache->evicted, 1, __ATOMIC_RELEASE);
+            if (slot->block != 0) hash_remove(cache, slot);
+            lru_unlink(cache, slot);
+            free(slot);
+            cache->nslots--;
+        }
+        slot = prev;
+    }
+}
+
+int cmp_slot_block(const void* a, const void* b) {
+    uint64_t ba = (*(struct cacheblk* const*) a)->block;
+    uint64_t bb = (*(struct cacheblk* const*) b)->block;
+    return (ba > bb) - (ba < bb);
+}
+
+/* Write every dirty block back to the image, through the journal if there
+ * is one, after copying what the snapshots need (see snap_flush).  Dirty
+ * blocks are sorted by block number and runs of adjacent blocks go out in
+ * a single pwritev. */
+void cache_flush(struct superblock* sb) {
+    struct blkcache* cache = sb->state->cache;
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    struct snapstate* snap = cache->snap;
+    if (snap != NULL) {
+        pthread_rwlock_wrlock(&snap->lock);
+        if (snap_flush(sb) < 0) __atomic_store_n(&cache->werr, ENOSPC, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->map != NULL) {
+        if (cache->sb_dirty) superblock_image(sb, cache->map);
+        cache->sb_dirty = 0;
+        pthread_mutex_unlock(&cache->lock);
+        if (snap != NULL) pthread_rwlock_unlock(&snap->lock);
+        pthread_mutex_unlock(&sb->state->locks->alloc);
+        return;
+    }
+
+    //writebacks still running must land before the log and the sync
+    while (cache->writing > 0) pthread_cond_wait(&cache->cond, &cache->lock);
+    //blocks that snap_flush could not copy stay dirty, see struct snapstate
+    struct cacheblk** dirty = (struct cacheblk**) malloc(cache->nslots * sizeof(struct cacheblk*));
+    uint64_t ndirty = 0, kept = 0;
+    for (struct cacheblk* slot = cache->head; slot != NULL; slot = slot->next) {
+        if (slot->block != 0 && slot->dirty && slot->copy) {
+            kept++;
+        } else if (slot->block != 0 && slot->dirty) {
+            slot->dirty = 0;
+            dirty[ndirty++] = slot;
+        }
+    }
+    qsort(dirty, ndirty, sizeof(struct cacheblk*), cmp_slot_block);
+
+    if (cache->jlen > 0) {
+        //delayed file data goes in place before the log that refers to it
+        struct cacheblk** data = (struct cacheblk**) malloc((ndirty + 1) * sizeof(struct cacheblk*));
+        uint64_t ndata = 0, nmeta = 0;
+        for (uint64_t ii = 0; ii < ndirty; ii++) {
+            if (dirty[ii]->isdata) data[ndata++] = dirty[ii];
+            else dirty[nmeta++] = dirty[ii];
+        }
+        if (ndata > 0) {
+            write_dirty_blocks(sb, data, ndata);
+            cache->jsynced = 0;
+        }
+        free(data);
+        ndirty = nmeta;
+        journal_commit(sb, dirty, ndirty);
+    }
+
+    if (cache->sb_dirty) {
+        char* image = (char*) malloc(sb->blksz);
+        superblock_image(sb, image);
+        write_result(sb, pwrite(sb->state->fd, image, sb->blksz, 0), sb->blksz);
+        free(image);
+        cache->sb_dirty = 0;
+    }
+    write_dirty_blocks(sb, dirty, ndirty);
+    free(dirty);
+    cache->ndirty = kept;
+    cache_trim(cache);
+    pthread_mutex_unlock(&cache->lock);
+    if (snap != NULL) pthread_rwlock_unlock(&snap->lock);
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+}
+
+void write_dirty_blocks(struct superblock* sb, struct cacheblk** dirty, uint64_t ndirty) {
+    if (sb->state->cache->ring != NULL && !sb->state->cache->ring->broken) {
+        uring_write_blocks(sb, dirty, ndirty);
+        return;
+    }
+    struct iovec iov[IOV_MAX];
+    uint64_t ii = 0;
+    while (ii < ndirty) {
+        uint64_t first = dirty[ii]->block;
+        int niov = 0;
+        while (ii < ndirty && niov < IOV_MAX && dirty[ii]->block == first + niov) {
+            iov[niov].iov_base = dirty[ii]->data;
+            iov[niov].iov_len = sb->blksz;
+            niov++;
+            ii++;
+        }
+        write_result(sb, pwritev(sb->state->fd, iov, niov, first * sb->blksz), niov * sb->blksz);
+    }
+}
+
+/* Count a write of =len bytes to the image that returned =ret, and keep
+ * its errno in =werr if it failed; a short write counts as EIO. */
+void write_result(struct superblock* sb, ssize_t ret, size_t len) {
+    stats_io(sb, 1, ret, 1);
+    if (ret < 0 || (size_t) ret != len) {
+        __atomic_store_n(&sb->state->cache->werr, (ret < 0) ? errno : EIO, __ATOMIC_RELAXED);
+    }
+}
+
+/* Write back every unpinned dirty slot that may go in place (with a
+ * journal, only those holding delayed file data; never the blocks that a
+ * snapshot still needs) as sorted runs.  Called
+ * with the cache lock held when a dirty slot is about to be recycled, so
+ * the slots around it, and the data of small files along with their
+ * metadata, go out in the same writes.  The lock is dropped during the
+ * writes; the slots stay pinned and marked =writing until they are done,
+ * and cache_flush waits for them. */
+void cache_writeback(struct superblock* sb) {
+    struct blkcache* cache = sb->state->cache;
+    struct cacheblk** dirty = (struct cacheblk**) malloc(cache->nslots * sizeof(struct cacheblk*));
+    uint64_t ndirty = 0;
+    for (struct cacheblk* slot = cache->head; slot != NULL; slot = slot->next) {
+        if (slot->block == 0 || !slot->dirty || slot->refcnt > 0) continue;
+        if ((cache->jlen > 0 && !slot->isdata) || snap_unsaved(cache, slot)) continue;
+        if (!slot->isdata) cache->ndirty--;
+        slot->dirty = 0;
+        slot->writing = 1;
+        slot->refcnt++;
+        dirty[ndirty++] = slot;
+    }
+    qsort(dirty, ndirty, sizeof(struct cacheblk*), cmp_slot_block);
+    cache->writing++;
+    pthread_mutex_unlock(&cache->lock);
+    write_dirty_blocks(sb, dirty, ndirty);
+    pthread_mutex_lock(&cache->lock);
+    for (uint64_t ii = 0; ii < ndirty; ii++) {
+        dirty[ii]->writing = 0;
+        dirty[ii]->refcnt--;
+    }
+    cache->writing--;
+    pthread_cond_broadcast(&cache->cond);
+    free(dirty);
+}
+
+/* Return a pinned pointer to the contents of =block. */
+void* get_block(struct superblock* sb, uint64_t block) {
+    if (sb->state->cache->map != NULL) {
+        assert(block != 0 && block < sb->blks);
+        return sb->state->cache->map + block * sb->blksz;
+    }
+    pthread_mutex_lock(&sb->state->cache->lock);
+    struct cacheblk* slot = cache_slot(sb, block, 1);
+    slot->refcnt++;
+    pthread_mutex_unlock(&sb->state->cache->lock);
+    return slot->data;
+}
+
+/* Like get_block, but for a block that is about to be completely
+ * overwritten: the old contents are not read and the buffer is zeroed. */
+void* new_block(struct superblock* sb, uint64_t block) {
+    if (sb->state->cache->map != NULL) {
+        void* data = get_block(sb, block);
+        memset(data, 0, sb->blksz);
+        return data;
+    }
+    pthread_mutex_lock(&sb->state->cache->lock);
+    struct cacheblk* slot = cache_slot(sb, block, 0);
+    memset(slot->data, 0, sb->blksz);
+    slot->refcnt++;
+    pthread_mutex_unlock(&sb->state->cache->lock);
+    return slot->data;
+}
+
+void release_block(struct superblock* sb, void* data) {
+    if (sb->state->cache->map != NULL) return;
+    struct cacheblk* slot = (struct cacheblk*) ((char*) data - offsetof(struct cacheblk, data));
+    pthread_mutex_lock(&sb->state->cache->lock);
+    assert(slot->refcnt > 0);
+    slot->refcnt--;
+    if (slot->refcnt == 0 && sb->state->cache->nslots >= CACHE_MAX_SLOTS) pthread_cond_broadcast(&sb->state->cache->cond);
+    pthread_mutex_unlock(&sb->state->cache->lock);
+}
+
+/* Store =data as the new contents of =block.  =data may be the pinned
+ * buffer of =block itself, in which case only the dirty bit changes.
+ * =raw is set for blocks outside of the tree, which snapshots never need
+ * (see snap_flush). */
+void write_block(struct superblock* sb, uint64_t block, const void* data, int raw) {
+    pthread_mutex_lock(&sb->state->cache->lock);
+    sb->state->cache->gen++;
+    if (sb->state->cache->map != NULL) {
+        void* dst = get_block(sb, block);
+        if (dst != data) memcpy(dst, data, sb->blksz);
+    } else {
+        struct cacheblk* slot = cache_slot(sb, block, 0);
+        if (slot->data != data) memcpy(slot->data, data, sb->blksz);
+        if (slot->dirty == 0 || slot->isdata) sb->state->cache->ndirty++;
+        slot->dirty = 1;
+        slot->isdata = 0;
+        slot->raw = raw;
+        snap_mark(sb->state->cache, slot);
+    }
+    pthread_mutex_unlock(&sb->state->cache->lock);
+}
+
+/* File data does not go through the cache: it would only push metadata out.
+ * =nbytes may span several consecutive blocks starting at =block, which are
+ * then transferred with a single call.  Cached copies of those blocks are
+ * still preferred on reads, and dropped on writes. */
+void read_data_block(struct superblock* sb, uint64_t block, void* buf, size_t nbytes) {
+    if (sb->state->cache->map != NULL) {
+        memcpy(buf, get_block(sb, block), nbytes);
+        stats_io(sb, 0, nbytes, 0);
+        return;
+    }
+    if (sb->state->cache->live != NULL) {
+        view_read(sb, block, buf, nbytes);
+        return;
+    }
+
+    uint64_t evicted = __atomic_load_n(&sb->state->cache->evicted, __ATOMIC_ACQUIRE);
+    size_t done = 0;
+    while (done < nbytes) {
+        ssize_t ret = pread(sb->state->fd, (char*) buf + done, nbytes - done, block * sb->blksz + done);
+        stats_io(sb, 0, ret, 1);
+        if (ret <= 0) break;
+        done += ret;
+    }
+
+    overlay_cached_blocks(sb, block, buf, nbytes, evicted);
+}
+
+/* Copy over =buf the cached copies of any of the blocks that were just read
+ * from disk into it, since those may be newer.  =evicted is the value of
+ * the cache's =evicted counter from before the read: if a slot of delayed
+ * data was written back and recycled since, the read may have missed both
+ * copies, so the blocks are read again while no slot can go away. */
+void overlay_cached_blocks(struct superblock* sb, uint64_t block, char* buf, size_t nbytes, uint64_t evicted) {
+    pthread_mutex_lock(&sb->state->cache->lock);
+    if (sb->state->cache->evicted != evicted) {
+        size_t done = 0;
+        while (done < nbytes) {
+            ssize_t ret = pread(sb->state->fd, buf + done, nbytes - done, block * sb->blksz + done);
+            stats_io(sb, 0, ret, 1);
+            if (ret <= 0) break;
+            done += ret;
+        }
+    }
+    for (uint64_t ii = 0; ii * sb->blksz < nbytes; ii++) {
+        struct cacheblk* slot = cache_lookup(sb->state->cache, block + ii);
+        if (slot == NULL || slot->loading) continue;
+        size_t left = nbytes - ii * sb->blksz;
+        memcpy(buf + ii * sb->blksz, slot->data, (left < sb->blksz) ? left : sb->blksz);
+    }
+    pthread_mutex_unlock(&sb->state->cache->lock);
+}
+
+/* Queue a read of =nbytes bytes starting at =block into =buf, submitting
+ * the batch first if the run cannot be added to it. */
+void readbatch_add(struct superblock* sb, struct readbatch* rb, uint64_t block, char* buf, size_t nbytes) {
+    if (sb->state->cache->map != NULL || sb->state->cache->live != NULL) {
+        read_data_block(sb, block, buf, nbytes);
+        return;
+    }
+
+    uint64_t nblocks = (nbytes + sb->blksz - 1) / sb->blksz;
+    int ring = sb->state->cache->ring != NULL && !sb->state->cache->ring->broken;
+    if (rb->niov > 0) {
+        //the ring reads each run on its own, wherever it is on disk
+        int fits = ring ? rb->niov < IOV_MAX
+                : rb->tail == 0 && block >= rb->end && block - rb->end <= READ_GAP_BLOCKS
+                && rb->niov + 2 <= IOV_MAX;
+        if (!fits) readbatch_submit(sb, rb);
+    }
+
+    if (rb->niov == 0) {
+        rb->first = block;
+        rb->end = block;
+    } else if (block > rb->end && !ring) {
+        rb->iov[rb->niov].iov_base = rb->gap;
+        rb->iov[rb->niov].iov_len = (block - rb->end) * sb->blksz;
+        rb->iovblk[rb->niov] = 0;
+        rb->niov++;
+    }
+
+    struct iovec* last = (rb->niov > 0) ? &rb->iov[rb->niov - 1] : NULL;
+    if (last != NULL && rb->iovblk[rb->niov - 1] != 0 && block == rb->end && rb->tail == 0
+            && (char*) last->iov_base + last->iov_len == buf) {
+        //adjacent on disk and in memory: grow the last iovec
+        last->iov_len += nbytes;
+    } else {
+        rb->iov[rb->niov].iov_base = buf;
+        rb->iov[rb->niov].iov_len = nbytes;
+        rb->iovblk[rb->niov] = block;
+        rb->niov++;
+    }
+    rb->end = block + nblocks;
+    rb->tail = nbytes % sb->blksz;
+}
+
+void readbatch_submit(struct superblock* sb, struct readbatch* rb) {
+    if (rb->niov == 0) return;
+
+    uint64_t evicted = __atomic_load_n(&sb->state->cache->evicted, __ATOMIC_ACQUIRE);
+    struct uring* ring = sb->state->cache->ring;
+    if (ring != NULL && !ring->broken) {
+        int res[IOV_MAX];
+        pthread_mutex_lock(&ring->lock);
+        ring->res = res;
+        for (int ii = 0; ii < rb->niov; ii++) {
+            uring_queue(ring, IORING_OP_READ, sb->state->fd, rb->iov[ii].iov_base, rb->iov[ii].iov_len,
+                    rb->iovblk[ii] * sb->blksz, ii);
+        }
+        uring_wait(ring);
+        pthread_mutex_unlock(&ring->lock);
+
+        for (int ii = 0; ii < rb->niov; ii++) {
+            stats_io(sb, 0, res[ii], 1);
+            if (res[ii] < 0 || (size_t) res[ii] != rb->iov[ii].iov_len) {
+                read_data_block(sb, rb->iovblk[ii], rb->iov[ii].iov_base, rb->iov[ii].iov_len);
+            } else {
+                overlay_cached_blocks(sb, rb->iovblk[ii], rb->iov[ii].iov_base, rb->iov[ii].iov_len, evicted);
+            }
+        }
+        rb->niov = 0;
+        rb->tail = 0;
+        return;
+    }
+
+    size_t total = 0;
+    for (int ii = 0; ii < rb->niov; ii++) total += rb->iov[ii].iov_len;
+
+    ssize_t ret = preadv(sb->state->fd, rb->iov, rb->niov, rb->first * sb->blksz);
+    stats_io(sb, 0, ret, 1);
+    for (int ii = 0; ii < rb->niov; ii++) {
+        if (rb->iovblk[ii] == 0) continue;
+        if (ret < 0 || (size_t) ret < total) {
+            //short read: fall back to one read per run
+            read_data_block(sb, rb->iovblk[ii], rb->iov[ii].iov_base, rb->iov[ii].iov_len);
+        } else {
+            overlay_cached_blocks(sb, rb->iovblk[ii], rb->iov[ii].iov_base, rb->iov[ii].iov_len, evicted);
+        }
+    }
+    rb->niov = 0;
+    rb->tail = 0;
+}
+
+/* Set up a ring of URING_ENTRIES requests, or return NULL if the kernel
+ * does not support io_uring (or forbids it, or DCC605FS_NO_URING is set). */
+struct uring* uring_setup(void) {
+    if (getenv("DCC605FS_NO_URING") != NULL) {
+        errno = ENOSYS;
+        return NULL;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) return NULL;
+
+    struct uring* ring = (struct uring*) calloc(1, sizeof(struct uring));
+    ring->fd = fd;
+    ring->sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        //both rings live in one mapping
+        if (ring->cq_sz > ring->sq_sz) ring->sq_sz = ring->cq_sz;
+        ring->cq_sz = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_sz > 0) {
+        ring->cq_ring = mmap(NULL, ring->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_teardown(ring);
+        return NULL;
+    }
+
+    char* sq = (char*) ring->sq_ring;
+    char* cq = (char*) ring->cq_ring;
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    pthread_mutex_init(&ring->lock, NULL);
+    return ring;
+}
+
+void uring_teardown(struct uring* ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_sz > 0 && ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_sz);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_sz);
+    pthread_mutex_destroy(&ring->lock);
+    close(ring->fd);
+    free(ring);
+}
+
+/* Queue a read or write of =len bytes at =offset of =fd, with the ring
+ * lock held.  Its result goes to =res[=tag] once uring_wait returns; a
+ * request that never completes leaves -1 there.  =addr is a buffer, or an
+ * iovec array of =len entries for the vectored operations. */
+void uring_queue(struct uring* ring, int op, int fd, void* addr, size_t len, uint64_t offset, uint64_t tag) {
+    ring->res[tag] = -1;
+    if (len > INT_MAX || ring->broken) return;
+    if (ring->queued + ring->inflight == URING_ENTRIES) {
+        uring_wait(ring);
+    }
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/* Submit the queued requests and wait until every one has completed. */
+void uring_wait(struct uring* ring) {
+    while (ring->queued + ring->inflight > 0 && !ring->broken) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            //requests without a result are redone with pread/pwrite
+            ring->broken = 1;
+            break;
+        }
+        ring->queued -= ret;
+        ring->inflight += ret;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            ring->res[cqe->user_data] = cqe->res;
+            ring->inflight--;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* write_dirty_blocks through the ring: each run of adjacent blocks is one
+ * request, and all runs are written at once. */
+void uring_write_blocks(struct superblock* sb, struct cacheblk** dirty, uint64_t ndirty) {
+    struct uring* ring = sb->state->cache->ring;
+    struct iovec* iov = (struct iovec*) malloc((ndirty + 1) * sizeof(struct iovec));
+    uint64_t* runs = (uint64_t*) malloc(2 * (ndirty + 1) * sizeof(uint64_t));
+    int* res = (int*) malloc((ndirty + 1) * sizeof(int));
+
+    uint64_t nruns = 0;
+    uint64_t ii = 0;
+    while (ii < ndirty) {
+        uint64_t start = ii;
+        while (ii < ndirty && ii - start < IOV_MAX && dirty[ii]->block == dirty[start]->block + (ii - start)) {
+            iov[ii].iov_base = dirty[ii]->data;
+            iov[ii].iov_len = sb->blksz;
+            ii++;
+        }
+        runs[2 * nruns] = start;
+        runs[2 * nruns + 1] = ii - start;
+        nruns++;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    ring->res = res;
+    for (uint64_t rr = 0; rr < nruns; rr++) {
+        uint64_t start = runs[2 * rr];
+        uring_queue(ring, IORING_OP_WRITEV, sb->state->fd, &iov[start], runs[2 * rr + 1],
+                dirty[start]->block * sb->blksz, rr);
+    }
+    uring_wait(ring);
+    pthread_mutex_unlock(&ring->lock);
+
+    for (uint64_t rr = 0; rr < nruns; rr++) {
+        uint64_t start = runs[2 * rr];
+        uint64_t count = runs[2 * rr + 1];
+        stats_io(sb, 1, res[rr], 1);
+        if (res[rr] < 0 || (uint64_t) res[rr] != count * sb->blksz) {
+            write_result(sb, pwritev(sb->state->fd, &iov[start], count, dirty[start]->block * sb->blksz),
+                    count * sb->blksz);
+        }
+    }
+    free(res);
+    free(runs);
+    free(iov);
+}
+
+void write_data_block(struct superblock* sb, uint64_t block, const void* buf, size_t nbytes) {
+    if (sb->state->cache->map != NULL) {
+        memcpy(get_block(sb, block), buf, nbytes);
+        stats_io(sb, 1, nbytes, 0);
+        return;
+    }
+
+    uint64_t nblocks = (nbytes + sb->blksz - 1) / sb->blksz;
+    for (uint64_t ii = 0; ii < nblocks; ii++) {
+        if (!journal_is_freed(sb, block + ii) && !snap_unsaved_block(sb, block + ii)) continue;
+
+        //some block may still be in use in the committed image, or in a
+        //snapshot: go through the cache with them all
+        pthread_mutex_lock(&sb->state->cache->lock);
+        for (ii = 0; ii < nblocks; ii++) {
+            size_t left = nbytes - ii * sb->blksz;
+            struct cacheblk* slot = cache_slot(sb, block + ii, left < sb->blksz);
+            memcpy(slot->data, (const char*) buf + ii * sb->blksz, (left < sb->blksz) ? left : sb->blksz);
+            if (slot->dirty == 0 || slot->isdata) sb->state->cache->ndirty++;
+            slot->dirty = 1;
+            slot->isdata = 0;
+            slot->raw = 0;
+            snap_mark(sb->state->cache, slot);
+        }
+        pthread_mutex_unlock(&sb->state->cache->lock);
+        return;
+    }
+
+    for (uint64_t ii = 0; ii < nblocks; ii++) {
+        cache_drop(sb, block + ii);
+    }
+
+    size_t done = 0;
+    while (done < nbytes) {
+        ssize_t ret = pwrite(sb->state->fd, (const char*) buf + done, nbytes - done, block * sb->blksz + done);
+        stats_io(sb, 1, ret, 1);
+        if (ret <= 0) break;
+        done += ret;
+    }
+}
+
+/* Like write_data_block, but the blocks are only copied into dirty slots
+ * marked =isdata, to be written along with the metadata that refers to
+ * them on the next flush or writeback.  The rest of the last block is
+ * zeroed.  Blocks that a journal must log are written as write_data_block
+ * does. */
+void delay_data_block(struct superblock* sb, uint64_t block, const void* buf, size_t nbytes) {
+    struct blkcache* cache = sb->state->cache;
+    uint64_t nblocks = (nbytes + sb->blksz - 1) / sb->blksz;
+    int direct = cache->map != NULL;
+    for (uint64_t ii = 0; ii < nblocks && !direct; ii++) {
+        direct = journal_is_freed(sb, block + ii) || snap_unsaved_block(sb, block + ii);
+    }
+    if (direct) {
+        write_data_block(sb, block, buf, nbytes);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint64_t ii = 0; ii < nblocks; ii++) {
+        size_t left = nbytes - ii * sb->blksz;
+        size_t len = (left < sb->blksz) ? left : sb->blksz;
+        struct cacheblk* slot = cache_slot(sb, block + ii, 0);
+        memcpy(slot->data, (const char*) buf + ii * sb->blksz, len);
+        memset(slot->data + len, 0, sb->blksz - len);
+        if (slot->dirty && !slot->isdata) cache->ndirty--;
+        slot->dirty = 1;
+        slot->isdata = 1;
+        slot->raw = 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+struct inode* retrieve_inode(struct superblock* sb, uint64_t block) {
+    return (struct inode*) get_block(sb, block);
+}
+
+/* In a compact image =block is the head inode, and the nodeinfo returned
+ * points into it: it must be saved with save_nodeinfo and released with
+ * release_nodeinfo, which find the start of the block again. */
+struct nodeinfo* retrieve_nodeinfo(struct superblock* sb, uint64_t block) {
+    char* data = (char*) get_block(sb, block);
+    if (is_compact(sb)) data += sb->blksz - COMPACT_INFO_SIZE;
+    return (struct nodeinfo*) data;
+}
+
+void release_nodeinfo(struct superblock* sb, struct nodeinfo* ni) {
+    char* data = (char*) ni;
+    if (is_compact(sb)) data -= sb->blksz - COMPACT_INFO_SIZE;
+    release_block(sb, data);
+}
+
+struct freepage* retrieve_freepage(struct superblock* sb, uint64_t block) {
+    return (struct freepage*) get_block(sb, block);
+}
+
+/* Copy the superblock as it goes on disk, without its in-memory =state,
+ * to the =blksz bytes at =buf. */
+void superblock_image(struct superblock* sb, void* buf) {
+    memcpy(buf, sb, sb->blksz);
+    ((struct superblock*) buf)->state = NULL;
+}
+
+void save_superblock(struct superblock* sb) {
+    pthread_mutex_lock(&sb->state->cache->lock);
+    sb->state->cache->sb_dirty = 1;
+    sb->state->cache->gen++;
+    pthread_mutex_unlock(&sb->state->cache->lock);
+}
+
+void save_inode(struct superblock* sb, struct inode* node, uint64_t block) {
+    write_block(sb, block, node, 0);
+}
+
+void save_nodeinfo(struct superblock* sb, struct nodeinfo* ni, uint64_t block) {
+    char* data = (char*) ni;
+    if (is_compact(sb)) data -= sb->blksz - COMPACT_INFO_SIZE;
+    write_block(sb, block, data, 0);
+}
+
+void save_freepage(struct superblock* sb, struct freepage* fp, uint64_t block) {
+    write_block(sb, block, fp, 1);
+}
+
+
+uint64_t get_max_extents_in_freepage(struct superblock* sb) {
+    return (sb->blksz - sizeof(struct freepage)) / (2 * sizeof(uint64_t));
+}
+
+void freepage_remove_extent(struct freepage* fp, uint64_t index) {
+    fp->count--;
+    fp->links[2 * index] = fp->links[2 * fp->count];
+    fp->links[2 * index + 1] = fp->links[2 * fp->count + 1];
+}
+
+/* Try to grow an extent of =fp with the run of =nblocks blocks starting at
+ * =block.  If the grown extent now touches another one, both are merged.
+ * Returns 1 if the run was merged and 0 if it is not adjacent to any
+ * extent in =fp. */
+int freepage_merge_extent(struct freepage* fp, uint64_t block, uint64_t nblocks) {
+    uint64_t joined;
+    for (joined = 0; joined < fp->count; joined++) {
+        uint64_t* ext = &fp->links[2 * joined];
+        if (ext[0] + ext[1] == block) {
+            ext[1] += nblocks;
+            break;
+        }
+        if (block + nblocks == ext[0]) {
+            ext[0] = block;
+            ext[1] += nblocks;
+            break;
+        }
+    }
+    if (joined == fp->count) {
+        return 0;
+    }
+
+    uint64_t* ext = &fp->links[2 * joined];
+    for (uint64_t ii = 0; ii < fp->count; ii++) {
+        uint64_t* other = &fp->links[2 * ii];
+        if (ii == joined) continue;
+        if (other[0] == ext[0] + ext[1]) {
+            ext[1] += other[1];
+            freepage_remove_extent(fp, ii);
+            break;
+        }
+        if (other[0] + other[1] == ext[0]) {
+            other[1] += ext[1];
+            freepage_remove_extent(fp, joined);
+            break;
+        }
+    }
+    return 1;
+}
+
+void dirindex_init(struct superblock* sb) {
+    sb->state->dirindex = (struct dirindex*) calloc(1, sizeof(struct dirindex));
+    pthread_mutex_init(&sb->state->dirindex->lock, NULL);
+}
+
+void dirindex_destroy(struct superblock* sb) {
+    dirindex_clear(sb->state->dirindex);
+    pthread_mutex_destroy(&sb->state->dirindex->lock);
+    free(sb->state->dirindex);
+    sb->state->dirindex = NULL;
+}
+
+/* Drops every directory from =index, with its lock held. */
+void dirindex_clear(struct dirindex* index) {
+    for (int ii = 0; ii < DIRINDEX_BUCKETS; ii++) {
+        while (index->dirs[ii] != NULL) {
+            dirindex_unlink(index, index->dirs[ii]->dir_blk);
+        }
+    }
+}
+
+/* FNV-1a */
+uint64_t hash_name(const char* name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void dirhash_insert(struct dirindex* index, struct dirhash* dh, const char* name, uint64_t block) {
+    if (dh->nentries >= 2 * dh->nbuckets) {
+        //grow the table to keep chains short
+        uint64_t nbuckets = 2 * dh->nbuckets;
+        struct dirhash_ent** buckets = (struct dirhash_ent**) calloc(nbuckets, sizeof(struct dirhash_ent*));
+        for (uint64_t ii = 0; ii < dh->nbuckets; ii++) {
+            struct dirhash_ent* ent = dh->buckets[ii];
+            while (ent != NULL) {
+                struct dirhash_ent* next = ent->next;
+                uint64_t bucket = hash_name(ent->name) % nbuckets;
+                ent->next = buckets[bucket];
+                buckets[bucket] = ent;
+                ent = next;
+            }
+        }
+        free(dh->buckets);
+        dh->buckets = buckets;
+        dh->nbuckets = nbuckets;
+    }
+
+    struct dirhash_ent* ent = (struct dirhash_ent*) malloc(sizeof(struct dirhash_ent) + strlen(name) + 1);
+    ent->block = block;
+    strcpy(ent->name, name);
+    uint64_t bucket = hash_name(name) % dh->nbuckets;
+    ent->next = dh->buckets[bucket];
+    dh->buckets[bucket] = ent;
+    dh->nentries++;
+    index->nentries++;
+}
+
+/* Return the index of the directory whose head inode is =dir_blk.  If the
+ * directory is not indexed yet and =build is set, its inode chain is scanned
+ * to build the index; otherwise NULL is returned.  NULL is also returned if
+ * =dir_blk is not a directory. */
+struct dirhash* dirindex_get(struct superblock* sb, uint64_t dir_blk, int build) {
+    struct dirindex* index = sb->state->dirindex;
+    struct dirhash* dh = index->dirs[dir_blk % DIRINDEX_BUCKETS];
+    while (dh != NULL && dh->dir_blk != dir_blk) dh = dh->next;
+    if (dh != NULL || build == 0) {
+        return dh;
+    }
+
+    struct dircursor cur;
+    if (dircursor_open(sb, dir_blk, &cur) < 0) {
+        return NULL;
+    }
+
+    if (index->nentries > DIRINDEX_MAX_ENTRIES) {
+        dirindex_clear(index);
+    }
+
+    dh = (struct dirhash*) calloc(1, sizeof(struct dirhash));
+    dh->dir_blk = dir_blk;
+    dh->nbuckets = 16;
+    dh->buckets = (struct dirhash_ent**) calloc(dh->nbuckets, sizeof(struct dirhash_ent*));
+
+    while (dircursor_next(sb, &cur)) {
+        dirhash_insert(index, dh, cur.name, cur.block);
+    }
+    dircursor_close(sb, &cur);
+
+    dh->next = index->dirs[dir_blk % DIRINDEX_BUCKETS];
+    index->dirs[dir_blk % DIRINDEX_BUCKETS] = dh;
+    return dh;
+}
+
+/* Return the inode of the entry called =name in the directory =dir_blk, or
+ * zero if there is no such entry (or =dir_blk is not a directory). */
+uint64_t dirindex_lookup(struct superblock* sb, uint64_t dir_blk, const char* name) {
+    pthread_mutex_lock(&sb->state->dirindex->lock);
+    struct dirhash* dh = dirindex_get(sb, dir_blk, 1);
+    struct dirhash_ent* ent = NULL;
+    if (dh != NULL) {
+        ent = dh->buckets[hash_name(name) % dh->nbuckets];
+        while (ent != NULL && strcmp(ent->name, name) != 0) ent = ent->next;
+    }
+    uint64_t block = (ent != NULL) ? ent->block : 0;
+    pthread_mutex_unlock(&sb->state->dirindex->lock);
+    return block;
+}
+
+void dirindex_add(struct superblock* sb, uint64_t dir_blk, const char* name, uint64_t block) {
+    pthread_mutex_lock(&sb->state->dirindex->lock);
+    struct dirhash* dh = dirindex_get(sb, dir_blk, 0);
+    if (dh != NULL) dirhash_insert(sb->state->dirindex, dh, name, block);
+    pthread_mutex_unlock(&sb->state->dirindex->lock);
+}
+
+void dirindex_remove(struct superblock* sb, uint64_t dir_blk, const char* name) {
+    pthread_mutex_lock(&sb->state->dirindex->lock);
+    struct dirhash* dh = dirindex_get(sb, dir_blk, 0);
+    struct dirhash_ent** pp = NULL;
+    if (dh != NULL) {
+        pp = &dh->buckets[hash_name(name) % dh->nbuckets];
+        while (*pp != NULL && strcmp((*pp)->name, name) != 0) pp = &(*pp)->next;
+    }
+    if (pp != NULL && *pp != NULL) {
+        struct dirhash_ent* ent = *pp;
+        *pp = ent->next;
+        free(ent);
+        dh->nentries--;
+        sb->state->dirindex->nentries--;
+    }
+    pthread_mutex_unlock(&sb->state->dirindex->lock);
+}
+
+/* Forget the index of =dir_blk, e.g. because the directory was removed and
+ * its block may be reused. */
+void dirindex_drop(struct superblock* sb, uint64_t dir_blk) {
+    pthread_mutex_lock(&sb->state->dirindex->lock);
+    dirindex_unlink(sb->state->dirindex, dir_blk);
+    pthread_mutex_unlock(&sb->state->dirindex->lock);
+}
+
+/* dirindex_drop, with the lock of =index held. */
+void dirindex_unlink(struct dirindex* index, uint64_t dir_blk) {
+    struct dirhash** pp = &index->dirs[dir_blk % DIRINDEX_BUCKETS];
+    while (*pp != NULL && (*pp)->dir_blk != dir_blk) pp = &(*pp)->next;
+    if (*pp == NULL) return;
+
+    struct dirhash* dh = *pp;
+    *pp = dh->next;
+    for (uint64_t ii = 0; ii < dh->nbuckets; ii++) {
+        while (dh->buckets[ii] != NULL) {
+            struct dirhash_ent* ent = dh->buckets[ii];
+            dh->buckets[ii] = ent->next;
+            free(ent);
+        }
+    }
+    index->nentries -= dh->nentries;
+    free(dh->buckets);
+    free(dh);
+}
+
+void dcache_init(struct superblock* sb) {
+    sb->state->dcache = (struct dcache*) calloc(1, sizeof(struct dcache));
+    pthread_mutex_init(&sb->state->dcache->lock, NULL);
+}
+
+void dcache_destroy(struct superblock* sb) {
+    dcache_clear(sb->state->dcache);
+    pthread_mutex_destroy(&sb->state->dcache->lock);
+    free(sb->state->dcache);
+    sb->state->dcache = NULL;
+}
+
+/* Forgets every path in =dc, with its lock held. */
+void dcache_clear(struct dcache* dc) {
+    for (int ii = 0; ii < DCACHE_BUCKETS; ii++) {
+        while (dc->buckets[ii] != NULL) {
+            struct dirhash_ent* ent = dc->buckets[ii];
+            dc->buckets[ii] = ent->next;
+            free(ent);
+        }
+    }
+    dc->nentries = 0;
+}
+
+/* Copy =full_path into =key without empty components, so that equivalent
+ * spellings of a path share one cache entry.  =key must have room for
+ * strlen(=full_path) + 2 characters. */
+void normalize_path(const char* full_path, char* key) {
+    char* out = key;
+    const char* in = full_path;
+    while (*in != '\0') {
+        while (*in == '/') in++;
+        if (*in == '\0') break;
+        *out++ = '/';
+        while (*in != '\0' && *in != '/') *out++ = *in++;
+    }
+    if (out == key) *out++ = '/';
+    *out = '\0';
+}
+
+uint64_t dcache_lookup(struct superblock* sb, const char* key) {
+    pthread_mutex_lock(&sb->state->dcache->lock);
+    struct dirhash_ent* ent = sb->state->dcache->buckets[hash_name(key) % DCACHE_BUCKETS];
+    while (ent != NULL && strcmp(ent->name, key) != 0) ent = ent->next;
+    uint64_t block = (ent != NULL) ? ent->block : 0;
+    pthread_mutex_unlock(&sb->state->dcache->lock);
+    return block;
+}
+
+void dcache_add(struct superblock* sb, const char* key, uint64_t block) {
+    struct dcache* dc = sb->state->dcache;
+    pthread_mutex_lock(&dc->lock);
+    if (dc->nentries >= DCACHE_MAX_ENTRIES) {
+        dcache_clear(dc);
+    }
+
+    //two threads may resolve the same path at once
+    uint64_t bucket = hash_name(key) % DCACHE_BUCKETS;
+    struct dirhash_ent* ent = dc->buckets[bucket];
+    while (ent != NULL && strcmp(ent->name, key) != 0) ent = ent->next;
+    if (ent == NULL) {
+        ent = (struct dirhash_ent*) malloc(sizeof(struct dirhash_ent) + strlen(key) + 1);
+        ent->block = block;
+        strcpy(ent->name, key);
+        ent->next = dc->buckets[bucket];
+        dc->buckets[bucket] = ent;
+        dc->nentries++;
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_remove(struct superblock* sb, const char* full_path) {
+    char* key = malloc((strlen(full_path) + 2) * sizeof(char));
+    normalize_path(full_path, key);
+
+    pthread_mutex_lock(&sb->state->dcache->lock);
+    struct dirhash_ent** pp = &sb->state->dcache->buckets[hash_name(key) % DCACHE_BUCKETS];
+    while (*pp != NULL && strcmp((*pp)->name, key) != 0) pp = &(*pp)->next;
+    if (*pp != NULL) {
+        struct dirhash_ent* ent = *pp;
+        *pp = ent->next;
+        free(ent);
+        sb->state->dcache->nentries--;
+    }
+    pthread_mutex_unlock(&sb->state->dcache->lock);
+    free(key);
+}
+
+/* This function returns the block number for the deepest matching token in the path
+ * If the path was fully matched, it sets full_match to 1, otherwise 0 */
+uint64_t get_inode_block(struct superblock *sb, const char *full_path, int *full_match, char* path_left_over) {
+    *full_match = 1;
+    if (strcmp("/", full_path) == 0) {
+        return sb->root;
+    }
+
+    char* key = malloc((strlen(full_path) + 2) * sizeof(char));
+    normalize_path(full_path, key);
+    uint64_t cached_block = dcache_lookup(sb, key);
+    if (cached_block != 0) {
+        free(key);
+        return cached_block;
+    }
+
+    //starts from the root
+    uint64_t curr_block = sb->root;
+
+    //for each token in the fullpath
+    //  look for its block
+    int token_matched = 0;
+    char* path = malloc((strlen(full_path) + 1) * sizeof(char));
+    strcpy(path, full_path);
+    char * pch;
+    char * save;
+    for (pch = strtok_r(path, "/", &save); pch != NULL; pch = strtok_r(NULL, "/", &save)) {
+        // printf ("Path token: %s\n", pch);
+        pthread_rwlock_t* lock = inode_lock(sb, curr_block);
+        pthread_rwlock_rdlock(lock);
+        uint64_t child_block = dirindex_lookup(sb, curr_block, pch);
+        pthread_rwlock_unlock(lock);
+        token_matched = (child_block != 0);
+
+        if (token_matched == 0) {
+            break; //did not found subdir or file
+        }
+        //goes down one level
+        curr_block = child_block;
+    }
+
+    //Assuming that the path is correct, if token_matched == 0, the file does not exist yet.
+    //Thus, returns the block for the directory that will store this file
+    *full_match = token_matched;
+    if (*full_match == 0 && path_left_over != NULL) {
+        // printf ("token left: %s\n", pch);
+        strcpy(path_left_over, pch);
+    }
+    if (*full_match == 1) {
+        dcache_add(sb, key, curr_block);
+    }
+
+    free(key);
+    free(path);
+    return curr_block;
+}
+
+/* Return the directory that should hold a new entity at =path and copy the
+ * last component of =path to =name, which must have room for NAME_MAX_LEN
+ * characters.  Returns zero and sets errno if =path names the root
+ * (EEXIST), if a directory on the way does not exist (ENOENT) or is not a
+ * directory (ENOTDIR), or if the name is too long (ENAMETOOLONG). */
+uint64_t get_parent_block(struct superblock* sb, const char* path, char* name) {
+    char* dir = malloc((strlen(path) + 2) * sizeof(char));
+    normalize_path(path, dir);
+
+    char* slash = strrchr(dir, '/');
+    if (slash[1] == '\0') {
+        free(dir);
+        errno = EEXIST;
+        return 0;
+    }
+    if (strlen(slash + 1) >= NAME_MAX_LEN) {
+        free(dir);
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    strcpy(name, slash + 1);
+    slash[(slash == dir) ? 1 : 0] = '\0';
+
+    int full_match = 0;
+    uint64_t dir_blk = get_inode_block(sb, dir, &full_match, NULL);
+    free(dir);
+    if (full_match == 0) {
+        errno = ENOENT;
+        return 0;
+    }
+    if (!is_dir_block(sb, dir_blk)) {
+        errno = ENOTDIR;
+        return 0;
+    }
+    return dir_blk;
+}
+
+int is_dir_block(struct superblock* sb, uint64_t block) {
+    pthread_rwlock_t* lock = inode_lock(sb, block);
+    pthread_rwlock_rdlock(lock);
+    struct inode* node = retrieve_inode(sb, block);
+    int isdir = (node->mode & IMDIR) != 0;
+    release_block(sb, node);
+    pthread_rwlock_unlock(lock);
+    return isdir;
+}
+
+/* Whether the entities of =sb keep their nodeinfo in their head inode,
+ * see FORMAT_COMPACT. */
+int is_compact(struct superblock* sb) {
+    return sb->format == FORMAT_COMPACT;
+}
+
+/* Blocks taken by a new entity besides its data: the head inode, and the
+ * nodeinfo unless it lives in the inode. */
+uint64_t get_meta_blocks(struct superblock* sb) {
+    return is_compact(sb) ? 1 : 2;
+}
+
+/* Bytes of =node->links available for links, extents, entries or inline
+ * contents.  A compact head inode gives the end of its block to its
+ * nodeinfo. */
+size_t get_links_area(struct superblock* sb, struct inode* node) {
+    size_t area = sb->blksz - sizeof(struct inode);
+    if (is_compact(sb) && (node->mode & IMCHILD) == 0) area -= COMPACT_INFO_SIZE;
+    return area;
+}
+
+int get_max_links_in_node(struct superblock* sb, struct inode* node) {
+    return (get_links_area(sb, node) / sizeof(uint64_t) - 1);
+}
+
+int get_num_links_in_node(struct inode* node) {
+    int cnt = 0;
+    while (node->links[cnt] != 0) cnt++;
+    return cnt;
+}
+
+int get_max_extents_in_node(struct superblock* sb, struct inode* node) {
+    return get_max_links_in_node(sb, node) / 2;
+}
+
+int get_num_extents_in_node(struct superblock* sb, struct inode* node) {
+    int max = get_max_extents_in_node(sb, node);
+    int cnt = 0;
+    while (cnt < max && node->links[2 * cnt] != 0) cnt++;
+    return cnt;
+}
+
+/* Largest file whose contents fit in its head inode, see IMINLINE. */
+size_t get_inline_capacity(struct superblock* sb) {
+    size_t area = sb->blksz - sizeof(struct inode);
+    return is_compact(sb) ? area - COMPACT_INFO_SIZE : area;
+}
+
+uint64_t get_last_inode(struct superblock* sb, uint64_t block) {
+    struct inode* node = retrieve_inode(sb, block);
+
+    while (node->next != 0) {
+        block = node->next;
+        release_block(sb, node);
+        node = retrieve_inode(sb, block);
+    }
+    release_block(sb, node);
+    return block;
+}
+
+uint64_t get_node_blk_with_space(struct superblock* sb, uint64_t block) {
+    struct inode* node = retrieve_inode(sb, block);
+    
+    if (get_num_links_in_node(node) < get_max_links_in_node(sb, node)) {
+        release_block(sb, node);
+        return block;
+    }
+
+    while (node->next != 0) {
+        block = node->next;
+        release_block(sb, node);
+        node = retrieve_inode(sb, block);
+    
+        if (get_num_links_in_node(node) < get_max_links_in_node(sb, node)) {
+            release_block(sb, node);
+            return block;
+        }
+    }
+    release_block(sb, node);
+    return 0;
+}
+
+/* Add the link =blk_to_link to the inode chain of =ref_blk, growing its
+ * size by =nbytes (one entry for a directory).  Returns -1, changing
+ * nothing, with errno set to ENOSPC if a new inode is needed and there is
+ * no free block for it. */
+int link_node_to_nodelist(struct superblock* sb, uint64_t ref_blk, uint64_t blk_to_link, uint64_t nbytes) {
+    struct inode* ref_node = retrieve_inode(sb, ref_blk);
+    
+    if (ref_node->mode == IMCHILD) {
+        //get header node
+        ref_blk = ref_node->parent;
+        release_block(sb, ref_node);
+        ref_node = retrieve_inode(sb, ref_blk);
+    }
+
+    uint64_t blk_with_space = get_node_blk_with_space(sb, ref_blk);
+
+    if (blk_with_space != 0) {
+        struct inode* node_with_space = retrieve_inode(sb, blk_with_space);
+        uint64_t num_links = get_num_links_in_node(node_with_space);
+
+        node_with_space->links[num_links] = blk_to_link;
+        node_with_space->links[num_links + 1] = 0;
+        save_inode(sb, node_with_space, blk_with_space);
+        release_block(sb, node_with_space);
+    } else {
+        uint64_t new_node_block = fs_get_block(sb);
+        if (new_node_block == 0) {
+            release_block(sb, ref_node);
+            errno = ENOSPC;
+            return -1;
+        }
+        uint64_t prev_node_block = get_last_inode(sb, ref_blk);
+
+        struct inode* prev_node = retrieve_inode(sb, prev_node_block);
+        prev_node->next = new_node_block;
+        save_inode(sb, prev_node, prev_node_block);
+        release_block(sb, prev_node);
+
+        struct inode* new_node = (struct inode*) new_block(sb, new_node_block);
+        new_node->mode = IMCHILD;
+        new_node->parent = ref_blk;
+        new_node->next = 0;
+        new_node->meta = prev_node_block;
+        new_node->links[0] = blk_to_link;
+        new_node->links[1] = 0;
+        save_inode(sb, new_node, new_node_block);
+        release_block(sb, new_node);
+    }
+    struct nodeinfo* metadata = retrieve_nodeinfo(sb, ref_node->meta);
+    metadata->size += (ref_node->mode & IMDIR) ? 1 : nbytes;
+    save_nodeinfo(sb, metadata, ref_node->meta);
+
+    release_block(sb, ref_node);
+    release_nodeinfo(sb, metadata);
+    return 0;
+}
+
+void free_file_data_blocks(struct superblock* sb, uint64_t file_block) {
+    struct inode* file_node = retrieve_inode(sb, file_block);
+    struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+    int extents = (file_node->mode & IMEXTENT) != 0;
+    int iszip = (file_node->mode & IMZIP) != 0;
+
+    //inline contents go away with the links below
+    uint64_t curr_blk = (file_node->mode & IMINLINE) ? 0 : file_block;
+    struct inode* node = file_node;
+    while (curr_blk != 0) {
+        if (extents) {
+            for (int ext = 0; ext < get_num_extents_in_node(sb, node); ext++) {
+                if (iszip) zcache_drop(sb, node->links[2 * ext], node->links[2 * ext + 1]);
+                fs_put_blocks(sb, node->links[2 * ext], node->links[2 * ext + 1]);
+            }
+        } else {
+            for(int link_index = 0; node->links[link_index] != 0; link_index++) {
+                fs_put_block(sb, node->links[link_index]);
+            }
+        }
+        uint64_t next_blk = node->next;
+        if (node != file_node) {
+            release_block(sb, node);
+            fs_put_block(sb, curr_blk);
+        }
+        curr_blk = next_blk;
+        if (curr_blk != 0) node = retrieve_inode(sb, curr_blk);
+    }
+
+    //the file is empty now, so it can always be rewritten with extents
+    memset(file_node->links, 0, get_links_area(sb, file_node));
+    file_node->mode = IMREG | IMEXTENT;
+    file_node->next = 0;
+    save_inode(sb, file_node, file_block);
+
+    file_info->size = 0;
+    save_nodeinfo(sb, file_info, file_node->meta);
+    
+    release_block(sb, file_node);
+    release_nodeinfo(sb, file_info);
+}
+
+/* Create the entry =ename in the directory =parent_blk and return its head
+ * inode.  =first, if nonzero, is a run of get_meta_blocks blocks the caller
+ * reserved for the nodeinfo and the inode; otherwise they are allocated
+ * here.  In a compact image the nodeinfo goes in the inode's block. */
+uint64_t create_entity(struct superblock* sb, uint64_t parent_blk, const char* ename, uint64_t mode, uint64_t first) {
+    //the inode, its nodeinfo and maybe a new inode for the parent's entries
+    uint64_t nmeta = get_meta_blocks(sb);
+    if (get_free_blocks(sb) < (first != 0 ? 1 : nmeta + 1)) {
+        errno = ENOSPC;
+        return 0;
+    }
+    uint64_t info_blk = (first != 0) ? first : fs_get_block(sb);
+    uint64_t e_blk = info_blk;
+    if (nmeta > 1) e_blk = (first != 0) ? first + 1 : fs_get_block(sb);
+    //the entry goes in first, as it may need a block too
+    if (info_blk == 0 || e_blk == 0 || add_dir_entry(sb, parent_blk, ename, e_blk, mode) < 0) {
+        if (first == 0 && info_blk != 0) fs_put_block(sb, info_blk);
+        if (first == 0 && e_blk != 0 && e_blk != info_blk) fs_put_block(sb, e_blk);
+        errno = ENOSPC;
+        return 0;
+    }
+
+    struct inode *e_node = (struct inode*) new_block(sb, e_blk);
+    e_node->mode = mode;
+    e_node->parent = parent_blk;
+    e_node->meta = info_blk;
+    e_node->next = 0;
+    e_node->links[0] = 0;
+    save_inode(sb, e_node, e_blk);
+
+    struct nodeinfo* info = is_compact(sb) ? retrieve_nodeinfo(sb, info_blk)
+                                           : (struct nodeinfo*) new_block(sb, info_blk);
+    info->size = 0;
+    strcpy(info->name, ename);
+    save_nodeinfo(sb, info, info_blk);
+    dirindex_add(sb, parent_blk, ename, e_blk);
+
+    release_block(sb, e_node);
+    release_nodeinfo(sb, info);
+    return e_blk;
+}
+
+/* Reserve =nblocks blocks as runs of contiguous blocks, taking the longest
+ * runs the free list has.  Returns a list of (first block, length) pairs
+ * that the caller must free, and stores its length in =nruns.  =first, if
+ * nonzero, is a run of =nblocks blocks the caller already reserved.  If
+ * there is not enough space, the blocks taken so far are given back, NULL
+ * is returned and errno is set to ENOSPC. */
+uint64_t* reserve_runs(struct superblock* sb, uint64_t nblocks, uint64_t first, uint64_t* nruns) {
+    uint64_t* runs = (uint64_t*) calloc(2 * (nblocks + 1), sizeof(uint64_t));
+    *nruns = 0;
+    if (first != 0) {
+        runs[0] = first;
+        runs[1] = nblocks;
+        *nruns = 1;
+    }
+
+    for (uint64_t reserved = (first != 0) ? nblocks : 0; reserved < nblocks; ) {
+        uint64_t run_len;
+        uint64_t block = fs_get_blocks(sb, nblocks - reserved, &run_len);
+        if (block == 0) {
+            //out of space: give back what was reserved so far
+            put_runs(sb, runs, *nruns);
+            free(runs);
+            errno = ENOSPC;
+            return NULL;
+        }
+        runs[2 * *nruns] = block;
+        runs[2 * *nruns + 1] = run_len;
+        (*nruns)++;
+        reserved += run_len;
+    }
+    return runs;
+}
+
+void put_runs(struct superblock* sb, const uint64_t* runs, uint64_t nruns) {
+    for (uint64_t ii = 0; ii < nruns; ii++) {
+        fs_put_blocks(sb, runs[2 * ii], runs[2 * ii + 1]);
+    }
+}
+
+/* Append =buf to the file whose head inode is =file_blk, in the =nruns
+ * runs that reserve_runs returned for it; =nodes holds the blocks for the
+ * child inodes they need (see reserve_nodes).  Each run
+ * is written with a single call and the extents are added in one pass over
+ * the inode chain.  Writes of at most DELAY_MAX_BLOCKS blocks are left in
+ * the cache, see delay_data_block. */
+void write_to_file(struct superblock *sb, uint64_t file_blk, char *buf, size_t buf_sz, const uint64_t* runs, uint64_t nruns, const uint64_t* nodes) {
+    uint64_t nblocks = (buf_sz + sb->blksz - 1) / sb->blksz;
+    size_t cnt = 0;
+    for (uint64_t ii = 0; ii < nruns; ii++) {
+        size_t nbytes = runs[2 * ii + 1] * sb->blksz;
+        if (nbytes > buf_sz - cnt) nbytes = buf_sz - cnt;
+        if (nblocks <= DELAY_MAX_BLOCKS) {
+            delay_data_block(sb, runs[2 * ii], buf + cnt, nbytes);
+        } else {
+            write_data_block(sb, runs[2 * ii], buf + cnt, nbytes);
+        }
+        cnt += nbytes;
+    }
+    append_extents(sb, file_blk, runs, nruns, nodes);
+
+    struct inode* file_node = retrieve_inode(sb, file_blk);
+    struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+    file_info->size += buf_sz;
+    save_nodeinfo(sb, file_info, file_node->meta);
+    release_block(sb, file_node);
+    release_nodeinfo(sb, file_info);
+}
+
+/* Write the =cnt bytes of =buf at =offset of the file whose head inode is
+ * =file_blk, storing them in the inode itself (see IMINLINE).  The file
+ * must have no data blocks, and =offset + =cnt must not exceed
+ * get_inline_capacity.  The file grows to cover what was written. */
+void write_inline(struct superblock* sb, uint64_t file_blk, const char* buf, size_t cnt, uint64_t offset) {
+    struct inode* file_node = retrieve_inode(sb, file_blk);
+    struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+    if ((file_node->mode & IMINLINE) == 0) {
+        memset(file_node->links, 0, get_inline_capacity(sb));
+        file_node->mode = IMREG | IMINLINE;
+    }
+    memcpy((char*) file_node->links + offset, buf, cnt);
+    save_inode(sb, file_node, file_blk);
+
+    if (offset + cnt > file_info->size) {
+        file_info->size = offset + cnt;
+        save_nodeinfo(sb, file_info, file_node->meta);
+    }
+    release_block(sb, file_node);
+    release_nodeinfo(sb, file_info);
+}
+
+/* How many child inodes append_extents needs to add =runs to the file
+ * whose head inode is =file_blk, or to a file with no data blocks if
+ * =file_blk is zero. */
+uint64_t extent_nodes_needed(struct superblock* sb, uint64_t file_blk, const uint64_t* runs, uint64_t nruns) {
+    struct inode head = { .mode = IMREG | IMEXTENT };
+    int num_ext = 0;
+    int max_ext = get_max_extents_in_node(sb, &head);
+    uint64_t end = 0;
+    if (file_blk != 0) {
+        uint64_t last_blk = get_last_inode(sb, file_blk);
+        struct inode* last_node = retrieve_inode(sb, last_blk);
+        num_ext = get_num_extents_in_node(sb, last_node);
+        max_ext = get_max_extents_in_node(sb, last_node);
+        if (num_ext > 0) end = last_node->links[2 * (num_ext - 1)] + last_node->links[2 * (num_ext - 1) + 1];
+        release_block(sb, last_node);
+    }
+
+    //the new inodes are children, which may hold more than the head
+    struct inode child = { .mode = IMCHILD };
+    uint64_t nodes = 0;
+    for (uint64_t ii = 0; ii < nruns; ii++) {
+        if (num_ext > 0 && end == runs[2 * ii]) {
+            end += runs[2 * ii + 1];
+            continue;
+        }
+        if (num_ext == max_ext) {
+            nodes++;
+            max_ext = get_max_extents_in_node(sb, &child);
+            num_ext = 0;
+        }
+        num_ext++;
+        end = runs[2 * ii] + runs[2 * ii + 1];
+    }
+    return nodes;
+}
+
+/* Take =n free blocks for child inodes, before the operation that needs
+ * them changes anything.  Returns them in an array the caller frees, or
+ * NULL with errno set to ENOSPC, having taken none, if there is not
+ * enough space. */
+uint64_t* reserve_nodes(struct superblock* sb, uint64_t n) {
+    uint64_t* nodes = (uint64_t*) calloc(n + 1, sizeof(uint64_t));
+    for (uint64_t ii = 0; ii < n; ii++) {
+        nodes[ii] = fs_get_block(sb);
+        if (nodes[ii] == 0) {
+            while (ii-- > 0) fs_put_block(sb, nodes[ii]);
+            free(nodes);
+            errno = ENOSPC;
+            return NULL;
+        }
+    }
+    return nodes;
+}
+
+/* Add the =nruns (first block, length) pairs in =runs to the end of the
+ * extent list of the file whose head inode is =file_blk.  A run is merged
+ * into the last extent when it continues it; new child inodes are chained
+ * when the last inode has no room for another extent, in the blocks of
+ * =nodes, which reserve_nodes took for extent_nodes_needed of them. */
+void append_extents(struct superblock* sb, uint64_t file_blk, const uint64_t* runs, uint64_t nruns, const uint64_t* nodes) {
+    uint64_t last_blk = get_last_inode(sb, file_blk);
+    struct inode* last_node = retrieve_inode(sb, last_blk);
+    int num_ext = get_num_extents_in_node(sb, last_node);
+
+    for (uint64_t ii = 0; ii < nruns; ii++) {
+        uint64_t block = runs[2 * ii];
+        uint64_t nblocks = runs[2 * ii + 1];
+
+        if (num_ext > 0 && last_node->links[2 * (num_ext - 1)] + last_node->links[2 * (num_ext - 1) + 1] == block) {
+            last_node->links[2 * (num_ext - 1) + 1] += nblocks;
+            continue;
+        }
+        if (num_ext == get_max_extents_in_node(sb, last_node)) {
+            uint64_t new_node_block = *nodes++;
+            assert(new_node_block != 0);
+            last_node->next = new_node_block;
+            save_inode(sb, last_node, last_blk);
+            release_block(sb, last_node);
+
+            struct inode* new_node = (struct inode*) new_block(sb, new_node_block);
+            new_node->mode = IMCHILD;
+            new_node->parent = file_blk;
+            new_node->next = 0;
+            new_node->meta = last_blk;
+
+            last_node = new_node;
+            last_blk = new_node_block;
+            num_ext = 0;
+        }
+        last_node->links[2 * num_ext] = block;
+        last_node->links[2 * num_ext + 1] = nblocks;
+        num_ext++;
+    }
+    save_inode(sb, last_node, last_blk);
+    release_block(sb, last_node);
+}
+
+/* Read the first =nbytes bytes of the file whose head inode is =file_blk
+ * into =buf.  Both extent-mapped files and files with a link per block are
+ * handled; runs of data are gathered from the whole inode chain and read
+ * in batches (see struct readbatch).  Returns the number of bytes read. */
+uint64_t read_file_data(struct superblock* sb, uint64_t file_blk, char* buf, uint64_t nbytes) {
+    struct readbatch* rb = (struct readbatch*) calloc(1, sizeof(struct readbatch));
+    rb->gap = (char*) malloc(READ_GAP_BLOCKS * sb->blksz);
+
+    uint64_t cnt = 0;
+    struct inode* node = retrieve_inode(sb, file_blk);
+    int extents = (node->mode & IMEXTENT) != 0;
+    if (node->mode & IMINLINE) {
+        memcpy(buf, node->links, nbytes);
+        cnt = nbytes;
+        release_block(sb, node);
+        node = NULL;
+    }
+
+    while (node != NULL) {
+        if (extents) {
+            for (int ext = 0; ext < get_num_extents_in_node(sb, node) && cnt < nbytes; ext++) {
+                uint64_t ext_bytes = node->links[2 * ext + 1] * sb->blksz;
+                if (ext_bytes > nbytes - cnt) ext_bytes = nbytes - cnt;
+                readbatch_add(sb, rb, node->links[2 * ext], buf + cnt, ext_bytes);
+                cnt += ext_bytes;
+            }
+        } else {
+            //files written before extents were introduced keep a link per block
+            for (int ii = 0; node->links[ii] != 0 && cnt < nbytes; ii++) {
+                uint64_t blk_bytes = (nbytes - cnt < sb->blksz) ? nbytes - cnt : sb->blksz;
+                readbatch_add(sb, rb, node->links[ii], buf + cnt, blk_bytes);
+                cnt += blk_bytes;
+            }
+        }
+
+        uint64_t next_blk = (cnt < nbytes) ? node->next : 0;
+        release_block(sb, node);
+        node = (next_blk != 0) ? retrieve_inode(sb, next_blk) : NULL;
+    }
+    readbatch_submit(sb, rb);
+
+    free(rb->gap);
+    free(rb);
+    return cnt;
+}
+
+/* Compress the =cnt bytes of =buf into what the data blocks of a
+ * compressed file hold (see struct zipheader), in a buffer the caller
+ * must free, block-aligned, whose size is stored in =zip_sz.  A group is
+ * stored as is unless compressing it saves a block.  Returns NULL if the
+ * result would not take fewer blocks than =buf. */
+char* zip_compress(struct superblock* sb, const char* buf, size_t cnt, size_t* zip_sz) {
+    uint64_t blksz = sb->blksz;
+    uint64_t group = get_zip_group(sb);
+    uint64_t ngroups = (cnt + group - 1) / group;
+    uint64_t plain = (cnt + blksz - 1) / blksz;
+    uint64_t hdr_blocks = (get_zip_header_size(ngroups) + blksz - 1) / blksz;
+    //every group takes a block at least
+    if (hdr_blocks + ngroups >= plain) return NULL;
+
+    char* zip = (char*) calloc(hdr_blocks + plain, blksz);
+    struct zipheader* hdr = (struct zipheader*) zip;
+    hdr->group = group;
+    uint64_t pos = hdr_blocks * blksz;
+    for (uint64_t gg = 0; gg < ngroups; gg++) {
+        size_t len = (cnt - gg * group < group) ? cnt - gg * group : group;
+        size_t len_blocks = (len + blksz - 1) / blksz;
+        size_t stored = lz_compress(buf + gg * group, len, zip + pos, (len_blocks - 1) * blksz);
+        if (stored == 0) {
+            memcpy(zip + pos, buf + gg * group, len);
+            stored = len;
+        }
+        hdr->stored[gg] = stored;
+        pos += (stored + blksz - 1) / blksz * blksz;
+    }
+    if (pos / blksz >= plain) {
+        free(zip);
+        return NULL;
+    }
+    *zip_sz = pos;
+    return zip;
+}
+
+/* Read the first =nbytes bytes of the compressed file whose head inode is
+ * =file_blk and whose size is =size into =buf.  The header, then the
+ * blocks of the groups that cover =nbytes, are read as read_file_data
+ * reads any file, and each group is decompressed in place.  Returns
+ * =nbytes, or -1 with errno set to EIO if the blocks do not hold what the
+ * header says. */
+ssize_t read_zip_data(struct superblock* sb, uint64_t file_blk, char* buf, uint64_t nbytes, uint64_t size) {
+    uint64_t blksz = sb->blksz;
+    if (nbytes == 0) return 0;
+    char* zip = (char*) malloc(blksz);
+    read_file_data(sb, file_blk, zip, blksz);
+    uint64_t group = ((struct zipheader*) zip)->group;
+    if (group == 0 || group % blksz != 0) {
+        free(zip);
+        errno = EIO;
+        return -1;
+    }
+    uint64_t ngroups = (size + group - 1) / group;
+    uint64_t hdr_blocks = (get_zip_header_size(ngroups) + blksz - 1) / blksz;
+    if (hdr_blocks > 1) {
+        zip = (char*) realloc(zip, hdr_blocks * blksz);
+        read_file_data(sb, file_blk, zip, hdr_blocks * blksz);
+    }
+
+    uint64_t nneed = (nbytes + group - 1) / group;
+    uint64_t zip_blocks = hdr_blocks;
+    for (uint64_t gg = 0; gg < nneed; gg++) {
+        uint32_t stored = ((struct zipheader*) zip)->stored[gg];
+        if (stored > group) {
+            free(zip);
+            errno = EIO;
+            return -1;
+        }
+        zip_blocks += (stored + blksz - 1) / blksz;
+    }
+    zip = (char*) realloc(zip, zip_blocks * blksz);
+    int ok = read_file_data(sb, file_blk, zip, zip_blocks * blksz) == zip_blocks * blksz;
+
+    struct zipheader* hdr = (struct zipheader*) zip;
+    uint64_t pos = hdr_blocks * blksz;
+    uint64_t done = 0;
+    for (uint64_t gg = 0; gg < nneed && ok; gg++) {
+        uint64_t len = (size - gg * group < group) ? size - gg * group : group;
+        uint64_t want = (nbytes - done < len) ? nbytes - done : len;
+        uint64_t stored = hdr->stored[gg];
+        if (stored > len) {
+            ok = 0;
+        } else if (stored == len) {
+            memcpy(buf + done, zip + pos, want);
+        } else if (want == len) {
+            ok = lz_decompress(zip + pos, stored, buf + done, len) == (ssize_t) len;
+        } else {
+            //the caller's buffer ends inside the group
+            char* tmp = (char*) malloc(len);
+            ok = lz_decompress(zip + pos, stored, tmp, len) == (ssize_t) len;
+            memcpy(buf + done, tmp, want);
+            free(tmp);
+        }
+        pos += (stored + blksz - 1) / blksz * blksz;
+        done += want;
+    }
+    free(zip);
+    if (!ok) {
+        errno = EIO;
+        return -1;
+    }
+    return done;
+}
+
+void unlink_node(struct superblock* sb, uint64_t dir_blk, uint64_t blk_to_unlink) {
+    struct inode* dir_node = retrieve_inode(sb, dir_blk);
+    int packed = (dir_node->mode & IMDIRENT) != 0;
+    release_block(sb, dir_node);
+    if (packed) {
+        remove_dir_entry(sb, dir_blk, blk_to_unlink);
+        return;
+    }
+
+    struct inode* unlinked_node = retrieve_inode(sb, blk_to_unlink);
+    struct nodeinfo* unlinked_info = retrieve_nodeinfo(sb, unlinked_node->meta);
+    dirindex_remove(sb, dir_blk, unlinked_info->name);
+    release_block(sb, unlinked_node);
+    release_nodeinfo(sb, unlinked_info);
+
+    struct inode *curr_node;
+    uint64_t curr_blk = dir_blk;
+    int entity_index = -1;
+
+find_inode_to_unlink:    
+    curr_node = retrieve_inode(sb, curr_blk);
+    
+    for (int index = 0; curr_node->links[index] != 0; index++) {
+        if (blk_to_unlink == curr_node->links[index]) {
+            entity_index = index;
+            break;
+        }
+    }
+
+    //go to next inode in list
+    if (entity_index < 0 && curr_node->next != 0) {
+        curr_blk = curr_node->next;
+        release_block(sb, curr_node);
+        goto find_inode_to_unlink; 
+    }
+    
+    assert (entity_index >= 0);
+
+    //shift the array tail, so empty spaces are always in the end
+    for (int ii = entity_index; curr_node->links[ii] != 0; ii++) {
+        curr_node->links[ii] = curr_node->links[ii + 1];
+    }
+    save_inode(sb, curr_node, curr_blk);
+    dirstreams_shift(sb, curr_blk, entity_index, 1);
+    
+    if (curr_node->links[0] == 0 && curr_node->mode == IMCHILD) {
+        //this node does not have to exist anymore
+        unchain_child_node(sb, curr_node, curr_blk);
+    }
+    
+    struct inode* dir_header_node = retrieve_inode(sb, dir_blk); 
+    struct nodeinfo* dir_info = retrieve_nodeinfo(sb, dir_header_node->meta);
+    dir_info->size--;
+    save_nodeinfo(sb, dir_info, dir_header_node->meta);
+
+    release_block(sb, curr_node);
+    release_block(sb, dir_header_node);
+    release_nodeinfo(sb, dir_info);
+}
+
+uint64_t get_file_size(struct superblock *sb, const char *fname) {
+    int full_match = 0;
+    uint64_t file_blk = get_inode_block(sb, fname, &full_match, NULL);
+    
+    if (full_match == 0) {
+        //file does not exist
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct inode* file_node = retrieve_inode(sb, file_blk);
+    struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+ 
+    uint64_t filesz = file_info->size;
+    
+    release_block(sb, file_node);
+    release_nodeinfo(sb, file_info);
+
+    return filesz;
+}
+
+/* Remove the child inode =node, stored at =block, from its chain and free
+ * its block. */
+void unchain_child_node(struct superblock* sb, struct inode* node, uint64_t block) {
+    dirstreams_skip(sb, block, node->next);
+    struct inode* prev_node = retrieve_inode(sb, node->meta);
+    prev_node->next = node->next;
+    save_inode(sb, prev_node, node->meta);
+    release_block(sb, prev_node);
+
+    if (node->next != 0) {
+        struct inode* next_node = retrieve_inode(sb, node->next);
+        next_node->meta = node->meta;
+        save_inode(sb, next_node, node->next);
+        release_block(sb, next_node);
+    }
+    
+    fs_put_block(sb, block);
+}
+
+size_t get_direntry_size(const char* name) {
+    return sizeof(struct direntry) + ((strlen(name) + 1 + 7) & ~(size_t) 7);
+}
+
+size_t get_direntry_area(struct superblock* sb, struct inode* node) {
+    return get_links_area(sb, node);
+}
+
+/* Return how many bytes of =node->links are taken by packed entries.  The
+ * rest of the area is always zeroed. */
+size_t get_direntries_used(struct superblock* sb, struct inode* node) {
+    size_t area = get_direntry_area(sb, node);
+    size_t used = 0;
+    while (used + sizeof(struct direntry) <= area) {
+        struct direntry* ent = (struct direntry*) ((char*) node->links + used);
+        if (ent->inode == 0) break;
+        used += ent->reclen;
+    }
+    return used;
+}
+
+/* Add the entity =blk called =name to the directory =dir_blk.  Entries go
+ * to the first inode in the directory chain with room for them; a new
+ * child inode is chained when none has.  Empty directories are plain IMDIR
+ * inodes and switch to packed entries here; non-empty directories written
+ * with plain links keep that layout.  Returns -1 with errno set to ENOSPC
+ * if a new inode is needed and there is no free block for it; the entry is
+ * not added then. */
+int add_dir_entry(struct superblock* sb, uint64_t dir_blk, const char* name, uint64_t blk, uint64_t mode) {
+    struct inode* dir_node = retrieve_inode(sb, dir_blk);
+    if ((dir_node->mode & IMDIRENT) == 0) {
+        if (dir_node->links[0] != 0 || dir_node->next != 0) {
+            release_block(sb, dir_node);
+            return link_node_to_nodelist(sb, dir_blk, blk, 0);
+        }
+        memset(dir_node->links, 0, get_direntry_area(sb, dir_node));
+        dir_node->mode |= IMDIRENT;
+        save_inode(sb, dir_node, dir_blk);
+    }
+
+    size_t reclen = get_direntry_size(name);
+    uint64_t curr_blk = dir_blk;
+    struct inode* curr_node = retrieve_inode(sb, curr_blk);
+    size_t used = get_direntries_used(sb, curr_node);
+    while (used + reclen > get_direntry_area(sb, curr_node) && curr_node->next != 0) {
+        curr_blk = curr_node->next;
+        release_block(sb, curr_node);
+        curr_node = retrieve_inode(sb, curr_blk);
+        used = get_direntries_used(sb, curr_node);
+    }
+
+    if (used + reclen > get_direntry_area(sb, curr_node)) {
+        uint64_t new_node_block = fs_get_block(sb);
+        if (new_node_block == 0) {
+            release_block(sb, curr_node);
+            release_block(sb, dir_node);
+            errno = ENOSPC;
+            return -1;
+        }
+        curr_node->next = new_node_block;
+        save_inode(sb, curr_node, curr_blk);
+        release_block(sb, curr_node);
+
+        curr_node = (struct inode*) new_block(sb, new_node_block);
+        curr_node->mode = IMCHILD;
+        curr_node->parent = dir_blk;
+        curr_node->next = 0;
+        curr_node->meta = curr_blk;
+        curr_blk = new_node_block;
+        used = 0;
+    }
+
+    struct direntry* ent = (struct direntry*) ((char*) curr_node->links + used);
+    memset(ent, 0, reclen);
+    ent->inode = blk;
+    ent->reclen = reclen;
+    ent->type = (mode & IMDIR) ? IMDIR : IMREG;
+    strcpy(ent->name, name);
+    save_inode(sb, curr_node, curr_blk);
+    release_block(sb, curr_node);
+
+    struct nodeinfo* dir_info = retrieve_nodeinfo(sb, dir_node->meta);
+    dir_info->size++;
+    save_nodeinfo(sb, dir_info, dir_node->meta);
+    release_nodeinfo(sb, dir_info);
+    release_block(sb, dir_node);
+    return 0;
+}
+
+/* Remove the entry for =blk from the packed directory =dir_blk, closing
+ * the gap it leaves so free space stays at the end of each inode. */
+void remove_dir_entry(struct superblock* sb, uint64_t dir_blk, uint64_t blk) {
+    uint64_t curr_blk = dir_blk;
+    struct inode* curr_node = retrieve_inode(sb, curr_blk);
+    struct direntry* ent = NULL;
+    size_t offset;
+
+    while (1) {
+        size_t area = get_direntry_area(sb, curr_node);
+        for (offset = 0; offset + sizeof(struct direntry) <= area; offset += ent->reclen) {
+            ent = (struct direntry*) ((char*) curr_node->links + offset);
+            if (ent->inode == 0 || ent->inode == blk) break;
+        }
+        if (offset + sizeof(struct direntry) <= area && ent->inode == blk) break;
+        assert(curr_node->next != 0);
+        curr_blk = curr_node->next;
+        release_block(sb, curr_node);
+        curr_node = retrieve_inode(sb, curr_blk);
+    }
+    dirindex_remove(sb, dir_blk, ent->name);
+
+    size_t used = get_direntries_used(sb, curr_node);
+    size_t reclen = ent->reclen;
+    memmove(ent, (char*) ent + reclen, used - offset - reclen);
+    memset((char*) curr_node->links + used - reclen, 0, reclen);
+    save_inode(sb, curr_node, curr_blk);
+    dirstreams_shift(sb, curr_blk, offset, reclen);
+
+    if (curr_node->mode == IMCHILD && get_direntries_used(sb, curr_node) == 0) {
+        //this node does not have to exist anymore
+        unchain_child_node(sb, curr_node, curr_blk);
+    }
+    release_block(sb, curr_node);
+
+    struct inode* dir_node = retrieve_inode(sb, dir_blk); 
+    struct nodeinfo* dir_info = retrieve_nodeinfo(sb, dir_node->meta);
+    dir_info->size--;
+    save_nodeinfo(sb, dir_info, dir_node->meta);
+    if (dir_info->size == 0) {
+        //back to the layout of an empty directory
+        assert(dir_node->next == 0);
+        dir_node->mode = IMDIR;
+        save_inode(sb, dir_node, dir_blk);
+    }
+    release_block(sb, dir_node);
+    release_nodeinfo(sb, dir_info);
+}
+
+/* Start listing the directory =dir_blk.  Returns -1 if it is not a
+ * directory. */
+int dircursor_open(struct superblock* sb, uint64_t dir_blk, struct dircursor* cur) {
+    cur->node = retrieve_inode(sb, dir_blk);
+    if ((cur->node->mode & IMDIR) == 0) {
+        release_block(sb, cur->node);
+        cur->node = NULL;
+        return -1;
+    }
+    cur->nodeblk = dir_blk;
+    cur->packed = (cur->node->mode & IMDIRENT) != 0;
+    cur->pos = 0;
+    cur->block = 0;
+    cur->isdir = 0;
+    cur->name = (char*) malloc(sb->blksz);
+    return 0;
+}
+
+/* Move =cur to the next entry.  Returns 1 and fills =cur->block,
+ * =cur->isdir and =cur->name, or returns 0 after the last entry. */
+int dircursor_next(struct superblock* sb, struct dircursor* cur) {
+    while (cur->node != NULL) {
+        if (cur->packed) {
+            struct direntry* ent = (struct direntry*) ((char*) cur->node->links + cur->pos);
+            if (cur->pos + sizeof(struct direntry) <= get_direntry_area(sb, cur->node) && ent->inode != 0) {
+                cur->block = ent->inode;
+                cur->isdir = (ent->type & IMDIR) != 0;
+                strcpy(cur->name, ent->name);
+                cur->pos += ent->reclen;
+                return 1;
+            }
+        } else if (cur->node->links[cur->pos] != 0) {
+            cur->block = cur->node->links[cur->pos];
+            struct inode* ent_node = retrieve_inode(sb, cur->block);
+            struct nodeinfo* ent_info = retrieve_nodeinfo(sb, ent_node->meta);
+            cur->isdir = (ent_node->mode & IMDIR) != 0;
+            strcpy(cur->name, ent_info->name);
+            release_block(sb, ent_node);
+            release_nodeinfo(sb, ent_info);
+            cur->pos++;
+            return 1;
+        }
+
+        //go to next inode in list
+        uint64_t next_blk = cur->node->next;
+        release_block(sb, cur->node);
+        cur->node = (next_blk != 0) ? retrieve_inode(sb, next_blk) : NULL;
+        cur->nodeblk = next_blk;
+        cur->pos = 0;
+    }
+    return 0;
+}
+
+void dircursor_close(struct superblock* sb, struct dircursor* cur) {
+    if (cur->node != NULL) release_block(sb, cur->node);
+    cur->node = NULL;
+    free(cur->name);
+    cur->name = NULL;
+}
+
+/* Ask the OS to start reading the inodes and nodeinfos of the entries in
+ * the current node of =cur, and the next node of the directory, before
+ * they are needed.  A nodeinfo is usually allocated right before its
+ * inode, and entries created together are close on disk, so nearby blocks
+ * are requested as one range. */
+void dircursor_readahead(struct superblock* sb, struct dircursor* cur) {
+    if (cur->node == NULL || sb->state->cache->map != NULL) return;
+
+    size_t area = get_direntry_area(sb, cur->node);
+    uint64_t first = 0;
+    uint64_t end = 0;
+    uint64_t next = cur->node->next;
+    size_t pos = 0;
+    while (1) {
+        uint64_t block = 0;
+        if (cur->packed) {
+            struct direntry* ent = (struct direntry*) ((char*) cur->node->links + pos);
+            if (pos + sizeof(struct direntry) <= area && ent->inode != 0) {
+                block = ent->inode;
+                pos += ent->reclen;
+            }
+        } else if (pos < (size_t) get_max_links_in_node(sb, cur->node) && cur->node->links[pos] != 0) {
+            block = cur->node->links[pos++];
+        }
+        if (block == 0 && next != 0) {
+            block = next;
+            next = 0;
+        }
+
+        int fits = end > 0 && block + READ_GAP_BLOCKS + 1 >= first && block <= end + READ_GAP_BLOCKS;
+        if (!fits && end > 0) {
+            posix_fadvise(sb->state->fd, first * sb->blksz, (end - first) * sb->blksz, POSIX_FADV_WILLNEED);
+            end = 0;
+        }
+        if (block == 0) break;
+        if (end == 0) {
+            first = block - 1;
+            end = block + 1;
+        } else {
+            if (block - 1 < first) first = block - 1;
+            if (block + 1 > end) end = block + 1;
+        }
+    }
+}
+
+/* The entries of node =block past offset =pos moved =delta back (bytes in
+ * a packed node, links otherwise).  Called with =ns held exclusively. */
+void dirstreams_shift(struct superblock* sb, uint64_t block, size_t pos, size_t delta) {
+    for (struct fsdir* d = sb->state->locks->dirs; d != NULL; d = d->next) {
+        if (d->cur.nodeblk == block && d->cur.pos > pos) d->cur.pos -= delta;
+    }
+}
+
+/* Node =block left its directory: streams standing in it go on at the
+ * start of =next.  Called with =ns held exclusively. */
+void dirstreams_skip(struct superblock* sb, uint64_t block, uint64_t next) {
+    for (struct fsdir* d = sb->state->locks->dirs; d != NULL; d = d->next) {
+        if (d->cur.nodeblk == block) {
+            d->cur.nodeblk = next;
+            d->cur.pos = 0;
+        }
+    }
+}
+/* Add =nblocks disk blocks starting at =block to the end of the in-memory
+ * map of =f. */
+void file_map_append(struct fsfile* f, uint64_t block, uint64_t nblocks) {
+    uint64_t* last = (f->nruns > 0) ? &f->runs[3 * (f->nruns - 1)] : NULL;
+    if (last != NULL && last[1] + last[2] == block) {
+        last[2] += nblocks;
+    } else {
+        if (f->nruns == f->maxruns) {
+            f->maxruns = (f->maxruns == 0) ? 16 : 2 * f->maxruns;
+            f->runs = (uint64_t*) realloc(f->runs, 3 * f->maxruns * sizeof(uint64_t));
+        }
+        f->runs[3 * f->nruns] = f->nblocks;
+        f->runs[3 * f->nruns + 1] = block;
+        f->runs[3 * f->nruns + 2] = nblocks;
+        f->nruns++;
+    }
+    f->nblocks += nblocks;
+}
+
+/* Reloads the map of =f if the file was remapped since it was loaded, e.g.
+ * through another handle.  The inode lock of the file must be held. */
+void file_refresh(struct fsfile* f) {
+    uint64_t gen = *inode_gen(f->sb, f->blk);
+    if (f->gen == gen) return;
+    file_load_map(f);
+    f->gen = gen;
+}
+
+void file_load_map(struct fsfile* f) {
+    struct superblock* sb = f->sb;
+    f->nruns = 0;
+    f->nblocks = 0;
+
+    struct inode* node = retrieve_inode(sb, f->blk);
+    struct nodeinfo* info = retrieve_nodeinfo(sb, node->meta);
+    f->size = info->size;
+    release_nodeinfo(sb, info);
+
+    int extents = (node->mode & IMEXTENT) != 0;
+    f->isinline = (node->mode & IMINLINE) != 0;
+    f->iszip = (node->mode & IMZIP) != 0;
+    if (f->isinline) {
+        release_block(sb, node);
+        node = NULL;
+    }
+    while (node != NULL) {
+        if (extents) {
+            for (int ext = 0; ext < get_num_extents_in_node(sb, node); ext++) {
+                file_map_append(f, node->links[2 * ext], node->links[2 * ext + 1]);
+            }
+        } else {
+            for (int ii = 0; node->links[ii] != 0; ii++) {
+                file_map_append(f, node->links[ii], 1);
+            }
+        }
+        uint64_t next_blk = node->next;
+        release_block(sb, node);
+        node = (next_blk != 0) ? retrieve_inode(sb, next_blk) : NULL;
+    }
+    if (f->iszip) file_load_zip(f);
+}
+
+/* Return the disk block holding block =fblk of the file; =nblocks is set
+ * to the number of blocks from there to the end of its run. */
+uint64_t file_map_lookup(struct fsfile* f, uint64_t fblk, uint64_t* nblocks) {
+    uint64_t lo = 0, hi = f->nruns;
+    while (hi - lo > 1) {
+        uint64_t mid = (lo + hi) / 2;
+        if (f->runs[3 * mid] <= fblk) lo = mid;
+        else hi = mid;
+    }
+    uint64_t* run = &f->runs[3 * lo];
+    assert(fblk >= run[0] && fblk < run[0] + run[2]);
+    *nblocks = run[0] + run[2] - fblk;
+    return run[1] + (fblk - run[0]);
+}
+
+/* Rewrite the inode chain of a file with one link per block as extents,
+ * so it can grow with append_extents.  The data blocks stay in place.
+ * Returns -1, leaving the file unchanged, if there is no room for the
+ * child inodes the extents need. */
+int convert_to_extents(struct fsfile* f) {
+    struct superblock* sb = f->sb;
+    uint64_t* pairs = (uint64_t*) malloc(2 * (f->nruns + 1) * sizeof(uint64_t));
+    for (uint64_t ii = 0; ii < f->nruns; ii++) {
+        pairs[2 * ii] = f->runs[3 * ii + 1];
+        pairs[2 * ii + 1] = f->runs[3 * ii + 2];
+    }
+    uint64_t* nodes = reserve_nodes(sb, extent_nodes_needed(sb, 0, pairs, f->nruns));
+    if (nodes == NULL) {
+        free(pairs);
+        return -1;
+    }
+
+    struct inode* file_node = retrieve_inode(sb, f->blk);
+
+    uint64_t curr_blk = file_node->next;
+    while (curr_blk != 0) {
+        struct inode* node = retrieve_inode(sb, curr_blk);
+        uint64_t next_blk = node->next;
+        release_block(sb, node);
+        fs_put_block(sb, curr_blk);
+        curr_blk = next_blk;
+    }
+    memset(file_node->links, 0, get_links_area(sb, file_node));
+    file_node->mode = IMREG | IMEXTENT;
+    file_node->next = 0;
+    save_inode(sb, file_node, f->blk);
+    release_block(sb, file_node);
+
+    append_extents(sb, f->blk, pairs, f->nruns, nodes);
+    free(nodes);
+    free(pairs);
+    return 0;
+}
+
+/* Move the contents of =f out of its head inode into a data block, so the
+ * file can grow past get_inline_capacity.  Returns -1, leaving the file
+ * unchanged, if there is no free block. */
+int file_uninline(struct fsfile* f) {
+    struct superblock* sb = f->sb;
+    uint64_t block = 0;
+    if (f->size > 0) {
+        block = fs_get_block(sb);
+        if (block == 0) return -1;
+    }
+
+    struct inode* file_node = retrieve_inode(sb, f->blk);
+    if (block != 0) {
+        memset(f->bounce, 0, sb->blksz);
+        memcpy(f->bounce, file_node->links, f->size);
+        write_data_block(sb, block, f->bounce, sb->blksz);
+    }
+    memset(file_node->links, 0, get_inline_capacity(sb));
+    file_node->mode = IMREG | IMEXTENT;
+    file_node->links[0] = block;
+    file_node->links[1] = (block != 0) ? 1 : 0;
+    save_inode(sb, file_node, f->blk);
+    release_block(sb, file_node);
+
+    f->isinline = 0;
+    if (block != 0) file_map_append(f, block, 1);
+    return 0;
+}
+
+/* Allocate =nblocks more data blocks at the end of the file.  Returns -1,
+ * leaving the file unchanged, if there is not enough space. */
+int file_reserve(struct fsfile* f, uint64_t nblocks) {
+    struct superblock* sb = f->sb;
+    uint64_t nruns;
+    uint64_t* runs = reserve_runs(sb, nblocks, 0, &nruns);
+    if (runs == NULL) return -1;
+
+    struct inode* file_node = retrieve_inode(sb, f->blk);
+    int extents = (file_node->mode & IMEXTENT) != 0;
+    release_block(sb, file_node);
+    uint64_t* nodes = NULL;
+    if (extents || convert_to_extents(f) == 0) {
+        nodes = reserve_nodes(sb, extent_nodes_needed(sb, f->blk, runs, nruns));
+    }
+    if (nodes == NULL) {
+        put_runs(sb, runs, nruns);
+        free(runs);
+        return -1;
+    }
+
+    append_extents(sb, f->blk, runs, nruns, nodes);
+    free(nodes);
+    for (uint64_t ii = 0; ii < nruns; ii++) {
+        file_map_append(f, runs[2 * ii], runs[2 * ii + 1]);
+    }
+    free(runs);
+    return 0;
+}
+
+/* Write =cnt bytes at =offset into blocks already allocated to the file.
+ * Whole blocks are written in place; partial blocks that hold file data
+ * are read, patched and written back. */
+void file_write_range(struct fsfile* f, const char* buf, size_t cnt, uint64_t offset) {
+    struct superblock* sb = f->sb;
+    size_t done = 0;
+    while (done < cnt) {
+        uint64_t pos = offset + done;
+        uint64_t in_blk = pos % sb->blksz;
+        uint64_t run_len;
+        uint64_t block = file_map_lookup(f, pos / sb->blksz, &run_len);
+
+        if (in_blk != 0 || cnt - done < sb->blksz) {
+            size_t nbytes = sb->blksz - in_blk;
+            if (nbytes > cnt - done) nbytes = cnt - done;
+            if (pos - in_blk < f->size) {
+                read_data_block(sb, block, f->bounce, sb->blksz);
+            } else {
+                memset(f->bounce, 0, sb->blksz);
+            }
+            memcpy(f->bounce + in_blk, buf + done, nbytes);
+            write_data_block(sb, block, f->bounce, sb->blksz);
+            done += nbytes;
+        } else {
+            size_t nbytes = (cnt - done) / sb->blksz * sb->blksz;
+            if (nbytes > run_len * sb->blksz) nbytes = run_len * sb->blksz;
+            write_data_block(sb, block, buf + done, nbytes);
+            done += nbytes;
+        }
+    }
+}
+
+/* Read =cnt bytes at =offset from the blocks allocated to the file.
+ * Whole blocks are read in place, up to the end of each run; partial
+ * blocks go through the bounce buffer. */
+void file_read_range(struct fsfile* f, char* buf, size_t cnt, uint64_t offset) {
+    struct superblock* sb = f->sb;
+    size_t done = 0;
+    while (done < cnt) {
+        uint64_t pos = offset + done;
+        uint64_t in_blk = pos % sb->blksz;
+        uint64_t run_len;
+        uint64_t block = file_map_lookup(f, pos / sb->blksz, &run_len);
+
+        if (in_blk != 0 || cnt - done < sb->blksz) {
+            size_t nbytes = sb->blksz - in_blk;
+            if (nbytes > cnt - done) nbytes = cnt - done;
+            read_data_block(sb, block, f->bounce, sb->blksz);
+            memcpy(buf + done, f->bounce + in_blk, nbytes);
+            done += nbytes;
+        } else {
+            size_t nbytes = (cnt - done) / sb->blksz * sb->blksz;
+            if (nbytes > run_len * sb->blksz) nbytes = run_len * sb->blksz;
+            read_data_block(sb, block, buf + done, nbytes);
+            done += nbytes;
+        }
+    }
+}
+
+/* Read the header of the compressed file =f into its map of groups.  A
+ * header that does not fit the file leaves =zgroup zero, and reads then
+ * fail. */
+void file_load_zip(struct fsfile* f) {
+    struct superblock* sb = f->sb;
+    uint64_t blksz = sb->blksz;
+    f->zgroup = 0;
+    f->ngroups = 0;
+    if (f->nblocks == 0) return;
+
+    struct zipheader* hdr = (struct zipheader*) malloc(blksz);
+    file_read_range(f, (char*) hdr, blksz, 0);
+    uint64_t group = hdr->group;
+    if (group == 0 || group % blksz != 0) {
+        free(hdr);
+        return;
+    }
+    uint64_t ngroups = (f->size + group - 1) / group;
+    uint64_t hdr_blocks = (get_zip_header_size(ngroups) + blksz - 1) / blksz;
+    if (hdr_blocks > f->nblocks) {
+        free(hdr);
+        return;
+    }
+    hdr = (struct zipheader*) realloc(hdr, hdr_blocks * blksz);
+    file_read_range(f, (char*) hdr, hdr_blocks * blksz, 0);
+
+    f->zgroups = (uint64_t*) realloc(f->zgroups, 2 * (ngroups + 1) * sizeof(uint64_t));
+    uint64_t pos = hdr_blocks * blksz;
+    for (uint64_t gg = 0; gg < ngroups; gg++) {
+        uint64_t len = (f->size - gg * group < group) ? f->size - gg * group : group;
+        uint64_t stored = hdr->stored[gg];
+        if (stored > len || pos + stored > f->nblocks * blksz) {
+            free(hdr);
+            return;
+        }
+        f->zgroups[2 * gg] = pos;
+        f->zgroups[2 * gg + 1] = stored;
+        pos += (stored + blksz - 1) / blksz * blksz;
+    }
+    free(hdr);
+    f->zbuf = (char*) realloc(f->zbuf, group);
+    f->zdata = (char*) realloc(f->zdata, group);
+    f->zgroup = group;
+    f->ngroups = ngroups;
+}
+
+/* Decompress the group =group of the compressed file =f into =out.
+ * Returns -1 with errno set to EIO if it does not decompress to the
+ * length of the group. */
+int file_read_group(struct fsfile* f, uint64_t group, char* out) {
+    uint64_t len = (f->size - group * f->zgroup < f->zgroup) ? f->size - group * f->zgroup : f->zgroup;
+    uint64_t start = f->zgroups[2 * group];
+    uint64_t stored = f->zgroups[2 * group + 1];
+    if (stored == len) {
+        file_read_range(f, out, len, start);
+        return 0;
+    }
+    file_read_range(f, f->zbuf, stored, start);
+    if (lz_decompress(f->zbuf, stored, out, len) != (ssize_t) len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Read =cnt bytes at =offset of the compressed file =f, which has that
+ * many.  Groups stored as they are, and groups read whole, are read
+ * straight into =buf; the others are decompressed through the zcache.
+ * Returns =cnt, or -1 with errno set to EIO. */
+ssize_t file_read_zip(struct fsfile* f, char* buf, size_t cnt, uint64_t offset) {
+    struct superblock* sb = f->sb;
+    if (cnt > 0 && f->zgroup == 0) {
+        errno = EIO;
+        return -1;
+    }
+    size_t done = 0;
+    while (done < cnt) {
+        uint64_t pos = offset + done;
+        uint64_t group = pos / f->zgroup;
+        uint64_t in_group = pos % f->zgroup;
+        uint64_t len = (f->size - group * f->zgroup < f->zgroup) ? f->size - group * f->zgroup : f->zgroup;
+        size_t nbytes = (len - in_group < cnt - done) ? len - in_group : cnt - done;
+        uint64_t start = f->zgroups[2 * group];
+
+        if (f->zgroups[2 * group + 1] == len) {
+            file_read_range(f, buf + done, nbytes, start + in_group);
+        } else if (nbytes == len) {
+            if (file_read_group(f, group, buf + done) < 0) return -1;
+        } else {
+            uint64_t run_len;
+            uint64_t block = file_map_lookup(f, start / sb->blksz, &run_len);
+            if (!zcache_read(sb, block, buf + done, in_group, nbytes)) {
+                if (file_read_group(f, group, f->zdata) < 0) return -1;
+                zcache_put(sb, block, f->zdata, len);
+                memcpy(buf + done, f->zdata + in_group, nbytes);
+            }
+        }
+        done += nbytes;
+    }
+    return done;
+}
+
+/* Rewrite the compressed file =f uncompressed, in new data blocks, so that
+ * it can be written in place.  The new blocks are reserved and filled
+ * before the old ones are freed.  Returns -1 with errno set, leaving the
+ * file unchanged: ENOSPC if there is not enough space, EIO if the file
+ * cannot be decompressed. */
+int file_unzip(struct fsfile* f) {
+    struct superblock* sb = f->sb;
+    uint64_t size = f->size;
+    uint64_t nblocks = (size + sb->blksz - 1) / sb->blksz;
+    struct fsfile* plain = (struct fsfile*) calloc(1, sizeof(struct fsfile));
+    plain->sb = sb;
+    plain->blk = f->blk;
+    plain->bounce = (char*) malloc(sb->blksz);
+
+    int err = 0;
+    while (plain->nblocks < nblocks) {
+        uint64_t run_len;
+        uint64_t first = fs_get_blocks(sb, nblocks - plain->nblocks, &run_len);
+        if (first == 0) break;
+        file_map_append(plain, first, run_len);
+    }
+    if (plain->nblocks < nblocks) err = ENOSPC;
+    for (uint64_t gg = 0; gg < f->ngroups && err == 0; gg++) {
+        uint64_t len = (size - gg * f->zgroup < f->zgroup) ? size - gg * f->zgroup : f->zgroup;
+        if (file_read_group(f, gg, f->zdata) < 0) err = EIO;
+        else file_write_range(plain, f->zdata, len, gg * f->zgroup);
+    }
+    if (err == 0 && size > 0 && f->zgroup == 0) err = EIO;
+
+    //the child inodes of the new extents, which replace all the old ones
+    uint64_t* pairs = (uint64_t*) calloc(2 * (plain->nruns + 1), sizeof(uint64_t));
+    for (uint64_t ii = 0; ii < plain->nruns; ii++) {
+        pairs[2 * ii] = plain->runs[3 * ii + 1];
+        pairs[2 * ii + 1] = plain->runs[3 * ii + 2];
+    }
+    uint64_t* nodes = NULL;
+    if (err == 0) {
+        nodes = reserve_nodes(sb, extent_nodes_needed(sb, 0, pairs, plain->nruns));
+        if (nodes == NULL) err = ENOSPC;
+    }
+    if (err != 0) {
+        free(pairs);
+        for (uint64_t ii = 0; ii < plain->nruns; ii++) {
+            fs_put_blocks(sb, plain->runs[3 * ii + 1], plain->runs[3 * ii + 2]);
+        }
+        free(plain->runs);
+        free(plain->bounce);
+        free(plain);
+        errno = err;
+        return -1;
+    }
+
+    free_file_data_blocks(sb, f->blk);
+    append_extents(sb, f->blk, pairs, plain->nruns, nodes);
+    free(nodes);
+    free(pairs);
+    struct inode* file_node = retrieve_inode(sb, f->blk);
+    struct nodeinfo* file_info = retrieve_nodeinfo(sb, file_node->meta);
+    file_info->size = size;
+    save_nodeinfo(sb, file_info, file_node->meta);
+    release_block(sb, file_node);
+    release_nodeinfo(sb, file_info);
+
+    //other handles on the file must reload its map
+    free(f->runs);
+    f->runs = plain->runs;
+    f->nruns = plain->nruns;
+    f->maxruns = plain->maxruns;
+    f->nblocks = plain->nblocks;
+    f->iszip = 0;
+    f->gen = ++(*inode_gen(sb, f->blk));
+    free(plain->bounce);
+    free(plain);
+    return 0;
+}
+
+/* Append to the =*op bytes at =out a sequence of the =nlit bytes at =lit
+ * followed by a match of =len bytes starting =offset bytes back, or the
+ * literals alone if =len is zero (the last sequence).  Returns -1 if the
+ * sequence does not fit in =cap bytes. */
+int lz_put_sequence(unsigned char* out, size_t* op, size_t cap, const unsigned char* lit,
+        size_t nlit, size_t offset, size_t len) {
+    if (*op + 1 + nlit / 255 + 1 + nlit + 2 + len / 255 + 1 > cap) return -1;
+    unsigned char* token = out + *op;
+    size_t pos = *op + 1;
+    if (nlit >= 15) {
+        *token = 15 << 4;
+        size_t rest = nlit - 15;
+        for (; rest >= 255; rest -= 255) out[pos++] = 255;
+        out[pos++] = rest;
+    } else {
+        *token = nlit << 4;
+    }
+    memcpy(out + pos, lit, nlit);
+    pos += nlit;
+    if (len > 0) {
+        out[pos++] = offset & 0xff;
+        out[pos++] = offset >> 8;
+        size_t rest = len - LZ_MIN_MATCH;
+        if (rest >= 15) {
+            *token |= 15;
+            for (rest -= 15; rest >= 255; rest -= 255) out[pos++] = 255;
+            out[pos++] = rest;
+        } else {
+            *token |= rest;
+        }
+    }
+    *op = pos;
+    return 0;
+}
+
+uint32_t lz_read32(const unsigned char* p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+/* Compress the =nbytes bytes at =src into at most =cap bytes at =dst (see
+ * ZIP_GROUP_BYTES).  Returns the compressed size, or zero if it would not
+ * fit.  =nbytes must be below 4 GiB. */
+size_t lz_compress(const char* src, size_t nbytes, char* dst, size_t cap) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t ip = 0, anchor = 0, op = 0;
+    size_t limit = (nbytes > LZ_MATCH_LIMIT) ? nbytes - LZ_MATCH_LIMIT : 0;
+
+    while (ip < limit) {
+        uint32_t seq = lz_read32(in + ip);
+        uint32_t hash = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[hash];
+        table[hash] = ip;
+        if (cand >= ip || ip - cand > LZ_MAX_OFFSET || lz_read32(in + cand) != seq) {
+            //move faster through data that does not match
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < nbytes - LZ_LAST_LITERALS && in[cand + len] == in[ip + len]) len++;
+        if (lz_put_sequence(out, &op, cap, in + anchor, ip - anchor, ip - cand, len) < 0) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    if (lz_put_sequence(out, &op, cap, in + anchor, nbytes - anchor, 0, 0) < 0) return 0;
+    return op;
+}
+
+/* Read an extra length byte by byte, see lz_put_sequence. */
+int lz_get_length(const unsigned char* in, size_t nbytes, size_t* ip, size_t* len) {
+    unsigned char byte;
+    do {
+        if (*ip >= nbytes) return -1;
+        byte = in[(*ip)++];
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/* Decompress the =nbytes bytes at =src into at most =cap bytes at =dst.
+ * Returns the decompressed size, or -1 if =src is not a valid sequence or
+ * would decompress to more than =cap bytes. */
+ssize_t lz_decompress(const char* src, size_t nbytes, char* dst, size_t cap) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    size_t ip = 0, op = 0;
+    while (ip < nbytes) {
+        unsigned token = in[ip++];
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz_get_length(in, nbytes, &ip, &nlit) < 0) return -1;
+        if (nlit > nbytes - ip || nlit > cap - op) return -1;
+        memcpy(out + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == nbytes) break;
+
+        if (nbytes - ip < 2) return -1;
+        size_t offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && lz_get_length(in, nbytes, &ip, &len) < 0) return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || len > cap - op) return -1;
+        //a match may overlap the bytes it produces
+        if (offset >= len) {
+            memcpy(out + op, out + op - offset, len);
+        } else {
+            for (size_t ii = 0; ii < len; ii++) out[op + ii] = out[op - offset + ii];
+        }
+        op += len;
+    }
+    return op;
+}
+
+/* Bytes in each group of a file compressed in =sb. */
+uint64_t get_zip_group(struct superblock* sb) {
+    uint64_t nblocks = ZIP_GROUP_BYTES / sb->blksz;
+    if (nblocks < ZIP_MIN_GROUP_BLOCKS) nblocks = ZIP_MIN_GROUP_BLOCKS;
+    return nblocks * sb->blksz;
+}
+
+size_t get_zip_header_size(uint64_t ngroups) {
+    return sizeof(struct zipheader) + ngroups * sizeof(uint32_t);
+}
+
+void zcache_init(struct superblock* sb) {
+    struct zcache* zc = (struct zcache*) calloc(1, sizeof(struct zcache));
+    pthread_mutex_init(&zc->lock, NULL);
+    sb->state->cache->zcache = zc;
+}
+
+void zcache_destroy(struct superblock* sb) {
+    struct zcache* zc = sb->state->cache->zcache;
+    for (int ii = 0; ii < ZCACHE_SLOTS; ii++) {
+        free(zc->slots[ii].data);
+    }
+    pthread_mutex_destroy(&zc->lock);
+    free(zc);
+    sb->state->cache->zcache = NULL;
+}
+
+/* Copy =cnt bytes at =offset of the cached group whose compressed bytes
+ * start at =block into =buf.  Returns zero if the group is not cached. */
+int zcache_read(struct superblock* sb, uint64_t block, char* buf, size_t offset, size_t cnt) {
+    struct zcache* zc = sb->state->cache->zcache;
+    pthread_mutex_lock(&zc->lock);
+    for (int ii = 0; ii < ZCACHE_SLOTS; ii++) {
+        struct zslot* slot = &zc->slots[ii];
+        if (slot->block != block || offset + cnt > slot->len) continue;
+        slot->used = ++zc->tick;
+        memcpy(buf, slot->data + offset, cnt);
+        pthread_mutex_unlock(&zc->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&zc->lock);
+    return 0;
+}
+
+/* Cache the =len bytes of =data, the group whose compressed bytes start at
+ * =block, in place of the least recently used group. */
+void zcache_put(struct superblock* sb, uint64_t block, const char* data, size_t len) {
+    struct zcache* zc = sb->state->cache->zcache;
+    pthread_mutex_lock(&zc->lock);
+    struct zslot* victim = &zc->slots[0];
+    for (int ii = 0; ii < ZCACHE_SLOTS; ii++) {
+        struct zslot* slot = &zc->slots[ii];
+        if (slot->block == block) {
+            //another thread decompressed it meanwhile
+            victim = slot;
+            break;
+        }
+        if (slot->used < victim->used) victim = slot;
+    }
+    if (victim->len < len) victim->data = (char*) realloc(victim->data, len);
+    memcpy(victim->data, data, len);
+    victim->block = block;
+    victim->len = len;
+    victim->used = ++zc->tick;
+    pthread_mutex_unlock(&zc->lock);
+}
+
+/* Forget the groups whose compressed bytes start in the =nblocks blocks
+ * from =block, which are being freed. */
+void zcache_drop(struct superblock* sb, uint64_t block, uint64_t nblocks) {
+    struct zcache* zc = sb->state->cache->zcache;
+    pthread_mutex_lock(&zc->lock);
+    for (int ii = 0; ii < ZCACHE_SLOTS; ii++) {
+        struct zslot* slot = &zc->slots[ii];
+        if (slot->block >= block && slot->block < block + nblocks) {
+            slot->block = 0;
+            slot->used = 0;
+        }
+    }
+    pthread_mutex_unlock(&zc->lock);
+}
+
+uint64_t journal_desc_capacity(struct superblock* sb) {
+    return (sb->blksz - sizeof(struct journal_desc)) / sizeof(uint64_t);
+}
+
+/* FNV-1a, continued from =sum */
+uint64_t checksum_update(uint64_t sum, const void* data, size_t nbytes) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t ii = 0; ii < nbytes; ii++) {
+        sum ^= bytes[ii];
+        sum *= 1099511628211ULL;
+    }
+    return sum;
+}
+
+void pwritev_all(int fd, struct iovec* iov, uint64_t niov, off_t offset) {
+    while (niov > 0) {
+        int cnt = (niov < IOV_MAX) ? niov : IOV_MAX;
+        size_t nbytes = 0;
+        for (int ii = 0; ii < cnt; ii++) nbytes += iov[ii].iov_len;
+        pwritev(fd, iov, cnt, offset);
+        offset += nbytes;
+        iov += cnt;
+        niov -= cnt;
+    }
+}
+
+/* Apply the transaction found in the journal of the image, if it was
+ * completely committed.  Runs before the cache exists, so it reads and
+ * writes the image directly.  Returns the number of blocks replayed; if
+ * the superblock does not point to a valid journal, the pointer is
+ * cleared (images written before journals existed have garbage there). */
+int journal_replay(struct superblock* sb) {
+    uint64_t blksz = sb->blksz;
+    struct journal* hdr = (struct journal*) malloc(blksz);
+    if (sb->journal == 0 || sb->journal >= sb->blks
+            || pread(sb->state->fd, hdr, blksz, sb->journal * blksz) != (ssize_t) blksz
+            || hdr->magic != JOURNAL_MAGIC || hdr->nblocks < 3
+            || hdr->nblocks > sb->blks - sb->journal) {
+        sb->journal = 0;
+        free(hdr);
+        return 0;
+    }
+    uint64_t jlen = hdr->nblocks;
+    free(hdr);
+
+    uint64_t cap = journal_desc_capacity(sb);
+    struct journal_desc* desc = (struct journal_desc*) malloc(blksz);
+    pread(sb->state->fd, desc, blksz, (sb->journal + 1) * blksz);
+    uint64_t count = desc->count;
+    uint64_t ndesc = (count + cap - 1) / cap;
+    if (desc->magic != JOURNAL_DESC_MAGIC || count == 0 || count > jlen
+            || 2 + ndesc + count > jlen) {
+        free(desc);
+        return 0;
+    }
+    uint64_t seq = desc->seq;
+    free(desc);
+
+    char* log = (char*) malloc((ndesc + count + 1) * blksz);
+    size_t logsz = (ndesc + count + 1) * blksz;
+    size_t done = 0;
+    while (done < logsz) {
+        ssize_t ret = pread(sb->state->fd, log + done, logsz - done, (sb->journal + 1) * blksz + done);
+        if (ret <= 0) break;
+        done += ret;
+    }
+    struct journal_commit* commit = (struct journal_commit*) (log + (ndesc + count) * blksz);
+    uint64_t sum = checksum_update(14695981039346656037ULL, log, (ndesc + count) * blksz);
+    if (done < logsz || commit->magic != JOURNAL_COMMIT_MAGIC || commit->seq != seq
+            || commit->count != count || commit->checksum != sum) {
+        //the crash happened before the commit block: nothing to redo
+        free(log);
+        return 0;
+    }
+
+    for (uint64_t ii = 0; ii < count; ii++) {
+        struct journal_desc* d = (struct journal_desc*) (log + (ii / cap) * blksz);
+        uint64_t target = d->targets[ii % cap];
+        if (target >= sb->blks) continue;
+        pwrite(sb->state->fd, log + (ndesc + ii) * blksz, blksz, target * blksz);
+    }
+    fdatasync(sb->state->fd);
+    free(log);
+    return count;
+}
+
+/* Start logging if the image has a journal.  Sequence numbers continue from
+ * both the header and the last descriptor written, so a stale commit block
+ * left further in the log never matches a new transaction. */
+void journal_load(struct superblock* sb, int mode) {
+    struct blkcache* cache = sb->state->cache;
+    if (sb->journal == 0) return;
+
+    char* buf = (char*) malloc(2 * sb->blksz);
+    pread(sb->state->fd, buf, 2 * sb->blksz, sb->journal * sb->blksz);
+    struct journal* hdr = (struct journal*) buf;
+    struct journal_desc* desc = (struct journal_desc*) (buf + sb->blksz);
+
+    uint64_t seq = hdr->seq;
+    if (desc->magic == JOURNAL_DESC_MAGIC && desc->seq > seq) seq = desc->seq;
+    hdr->seq = seq + 1;
+    if (mode == FS_IO_MMAP) {
+        //changes made through the mapping are not logged: forget the log
+        memset(desc, 0, sb->blksz);
+        pwrite(sb->state->fd, buf, 2 * sb->blksz, sb->journal * sb->blksz);
+    } else {
+        pwrite(sb->state->fd, hdr, sb->blksz, sb->journal * sb->blksz);
+        cache->jlen = hdr->nblocks;
+        cache->jseq = seq + 1;
+        cache->jsynced = 0;
+        clock_gettime(CLOCK_MONOTONIC, &cache->jlast);
+    }
+    fdatasync(sb->state->fd);
+    free(buf);
+}
+
+/* Write the dirty superblock and the =ndirty blocks in =dirty as one
+ * transaction in the journal and wait for it to reach the disk.  A
+ * transaction too large for the journal is written without it. */
+void journal_commit(struct superblock* sb, struct cacheblk** dirty, uint64_t ndirty) {
+    struct blkcache* cache = sb->state->cache;
+    uint64_t count = ndirty + (cache->sb_dirty ? 1 : 0);
+    if (count == 0) return;
+
+    //file data and the previous checkpoint must be on disk before the log
+    //that may refer to them replaces the previous transaction
+    if (!cache->jsynced) fdatasync(sb->state->fd);
+
+    uint64_t cap = journal_desc_capacity(sb);
+    uint64_t ndesc = (count + cap - 1) / cap;
+    if (2 + ndesc + count > cache->jlen) {
+        //an empty transaction replaces the previous one, which would
+        //otherwise be replayed over what is now written in place
+        struct journal_desc* empty = (struct journal_desc*) calloc(1, sb->blksz);
+        empty->magic = JOURNAL_DESC_MAGIC;
+        empty->seq = ++cache->jseq;
+        pwrite(sb->state->fd, empty, sb->blksz, (sb->journal + 1) * sb->blksz);
+        fdatasync(sb->state->fd);
+        free(empty);
+        cache->jsynced = 0;
+        cache->nfreed = 0;
+        stats_add(&sb->state->stats->journal_overflows, 1);
+        return;
+    }
+
+    cache->jseq++;
+    char* descs = (char*) calloc(ndesc, sb->blksz);
+    struct journal_commit* commit = (struct journal_commit*) calloc(1, sb->blksz);
+    struct iovec* iov = (struct iovec*) malloc((count + 2) * sizeof(struct iovec));
+    char* image = NULL;
+    uint64_t niov = 0;
+
+    iov[niov].iov_base = descs;
+    iov[niov].iov_len = ndesc * sb->blksz;
+    niov++;
+    uint64_t ii = 0;
+    if (cache->sb_dirty) {
+        image = (char*) malloc(sb->blksz);
+        superblock_image(sb, image);
+        iov[niov].iov_base = image;
+        iov[niov].iov_len = sb->blksz;
+        niov++;
+        ((struct journal_desc*) descs)->targets[0] = 0;
+        ii++;
+    }
+    for (uint64_t jj = 0; jj < ndirty; jj++, ii++) {
+        struct journal_desc* d = (struct journal_desc*) (descs + (ii / cap) * sb->blksz);
+        d->targets[ii % cap] = dirty[jj]->block;
+        iov[niov].iov_base = dirty[jj]->data;
+        iov[niov].iov_len = sb->blksz;
+        niov++;
+    }
+    for (uint64_t dd = 0; dd < ndesc; dd++) {
+        struct journal_desc* d = (struct journal_desc*) (descs + dd * sb->blksz);
+        d->magic = JOURNAL_DESC_MAGIC;
+        d->seq = cache->jseq;
+        d->count = count;
+    }
+
+    uint64_t sum = 14695981039346656037ULL;
+    for (ii = 0; ii < niov; ii++) {
+        sum = checksum_update(sum, iov[ii].iov_base, iov[ii].iov_len);
+    }
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->seq = cache->jseq;
+    commit->count = count;
+    commit->checksum = sum;
+    iov[niov].iov_base = commit;
+    iov[niov].iov_len = sb->blksz;
+    niov++;
+
+    pwritev_all(sb->state->fd, iov, niov, (sb->journal + 1) * sb->blksz);
+    stats_io(sb, 1, (ndesc + niov - 1) * sb->blksz, (niov + IOV_MAX - 1) / IOV_MAX);
+    fdatasync(sb->state->fd);
+    stats_add(&sb->state->stats->journal_commits, 1);
+
+    //the transaction is durable; the caller writes it in place
+    cache->jsynced = 0;
+    cache->nfreed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &cache->jlast);
+
+    free(iov);
+    free(image);
+    free(commit);
+    free(descs);
+}
+
+/* Called before each operation that changes the image, when no
+ * transaction is half done: commits the running transaction if it has
+ * grown large or old enough. */
+void journal_op_begin(struct superblock* sb) {
+    struct blkcache* cache = sb->state->cache;
+    pthread_mutex_lock(&cache->lock);
+    int due = journal_commit_due(sb);
+    pthread_mutex_unlock(&cache->lock);
+    if (!due) return;
+
+    //a transaction must not catch another operation halfway
+    pthread_rwlock_wrlock(&sb->state->locks->ns);
+    pthread_mutex_lock(&cache->lock);
+    due = journal_commit_due(sb);
+    pthread_mutex_unlock(&cache->lock);
+    if (due) cache_flush(sb);
+    pthread_rwlock_unlock(&sb->state->locks->ns);
+}
+
+/* Whether the running transaction should be committed, with the cache
+ * lock held.  With snapshots, blocks waiting to be copied are flushed in
+ * batches even without a journal. */
+int journal_commit_due(struct superblock* sb) {
+    struct blkcache* cache = sb->state->cache;
+    if (cache->snap != NULL && cache->snap->nsnaps > 0 && cache->ndirty >= SNAPSHOT_FLUSH_BLOCKS) return 1;
+    if (cache->jlen == 0 || (cache->ndirty == 0 && !cache->sb_dirty)) return 0;
+
+    uint64_t limit = (cache->jlen - 2) / 2;
+    if (limit > JOURNAL_COMMIT_BLOCKS) limit = JOURNAL_COMMIT_BLOCKS;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return cache->ndirty >= limit || now.tv_sec - cache->jlast.tv_sec >= JOURNAL_COMMIT_SECS;
+}
+
+void journal_note_free(struct superblock* sb, uint64_t block, uint64_t nblocks) {
+    struct blkcache* cache = sb->state->cache;
+    if (cache->jlen == 0) return;
+
+    if (cache->nfreed > 0 && cache->freed[2 * (cache->nfreed - 1)] + cache->freed[2 * (cache->nfreed - 1) + 1] == block) {
+        cache->freed[2 * (cache->nfreed - 1) + 1] += nblocks;
+        return;
+    }
+    if (cache->nfreed == cache->maxfreed) {
+        cache->maxfreed = (cache->maxfreed == 0) ? 64 : 2 * cache->maxfreed;
+        cache->freed = (uint64_t*) realloc(cache->freed, 2 * cache->maxfreed * sizeof(uint64_t));
+    }
+    cache->freed[2 * cache->nfreed] = block;
+    cache->freed[2 * cache->nfreed + 1] = nblocks;
+    cache->nfreed++;
+}
+
+int journal_is_freed(struct superblock* sb, uint64_t block) {
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    int freed = journal_freed(sb->state->cache, block);
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+    return freed;
+}
+
+/* journal_is_freed, with =alloc held. */
+int journal_freed(struct blkcache* cache, uint64_t block) {
+    int freed = 0;
+    for (uint64_t ii = 0; ii < cache->nfreed && !freed; ii++) {
+        freed = block >= cache->freed[2 * ii] && block < cache->freed[2 * ii] + cache->freed[2 * ii + 1];
+    }
+    return freed;
+}
+
+/* Set up the snapshot state of =sb and load the snapshots on the image.
+ * Images written before snapshots existed may hold anything in
+ * =snapshots, so a record without SNAPSHOT_MAGIC ends the list.  Returns
+ * -1 and sets errno to EINVAL if there are snapshots and =mode is
+ * FS_IO_MMAP. */
+int snap_init(struct superblock* sb, int mode) {
+    struct snapstate* snap = (struct snapstate*) calloc(1, sizeof(struct snapstate));
+    pthread_rwlock_init(&snap->lock, NULL);
+    sb->state->cache->snap = snap;
+
+    struct snapshot* rec = (struct snapshot*) malloc(sb->blksz);
+    struct snappage* page = (struct snappage*) malloc(sb->blksz);
+    uint64_t max = (sb->blksz - sizeof(struct snappage)) / (2 * sizeof(uint64_t));
+    uint64_t block = sb->snapshots;
+    while (block != 0 && block < sb->blks
+            && pread(sb->state->fd, rec, sb->blksz, block * sb->blksz) == (ssize_t) sb->blksz
+            && rec->magic == SNAPSHOT_MAGIC) {
+        snap->snaps = (struct snapmem*) realloc(snap->snaps, (snap->nsnaps + 1) * sizeof(struct snapmem));
+        struct snapmem* sm = &snap->snaps[snap->nsnaps++];
+        memset(sm, 0, sizeof(struct snapmem));
+        sm->id = ++snap->nextid;
+        sm->record = block;
+        sm->root = rec->root;
+        strncpy(sm->name, rec->name, FS_NAME_MAX - 1);
+        for (uint64_t pg = rec->saved; pg != 0 && pg < sb->blks; pg = page->next) {
+            if (pread(sb->state->fd, page, sb->blksz, pg * sb->blksz) != (ssize_t) sb->blksz
+                    || page->count > max) break;
+            for (uint64_t ii = 0; ii < page->count; ii++) {
+                savedmap_put(sm, page->links[2 * ii], page->links[2 * ii + 1]);
+            }
+        }
+        block = rec->next;
+    }
+    if (snap->nsnaps == 0) sb->snapshots = 0;
+    free(page);
+    free(rec);
+
+    if (snap->nsnaps > 0 && mode == FS_IO_MMAP) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void snap_destroy(struct snapstate* snap) {
+    for (uint64_t ii = 0; ii < snap->nsnaps; ii++) {
+        free(snap->snaps[ii].keys);
+        free(snap->snaps[ii].vals);
+    }
+    free(snap->snaps);
+    free(snap->fresh);
+    free(snap->owned);
+    pthread_rwlock_destroy(&snap->lock);
+    free(snap);
+}
+
+int snap_find(struct snapstate* snap, const char* name) {
+    for (uint64_t ii = 0; ii < snap->nsnaps; ii++) {
+        if (strcmp(snap->snaps[ii].name, name) == 0) return (int) ii;
+    }
+    return -1;
+}
+
+int snap_index(struct snapstate* snap, uint64_t id) {
+    for (uint64_t ii = 0; ii < snap->nsnaps; ii++) {
+        if (snap->snaps[ii].id == id) return (int) ii;
+    }
+    return -1;
+}
+
+/* Index of the first extent of =fresh that starts past =block. */
+uint64_t fresh_search(struct snapstate* snap, uint64_t block) {
+    uint64_t lo = 0, hi = snap->nfresh;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (snap->fresh[2 * mid] <= block) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int fresh_has(struct snapstate* snap, uint64_t block) {
+    uint64_t ii = fresh_search(snap, block);
+    return ii > 0 && block < snap->fresh[2 * (ii - 1)] + snap->fresh[2 * (ii - 1) + 1];
+}
+
+/* Add the =nblocks blocks from =block on to =fresh, merging the extents
+ * they overlap or touch. */
+void fresh_add(struct snapstate* snap, uint64_t block, uint64_t nblocks) {
+    uint64_t end = block + nblocks;
+    uint64_t first = fresh_search(snap, block);
+    if (first > 0 && snap->fresh[2 * (first - 1)] + snap->fresh[2 * (first - 1) + 1] >= block) {
+        first--;
+        block = snap->fresh[2 * first];
+        if (end < block + snap->fresh[2 * first + 1]) end = block + snap->fresh[2 * first + 1];
+    }
+    uint64_t last = first;
+    while (last < snap->nfresh && snap->fresh[2 * last] <= end) {
+        if (end < snap->fresh[2 * last] + snap->fresh[2 * last + 1]) {
+            end = snap->fresh[2 * last] + snap->fresh[2 * last + 1];
+        }
+        last++;
+    }
+
+    //extents first to last - 1 become a single one
+    if (first == last) {
+        if (snap->nfresh == snap->maxfresh) {
+            snap->maxfresh = (snap->maxfresh == 0) ? 64 : 2 * snap->maxfresh;
+            snap->fresh = (uint64_t*) realloc(snap->fresh, 2 * snap->maxfresh * sizeof(uint64_t));
+        }
+        memmove(snap->fresh + 2 * (first + 1), snap->fresh + 2 * first,
+                2 * (snap->nfresh - first) * sizeof(uint64_t));
+        snap->nfresh++;
+    } else if (last - first > 1) {
+        memmove(snap->fresh + 2 * (first + 1), snap->fresh + 2 * last,
+                2 * (snap->nfresh - last) * sizeof(uint64_t));
+        snap->nfresh -= last - first - 1;
+    }
+    snap->fresh[2 * first] = block;
+    snap->fresh[2 * first + 1] = end - block;
+}
+
+/* Whether =slot holds a block of the tree whose old contents a snapshot
+ * still needs, with the cache lock held. */
+int snap_unsaved(struct blkcache* cache, struct cacheblk* slot) {
+    struct snapstate* snap = cache->snap;
+    return snap != NULL && snap->nsnaps > 0 && !slot->raw && !fresh_has(snap, slot->block);
+}
+
+/* Whether data written to =block must wait in the cache for its old
+ * contents to be copied, see snap_flush. */
+int snap_unsaved_block(struct superblock* sb, uint64_t block) {
+    struct snapstate* snap = sb->state->cache->snap;
+    if (snap == NULL || snap->nsnaps == 0) return 0;
+    pthread_mutex_lock(&sb->state->cache->lock);
+    int unsaved = !fresh_has(snap, block);
+    pthread_mutex_unlock(&sb->state->cache->lock);
+    return unsaved;
+}
+
+/* Position of =block in a =saved map of =cap entries: where it is, or the
+ * empty entry where it would go. */
+uint64_t savedmap_slot(const uint64_t* keys, uint64_t cap, uint64_t block) {
+    uint64_t ii = (block * 0x9e3779b97f4a7c15ULL) >> 32 & (cap - 1);
+    while (keys[ii] != 0 && keys[ii] != block) ii = (ii + 1) & (cap - 1);
+    return ii;
+}
+
+uint64_t savedmap_get(struct snapmem* sm, uint64_t block) {
+    if (sm->nsaved == 0) return 0;
+    uint64_t ii = savedmap_slot(sm->keys, sm->cap, block);
+    return (sm->keys[ii] == block) ? sm->vals[ii] : 0;
+}
+
+void savedmap_put(struct snapmem* sm, uint64_t block, uint64_t copy) {
+    if (2 * (sm->nsaved + 1) > sm->cap) {
+        //at most half full, so that probes stay short
+        uint64_t cap = (sm->cap == 0) ? 64 : 2 * sm->cap;
+        uint64_t* keys = (uint64_t*) calloc(cap, sizeof(uint64_t));
+        uint64_t* vals = (uint64_t*) calloc(cap, sizeof(uint64_t));
+        for (uint64_t ii = 0; ii < sm->cap; ii++) {
+            if (sm->keys[ii] == 0) continue;
+            uint64_t jj = savedmap_slot(keys, cap, sm->keys[ii]);
+            keys[jj] = sm->keys[ii];
+            vals[jj] = sm->vals[ii];
+        }
+        free(sm->keys);
+        free(sm->vals);
+        sm->keys = keys;
+        sm->vals = vals;
+        sm->cap = cap;
+    }
+    uint64_t ii = savedmap_slot(sm->keys, sm->cap, block);
+    if (sm->keys[ii] == 0) sm->nsaved++;
+    sm->keys[ii] = block;
+    sm->vals[ii] = copy;
+}
+
+/* Add the pair (=a, =b) to the saved list of the snapshot whose record is
+ * =record or, if =owned is set, the extent =a+=b to its owned list.  A new
+ * page goes in front of the list when the first one is full.  Called with
+ * =alloc held; returns -1 if there is no free block for the page. */
+int snappage_add(struct superblock* sb, uint64_t record, int owned, uint64_t a, uint64_t b) {
+    struct snapshot* rec = (struct snapshot*) get_block(sb, record);
+    uint64_t* head = owned ? &rec->owned : &rec->saved;
+    if (*head != 0) {
+        struct snappage* page = (struct snappage*) get_block(sb, *head);
+        uint64_t last = page->count - 1;
+        int added = 1;
+        if (owned && page->count > 0 && page->links[2 * last] + page->links[2 * last + 1] == a) {
+            page->links[2 * last + 1] += b;
+        } else if (page->count < (sb->blksz - sizeof(struct snappage)) / (2 * sizeof(uint64_t))) {
+            page->links[2 * page->count] = a;
+            page->links[2 * page->count + 1] = b;
+            page->count++;
+        } else {
+            added = 0;
+        }
+        if (added) write_block(sb, *head, page, 1);
+        release_block(sb, page);
+        if (added) {
+            release_block(sb, rec);
+            return 0;
+        }
+    }
+
+    uint64_t nblocks;
+    uint64_t block = alloc_blocks(sb, 1, &nblocks);
+    if (block == 0) {
+        release_block(sb, rec);
+        return -1;
+    }
+    struct snappage* page = (struct snappage*) new_block(sb, block);
+    page->next = *head;
+    page->count = 1;
+    page->links[0] = a;
+    page->links[1] = b;
+    write_block(sb, block, page, 1);
+    release_block(sb, page);
+    *head = block;
+    write_block(sb, record, rec, 1);
+    release_block(sb, rec);
+    return 0;
+}
+
+/* Whether the newest snapshot no longer needs what =block holds: it was
+ * allocated after the snapshot was taken or the snapshot already saved a
+ * copy, which =fresh forgets on fs_open and when a newer snapshot is
+ * deleted.  Called with =alloc and the cache lock held. */
+int snap_fresh(struct snapstate* snap, uint64_t block) {
+    return fresh_has(snap, block) || savedmap_get(&snap->snaps[0], block) != 0;
+}
+
+/* fs_put_blocks, with =alloc held.  Blocks that a snapshot may still use
+ * are kept in =owned instead of going to the free list. */
+int put_blocks(struct superblock* sb, uint64_t block, uint64_t nblocks) {
+    struct snapstate* snap = sb->state->cache->snap;
+    if (snap == NULL || snap->nsnaps == 0) return free_blocks(sb, block, nblocks);
+
+    uint64_t end = block + nblocks;
+    while (block < end) {
+        pthread_mutex_lock(&sb->state->cache->lock);
+        int fresh = snap_fresh(snap, block);
+        uint64_t len = 1;
+        while (block + len < end && snap_fresh(snap, block + len) == fresh) len++;
+        pthread_mutex_unlock(&sb->state->cache->lock);
+
+        uint64_t last = 2 * snap->nowned - 2;
+        if (fresh) {
+            free_blocks(sb, block, len);
+        } else if (snap->nowned > 0 && snap->owned[last] + snap->owned[last + 1] == block) {
+            snap->owned[last + 1] += len;
+        } else {
+            if (snap->nowned == snap->maxowned) {
+                snap->maxowned = (snap->maxowned == 0) ? 64 : 2 * snap->maxowned;
+                snap->owned = (uint64_t*) realloc(snap->owned, 2 * snap->maxowned * sizeof(uint64_t));
+            }
+            snap->owned[2 * snap->nowned] = block;
+            snap->owned[2 * snap->nowned + 1] = len;
+            snap->nowned++;
+        }
+        block += len;
+    }
+    return 0;
+}
+
+/* Add the extents freed since the last flush to the newest snapshot, and
+ * copy the old contents of the dirty blocks it still needs before they
+ * are overwritten.  Called by cache_flush with =alloc and the snapshot
+ * lock held.  Returns -1 if there was no room for a copy or a page: the
+ * blocks left without a copy stay marked =copy, and the extents left
+ * out stay in =owned, until a later flush. */
+int snap_flush(struct superblock* sb) {
+    struct blkcache* cache = sb->state->cache;
+    struct snapstate* snap = cache->snap;
+    if (snap->nsnaps == 0) {
+        pthread_mutex_lock(&cache->lock);
+        snap_recount(cache);
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+    struct snapmem* sm = &snap->snaps[0];
+    snap->flushing = 1;
+
+    uint64_t done = 0;
+    while (done < snap->nowned
+            && snappage_add(sb, sm->record, 1, snap->owned[2 * done], snap->owned[2 * done + 1]) == 0) {
+        done++;
+    }
+    if (done > 0) {
+        memmove(snap->owned, snap->owned + 2 * done, 2 * (snap->nowned - done) * sizeof(uint64_t));
+        snap->nowned -= done;
+    }
+    int full = snap->nowned > 0;
+
+    pthread_mutex_lock(&cache->lock);
+    uint64_t* blocks = (uint64_t*) malloc(cache->nslots * sizeof(uint64_t));
+    uint64_t nblocks = 0;
+    for (struct cacheblk* slot = cache->head; slot != NULL; slot = slot->next) {
+        if (slot->block != 0 && slot->dirty && snap_unsaved(cache, slot)) blocks[nblocks++] = slot->block;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    char* buf = (char*) malloc(sb->blksz);
+    for (uint64_t ii = 0; ii < nblocks; ii++) {
+        if (savedmap_get(sm, blocks[ii]) != 0) {
+            pthread_mutex_lock(&cache->lock);
+            fresh_add(snap, blocks[ii], 1);
+            pthread_mutex_unlock(&cache->lock);
+            continue;
+        }
+        uint64_t got;
+        uint64_t copy = alloc_blocks(sb, 1, &got);
+        if (copy != 0 && snappage_add(sb, sm->record, 0, blocks[ii], copy) < 0) {
+            free_blocks(sb, copy, 1);
+            copy = 0;
+        }
+        if (copy == 0) {
+            full = 1;
+            break;
+        }
+        stats_io(sb, 0, pread(sb->state->fd, buf, sb->blksz, blocks[ii] * sb->blksz), 1);
+        if (journal_freed(cache, copy)) {
+            //the copy may still be in use in the committed image: log it
+            pthread_mutex_lock(&cache->lock);
+            struct cacheblk* slot = cache_slot(sb, copy, 0);
+            memcpy(slot->data, buf, sb->blksz);
+            if (slot->dirty == 0 || slot->isdata) cache->ndirty++;
+            slot->dirty = 1;
+            slot->isdata = 0;
+            slot->raw = 1;
+            pthread_mutex_unlock(&cache->lock);
+        } else {
+            cache_drop(sb, copy);
+            stats_io(sb, 1, pwrite(sb->state->fd, buf, sb->blksz, copy * sb->blksz), 1);
+        }
+        savedmap_put(sm, blocks[ii], copy);
+
+        pthread_mutex_lock(&cache->lock);
+        fresh_add(snap, blocks[ii], 1);
+        cache->jsynced = 0;
+        pthread_mutex_unlock(&cache->lock);
+    }
+    free(buf);
+    free(blocks);
+    snap->flushing = 0;
+    pthread_mutex_lock(&cache->lock);
+    snap_recount(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return full ? -1 : 0;
+}
+
+/* Count =slot, just made dirty, in the copies the next flush has to make
+ * if the newest snapshot still needs its old contents.  Called with the
+ * cache lock held. */
+void snap_mark(struct blkcache* cache, struct cacheblk* slot) {
+    if (slot->copy || !snap_unsaved(cache, slot)) return;
+    slot->copy = 1;
+    __atomic_add_fetch(&cache->snap->pending, 1, __ATOMIC_RELAXED);
+}
+
+/* Mark =copy exactly the dirty slots that still need a copy, and count
+ * them in =pending.  Called with the cache lock held. */
+void snap_recount(struct blkcache* cache) {
+    uint64_t pending = 0;
+    for (struct cacheblk* slot = cache->head; slot != NULL; slot = slot->next) {
+        slot->copy = slot->block != 0 && slot->dirty && snap_unsaved(cache, slot);
+        pending += slot->copy;
+    }
+    __atomic_store_n(&cache->snap->pending, pending, __ATOMIC_RELAXED);
+}
+
+/* Free blocks that allocations must leave for the next flush: a copy of
+ * every pending block and of =nblocks more, plus SNAPSHOT_OP_BLOCKS, and
+ * the snapshot pages that list them and the =owned extents.  Zero without
+ * snapshots, and while snap_flush allocates the copies themselves.
+ * Called with =alloc held. */
+uint64_t snap_held(struct superblock* sb, uint64_t nblocks) {
+    struct snapstate* snap = sb->state->cache->snap;
+    if (snap == NULL || snap->nsnaps == 0 || snap->flushing) return 0;
+    uint64_t copies = __atomic_load_n(&snap->pending, __ATOMIC_RELAXED) + nblocks + SNAPSHOT_OP_BLOCKS;
+    uint64_t per_page = (sb->blksz - sizeof(struct snappage)) / (2 * sizeof(uint64_t));
+    return copies + (copies + snap->nowned) / per_page + 2;
+}
+
+/* Fail with ENOSPC if an operation that may dirty =nblocks blocks of file
+ * data, besides its metadata, would leave the next flush without room for
+ * the copies the snapshots need (see snap_held), or a removal without the
+ * room kept for it (see snap_reserve_removal). */
+int snap_reserve(struct superblock* sb, uint64_t nblocks) {
+    if (sb->state->cache->snap == NULL) return 0;
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    int full = snap_held(sb, nblocks + SNAPSHOT_OP_BLOCKS) > sb->freeblks;
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+    if (!full) return 0;
+    errno = ENOSPC;
+    return -1;
+}
+
+/* Count the blocks of the =nblocks at =block that put_blocks would free in
+ * =*gain, and the extents it would keep for the snapshots in =*kept.
+ * Called with =alloc held. */
+void snap_count_put(struct superblock* sb, uint64_t block, uint64_t nblocks, uint64_t* gain, uint64_t* kept) {
+    struct blkcache* cache = sb->state->cache;
+    pthread_mutex_lock(&cache->lock);
+    for (uint64_t ii = 0; ii < nblocks; ii++) {
+        if (snap_fresh(cache->snap, block + ii)) (*gain)++;
+        else if (ii == 0 || snap_fresh(cache->snap, block + ii - 1)) (*kept)++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* snap_reserve for removing the entity whose head inode is =blk, a file
+ * or an empty directory.  The blocks the removal frees count as room, and
+ * the extents it leaves to the snapshots need room in their pages; the
+ * metadata it dirties is covered by the SNAPSHOT_OP_BLOCKS that
+ * allocations leave for a removal.  Called with =ns held. */
+int snap_reserve_removal(struct superblock* sb, uint64_t blk) {
+    struct snapstate* snap = sb->state->cache->snap;
+    if (snap == NULL) return 0;
+    uint64_t gain = 0, kept = 0;
+    pthread_mutex_lock(&sb->state->locks->alloc);
+    if (snap->nsnaps == 0) {
+        pthread_mutex_unlock(&sb->state->locks->alloc);
+        return 0;
+    }
+    struct inode* head = retrieve_inode(sb, blk);
+    int extents = (head->mode & IMEXTENT) != 0;
+    if (!is_compact(sb)) snap_count_put(sb, head->meta, 1, &gain, &kept);
+    uint64_t curr_blk = blk;
+    struct inode* node = head;
+    while (curr_blk != 0) {
+        snap_count_put(sb, curr_blk, 1, &gain, &kept);
+        if ((node->mode & (IMINLINE | IMDIR)) != 0) {
+            //no data blocks
+        } else if (extents) {
+            for (int ext = 0; ext < get_num_extents_in_node(sb, node); ext++) {
+                snap_count_put(sb, node->links[2 * ext], node->links[2 * ext + 1], &gain, &kept);
+            }
+        } else {
+            for (int link_index = 0; node->links[link_index] != 0; link_index++) {
+                snap_count_put(sb, node->links[link_index], 1, &gain, &kept);
+            }
+        }
+        curr_blk = node->next;
+        release_block(sb, node);
+        if (curr_blk != 0) node = retrieve_inode(sb, curr_blk);
+    }
+    uint64_t per_page = (sb->blksz - sizeof(struct snappage)) / (2 * sizeof(uint64_t));
+    int full = snap_held(sb, 0) + (kept + per_page - 1) / per_page > sb->freeblks + gain;
+    pthread_mutex_unlock(&sb->state->locks->alloc);
+    if (!full) return 0;
+    errno = ENOSPC;
+    return -1;
+}
+
+/* Delete the snapshot at =index of =snaps.  The copies it saved and the
+ * blocks it owns go to the next older snapshot, which may need them, or
+ * back to the free list if there is none (or the older one saved its own
+ * copy).  Called with =alloc and the snapshot lock held. */
+void snap_delete(struct superblock* sb, uint64_t index) {
+    struct blkcache* cache = sb->state->cache;
+    struct snapstate* snap = cache->snap;
+    struct snapmem* sm = &snap->snaps[index];
+    struct snapmem* older = (index + 1 < snap->nsnaps) ? &snap->snaps[index + 1] : NULL;
+    struct snapshot* rec = (struct snapshot*) get_block(sb, sm->record);
+    uint64_t next = rec->next;
+    uint64_t lists[2] = {rec->saved, rec->owned};
+    release_block(sb, rec);
+
+    int lost = 0;
+    for (uint64_t ii = 0; ii < sm->cap; ii++) {
+        uint64_t block = sm->keys[ii];
+        if (block == 0) continue;
+        if (older != NULL && savedmap_get(older, block) == 0) {
+            savedmap_put(older, block, sm->vals[ii]);
+            if (snappage_add(sb, older->record, 0, block, sm->vals[ii]) < 0) lost = 1;
+        } else {
+            free_blocks(sb, sm->vals[ii], 1);
+        }
+    }
+    for (int owned = 0; owned < 2; owned++) {
+        uint64_t pg = lists[owned];
+        while (pg != 0) {
+            struct snappage* page = (struct snappage*) get_block(sb, pg);
+            uint64_t next_pg = page->next;
+            for (uint64_t ii = 0; owned && ii < page->count; ii++) {
+                if (older == NULL) {
+                    free_blocks(sb, page->links[2 * ii], page->links[2 * ii + 1]);
+                } else if (snappage_add(sb, older->record, 1, page->links[2 * ii], page->links[2 * ii + 1]) < 0) {
+                    lost = 1;
+                }
+            }
+            release_block(sb, page);
+            free_blocks(sb, pg, 1);
+            pg = next_pg;
+        }
+    }
+
+    //unlink the record
+    if (index == 0) {
+        sb->snapshots = next;
+        save_superblock(sb);
+    } else {
+        struct snapshot* newer = (struct snapshot*) get_block(sb, snap->snaps[index - 1].record);
+        newer->next = next;
+        write_block(sb, snap->snaps[index - 1].record, newer, 1);
+        release_block(sb, newer);
+    }
+    free_blocks(sb, sm->record, 1);
+
+    free(sm->keys);
+    free(sm->vals);
+    pthread_mutex_lock(&cache->lock);
+    memmove(sm, sm + 1, (snap->nsnaps - index - 1) * sizeof(struct snapmem));
+    snap->nsnaps--;
+    if (snap->nsnaps == 0) snap->nfresh = 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    //the older snapshot misses some of what it needs
+    if (lost) snap_drop_all(sb);
+}
+
+/* Delete every snapshot, oldest first so that nothing moves to another
+ * one, and free the blocks kept for them.  Called with =alloc and the
+ * snapshot lock held. */
+void snap_drop_all(struct superblock* sb) {
+    struct snapstate* snap = sb->state->cache->snap;
+    while (snap->nsnaps > 0) snap_delete(sb, snap->nsnaps - 1);
+    for (uint64_t ii = 0; ii < snap->nowned; ii++) {
+        free_blocks(sb, snap->owned[2 * ii], snap->owned[2 * ii + 1]);
+    }
+    snap->nowned = 0;
+}
+
+/* Read =nbytes from =block on for =sb, a snapshot opened with
+ * fs_snapshot_open, each block from wherever the snapshot keeps it.  Runs
+ * that stay contiguous are read with a single pread.  Blocks of a dropped
+ * snapshot read as zeros. */
+void view_read(struct superblock* sb, uint64_t block, void* buf, size_t nbytes) {
+    struct snapstate* snap = sb->state->cache->live->state->cache->snap;
+    pthread_rwlock_rdlock(&snap->lock);
+    int index = snap_index(snap, sb->state->cache->snapid);
+    if (index < 0) {
+        memset(buf, 0, nbytes);
+        pthread_rwlock_unlock(&snap->lock);
+        return;
+    }
+
+    //a run of =run blocks read from =first on disk into block =start of =buf
+    uint64_t nblocks = (nbytes + sb->blksz - 1) / sb->blksz;
+    uint64_t first = 0, start = 0, run = 0;
+    for (uint64_t ii = 0; ii <= nblocks; ii++) {
+        uint64_t src = 0;
+        if (ii < nblocks) {
+            src = block + ii;
+            for (int kk = index; kk >= 0; kk--) {
+                uint64_t copy = savedmap_get(&snap->snaps[kk], block + ii);
+                if (copy != 0) {
+                    src = copy;
+                    break;
+                }
+            }
+            if (run > 0 && src == first + run) {
+                run++;
+                continue;
+            }
+        }
+        if (run > 0) {
+            size_t off = start * sb->blksz;
+            size_t len = (run * sb->blksz < nbytes - off) ? run * sb->blksz : nbytes - off;
+            ssize_t ret = pread(sb->state->fd, (char*) buf + off, len, first * sb->blksz);
+            stats_io(sb, 0, ret, 1);
+            if (ret < 0) ret = 0;
+            if ((size_t) ret < len) memset((char*) buf + off + ret, 0, len - ret);
+        }
+        first = src;
+        start = ii;
+        run = 1;
+    }
+    pthread_rwlock_unlock(&snap->lock);
+}
+
+/* Fail with EROFS if =sb is a snapshot opened with fs_snapshot_open. */
+int view_readonly(struct superblock* sb) {
+    if (sb->state->cache->live == NULL) return 0;
+    errno = EROFS;
+    return -1;
+}
+
+/* Fail with EIO if =sb is a snapshot whose snapshot was dropped. */
+int view_lost(struct superblock* sb) {
+    if (sb->state->cache->live == NULL) return 0;
+    struct snapstate* snap = sb->state->cache->live->state->cache->snap;
+    pthread_rwlock_rdlock(&snap->lock);
+    int lost = snap_index(snap, sb->state->cache->snapid) < 0;
+    pthread_rwlock_unlock(&snap->lock);
+    if (lost) errno = EIO;
+    return lost;
+}
+
+const char* fsck_use_names[] = {
+    "unused block", "superblock", "journal block", "freepage", "free block",
+    "inode", "nodeinfo", "data block", "snapshot block"
+};
+
+/* Forget everything found so far and start the check over. */
+void fsck_reset(struct fsck* ck) {
+    memset(ck->use, 0, ck->sb->blks);
+    ck->phase = FSCK_START;
+    pthread_mutex_lock(&ck->sb->state->cache->lock);
+    ck->gen = ck->sb->state->cache->gen;
+    pthread_mutex_unlock(&ck->sb->state->cache->lock);
+    ck->freepage = 0;
+    ck->nfree = 0;
+    ck->nstack = 0;
+
+    uint64_t restarts = ck->report.restarts;
+    memset(&ck->report, 0, sizeof(struct fsck_report));
+    ck->report.restarts = restarts;
+}
+
+void fsck_error(struct fsck* ck, const char* fmt, ...) {
+    pthread_mutex_lock(&ck->lock);
+    ck->report.errors++;
+    if (ck->log != NULL) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(ck->log, fmt, ap);
+        va_end(ap);
+        fputc('\n', ck->log);
+    }
+    pthread_mutex_unlock(&ck->lock);
+}
+
+int fsck_read(struct fsck* ck, uint64_t block, void* buf) {
+    size_t blksz = ck->sb->blksz;
+    size_t done = 0;
+    while (done < blksz) {
+        ssize_t ret = pread(ck->sb->state->fd, (char*) buf + done, blksz - done, block * blksz + done);
+        stats_io(ck->sb, 0, ret, 1);
+        if (ret <= 0) {
+            fsck_error(ck, "block %" PRIu64 ": cannot be read", block);
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* Record =use as the use of the =nblocks blocks starting at =block.  Each
+ * run of blocks that already had a use is reported once.  Returns how
+ * many blocks could not be claimed. */
+uint64_t fsck_claim(struct fsck* ck, uint64_t block, uint64_t nblocks, int use) {
+    uint64_t blks = ck->sb->blks;
+    if (block == 0 || block >= blks || nblocks > blks - block) {
+        if (nblocks == 1) {
+            fsck_error(ck, "block %" PRIu64 ": out of range for a %s", block, fsck_use_names[use]);
+        } else {
+            fsck_error(ck, "blocks %" PRIu64 "+%" PRIu64 ": out of range for a %s",
+                       block, nblocks, fsck_use_names[use]);
+        }
+        return nblocks;
+    }
+
+    uint64_t failed = 0;
+    uint64_t run = 0; //blocks in the current run of conflicts
+    unsigned char run_use = 0;
+    for (uint64_t ii = 0; ii <= nblocks; ii++) {
+        unsigned char prev = 0;
+        if (ii < nblocks) {
+            __atomic_compare_exchange_n(&ck->use[block + ii], &prev, (unsigned char) use,
+                                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        if (prev != 0 && run > 0 && prev == run_use) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            uint64_t first = block + ii - run;
+            if (run == 1) {
+                fsck_error(ck, "block %" PRIu64 ": used as a %s and as a %s",
+                           first, fsck_use_names[run_use], fsck_use_names[use]);
+            } else {
+                fsck_error(ck, "blocks %" PRIu64 "-%" PRIu64 ": used as a %s and as a %s",
+                           first, first + run - 1, fsck_use_names[run_use], fsck_use_names[use]);
+            }
+            failed += run;
+            run = 0;
+        }
+        if (prev != 0) {
+            run = 1;
+            run_use = prev;
+        }
+    }
+    return failed;
+}
+
+void fsck_push(struct fsck* ck, uint64_t block, uint64_t parent, uint64_t type, const char* name) {
+    pthread_mutex_lock(&ck->lock);
+    if (ck->nstack == ck->maxstack) {
+        ck->maxstack = ck->maxstack ? 2 * ck->maxstack : 64;
+        ck->stack = (struct fsck_item*) realloc(ck->stack, ck->maxstack * sizeof(struct fsck_item));
+    }
+    struct fsck_item* item = &ck->stack[ck->nstack++];
+    item->block = block;
+    item->parent = parent;
+    item->type = type;
+    item->name[0] = '\0';
+    //names that do not fit are not compared
+    if (name != NULL && strlen(name) < NAME_MAX_LEN) strcpy(item->name, name);
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+/* Check the superblock and the journal, and queue the root directory. */
+void fsck_start(struct fsck* ck) {
+    struct superblock* sb = ck->sb;
+    struct superblock* super = ck->super;
+    ck->use[0] = FSCK_SUPER;
+    ck->phase = FSCK_DONE;
+
+    if (fsck_read(ck, 0, super) < 0) return;
+    if (super->magic != 0xdcc605f5 || super->blksz != sb->blksz || super->blks != sb->blks) {
+        fsck_error(ck, "superblock: bad magic or geometry");
+        return;
+    }
+    struct stat st;
+    if (fstat(sb->state->fd, &st) == 0 && (uint64_t) st.st_size / sb->blksz < sb->blks) {
+        fsck_error(ck, "superblock: %" PRIu64 " blocks, but the image holds %" PRIu64,
+                   sb->blks, (uint64_t) st.st_size / sb->blksz);
+        return;
+    }
+
+    if (super->journal != 0) {
+        struct journal* hdr = (struct journal*) malloc(sb->blksz);
+        if (super->journal >= sb->blks || fsck_read(ck, super->journal, hdr) < 0
+                || hdr->magic != JOURNAL_MAGIC || hdr->nblocks < 3
+                || hdr->nblocks > sb->blks - super->journal) {
+            fsck_error(ck, "journal %" PRIu64 ": bad header", super->journal);
+        } else {
+            fsck_claim(ck, super->journal, hdr->nblocks, FSCK_JOURNAL);
+        }
+        free(hdr);
+    }
+    fsck_snapshots(ck);
+
+    fsck_push(ck, super->root, super->root, IMDIR, "/");
+    ck->freepage = super->freelist;
+    ck->phase = FSCK_FREELIST;
+}
+
+/* Claim the records of the snapshots, their pages, the copies they saved
+ * and the blocks they own.  The trees of the snapshots are not walked:
+ * whatever they still use is either in the live tree, saved or owned. */
+void fsck_snapshots(struct fsck* ck) {
+    struct superblock* sb = ck->sb;
+    uint64_t max = (sb->blksz - sizeof(struct snappage)) / (2 * sizeof(uint64_t));
+    struct snapshot* rec = (struct snapshot*) malloc(sb->blksz);
+    struct snappage* page = (struct snappage*) malloc(sb->blksz);
+    for (uint64_t block = ck->super->snapshots; block != 0; block = rec->next) {
+        if (block >= sb->blks || fsck_read(ck, block, rec) < 0 || rec->magic != SNAPSHOT_MAGIC) {
+            fsck_error(ck, "snapshot %" PRIu64 ": bad record", block);
+            break;
+        }
+        if (fsck_claim(ck, block, 1, FSCK_SNAPSHOT) > 0) break;
+        for (int owned = 0; owned < 2; owned++) {
+            uint64_t pg = owned ? rec->owned : rec->saved;
+            while (pg != 0) {
+                if (fsck_claim(ck, pg, 1, FSCK_SNAPSHOT) > 0 || fsck_read(ck, pg, page) < 0) break;
+                if (page->count > max) {
+                    fsck_error(ck, "snapshot page %" PRIu64 ": %" PRIu64 " entries", pg, page->count);
+                    break;
+                }
+                for (uint64_t ii = 0; ii < page->count; ii++) {
+                    //(first, length) extents, or (block, copy) pairs
+                    if (owned) fsck_claim(ck, page->links[2 * ii], page->links[2 * ii + 1], FSCK_SNAPSHOT);
+                    else fsck_claim(ck, page->links[2 * ii + 1], 1, FSCK_SNAPSHOT);
+                }
+                pg = page->next;
+            }
+        }
+    }
+    free(page);
+    free(rec);
+}
+
+/* Claim the blocks on the free list, one freepage per unit of budget. */
+void fsck_freelist(struct fsck* ck) {
+    struct freepage* fp = (struct freepage*) malloc(ck->sb->blksz);
+    uint64_t max_extents = get_max_extents_in_freepage(ck->sb);
+
+    while (ck->freepage != 0 && ck->budget > 0) {
+        uint64_t page = ck->freepage;
+        ck->freepage = 0;
+        ck->budget--;
+        if (fsck_claim(ck, page, 1, FSCK_FREEPAGE) > 0 || fsck_read(ck, page, fp) < 0) break;
+        ck->nfree++;
+
+        uint64_t count = fp->count;
+        if (count > max_extents) {
+            fsck_error(ck, "freepage %" PRIu64 ": %" PRIu64 " extents", page, count);
+            count = max_extents;
+        }
+        for (uint64_t ii = 0; ii < count; ii++) {
+            uint64_t nblocks = fp->links[2 * ii + 1];
+            ck->nfree += nblocks - fsck_claim(ck, fp->links[2 * ii], nblocks, FSCK_FREE);
+        }
+        ck->freepage = fp->next;
+    }
+    free(fp);
+    if (ck->freepage == 0) ck->phase = FSCK_TREE;
+}
+
+/* Check queued entities with =nthreads threads, this one included, until
+ * the queue is empty or the budget runs out. */
+void fsck_tree(struct fsck* ck) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    int nthreads = 0;
+    while (nthreads < ck->nthreads - 1) {
+        if (pthread_create(&threads[nthreads], NULL, fsck_worker, ck) != 0) break;
+        nthreads++;
+    }
+    fsck_worker(ck);
+    for (int ii = 0; ii < nthreads; ii++) {
+        pthread_join(threads[ii], NULL);
+    }
+    if (ck->nstack == 0) ck->phase = FSCK_LEAKS;
+}
+
+void* fsck_worker(void* arg) {
+    struct fsck* ck = (struct fsck*) arg;
+    char* buf = (char*) malloc(2 * ck->sb->blksz);
+
+    pthread_mutex_lock(&ck->lock);
+    for (;;) {
+        if (ck->nstack > 0 && ck->budget > 0) {
+            struct fsck_item item = ck->stack[--ck->nstack];
+            ck->budget--;
+            ck->busy++;
+            pthread_mutex_unlock(&ck->lock);
+            fsck_entity(ck, &item, buf);
+            pthread_mutex_lock(&ck->lock);
+            ck->busy--;
+            //nothing left to check and nobody to add more: wake everyone up
+            if (ck->busy == 0 && ck->nstack == 0) pthread_cond_broadcast(&ck->cond);
+            continue;
+        }
+        if (ck->busy == 0 || ck->budget == 0) break;
+        pthread_cond_wait(&ck->cond, &ck->lock);
+    }
+    pthread_mutex_unlock(&ck->lock);
+
+    free(buf);
+    return NULL;
+}
+
+/* Check the directory or file whose head inode is =item->block, its
+ * nodeinfo and its chain of child inodes, queueing the entries of a
+ * directory.  =buf holds two blocks. */
+void fsck_entity(struct fsck* ck, struct fsck_item* item, char* buf) {
+    struct superblock* sb = ck->sb;
+    struct inode* node = (struct inode*) buf;
+    struct nodeinfo* info = (struct nodeinfo*) (buf + sb->blksz);
+    uint64_t blk = item->block;
+
+    if (fsck_claim(ck, blk, 1, FSCK_INODE) > 0 || fsck_read(ck, blk, node) < 0) return;
+    uint64_t mode = node->mode;
+    int isdir = (mode & IMDIR) != 0;
+    if ((mode & IMCHILD) != 0 || isdir == ((mode & IMREG) != 0)) {
+        fsck_error(ck, "inode %" PRIu64 ": bad mode %" PRIu64, blk, mode);
+        return;
+    }
+    if (item->type != 0 && item->type != (isdir ? IMDIR : IMREG)) {
+        fsck_error(ck, "inode %" PRIu64 ": entry says it is a %s", blk,
+                   item->type == IMDIR ? "directory" : "file");
+    }
+    if (node->parent != item->parent) {
+        fsck_error(ck, "inode %" PRIu64 ": parent is %" PRIu64 ", not %" PRIu64,
+                   blk, node->parent, item->parent);
+    }
+    __atomic_fetch_add(isdir ? &ck->report.dirs : &ck->report.files, 1, __ATOMIC_RELAXED);
+
+    int has_info;
+    size_t info_size = sb->blksz;
+    if (is_compact(sb)) {
+        //the nodeinfo is the end of the inode's block, copied since =node
+        //moves on to the child inodes
+        info_size = COMPACT_INFO_SIZE;
+        has_info = node->meta == blk;
+        if (has_info) memcpy(info, (char*) node + sb->blksz - info_size, info_size);
+        else fsck_error(ck, "inode %" PRIu64 ": nodeinfo is in block %" PRIu64, blk, node->meta);
+    } else {
+        has_info = fsck_claim(ck, node->meta, 1, FSCK_NODEINFO) == 0
+                   && fsck_read(ck, node->meta, info) == 0;
+    }
+    if (has_info) {
+        if (memchr(info->name, '\0', info_size - sizeof(struct nodeinfo)) == NULL) {
+            fsck_error(ck, "nodeinfo %" PRIu64 ": name is not terminated", node->meta);
+        } else if (item->name[0] != '\0' && strcmp(info->name, item->name) != 0) {
+            fsck_error(ck, "inode %" PRIu64 ": named \"%s\", entry says \"%s\"",
+                       blk, info->name, item->name);
+        }
+    }
+
+    if (!isdir && (mode & IMINLINE) != 0) {
+        if (node->next != 0) {
+            fsck_error(ck, "file %" PRIu64 ": inline contents but child inode %" PRIu64,
+                       blk, node->next);
+        }
+        if (has_info && info->size > get_inline_capacity(sb)) {
+            fsck_error(ck, "file %" PRIu64 ": size is %" PRIu64 ", too large to be inline",
+                       blk, info->size);
+        }
+        return;
+    }
+
+    int flag = (mode & (isdir ? IMDIRENT : IMEXTENT)) != 0;
+    if (!isdir && (mode & IMZIP) != 0 && !flag) {
+        fsck_error(ck, "file %" PRIu64 ": compressed without extents", blk);
+        return;
+    }
+    uint64_t found = 0;
+    uint64_t curr_blk = blk;
+    for (;;) {
+        if (isdir) found += fsck_dir_node(ck, blk, node, flag);
+        else found += fsck_file_node(ck, node, flag);
+
+        uint64_t next_blk = node->next;
+        if (next_blk == 0) break;
+        if (fsck_claim(ck, next_blk, 1, FSCK_INODE) > 0 || fsck_read(ck, next_blk, node) < 0) {
+            has_info = 0; //the count is incomplete
+            break;
+        }
+        if (node->mode != IMCHILD || node->parent != blk || node->meta != curr_blk) {
+            fsck_error(ck, "inode %" PRIu64 ": child inode %" PRIu64 " is not chained to it",
+                       blk, next_blk);
+        }
+        curr_blk = next_blk;
+    }
+
+    if (!has_info) return;
+    if (isdir && found != info->size) {
+        fsck_error(ck, "directory %" PRIu64 ": size is %" PRIu64 ", found %" PRIu64 " entries",
+                   blk, info->size, found);
+    }
+    if (!isdir && (mode & IMZIP) != 0) {
+        //compressed only if it saves a block
+        if (found == 0 || found >= (info->size + sb->blksz - 1) / sb->blksz) {
+            fsck_error(ck, "file %" PRIu64 ": size is %" PRIu64 ", found %" PRIu64 " blocks of compressed data",
+                       blk, info->size, found);
+        }
+    } else if (!isdir && found != (info->size + sb->blksz - 1) / sb->blksz) {
+        fsck_error(ck, "file %" PRIu64 ": size is %" PRIu64 ", found %" PRIu64 " blocks",
+                   blk, info->size, found);
+    }
+}
+
+/* Queue the entries held by =node, an inode of the directory =dir_blk, and
+ * return how many there are. */
+uint64_t fsck_dir_node(struct fsck* ck, uint64_t dir_blk, struct inode* node, int packed) {
+    uint64_t count = 0;
+    if (!packed) {
+        int max_links = get_max_links_in_node(ck->sb, node);
+        for (int ii = 0; ii < max_links && node->links[ii] != 0; ii++) {
+            fsck_push(ck, node->links[ii], dir_blk, 0, NULL);
+            count++;
+        }
+        return count;
+    }
+
+    size_t area = get_direntry_area(ck->sb, node);
+    size_t pos = 0;
+    while (pos + sizeof(struct direntry) <= area) {
+        struct direntry* ent = (struct direntry*) ((char*) node->links + pos);
+        if (ent->inode == 0) break;
+        if (ent->reclen <= sizeof(struct direntry) || ent->reclen % 8 != 0 || ent->reclen > area - pos
+                || memchr(ent->name, '\0', ent->reclen - sizeof(struct direntry)) == NULL) {
+            fsck_error(ck, "directory %" PRIu64 ": bad entry at offset %zu", dir_blk, pos);
+            break;
+        }
+        uint64_t type = ent->type;
+        if (type != IMDIR && type != IMREG) {
+            fsck_error(ck, "directory %" PRIu64 ": entry \"%s\" has type %" PRIu64,
+                       dir_blk, ent->name, type);
+            type = 0;
+        }
+        fsck_push(ck, ent->inode, dir_blk, type, ent->name);
+        count++;
+        pos += ent->reclen;
+    }
+    return count;
+}
+
+/* Claim the data blocks listed in =node, an inode of a file, and return
+ * how many there are.  The caller checks how =node is chained. */
+uint64_t fsck_file_node(struct fsck* ck, struct inode* node, int extents) {
+    uint64_t count = 0;
+    if (extents) {
+        int max_extents = get_max_extents_in_node(ck->sb, node);
+        for (int ii = 0; ii < max_extents && node->links[2 * ii] != 0; ii++) {
+            fsck_claim(ck, node->links[2 * ii], node->links[2 * ii + 1], FSCK_DATA);
+            count += node->links[2 * ii + 1];
+        }
+    } else {
+        int max_links = get_max_links_in_node(ck->sb, node);
+        for (int ii = 0; ii < max_links && node->links[ii] != 0; ii++) {
+            fsck_claim(ck, node->links[ii], 1, FSCK_DATA);
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Report the blocks nothing claimed and compare the free blocks found with
+ * the count in the superblock. */
+void fsck_leaks(struct fsck* ck) {
+    uint64_t blks = ck->sb->blks;
+    uint64_t block = 0;
+    while (block < blks) {
+        int use = ck->use[block];
+        if (use != 0) {
+            if (use != FSCK_FREE && use != FSCK_FREEPAGE) ck->report.used++;
+            block++;
+            continue;
+        }
+        uint64_t first = block;
+        while (block < blks && ck->use[block] == 0) block++;
+        if (block - first == 1) fsck_error(ck, "block %" PRIu64 ": leaked", first);
+        else fsck_error(ck, "blocks %" PRIu64 "-%" PRIu64 ": leaked", first, block - 1);
+        ck->report.leaked += block - first;
+    }
+
+    ck->report.free = ck->nfree;
+    if (ck->nfree != ck->super->freeblks) {
+        fsck_error(ck, "superblock: %" PRIu64 " free blocks, found %" PRIu64,
+                   ck->super->freeblks, ck->nfree);
+    }
+    ck->phase = FSCK_DONE;
 }
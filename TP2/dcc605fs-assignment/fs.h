@@ -16,13 +16,20 @@
  * ETXTBUSY (text file busy)
  * EPERM (operation not permitted)
  * EACCES (permission denied)
+ * EROFS (read-only filesystem)
+ * EIO (input/output error)
  */
 
 #include <inttypes.h>
+#include <stdio.h>
 
 #define IMREG 1   /* regular inode */
 #define IMDIR 2   /* directory inode */
 #define IMCHILD 4 /* child inode */
+#define IMEXTENT 8 /* regular inode whose =links hold extents */
+#define IMDIRENT 16 /* directory inode whose =links hold packed entries */
+#define IMINLINE 32 /* regular inode whose =links hold the file's contents */
+#define IMZIP 64 /* regular inode whose extents hold the file compressed */
 
 struct superblock {
     uint64_t magic; /* 0xdcc605f5 */
@@ -31,9 +38,43 @@ struct superblock {
     uint64_t freeblks; /* number of free blocks in the filesystem */
     uint64_t freelist; /* pointer to free block list */
     uint64_t root; /* pointer to root directory's inode */
+    uint64_t journal;
+    /* first block of the metadata journal (struct journal), or zero if the
+     * filesystem has no journal. */
+    uint64_t snapshots;
+    /* record of the newest snapshot (struct snapshot), or zero if the
+     * filesystem has no snapshots. */
+    uint64_t format;
+    /* FORMAT_COMPACT if every entity keeps its nodeinfo inside its head
+     * inode (see struct inode); any other value for the classic layout,
+     * where the nodeinfo has a block of its own. */
+    struct fsstate *state;
+    /* what the open filesystem keeps in memory, see struct fsstate.  zero
+     * in the copy of the superblock on disk. */
+};
+
+/* In-memory state of an open filesystem.  None of it is stored in the
+ * image: it is set up by fs_format and fs_open, and freed by fs_close. */
+struct fsstate {
     int fd; /* file descriptor for the filesystem image */
+    struct blkcache *cache;
+    /* in-memory cache of metadata blocks for this image. */
+    struct dirindex *dirindex;
+    /* in-memory hash index of directory entries, built on first lookup in
+     * each directory. */
+    struct dcache *dcache;
+    /* in-memory cache mapping resolved paths to inode blocks. */
+    struct fslocks *locks;
+    /* locks that let several threads share this superblock. */
+    struct fs_stats *stats;
+    /* counters of the work done on this image, see fs_stats_get. */
 };
 
+#define FORMAT_COMPACT 0x636d7074dcc605f5ULL
+#define COMPACT_INFO_SIZE 120
+/* bytes at the end of a compact head inode that hold its nodeinfo: a
+ * struct nodeinfo and FS_NAME_MAX bytes of name, rounded up to 8. */
+
 struct inode {
     uint64_t mode;
     uint64_t parent;
@@ -43,15 +84,28 @@ struct inode {
      * IMCHILD) for the entity represented by this inode. */
     uint64_t meta;
     /* if =mode does not contain IMCHILD, then meta points to this inode's
-     * metadata (struct iinfo).  if =mode contains IMCHILD, then meta
-     * points to the previous inode for this inode's entity. */
+     * metadata (struct nodeinfo).  in a compact image, meta is this
+     * inode's own block instead, and the nodeinfo takes the last
+     * COMPACT_INFO_SIZE bytes of it, which =links never reach.  if =mode
+     * contains IMCHILD, then meta points to the previous inode for this
+     * inode's entity. */
     uint64_t next;
     /* if this file's date block do not fit in this inode, =next points to
      * the next inode for this entity; otherwise =next should be zero. */
     uint64_t links[];
     /* if =mode contains IMDIR, then entries in =links point to inode's
-     * for each entity in the directory.  otherwise, if =mode contains
-     * IMREG, then entries in =links point to this file's data blocks. */
+     * for each entity in the directory.  if =mode also contains IMDIRENT,
+     * =links holds packed struct direntry records instead, in this inode
+     * and in all its child inodes.  otherwise, if =mode contains
+     * IMREG, then entries in =links point to this file's data blocks.  if
+     * =mode also contains IMEXTENT, the data blocks are described by
+     * (first block, length) pairs instead, in this inode and in all its
+     * child inodes; a pair with a zero first block ends the list.  if
+     * =mode contains IMZIP as well, those blocks hold a struct zipheader
+     * and the compressed contents it describes rather than the file.  if
+     * =mode contains IMINLINE instead, the file is small enough that its
+     * contents are stored in =links itself, zero-padded, and it has no
+     * data blocks nor child inodes. */
 };
 
 struct nodeinfo {
@@ -66,16 +120,88 @@ struct nodeinfo {
     /* remainder of block used to store this entity's name. */
 };
 
+struct direntry {
+    uint64_t inode;
+    /* first inode of the entity; zero (or the end of the block) ends the
+     * list of entries in this inode. */
+    uint32_t reclen;
+    /* size of this record in bytes, a multiple of 8. */
+    uint32_t type;
+    /* IMDIR or IMREG, so listings do not need to read the entity. */
+    char name[];
+    /* name of the entity, zero-padded up to =reclen. */
+};
+
+struct zipheader {
+    uint64_t group;
+    /* bytes of the file in each group, a multiple of the block size.  the
+     * file is compressed a group at a time; the last group holds what is
+     * left, and may be shorter. */
+    uint32_t stored[];
+    /* bytes each group takes in the data blocks: its compressed size, or
+     * the size of the group itself if it is stored as is.  each group
+     * starts on a block boundary, the first one right after the blocks
+     * of the header. */
+};
+
 struct freepage {
     uint64_t next;
     /* link to next freepage; or zero if this is the last freepage */
     uint64_t count;
     uint64_t links[];
-    /* remainder of block used to store links to free blocks.  =count
-     * counts the number of elements in links, stored from links[0] to
-     * links[counts-1]. */
+    /* remainder of block used to store extents of free blocks.  =count
+     * counts the number of extents, stored as (first block, length) pairs
+     * from links[0] to links[2*count-1].  the block holding a freepage is
+     * itself free: it is handed out once the page has no extents left. */
+};
+
+struct journal {
+    uint64_t magic; /* JOURNAL_MAGIC */
+    uint64_t nblocks;
+    /* length of the journal region, including this block.  the region is
+     * allocated like any other blocks and is never on the free list. */
+    uint64_t seq;
+    /* lower bound for the sequence numbers of future transactions. */
 };
 
+#define JOURNAL_MAGIC 0x6a726e6cdcc605f5ULL
+
+struct snapshot {
+    uint64_t magic; /* SNAPSHOT_MAGIC */
+    uint64_t next;
+    /* record of the next older snapshot; or zero for the oldest. */
+    uint64_t root; /* root directory's inode when the snapshot was taken */
+    uint64_t saved;
+    /* first struct snappage of (block, copy) pairs: the blocks of the
+     * frozen tree that were overwritten while this was the newest
+     * snapshot, and where their old contents were copied. */
+    uint64_t owned;
+    /* first struct snappage of (first block, length) extents: blocks that
+     * the live tree freed while this was the newest snapshot, and that are
+     * kept for the frozen trees instead of going to the free list. */
+    uint64_t created; /* seconds since the epoch */
+    char name[];
+    /* remainder of block used to store the snapshot's name. */
+};
+
+struct snappage {
+    uint64_t next;
+    /* link to the next page of the same list; or zero for the last one */
+    uint64_t count;
+    uint64_t links[];
+    /* remainder of block used to store =count pairs, from links[0] to
+     * links[2*count-1]. */
+};
+
+#define SNAPSHOT_MAGIC 0x736e6170dcc605f5ULL
+
+/* An open filesystem may be used by several threads at once: every fs_*
+ * function below can be called concurrently on the same superblock, except
+ * fs_close, and except that a struct fsfile handle must not be used by two
+ * threads at the same time.  Lookups, reads, writes and creations run in
+ * parallel when they touch different directories and files; removals, and
+ * flushes of the block cache, wait for every other operation to finish. */
+
 #define MIN_BLOCK_SIZE 128
 #define MIN_BLOCK_COUNT 32
 
@@ -87,17 +213,50 @@ struct freepage {
  * to the appropriate error code.  If the block size is smaller than
  * MIN_BLOCK_SIZE bytes, then the format fails and the function sets errno to
  * EINVAL.  If there is insufficient space to store MIN_BLOCK_COUNT blocks in
- * =fname, then the function fails and sets errno to ENOSPC. */
+ * =fname, then the function fails and sets errno to ENOSPC.  If the blocks
+ * of the new filesystem cannot be written, errno is set by the write.  Only
+ * the first few blocks are written, so formatting takes the same time
+ * whatever the size of =fname; the other blocks keep whatever they held,
+ * unless FS_FMT_DISCARD is given to fs_format_flags. */
 struct superblock * fs_format(const char *fname, uint64_t blocksize);
 
+#define FS_FMT_COMPACT 1 /* keep each nodeinfo in its head inode, see =format */
+#define FS_FMT_DISCARD 2 /* release the storage behind the free blocks */
+
+/* Same as fs_format, but =flags selects optional features of the on-disk
+ * format (a combination of the FS_FMT_* constants).  With FS_FMT_COMPACT,
+ * an entity takes a single block for its inode and nodeinfo, so creating
+ * it, and reading its size or name, touches half the metadata blocks.
+ * Block sizes under 272 bytes leave the head inode too little room next
+ * to the nodeinfo, and keep the classic layout; =format tells which one
+ * was used, and fs_open picks it up from there.  With FS_FMT_DISCARD, a
+ * hole is punched over the free blocks, so formatting a used image gives
+ * its storage back to the OS and leaves it sparse; if the OS cannot punch
+ * holes in =fname, the format fails with errno set by fallocate (usually
+ * EOPNOTSUPP).  Other =flags set errno to EINVAL. */
+struct superblock * fs_format_flags(const char *fname, uint64_t blocksize, int flags);
+
 /* Open the filesystem in =fname and return its superblock.  Returns NULL on
  * error, and sets errno accordingly.  If =fname does not contain a
  * 0xdcc605fs, then errno is set to EBADF. */
 struct superblock * fs_open(const char *fname);
 
+#define FS_IO_PREAD 0 /* blocks go through the block cache with pread/pwrite */
+#define FS_IO_MMAP 1  /* the whole image is mapped and blocks used in place */
+#define FS_IO_URING 2 /* as FS_IO_PREAD, with batches of blocks read and written through io_uring */
+
+/* Same as fs_open, but =mode selects how the image is accessed (one of the
+ * FS_IO_* constants).  If the image cannot be mapped in FS_IO_MMAP mode,
+ * NULL is returned and errno is set by mmap.  If the kernel does not support
+ * io_uring, FS_IO_URING falls back to FS_IO_PREAD; setting DCC605FS_NO_URING
+ * in the environment forces that fallback.  Any other =mode sets errno to
+ * EINVAL. */
+struct superblock * fs_open_mode(const char *fname, int mode);
+
 /* Close the filesystem pointed to by =sb.  Returns zero on success and a
  * negative number on error.  If there is an error, all resources are freed
- * and errno is set appropriately. */
+ * and errno is set appropriately; a write to the image that failed since
+ * the last fs_sync is reported here, as by fs_sync. */
 int fs_close(struct superblock *sb);
 
 /* Get a free block in the filesystem.  This block shall be removed from the
@@ -111,9 +270,36 @@ uint64_t fs_get_block(struct superblock *sb);
  * accordingly. */
 int fs_put_block(struct superblock *sb, uint64_t block);
 
+/* Get a run of up to =count free blocks that are contiguous on disk.  The
+ * first block of the run is returned and its length is stored in =nblocks,
+ * which may be smaller than =count when no free extent is long enough.  If
+ * there are no free blocks, zero is returned. */
+uint64_t fs_get_blocks(struct superblock *sb, uint64_t count, uint64_t *nblocks);
+
+/* Put the =nblocks blocks starting at =block back into the filesystem as
+ * free blocks.  Returns zero on success or a negative value on error. */
+int fs_put_blocks(struct superblock *sb, uint64_t block, uint64_t nblocks);
+
 int fs_write_file(struct superblock *sb, const char *fname, char *buf,
                   size_t cnt);
 
+#define FS_WR_COMPRESS 1 /* store the file compressed, see IMZIP */
+
+/* Same as fs_write_file, but =flags selects how the file is stored (a
+ * combination of the FS_WR_* constants).  With FS_WR_COMPRESS, the file
+ * is compressed in groups of blocks with an LZ4-style codec and takes
+ * fewer data blocks, at the cost of compressing it now and decompressing
+ * it on every read.  Groups that do not shrink are stored as they are,
+ * and a file that would save no block at all is written uncompressed.
+ * fs_read_file and fs_file_pread return the original contents, and the
+ * size of the file is its uncompressed size.  Writing to the file with
+ * fs_file_pwrite first rewrites it uncompressed, and rewriting it with
+ * fs_write_file stores it uncompressed too.  Reads of a compressed file
+ * whose blocks do not decompress fail with EIO.  Other =flags set errno
+ * to EINVAL. */
+int fs_write_file_flags(struct superblock *sb, const char *fname, char *buf,
+                        size_t cnt, int flags);
+
 ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
                      size_t bufsz);
 
@@ -125,4 +311,254 @@ int fs_rmdir(struct superblock *sb, const char *dname);
 
 char * fs_list_dir(struct superblock *sb, const char *dname);
 
+/* Directory streams return the entries of a directory one at a time, in
+ * the order they are stored, reading the directory as they go; memory use
+ * does not depend on the size of the directory.  An entry added or removed
+ * while a stream is open may or may not be returned; every other entry is
+ * returned exactly once.  Streams should be closed before fs_close. */
+#define FS_NAME_MAX 50 /* longest entry name, with its terminating NUL */
+
+struct fs_dirent {
+    uint64_t inode; /* first inode of the entry */
+    uint64_t size; /* bytes in a file, entries in a directory */
+    int isdir;
+    char name[FS_NAME_MAX];
+};
+
+struct fsdir;
+
+/* Open a stream on the directory =dname.  Returns NULL on error and sets
+ * errno: ENOENT if =dname does not exist, ENOTDIR if it is a file. */
+struct fsdir * fs_opendir(struct superblock *sb, const char *dname);
+
+/* Return the next entry of =d, or NULL once every entry was returned.  The
+ * entry is overwritten by the next call on =d. */
+struct fs_dirent * fs_readdir(struct fsdir *d);
+
+/* Release the stream =d. */
+int fs_closedir(struct fsdir *d);
+
+/* Fill =st with the entry for =fname, as fs_readdir would return it.
+ * Returns -1 with errno set to ENOENT if =fname does not exist. */
+int fs_stat(struct superblock *sb, const char *fname, struct fs_dirent *st);
+
+/* Metadata journal.  Once enabled, every flush of the block cache is a
+ * transaction: the dirty metadata blocks are first written as one
+ * sequential log to the journal region, and only then to their places in
+ * the image.  A transaction interrupted by a crash is either replayed or
+ * ignored by the next fs_open, so the metadata stays consistent.  File
+ * data is not logged, but it reaches the disk before the metadata that
+ * points to it.  Several operations are grouped in a transaction; it is
+ * committed when enough blocks are dirty, when fs_sync or fs_close is
+ * called, or when the journal is disabled.  Journaling does not apply to
+ * images opened with FS_IO_MMAP.
+ *
+ * A transaction must fit in the journal along with its descriptors.  One
+ * that does not, because a single operation dirtied more blocks than the
+ * journal holds or because the cache had to write back more than that,
+ * is written in place without the journal's protection: a crash while it
+ * is being written may leave the metadata inconsistent.  Such transactions
+ * are counted in =journal_overflows (see fs_stats_get); a larger journal
+ * avoids them. */
+#define JOURNAL_MIN_BLOCKS 32 /* smallest journal fs_journal_enable accepts */
+
+/* Allocate a journal of =nblocks contiguous blocks (at least
+ * JOURNAL_MIN_BLOCKS) and start logging metadata updates.  The journal is
+ * remembered in the image.  Returns zero on success, or -1 with errno set:
+ * EINVAL for a bad size or an image opened with FS_IO_MMAP, EEXIST if
+ * there is already a journal, ENOSPC if no free extent is long enough. */
+int fs_journal_enable(struct superblock *sb, uint64_t nblocks);
+
+/* Commit pending updates, stop journaling and free the journal region.
+ * Returns zero, or -1 with errno set to EINVAL if there is no journal. */
+int fs_journal_disable(struct superblock *sb);
+
+/* Write every pending update to the image (committing a transaction if
+ * there is a journal) and wait for it to reach the disk.  Returns zero, or
+ * -1 with errno set if a write to the image failed since the last call:
+ * EIO, the error of the write itself, or ENOSPC for updates held back
+ * because a snapshot copy of the blocks they change could not be made. */
+int fs_sync(struct superblock *sb);
+
+/* File handles give offset-based access to a file, so large files can be
+ * streamed or updated in place without holding them in memory.  Only the
+ * blocks covered by each call are read or written; in a compressed file,
+ * the groups covered, the last few of which are kept decompressed in
+ * memory for the next calls.  A file should not be rewritten with
+ * fs_write_file or removed while a handle to it is open. */
+struct fsfile;
+
+#define FS_CREAT 1 /* create the file if it does not exist */
+#define FS_TRUNC 2 /* discard the contents of the file */
+
+/* Open the file =fname and return a handle positioned at its start.  =flags
+ * is a combination of the FS_* flags above.  Returns NULL on error and sets
+ * errno: ENOENT if the file does not exist and FS_CREAT is not given,
+ * EISDIR if =fname is a directory. */
+struct fsfile * fs_file_open(struct superblock *sb, const char *fname, int flags);
+
+/* Release the handle =f.  Data is written as each call is made, so closing
+ * a handle never fails. */
+int fs_file_close(struct fsfile *f);
+
+/* Read up to =cnt bytes at =offset into =buf.  Returns the number of bytes
+ * read, which is zero at or past the end of the file. */
+ssize_t fs_file_pread(struct fsfile *f, void *buf, size_t cnt, uint64_t offset);
+
+/* Write =cnt bytes from =buf at =offset, growing the file if needed; a gap
+ * between the old end of the file and =offset reads back as zeros.
+ * Returns =cnt, or -1 with errno set to ENOSPC if the blocks could not be
+ * allocated, in which case the file is unchanged. */
+ssize_t fs_file_pwrite(struct fsfile *f, const void *buf, size_t cnt, uint64_t offset);
+
+/* Same as fs_file_pread and fs_file_pwrite, at the position of =f, which
+ * is then moved past the bytes transferred. */
+ssize_t fs_file_read(struct fsfile *f, void *buf, size_t cnt);
+ssize_t fs_file_write(struct fsfile *f, const void *buf, size_t cnt);
+
+/* Move the position of =f like lseek (=whence is SEEK_SET, SEEK_CUR or
+ * SEEK_END).  Returns the new position, or -1 with errno set to EINVAL. */
+int64_t fs_file_seek(struct fsfile *f, int64_t offset, int whence);
+
+/* Return the size of the file behind =f in bytes. */
+uint64_t fs_file_size(struct fsfile *f);
+
+/* Consistency checking.  The checker walks every directory and file from
+ * the root, following the chain of IMCHILD inodes of each, and checks that
+ * every block in the image has exactly one use: the superblock, the
+ * journal, an inode, a nodeinfo, file data, the free list or a snapshot
+ * (its record, its pages, saved copies and owned extents).  It also
+ * checks that the size in each nodeinfo agrees with the entries or data
+ * blocks found, that each inode points back to its directory and that the
+ * free list agrees with =freeblks.  Each problem is described in a line
+ * written to =log, unless =log is NULL.  The image is never modified.
+ * Entities are checked by =nthreads threads in parallel; zero means one
+ * thread per online CPU. */
+struct fsck_report {
+    uint64_t dirs; /* directories reached from the root */
+    uint64_t files; /* regular files reached from the root */
+    uint64_t used; /* blocks in use, including the superblock */
+    uint64_t free; /* blocks on the free list */
+    uint64_t leaked; /* blocks neither in use nor on the free list */
+    uint64_t errors; /* problems found, counting each leaked extent once */
+    uint64_t restarts; /* times an online check started over */
+};
+
+struct fsck;
+
+/* Check =sb and fill =report (if not NULL).  Returns zero if no problem
+ * was found, 1 otherwise, and -1 with errno set if the check could not be
+ * made. */
+int fs_fsck(struct superblock *sb, int nthreads, FILE *log, struct fsck_report *report);
+
+/* Online checking of an image that stays open.  fs_fsck_begin prepares a
+ * check of =sb; each call to fs_fsck_step then checks up to =budget
+ * entities (or freepages) and returns, so =sb can be used in between.
+ * fs_fsck_step returns 1 while there is work left and 0 once the check is
+ * over.  If the metadata changed since the check began, the next step
+ * starts it over (see =restarts), so a busy image should be checked in
+ * large steps.  fs_fsck_end completes the check if needed, fills =report,
+ * frees =ck and returns like fs_fsck.  Other operations on =sb wait while
+ * a step runs. */
+struct fsck * fs_fsck_begin(struct superblock *sb, int nthreads, FILE *log);
+int fs_fsck_step(struct fsck *ck, uint64_t budget);
+int fs_fsck_end(struct fsck *ck, struct fsck_report *report);
+
+/* Snapshots.  A snapshot freezes the tree as it is when it is taken; it
+ * costs one block to take, and afterwards it shares every block that the
+ * live tree does not change.  The first time a shared block is about to
+ * be overwritten, its old contents are copied to a new block that the
+ * snapshot keeps; blocks the live tree frees while a snapshot may still
+ * use them are kept as well, so =freeblks does not grow.  Copies are made
+ * when the cache is flushed, and room for them is set aside as blocks are
+ * changed: with snapshots, operations that change the tree fail with
+ * ENOSPC once the free blocks would not hold the copies, and allocations
+ * leave those blocks alone.  fs_unlink and fs_rmdir count the blocks they
+ * free as room, and some room is kept for them, so that what was written
+ * since the newest snapshot can still be removed from a full image.
+ * Removing what the snapshots share frees nothing and takes room to
+ * record what they keep; once that room is used up it fails with ENOSPC
+ * too.  Deleting a snapshot gives the room back; if what it kept cannot
+ * be handed to the next older snapshot for lack of space, every snapshot
+ * is dropped, and snapshots opened with fs_snapshot_open then fail with
+ * EIO.  Snapshots are not supported in FS_IO_MMAP mode. */
+
+/* Take a snapshot of =sb named =name.  Returns zero, or -1 with errno set:
+ * EEXIST if a snapshot has that name, ENAMETOOLONG or EINVAL for a bad
+ * name, EINVAL for an image opened with FS_IO_MMAP, ENOSPC if there are no
+ * free blocks, EROFS if =sb is itself a snapshot. */
+int fs_snapshot_create(struct superblock *sb, const char *name);
+
+/* Delete the snapshot =name, releasing the blocks that no other snapshot
+ * needs.  Returns zero, or -1 with errno set: ENOENT if there is no such
+ * snapshot, EBUSY if it is open, EROFS if =sb is a snapshot. */
+int fs_snapshot_delete(struct superblock *sb, const char *name);
+
+/* Return the names of the snapshots of =sb, newest first, separated by
+ * spaces, in a string that the caller must free. */
+char * fs_snapshot_list(struct superblock *sb);
+
+/* Open the snapshot =name of =sb for reading.  The result is used like an
+ * image with the fs_* functions that read (fs_read_file, fs_list_dir,
+ * fs_opendir, fs_stat, fs_file_open without flags, ...); those that would
+ * change it fail with EROFS.  It must be released with fs_close before
+ * =sb is closed.  Returns NULL on error and sets errno: ENOENT if there is
+ * no such snapshot, EINVAL if =sb is itself a snapshot. */
+struct superblock * fs_snapshot_open(struct superblock *sb, const char *name);
+
+/* Statistics.  Every open image counts the blocks and bytes it reads from
+ * and writes to the image file, the requests (system calls or io_uring
+ * entries) made to do so, lookups in the metadata block cache, block
+ * allocations and the calls to, and time spent in, each public operation.
+ * In FS_IO_MMAP mode, data copied to and from the mapping counts as blocks
+ * and bytes but makes no requests.  Counters are updated without locks, so
+ * they cost little enough to stay on for every image. */
+#define FS_OP_WRITE_FILE 0
+#define FS_OP_READ_FILE 1
+#define FS_OP_UNLINK 2
+#define FS_OP_MKDIR 3
+#define FS_OP_RMDIR 4
+#define FS_OP_LIST_DIR 5
+#define FS_OP_OPENDIR 6
+#define FS_OP_READDIR 7
+#define FS_OP_STAT 8
+#define FS_OP_FILE_OPEN 9
+#define FS_OP_FILE_PREAD 10
+#define FS_OP_FILE_PWRITE 11
+#define FS_OP_SYNC 12
+#define FS_NOPS 13
+
+struct fs_opstats {
+    uint64_t calls;
+    uint64_t nsecs; /* wall time spent in the calls, in nanoseconds */
+};
+
+struct fs_stats {
+    uint64_t blk_reads; /* blocks read from the image */
+    uint64_t blk_writes; /* blocks written to the image */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t io_requests; /* reads and writes issued to the kernel */
+    uint64_t cache_hits; /* metadata blocks found in the cache */
+    uint64_t cache_misses; /* metadata blocks read into the cache */
+    uint64_t alloc_calls; /* requests for free blocks */
+    uint64_t blk_allocs; /* blocks taken from the free list */
+    uint64_t blk_frees; /* blocks put back on the free list */
+    uint64_t journal_commits; /* transactions written through the journal */
+    uint64_t journal_overflows; /* transactions too large for it, see above */
+    struct fs_opstats ops[FS_NOPS]; /* indexed by the FS_OP_* constants */
+};
+
+/* Copy the counters of =sb, accumulated since it was opened or since the
+ * last fs_stats_reset, into =st. */
+void fs_stats_get(struct superblock *sb, struct fs_stats *st);
+
+/* Zero the counters of =sb.  Counts from calls running at the same time
+ * may be lost. */
+void fs_stats_reset(struct superblock *sb);
+
+/* Write the counters of =sb to =out in human-readable form, one line per
+ * group and per operation that was called. */
+void fs_stats_dump(struct superblock *sb, FILE *out);
+
 #endif
@@ -0,0 +1,79 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "fs.h"
+
+/* Exit codes, as in fsck(8) */
+#define FSCK_OK 0
+#define FSCK_UNCORRECTED 4
+#define FSCK_OPERATIONAL 8
+
+void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-j threads] [-s step] image\n", prog);
+	fprintf(stderr, "  -j threads  check with this many threads (default: one per CPU)\n");
+	fprintf(stderr, "  -s step     check incrementally, this many entities per step\n");
+	exit(FSCK_OPERATIONAL);
+}
+
+int main(int argc, char **argv) {
+	int nthreads = 0;
+	uint64_t step = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			step = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	// opening the image replays its journal, if any
+	struct superblock *sb = fs_open(argv[optind]);
+	if (sb == NULL) {
+		if (errno == EBUSY)
+			fprintf(stderr, "%s: image is open by another process; "
+				"check it from there with fs_fsck_step\n", argv[optind]);
+		else
+			perror(argv[optind]);
+		return FSCK_OPERATIONAL;
+	}
+
+	struct fsck *ck = fs_fsck_begin(sb, nthreads, stdout);
+	if (ck == NULL) {
+		perror("fs_fsck_begin");
+		fs_close(sb);
+		return FSCK_OPERATIONAL;
+	}
+	if (step > 0) {
+		uint64_t nsteps = 1;
+		while (fs_fsck_step(ck, step) > 0)
+			nsteps++;
+		printf("%" PRIu64 " steps\n", nsteps);
+	}
+
+	struct fsck_report report;
+	int ret = fs_fsck_end(ck, &report);
+	fs_close(sb);
+
+	printf("%" PRIu64 " directories, %" PRIu64 " files\n", report.dirs, report.files);
+	printf("%" PRIu64 " blocks used, %" PRIu64 " free, %" PRIu64 " leaked\n",
+	       report.used, report.free, report.leaked);
+	if (ret == 0) {
+		printf("%s: clean\n", argv[optind]);
+		return FSCK_OK;
+	}
+	printf("%s: %" PRIu64 " problems found\n", argv[optind], report.errors);
+	return FSCK_UNCORRECTED;
+}
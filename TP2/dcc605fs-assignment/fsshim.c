@@ -0,0 +1,918 @@
+/* LD_PRELOAD shim that serves the paths under a prefix from a dcc605fs
+ * image, so unmodified programs can be run against it:
+ *
+ *   DCC605FS_IMAGE=img DCC605FS_PREFIX=/fs LD_PRELOAD=bin/libfsshim.so \
+ *       cp -r /etc /fs/etc
+ *
+ * DCC605FS_PREFIX defaults to /dcc605fs and DCC605FS_MODE selects how the
+ * image is accessed (pread, mmap or uring, as fs_open_mode).  The image is
+ * opened on the first access under the prefix and closed when the program
+ * exits; every descriptor shares its block cache.
+ *
+ * Each descriptor opened under the prefix is backed by a descriptor on
+ * /dev/null, so its number can never be handed out twice, and by a file
+ * handle (or a directory path) that keeps its own offset.  Only absolute
+ * paths and paths relative to a directory opened under the prefix are
+ * served.  mmap, rename, links, truncation to a nonzero size and
+ * permissions are not supported; descriptors do not survive exec, and as
+ * an image is opened by one process at a time, a child that accesses the
+ * prefix while its parent has the image open fails with EBUSY.  stdio
+ * writes to the standard streams straight through the kernel, so output
+ * redirected to the prefix by the program itself (as shell builtins do)
+ * fails with EBADF. */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <sys/resource.h>
+
+#include "fs.h"
+
+#define SHIM_MAXFD 65536
+#define SHIM_PREFIX "/dcc605fs"
+#define SHIM_IMAGEFD_GAP 64 /* the image goes this far below the descriptor limit */
+
+/* An open file or directory of the image, shared by dup'ed descriptors. */
+struct shimfile {
+	struct fsfile *f; /* NULL for directories */
+	char path[PATH_MAX]; /* path inside the image */
+	int accmode; /* O_RDONLY, O_WRONLY or O_RDWR */
+	int append;
+	int refs;
+	pthread_mutex_t lock; /* serializes moves of the offset */
+};
+
+/* A directory stream handed out as a DIR*; owns the descriptor =fd. */
+struct shimdir {
+	int fd;
+	struct fsdir *d;
+	struct dirent ent;
+	struct shimdir *next;
+};
+
+static struct {
+	int (*openat)(int, const char *, int, ...);
+	int (*close)(int);
+	ssize_t (*read)(int, void *, size_t);
+	ssize_t (*write)(int, const void *, size_t);
+	ssize_t (*pread)(int, void *, size_t, off_t);
+	ssize_t (*pwrite)(int, const void *, size_t, off_t);
+	off_t (*lseek)(int, off_t, int);
+	int (*fstatat)(int, const char *, struct stat *, int);
+	int (*statx)(int, const char *, int, unsigned int, struct statx *);
+	int (*faccessat)(int, const char *, int, int);
+	int (*unlinkat)(int, const char *, int);
+	int (*mkdirat)(int, const char *, mode_t);
+	ssize_t (*getxattr)(const char *, const char *, void *, size_t);
+	ssize_t (*lgetxattr)(const char *, const char *, void *, size_t);
+	ssize_t (*fgetxattr)(int, const char *, void *, size_t);
+	ssize_t (*readlinkat)(int, const char *, char *, size_t);
+	int (*dup)(int);
+	int (*dup3)(int, int, int);
+	int (*fcntl)(int, int, ...);
+	FILE * (*fopen)(const char *, const char *);
+	DIR * (*fdopendir)(int);
+	struct dirent * (*readdir)(DIR *);
+	int (*closedir)(DIR *);
+	int (*dirfd)(DIR *);
+} real;
+
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+static pthread_once_t image_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER; // guards =fds and =dirs
+static struct shimfile *fds[SHIM_MAXFD];
+static struct shimdir *dirs;
+static struct superblock *sb;
+static int image_errno;
+static time_t image_time;
+static const char *prefix = SHIM_PREFIX;
+static size_t prefixlen = sizeof(SHIM_PREFIX) - 1;
+
+static void shim_resolve(void) {
+	real.openat = dlsym(RTLD_NEXT, "openat");
+	real.close = dlsym(RTLD_NEXT, "close");
+	real.read = dlsym(RTLD_NEXT, "read");
+	real.write = dlsym(RTLD_NEXT, "write");
+	real.pread = dlsym(RTLD_NEXT, "pread");
+	real.pwrite = dlsym(RTLD_NEXT, "pwrite");
+	real.lseek = dlsym(RTLD_NEXT, "lseek");
+	real.fstatat = dlsym(RTLD_NEXT, "fstatat");
+	real.statx = dlsym(RTLD_NEXT, "statx");
+	real.faccessat = dlsym(RTLD_NEXT, "faccessat");
+	real.unlinkat = dlsym(RTLD_NEXT, "unlinkat");
+	real.mkdirat = dlsym(RTLD_NEXT, "mkdirat");
+	real.getxattr = dlsym(RTLD_NEXT, "getxattr");
+	real.lgetxattr = dlsym(RTLD_NEXT, "lgetxattr");
+	real.fgetxattr = dlsym(RTLD_NEXT, "fgetxattr");
+	real.readlinkat = dlsym(RTLD_NEXT, "readlinkat");
+	real.dup = dlsym(RTLD_NEXT, "dup");
+	real.dup3 = dlsym(RTLD_NEXT, "dup3");
+	real.fcntl = dlsym(RTLD_NEXT, "fcntl");
+	real.fopen = dlsym(RTLD_NEXT, "fopen");
+	real.fdopendir = dlsym(RTLD_NEXT, "fdopendir");
+	real.readdir = dlsym(RTLD_NEXT, "readdir");
+	real.closedir = dlsym(RTLD_NEXT, "closedir");
+	real.dirfd = dlsym(RTLD_NEXT, "dirfd");
+
+	const char *p = getenv("DCC605FS_PREFIX");
+	if (p != NULL && p[0] == '/') {
+		prefix = p;
+		prefixlen = strlen(p);
+		// "/fs/" serves the same paths as "/fs"
+		while (prefixlen > 1 && prefix[prefixlen - 1] == '/')
+			prefixlen--;
+	}
+}
+
+#define REAL(fn) (pthread_once(&resolve_once, shim_resolve), real.fn)
+
+static void shim_open_image(void) {
+	const char *image = getenv("DCC605FS_IMAGE");
+	const char *m = getenv("DCC605FS_MODE");
+	int mode = FS_IO_PREAD;
+	if (m != NULL && strcmp(m, "mmap") == 0)
+		mode = FS_IO_MMAP;
+	else if (m != NULL && strcmp(m, "uring") == 0)
+		mode = FS_IO_URING;
+
+	if (image == NULL) {
+		image_errno = ENODEV;
+		return;
+	}
+	sb = fs_open_mode(image, mode);
+	if (sb == NULL) {
+		image_errno = errno;
+		return;
+	}
+	image_time = time(NULL);
+
+	// move the image out of the way of descriptors programs pick
+	// themselves, as shells do with dup2
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur > SHIM_IMAGEFD_GAP * 2) {
+		int fd = REAL(fcntl)(sb->state->fd, F_DUPFD_CLOEXEC, (int) rl.rlim_cur - SHIM_IMAGEFD_GAP);
+		if (fd >= 0) {
+			REAL(close)(sb->state->fd);
+			sb->state->fd = fd;
+		}
+	}
+}
+
+/* Return the image, opening it on first use; NULL with errno set if it
+ * could not be opened. */
+static struct superblock *shim_sb(void) {
+	pthread_once(&image_once, shim_open_image);
+	if (sb == NULL)
+		errno = image_errno;
+	return sb;
+}
+
+static struct shimfile *shim_fd(int fd) {
+	if (fd < 0 || fd >= SHIM_MAXFD)
+		return NULL;
+	return __atomic_load_n(&fds[fd], __ATOMIC_ACQUIRE);
+}
+
+/* Append the components of =rel to the image path =out, resolving "." and
+ * "..".  =out is "/" or a path without a trailing slash. */
+static int path_join(char *out, const char *rel) {
+	size_t len = strlen(out);
+	if (len == 1)
+		len = 0;
+	while (*rel != '\0') {
+		while (*rel == '/')
+			rel++;
+		size_t n = strcspn(rel, "/");
+		if (n == 0 || (n == 1 && rel[0] == '.')) {
+			// nothing to add
+		} else if (n == 2 && rel[0] == '.' && rel[1] == '.') {
+			while (len > 0 && out[len - 1] != '/')
+				len--;
+			if (len > 0)
+				len--;
+		} else {
+			if (len + 1 + n >= PATH_MAX) {
+				errno = ENAMETOOLONG;
+				return -1;
+			}
+			out[len++] = '/';
+			memcpy(out + len, rel, n);
+			len += n;
+		}
+		rel += n;
+	}
+	if (len == 0)
+		out[len++] = '/';
+	out[len] = '\0';
+	return 0;
+}
+
+/* Decide whether =path, relative to =dirfd as in openat, lies under the
+ * prefix.  Returns 1 and the path inside the image in =out if it does, 0
+ * if the call should go to the kernel, -1 with errno set on error. */
+static int shim_path(int dirfd, const char *path, char *out) {
+	if (path == NULL)
+		return 0;
+	pthread_once(&resolve_once, shim_resolve);
+	if (path[0] == '/') {
+		if (strncmp(path, prefix, prefixlen) != 0)
+			return 0;
+		if (path[prefixlen] != '\0' && path[prefixlen] != '/' && prefixlen > 1)
+			return 0;
+		strcpy(out, "/");
+		return (path_join(out, path + prefixlen) < 0) ? -1 : 1;
+	}
+	struct shimfile *sf = shim_fd(dirfd);
+	if (sf == NULL)
+		return 0;
+	if (sf->f != NULL) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	strcpy(out, sf->path);
+	return (path_join(out, path) < 0) ? -1 : 1;
+}
+
+static void fill_stat(const struct fs_dirent *ent, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_dev = 0xdcc605;
+	st->st_ino = ent->inode;
+	st->st_mode = ent->isdir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+	st->st_nlink = ent->isdir ? 2 : 1;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_size = ent->isdir ? 0 : ent->size;
+	st->st_blksize = sb->blksz;
+	st->st_blocks = ((st->st_size + sb->blksz - 1) / sb->blksz * sb->blksz + 511) / 512;
+	st->st_atime = st->st_mtime = st->st_ctime = image_time;
+}
+
+/* Install =sf at the number of a new descriptor on /dev/null. */
+static int shim_install(struct shimfile *sf, int cloexec) {
+	int fd = REAL(openat)(AT_FDCWD, "/dev/null", O_RDONLY | (cloexec ? O_CLOEXEC : 0));
+	if (fd < 0)
+		return -1;
+	if (fd >= SHIM_MAXFD) {
+		REAL(close)(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	pthread_mutex_lock(&shim_lock);
+	sf->refs++;
+	__atomic_store_n(&fds[fd], sf, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shim_lock);
+	return fd;
+}
+
+static void shim_release(struct shimfile *sf) {
+	pthread_mutex_lock(&shim_lock);
+	int last = (--sf->refs == 0);
+	pthread_mutex_unlock(&shim_lock);
+	if (!last)
+		return;
+	if (sf->f != NULL)
+		fs_file_close(sf->f);
+	pthread_mutex_destroy(&sf->lock);
+	free(sf);
+}
+
+static int shim_open(const char *path, int flags) {
+	struct superblock *s = shim_sb();
+	if (s == NULL)
+		return -1;
+
+	int accmode = flags & O_ACCMODE;
+	struct fs_dirent ent;
+	int exists = (fs_stat(s, path, &ent) == 0);
+	if (exists && (flags & O_CREAT) && (flags & O_EXCL)) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (!exists && !(flags & O_CREAT)) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (exists && ent.isdir && accmode != O_RDONLY) {
+		errno = EISDIR;
+		return -1;
+	}
+	if ((!exists || !ent.isdir) && (flags & O_DIRECTORY)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	struct shimfile *sf = calloc(1, sizeof(struct shimfile));
+	strcpy(sf->path, path);
+	sf->accmode = accmode;
+	sf->append = (flags & O_APPEND) != 0;
+	pthread_mutex_init(&sf->lock, NULL);
+	if (!exists || !ent.isdir) {
+		int fsflags = ((flags & O_CREAT) ? FS_CREAT : 0)
+			| ((flags & O_TRUNC) && accmode != O_RDONLY ? FS_TRUNC : 0);
+		sf->f = fs_file_open(s, path, fsflags);
+		if (sf->f == NULL) {
+			pthread_mutex_destroy(&sf->lock);
+			free(sf);
+			return -1;
+		}
+	}
+
+	int fd = shim_install(sf, flags & O_CLOEXEC);
+	if (fd < 0) {
+		sf->refs = 1;
+		shim_release(sf);
+	}
+	return fd;
+}
+
+static int shim_openat(int dirfd, const char *path, int flags, va_list ap) {
+	char p[PATH_MAX];
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE))
+		mode = va_arg(ap, mode_t);
+	switch (shim_path(dirfd, path, p)) {
+	case 1:
+		return shim_open(p, flags);
+	case 0:
+		return REAL(openat)(dirfd, path, flags, mode);
+	default:
+		return -1;
+	}
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+	va_list ap;
+	va_start(ap, flags);
+	int ret = shim_openat(dirfd, path, flags, ap);
+	va_end(ap);
+	return ret;
+}
+
+int open(const char *path, int flags, ...) {
+	va_list ap;
+	va_start(ap, flags);
+	int ret = shim_openat(AT_FDCWD, path, flags, ap);
+	va_end(ap);
+	return ret;
+}
+
+int creat(const char *path, mode_t mode) {
+	return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+// fortified callers do not pass a mode
+int __open_2(const char *path, int flags) {
+	return open(path, flags);
+}
+
+int __openat_2(int dirfd, const char *path, int flags) {
+	return openat(dirfd, path, flags);
+}
+
+int close(int fd) {
+	struct shimfile *sf = shim_fd(fd);
+	if (sf == NULL)
+		return REAL(close)(fd);
+	pthread_mutex_lock(&shim_lock);
+	__atomic_store_n(&fds[fd], NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shim_lock);
+	shim_release(sf);
+	return REAL(close)(fd);
+}
+
+static int shim_dup(int oldfd, struct shimfile *sf, int newfd, int cloexec) {
+	pthread_mutex_lock(&shim_lock);
+	sf->refs++;
+	pthread_mutex_unlock(&shim_lock);
+	int fd = (newfd < 0) ? REAL(dup)(oldfd) : REAL(dup3)(oldfd, newfd, cloexec ? O_CLOEXEC : 0);
+	if (fd < 0 || fd >= SHIM_MAXFD) {
+		if (fd >= 0)
+			REAL(close)(fd);
+		shim_release(sf);
+		errno = (fd < 0) ? errno : EMFILE;
+		return -1;
+	}
+	// dup2 onto a descriptor closes what was there
+	pthread_mutex_lock(&shim_lock);
+	struct shimfile *old = fds[fd];
+	__atomic_store_n(&fds[fd], sf, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shim_lock);
+	if (old != NULL)
+		shim_release(old);
+	return fd;
+}
+
+int dup(int oldfd) {
+	struct shimfile *sf = shim_fd(oldfd);
+	if (sf == NULL)
+		return REAL(dup)(oldfd);
+	return shim_dup(oldfd, sf, -1, 0);
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+	struct shimfile *sf = shim_fd(oldfd);
+	if (sf == NULL || oldfd == newfd) {
+		if (shim_fd(newfd) != NULL && oldfd != newfd) {
+			// the kernel closes =newfd, so must we
+			int fd = REAL(dup3)(oldfd, newfd, flags);
+			if (fd >= 0) {
+				pthread_mutex_lock(&shim_lock);
+				struct shimfile *old = fds[fd];
+				__atomic_store_n(&fds[fd], NULL, __ATOMIC_RELEASE);
+				pthread_mutex_unlock(&shim_lock);
+				if (old != NULL)
+					shim_release(old);
+			}
+			return fd;
+		}
+		return REAL(dup3)(oldfd, newfd, flags);
+	}
+	return shim_dup(oldfd, sf, newfd, flags & O_CLOEXEC);
+}
+
+int dup2(int oldfd, int newfd) {
+	if (oldfd == newfd)
+		return (fcntl(oldfd, F_GETFD) < 0) ? -1 : newfd;
+	return dup3(oldfd, newfd, 0);
+}
+
+int fcntl(int fd, int cmd, ...) {
+	va_list ap;
+	va_start(ap, cmd);
+	long arg = va_arg(ap, long);
+	va_end(ap);
+	struct shimfile *sf = shim_fd(fd);
+	if (sf != NULL && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)) {
+		// the lowest free descriptor at or above =arg
+		int newfd = REAL(fcntl)(fd, cmd, arg);
+		if (newfd < 0)
+			return -1;
+		return shim_dup(fd, sf, newfd, cmd == F_DUPFD_CLOEXEC);
+	}
+	if (sf != NULL && cmd == F_GETFL)
+		return sf->accmode | (sf->append ? O_APPEND : 0) | (sf->f == NULL ? O_DIRECTORY : 0);
+	return REAL(fcntl)(fd, cmd, arg);
+}
+
+ssize_t read(int fd, void *buf, size_t cnt) {
+	struct shimfile *sf = shim_fd(fd);
+	if (sf == NULL)
+		return REAL(read)(fd, buf, cnt);
+	if (sf->f == NULL) {
+		errno = EISDIR;
+		return -1;
+	}
+	if (sf->accmode == O_WRONLY) {
+		errno = EBADF;
+		return -1;
+	}
+	pthread_mutex_lock(&sf->lock);
+	ssize_t ret = fs_file_read(sf->f, buf, cnt);
+	pthread_mutex_unlock(&sf->lock);
+	return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t cnt) {
+	struct shimfile *sf = shim_fd(fd);
+	if (sf == NULL)
+		return REAL(write)(fd, buf, cnt);
+	if (sf->f == NULL || sf->accmode == O_RDONLY) {
+		errno = EBADF;
+		return -1;
+	}
+	pthread_mutex_lock(&sf->lock);
+	if (sf->append)
+		fs_file_seek(sf->f, 0, SEEK_END);
+	ssize_t ret = fs_file_write(sf->f, buf, cnt);
+	pthread_mutex_unlock(&sf->lock);
+	return ret;
+}
+
+ssize_t pread(int fd, void *buf, size_t cnt, off_t offset) {
+	struct shimfile *sf = shim_fd(fd);
+	if (sf == NULL)
+		return REAL(pread)(fd, buf, cnt, offset);
+	if (sf->f == NULL) {
+		errno = EISDIR;
+		return -1;
+	}
+	if (sf->accmode == O_WRONLY || offset < 0) {
+		errno = (offset < 0) ? EINVAL : EBADF;
+		return -1;
+	}
+	return fs_file_pread(sf->f, buf, cnt, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t cnt, off_t offset) {
+	struct shimfile *sf = shim_fd(fd);
+	if (sf == NULL)
+		return REAL(pwrite)(fd, buf, cnt, offset);
+	if (sf->f == NULL || sf->accmode == O_RDONLY || offset < 0) {
+		errno = (offset < 0) ? EINVAL : EBADF;
+		return -1;
+	}
+	return fs_file_pwrite(sf->f, buf, cnt, offset);
+}
+
+off_t lseek(int fd, off_t offset, int whence) {
+	struct shimfile *sf = shim_fd(fd);
+	if (sf == NULL)
+		return REAL(lseek)(fd, offset, whence);
+	if (sf->f == NULL) {
+		errno = EISDIR;
+		return -1;
+	}
+	pthread_mutex_lock(&sf->lock);
+	off_t ret;
+	if (whence == SEEK_DATA || whence == SEEK_HOLE) {
+		// files have no holes: all data up to the end of the file
+		uint64_t size = fs_file_size(sf->f);
+		if (offset < 0 || (uint64_t) offset >= size) {
+			errno = ENXIO;
+			ret = -1;
+		} else {
+			ret = fs_file_seek(sf->f, (whence == SEEK_DATA) ? offset : (off_t) size, SEEK_SET);
+		}
+	} else {
+		ret = fs_file_seek(sf->f, offset, whence);
+	}
+	pthread_mutex_unlock(&sf->lock);
+	return ret;
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags) {
+	struct shimfile *sf = shim_fd(dirfd);
+	if (sf != NULL && (flags & AT_EMPTY_PATH) && path[0] == '\0') {
+		struct fs_dirent ent;
+		if (fs_stat(sb, sf->path, &ent) < 0)
+			return -1;
+		// the handle knows of writes not yet seen through the path
+		if (sf->f != NULL)
+			ent.size = fs_file_size(sf->f);
+		fill_stat(&ent, st);
+		return 0;
+	}
+
+	char p[PATH_MAX];
+	switch (shim_path(dirfd, path, p)) {
+	case 0:
+		return REAL(fstatat)(dirfd, path, st, flags);
+	case -1:
+		return -1;
+	}
+	struct fs_dirent ent;
+	if (shim_sb() == NULL || fs_stat(sb, p, &ent) < 0)
+		return -1;
+	fill_stat(&ent, st);
+	return 0;
+}
+
+int stat(const char *path, struct stat *st) {
+	return fstatat(AT_FDCWD, path, st, 0);
+}
+
+int lstat(const char *path, struct stat *st) {
+	return fstatat(AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW);
+}
+
+int fstat(int fd, struct stat *st) {
+	return fstatat(fd, "", st, AT_EMPTY_PATH);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *stx) {
+	char p[PATH_MAX];
+	if (shim_fd(dirfd) == NULL && shim_path(dirfd, path, p) == 0)
+		return REAL(statx)(dirfd, path, flags, mask, stx);
+	struct stat st;
+	if (fstatat(dirfd, path, &st, flags & (AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) < 0)
+		return -1;
+	memset(stx, 0, sizeof(*stx));
+	stx->stx_mask = STATX_BASIC_STATS;
+	stx->stx_blksize = st.st_blksize;
+	stx->stx_nlink = st.st_nlink;
+	stx->stx_uid = st.st_uid;
+	stx->stx_gid = st.st_gid;
+	stx->stx_mode = st.st_mode;
+	stx->stx_ino = st.st_ino;
+	stx->stx_size = st.st_size;
+	stx->stx_blocks = st.st_blocks;
+	stx->stx_atime.tv_sec = stx->stx_mtime.tv_sec = stx->stx_ctime.tv_sec = st.st_mtime;
+	stx->stx_dev_major = major(st.st_dev);
+	stx->stx_dev_minor = minor(st.st_dev);
+	return 0;
+}
+
+int faccessat(int dirfd, const char *path, int mode, int flags) {
+	char p[PATH_MAX];
+	switch (shim_path(dirfd, path, p)) {
+	case 0:
+		return REAL(faccessat)(dirfd, path, mode, flags);
+	case -1:
+		return -1;
+	}
+	struct fs_dirent ent;
+	if (shim_sb() == NULL || fs_stat(sb, p, &ent) < 0)
+		return -1;
+	// files are readable and writable, directories searchable too
+	if ((mode & X_OK) && !ent.isdir) {
+		errno = EACCES;
+		return -1;
+	}
+	return 0;
+}
+
+int access(const char *path, int mode) {
+	return faccessat(AT_FDCWD, path, mode, 0);
+}
+
+int unlinkat(int dirfd, const char *path, int flags) {
+	char p[PATH_MAX];
+	switch (shim_path(dirfd, path, p)) {
+	case 0:
+		return REAL(unlinkat)(dirfd, path, flags);
+	case -1:
+		return -1;
+	}
+	struct fs_dirent ent;
+	if (shim_sb() == NULL || fs_stat(sb, p, &ent) < 0)
+		return -1;
+	if ((flags & AT_REMOVEDIR) && !ent.isdir) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (!(flags & AT_REMOVEDIR) && ent.isdir) {
+		errno = EISDIR;
+		return -1;
+	}
+	if (ent.isdir && ent.size > 0) {
+		errno = ENOTEMPTY;
+		return -1;
+	}
+	return ent.isdir ? fs_rmdir(sb, p) : fs_unlink(sb, p);
+}
+
+int unlink(const char *path) {
+	return unlinkat(AT_FDCWD, path, 0);
+}
+
+int rmdir(const char *path) {
+	return unlinkat(AT_FDCWD, path, AT_REMOVEDIR);
+}
+
+int mkdirat(int dirfd, const char *path, mode_t mode) {
+	char p[PATH_MAX];
+	switch (shim_path(dirfd, path, p)) {
+	case 0:
+		return REAL(mkdirat)(dirfd, path, mode);
+	case -1:
+		return -1;
+	}
+	if (shim_sb() == NULL)
+		return -1;
+	return fs_mkdir(sb, p);
+}
+
+int mkdir(const char *path, mode_t mode) {
+	return mkdirat(AT_FDCWD, path, mode);
+}
+
+/* Entries have no extended attributes and are never symbolic links. */
+ssize_t getxattr(const char *path, const char *name, void *value, size_t size) {
+	char p[PATH_MAX];
+	if (shim_path(AT_FDCWD, path, p) == 0)
+		return REAL(getxattr)(path, name, value, size);
+	errno = ENODATA;
+	return -1;
+}
+
+ssize_t lgetxattr(const char *path, const char *name, void *value, size_t size) {
+	char p[PATH_MAX];
+	if (shim_path(AT_FDCWD, path, p) == 0)
+		return REAL(lgetxattr)(path, name, value, size);
+	errno = ENODATA;
+	return -1;
+}
+
+ssize_t fgetxattr(int fd, const char *name, void *value, size_t size) {
+	if (shim_fd(fd) == NULL)
+		return REAL(fgetxattr)(fd, name, value, size);
+	errno = ENODATA;
+	return -1;
+}
+
+ssize_t readlinkat(int dirfd, const char *path, char *buf, size_t size) {
+	char p[PATH_MAX];
+	switch (shim_path(dirfd, path, p)) {
+	case 0:
+		return REAL(readlinkat)(dirfd, path, buf, size);
+	case -1:
+		return -1;
+	}
+	struct fs_dirent ent;
+	if (shim_sb() == NULL || fs_stat(sb, p, &ent) < 0)
+		return -1;
+	errno = EINVAL;
+	return -1;
+}
+
+ssize_t readlink(const char *path, char *buf, size_t size) {
+	return readlinkat(AT_FDCWD, path, buf, size);
+}
+
+static struct shimdir *shim_dir(DIR *dirp) {
+	pthread_mutex_lock(&shim_lock);
+	struct shimdir *sd = dirs;
+	while (sd != NULL && (DIR *) sd != dirp)
+		sd = sd->next;
+	pthread_mutex_unlock(&shim_lock);
+	return sd;
+}
+
+DIR *fdopendir(int fd) {
+	struct shimfile *sf = shim_fd(fd);
+	if (sf == NULL)
+		return REAL(fdopendir)(fd);
+	if (sf->f != NULL) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+	struct shimdir *sd = calloc(1, sizeof(struct shimdir));
+	sd->fd = fd;
+	sd->d = fs_opendir(sb, sf->path);
+	if (sd->d == NULL) {
+		free(sd);
+		return NULL;
+	}
+	pthread_mutex_lock(&shim_lock);
+	sd->next = dirs;
+	dirs = sd;
+	pthread_mutex_unlock(&shim_lock);
+	return (DIR *) sd;
+}
+
+DIR *opendir(const char *path) {
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	DIR *dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+	}
+	return dirp;
+}
+
+struct dirent *readdir(DIR *dirp) {
+	struct shimdir *sd = shim_dir(dirp);
+	if (sd == NULL)
+		return REAL(readdir)(dirp);
+	struct fs_dirent *ent = fs_readdir(sd->d);
+	if (ent == NULL)
+		return NULL;
+	sd->ent.d_ino = ent->inode;
+	sd->ent.d_off = 0;
+	sd->ent.d_reclen = sizeof(struct dirent);
+	sd->ent.d_type = ent->isdir ? DT_DIR : DT_REG;
+	strcpy(sd->ent.d_name, ent->name);
+	return &sd->ent;
+}
+
+int closedir(DIR *dirp) {
+	struct shimdir *sd = shim_dir(dirp);
+	if (sd == NULL)
+		return REAL(closedir)(dirp);
+	pthread_mutex_lock(&shim_lock);
+	struct shimdir **pp = &dirs;
+	while (*pp != sd)
+		pp = &(*pp)->next;
+	*pp = sd->next;
+	pthread_mutex_unlock(&shim_lock);
+	fs_closedir(sd->d);
+	int ret = close(sd->fd);
+	free(sd);
+	return ret;
+}
+
+int dirfd(DIR *dirp) {
+	struct shimdir *sd = shim_dir(dirp);
+	if (sd == NULL)
+		return REAL(dirfd)(dirp);
+	return sd->fd;
+}
+
+static ssize_t cookie_read(void *cookie, char *buf, size_t cnt) {
+	return read((int) (intptr_t) cookie, buf, cnt);
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t cnt) {
+	return write((int) (intptr_t) cookie, buf, cnt);
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+	off_t ret = lseek((int) (intptr_t) cookie, *offset, whence);
+	if (ret < 0)
+		return -1;
+	*offset = ret;
+	return 0;
+}
+
+static int cookie_close(void *cookie) {
+	return close((int) (intptr_t) cookie);
+}
+
+/* stdio opens files without going through open, so streams on paths under
+ * the prefix are built on a shim descriptor instead. */
+FILE *fopen(const char *path, const char *mode) {
+	char p[PATH_MAX];
+	switch (shim_path(AT_FDCWD, path, p)) {
+	case 0:
+		return REAL(fopen)(path, mode);
+	case -1:
+		return NULL;
+	}
+
+	int flags;
+	switch (mode[0]) {
+	case 'r':
+		flags = 0;
+		break;
+	case 'w':
+		flags = O_CREAT | O_TRUNC;
+		break;
+	case 'a':
+		flags = O_CREAT | O_APPEND;
+		break;
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+	if (strchr(mode, '+') != NULL)
+		flags |= O_RDWR;
+	else
+		flags |= (mode[0] == 'r') ? O_RDONLY : O_WRONLY;
+	if (strchr(mode, 'x') != NULL)
+		flags |= O_EXCL;
+
+	int fd = shim_open(p, flags);
+	if (fd < 0)
+		return NULL;
+	cookie_io_functions_t io = {cookie_read, cookie_write, cookie_seek, cookie_close};
+	FILE *fp = fopencookie((void *) (intptr_t) fd, mode, io);
+	if (fp == NULL)
+		close(fd);
+	return fp;
+}
+
+#ifdef __LP64__
+/* The 64-bit variants share the layout of the plain structures, and
+ * programs built with _FILE_OFFSET_BITS=64 call them by these names. */
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+int openat64(int dirfd, const char *path, int flags, ...) __attribute__((alias("openat")));
+int __open64_2(const char *path, int flags) __attribute__((alias("__open_2")));
+int __openat64_2(int dirfd, const char *path, int flags) __attribute__((alias("__openat_2")));
+int creat64(const char *path, mode_t mode) __attribute__((alias("creat")));
+ssize_t pread64(int fd, void *buf, size_t cnt, off64_t offset) __attribute__((alias("pread")));
+ssize_t pwrite64(int fd, const void *buf, size_t cnt, off64_t offset) __attribute__((alias("pwrite")));
+off64_t lseek64(int fd, off64_t offset, int whence) __attribute__((alias("lseek")));
+int stat64(const char *path, struct stat64 *st) __attribute__((alias("stat")));
+int lstat64(const char *path, struct stat64 *st) __attribute__((alias("lstat")));
+int fstat64(int fd, struct stat64 *st) __attribute__((alias("fstat")));
+int fstatat64(int dirfd, const char *path, struct stat64 *st, int flags) __attribute__((alias("fstatat")));
+struct dirent64 *readdir64(DIR *dirp) __attribute__((alias("readdir")));
+FILE *fopen64(const char *path, const char *mode) __attribute__((alias("fopen")));
+#endif
+
+/* Close what the program left open, so every write reaches the image. */
+__attribute__((destructor)) static void shim_fini(void) {
+	if (sb == NULL)
+		return;
+	while (dirs != NULL) {
+		struct shimdir *sd = dirs;
+		dirs = sd->next;
+		fs_closedir(sd->d);
+	}
+	int fd;
+	for (fd = 0; fd < SHIM_MAXFD; fd++) {
+		if (fds[fd] != NULL) {
+			struct shimfile *sf = fds[fd];
+			fds[fd] = NULL;
+			shim_release(sf);
+		}
+	}
+	fs_close(sb);
+	sb = NULL;
+}
@@ -0,0 +1,193 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int journal);
+int fs_threads_test(struct superblock *sb, uint64_t blksz);
+void *worker(void *arg);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NTHREADS 8
+#define NFILES 4
+#define NROUNDS 4
+
+static char *fname = "img";
+
+struct job {
+	struct superblock *sb;
+	struct fsfile *shared;
+	uint64_t blksz;
+	uint64_t maxsz;
+	int id;
+	int failed;
+};
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i], 0)) exit(EXIT_FAILURE);
+		if(test(fsizes[j], blkszs[i], 1)) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int journal)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(journal && fs_journal_enable(sb, 32) < 0) ERROR("FAIL fs_journal_enable\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_threads_test(sb, blksz)) ERROR("FAIL fs_threads_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_fsck(sb, 2, stdout, NULL) != 0) ERROR("FAIL fs_fsck\n");
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+#define FAIL(str) { puts(str); job->failed = 1; return NULL; }
+void *worker(void *arg)/*{{{*/
+{
+	struct job *job = arg;
+	struct superblock *sb = job->sb;
+	uint64_t maxsz = job->maxsz;
+	char *buf = malloc(maxsz);
+	char *back = malloc(maxsz);
+	assert(buf && back);
+	char dir[32], name[48];
+	int r, i;
+
+	sprintf(dir, "/t%d", job->id);
+	if(fs_mkdir(sb, dir) < 0) FAIL("FAIL fs_mkdir\n");
+
+	for(r = 0; r < NROUNDS; r++) {
+		for(i = 0; i < NFILES; i++) {
+			uint64_t cnt = 1 + (job->id * 131 + r * 17 + i * 29) % maxsz;
+			memset(buf, 'a' + (job->id + r + i) % 26, cnt);
+			sprintf(name, "%s/f%d", dir, i);
+			if(fs_write_file(sb, name, buf, cnt) < 0) FAIL("FAIL fs_write_file\n");
+			if(fs_read_file(sb, name, back, maxsz) != cnt || memcmp(buf, back, cnt))
+				FAIL("FAIL fs_read_file\n");
+		}
+		char *list = fs_list_dir(sb, "/");
+		if(list == NULL || strstr(list, dir + 1) == NULL) FAIL("FAIL fs_list_dir\n");
+		free(list);
+
+		// every thread writes its own stripe of the shared file
+		uint64_t off = (r * NTHREADS + job->id) * job->blksz;
+		memset(buf, '0' + job->id, job->blksz);
+		if(fs_file_pwrite(job->shared, buf, job->blksz, off) != job->blksz)
+			FAIL("FAIL fs_file_pwrite\n");
+		if(fs_file_pread(job->shared, back, job->blksz, off) != job->blksz
+				|| memcmp(buf, back, job->blksz))
+			FAIL("FAIL fs_file_pread\n");
+
+		for(i = r % 2; i < NFILES; i += 2) {
+			sprintf(name, "%s/f%d", dir, i);
+			if(fs_unlink(sb, name) < 0) FAIL("FAIL fs_unlink\n");
+		}
+	}
+
+	for(i = 0; i < NFILES; i++) {
+		sprintf(name, "%s/f%d", dir, i);
+		if(fs_unlink(sb, name) < 0 && errno != ENOENT) FAIL("FAIL fs_unlink\n");
+	}
+	if(fs_rmdir(sb, dir) < 0) FAIL("FAIL fs_rmdir\n");
+	free(buf);
+	free(back);
+	return NULL;
+}
+/*}}}*/
+
+
+int fs_threads_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	pthread_t threads[NTHREADS];
+	struct job jobs[NTHREADS];
+	int i;
+
+	struct fsfile *f = fs_file_open(sb, "/shared", FS_CREAT);
+	if(f == NULL) ERROR("FAIL fs_file_open\n");
+
+	// leave room for the metadata of every file at once
+	uint64_t room = sb->freeblks - 2 * NROUNDS * NTHREADS - 4 * NTHREADS;
+	uint64_t maxblks = room / (NTHREADS * NFILES) / 2;
+	if(maxblks > 6) maxblks = 6;
+	if(maxblks == 0) ERROR("FAIL image too small\n");
+
+	for(i = 0; i < NTHREADS; i++) {
+		jobs[i].sb = sb;
+		jobs[i].blksz = blksz;
+		jobs[i].maxsz = maxblks * blksz;
+		jobs[i].id = i;
+		jobs[i].failed = 0;
+		jobs[i].shared = fs_file_open(sb, "/shared", 0);
+		if(jobs[i].shared == NULL) ERROR("FAIL fs_file_open\n");
+		if(pthread_create(&threads[i], NULL, worker, &jobs[i]))
+			ERROR("FAIL pthread_create\n");
+	}
+	int failed = 0;
+	for(i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], NULL);
+		failed |= jobs[i].failed;
+		fs_file_close(jobs[i].shared);
+	}
+	if(failed) ERROR("FAIL worker\n");
+
+	// the handle opened first sees what every thread wrote
+	uint64_t size = NROUNDS * NTHREADS * blksz;
+	char *buf = malloc(size);
+	assert(buf);
+	if(fs_file_pread(f, buf, size, 0) != size) ERROR("FAIL shared size\n");
+	uint64_t b;
+	for(b = 0; b < NROUNDS * NTHREADS; b++) {
+		uint64_t j;
+		for(j = 0; j < blksz; j++) {
+			if(buf[b * blksz + j] != '0' + b % NTHREADS) ERROR("FAIL shared data\n");
+		}
+	}
+	free(buf);
+	fs_file_close(f);
+
+	char *list = fs_list_dir(sb, "/");
+	if(list == NULL || strcmp(list, "shared") != 0) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	if(fs_unlink(sb, "/shared") < 0) ERROR("FAIL fs_unlink /shared\n");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_readdir_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_readdir_test(sb, blksz)) ERROR("FAIL fs_readdir_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_readdir_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	// an empty directory lists as an empty string
+	char *list = fs_list_dir(sb, "/");
+	if(list == NULL || strcmp(list, "") != 0) ERROR("FAIL fs_list_dir empty\n");
+	free(list);
+
+	struct fsdir *d = fs_opendir(sb, "/");
+	if(d == NULL) ERROR("FAIL fs_opendir\n");
+	if(fs_readdir(d) != NULL) ERROR("FAIL fs_readdir empty\n");
+	fs_closedir(d);
+
+	// every entry takes two blocks, more in the directory itself
+	int n = sb->freeblks / 3;
+	if(n > 1500) n = 1500;
+	char *seen = calloc(n, 1);
+	char name[64];
+	char buf[7];
+	memset(buf, 'x', sizeof(buf));
+	int i;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/e%d", i);
+		if(i % 5 == 0) {
+			if(fs_mkdir(sb, name) < 0) ERROR("FAIL fs_mkdir\n");
+		} else if(fs_write_file(sb, name, buf, i % 7) < 0) {
+			ERROR("FAIL fs_write_file\n");
+		}
+	}
+
+	// the whole listing, longer than the old fixed buffer on most sizes
+	list = fs_list_dir(sb, "/");
+	if(list == NULL || list[strlen(list) - 1] == ' ') ERROR("FAIL fs_list_dir\n");
+	int spaces = 0;
+	for(i = 0; list[i]; i++) spaces += (list[i] == ' ');
+	if(spaces != n - 1) ERROR("FAIL fs_list_dir entries\n");
+	free(list);
+
+	if(fs_opendir(sb, "/nope") != NULL || errno != ENOENT)
+		ERROR("FAIL fs_opendir missing\n");
+	if(fs_opendir(sb, "/e1") != NULL || errno != ENOTDIR)
+		ERROR("FAIL fs_opendir file\n");
+
+	d = fs_opendir(sb, "/");
+	if(d == NULL) ERROR("FAIL fs_opendir\n");
+	struct fs_dirent *ent;
+	int count = 0;
+	while((ent = fs_readdir(d)) != NULL) {
+		if(sscanf(ent->name, "e%d", &i) != 1 || i < 0 || i >= n || seen[i])
+			ERROR("FAIL fs_readdir name\n");
+		seen[i] = 1;
+		if(ent->isdir != (i % 5 == 0)) ERROR("FAIL fs_readdir type\n");
+		if(ent->size != (ent->isdir ? 0 : i % 7)) ERROR("FAIL fs_readdir size\n");
+		count++;
+	}
+	fs_closedir(d);
+	if(count != n) ERROR("FAIL fs_readdir count\n");
+
+	// fs_stat agrees with the listing
+	struct fs_dirent st;
+	if(fs_stat(sb, "/e1", &st) < 0 || st.isdir || st.size != 1 || strcmp(st.name, "e1"))
+		ERROR("FAIL fs_stat file\n");
+	if(fs_stat(sb, "/e5", &st) < 0 || !st.isdir || strcmp(st.name, "e5"))
+		ERROR("FAIL fs_stat dir\n");
+	if(fs_stat(sb, "/", &st) < 0 || !st.isdir || st.size != n)
+		ERROR("FAIL fs_stat root\n");
+	if(fs_stat(sb, "/nope", &st) == 0 || errno != ENOENT)
+		ERROR("FAIL fs_stat missing\n");
+
+	// emptying the directory through a stream removes every entry once
+	d = fs_opendir(sb, "/");
+	count = 0;
+	while((ent = fs_readdir(d)) != NULL) {
+		sprintf(name, "/%s", ent->name);
+		if((ent->isdir ? fs_rmdir(sb, name) : fs_unlink(sb, name)) < 0)
+			ERROR("FAIL remove while reading\n");
+		count++;
+		// entries created meanwhile may show up, the others still do
+		if(count == n / 2 && fs_mkdir(sb, "/late") < 0) ERROR("FAIL fs_mkdir /late\n");
+	}
+	fs_closedir(d);
+	if(count != n && count != n + 1) ERROR("FAIL remove while reading count\n");
+	if(count == n && fs_rmdir(sb, "/late") < 0) ERROR("FAIL fs_rmdir /late\n");
+
+	list = fs_list_dir(sb, "/");
+	if(list == NULL || strcmp(list, "") != 0) ERROR("FAIL not empty\n");
+	free(list);
+	free(seen);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,141 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int mode);
+int fs_stats_test(struct superblock *sb, uint64_t blksz, int mode);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i], FS_IO_PREAD)) exit(EXIT_FAILURE);
+		if(test(fsizes[j], blkszs[i], FS_IO_MMAP)) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int mode)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	sb = fs_open_mode(fname, mode);
+	if(sb == NULL) ERROR("FAIL fs_open_mode\n");
+
+	if(fs_stats_test(sb, blksz, mode)) ERROR("FAIL fs_stats_test\n");
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_stats_test(struct superblock *sb, uint64_t blksz, int mode)/*{{{*/
+{
+	struct fs_stats st;
+	int i;
+
+	fs_stats_reset(sb);
+	fs_stats_get(sb, &st);
+	if(st.blk_reads || st.io_requests || st.cache_hits || st.alloc_calls)
+		ERROR("FAIL counters not reset\n");
+	for(i = 0; i < FS_NOPS; i++) {
+		if(st.ops[i].calls || st.ops[i].nsecs) ERROR("FAIL op counters not reset\n");
+	}
+
+	uint64_t freeblks = sb->freeblks;
+	uint64_t size = 3 * blksz;
+	char *buf = malloc(size);
+	char *back = malloc(size);
+	memset(buf, 'x', size);
+
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/d/f", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_read_file(sb, "/d/f", back, size) != size) ERROR("FAIL fs_read_file\n");
+	if(fs_read_file(sb, "/d/f", back, size) != size) ERROR("FAIL fs_read_file\n");
+	if(fs_read_file(sb, "/nope", back, size) >= 0) ERROR("FAIL fs_read_file missing\n");
+	struct fsfile *f = fs_file_open(sb, "/d/f", 0);
+	if(f == NULL || fs_file_pwrite(f, buf, blksz, 0) != blksz) ERROR("FAIL fs_file_pwrite\n");
+	fs_file_close(f);
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+
+	fs_stats_get(sb, &st);
+	if(st.ops[FS_OP_MKDIR].calls != 1) ERROR("FAIL mkdir calls\n");
+	if(st.ops[FS_OP_WRITE_FILE].calls != 1) ERROR("FAIL write_file calls\n");
+	// failed calls count too
+	if(st.ops[FS_OP_READ_FILE].calls != 3) ERROR("FAIL read_file calls\n");
+	if(st.ops[FS_OP_FILE_OPEN].calls != 1 || st.ops[FS_OP_FILE_PWRITE].calls != 1)
+		ERROR("FAIL file calls\n");
+	if(st.ops[FS_OP_SYNC].calls != 1 || st.ops[FS_OP_UNLINK].calls != 0)
+		ERROR("FAIL sync calls\n");
+	if(st.ops[FS_OP_READ_FILE].nsecs == 0) ERROR("FAIL read_file time\n");
+
+	// the data went to and came back from the image
+	if(st.bytes_written < size + blksz || st.blk_writes < 4) ERROR("FAIL bytes written\n");
+	if(st.bytes_read < 2 * size || st.blk_reads < 6) ERROR("FAIL bytes read\n");
+	if(mode == FS_IO_PREAD && st.io_requests == 0) ERROR("FAIL requests\n");
+	if(mode == FS_IO_PREAD && st.cache_hits == 0) ERROR("FAIL cache hits\n");
+	if(mode == FS_IO_MMAP && (st.io_requests || st.cache_hits || st.cache_misses))
+		ERROR("FAIL mmap requests\n");
+
+	if(st.alloc_calls == 0 || st.blk_allocs - st.blk_frees != freeblks - sb->freeblks)
+		ERROR("FAIL allocations\n");
+
+	FILE *out = tmpfile();
+	fs_stats_dump(sb, out);
+	rewind(out);
+	char line[256];
+	int found = 0, lines = 0;
+	while(fgets(line, sizeof(line), out)) {
+		lines++;
+		if(strncmp(line, "read_file ", 10) == 0 && strstr(line, " 3 calls")) found = 1;
+		if(strncmp(line, "unlink ", 7) == 0) ERROR("FAIL dump lists unused op\n");
+	}
+	fclose(out);
+	if(!found || lines != 3 + 6) ERROR("FAIL fs_stats_dump\n");
+
+	if(fs_unlink(sb, "/d/f") < 0 || fs_rmdir(sb, "/d") < 0) ERROR("FAIL cleanup\n");
+	fs_stats_get(sb, &st);
+	if(st.blk_allocs - st.blk_frees != freeblks - sb->freeblks) ERROR("FAIL frees\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+
+	free(buf);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int journal);
+int fs_small_files_test(struct superblock *sb, uint64_t blksz, int n, int journal);
+int check_files(struct superblock *sb, uint64_t blksz, int n);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < 2; k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j], (int)blkszs[i], k);
+		if(test(fsizes[j], blkszs[i], k)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int journal)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(journal && fs_journal_enable(sb, 64) < 0) ERROR("FAIL fs_journal_enable\n");
+
+	uint64_t freeblks = sb->freeblks;
+	// a small file takes its nodeinfo, its inode and up to three blocks
+	int n = freeblks / 8;
+	if(n > 400) n = 400;
+	if(fs_small_files_test(sb, blksz, n, journal)) ERROR("FAIL fs_small_files_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// everything left in the cache reached the image
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_files(sb, blksz, n)) ERROR("FAIL contents after fs_open\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+
+	char name[64];
+	int i;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink /big\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+void fill(char *buf, int i, size_t len)/*{{{*/
+{
+	size_t k;
+	for(k = 0; k < len; k++) buf[k] = (char)(i * 31 + k);
+}
+/*}}}*/
+
+
+size_t file_size(uint64_t blksz, int i)/*{{{*/
+{
+	return (i * 37) % (3 * blksz) + 1;
+}
+/*}}}*/
+
+
+int check_files(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	char name[64];
+	char *want = malloc(3 * blksz);
+	char *back = malloc(3 * blksz + 1);
+	int i;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		size_t len = file_size(blksz, i);
+		fill(want, i, len);
+		if(fs_read_file(sb, name, back, 3 * blksz + 1) != len) ERROR("FAIL size\n");
+		if(memcmp(want, back, len)) ERROR("FAIL contents\n");
+	}
+	free(want);
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_small_files_test(struct superblock *sb, uint64_t blksz, int n, int journal)/*{{{*/
+{
+	char name[64];
+	char *buf = malloc(3 * blksz);
+	int i;
+
+	// the writes of small files are batched with their metadata, which a
+	// journal writes separately
+	fs_stats_reset(sb);
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		fill(buf, i + 1, 3 * blksz);
+		if(fs_write_file(sb, name, buf, 3 * blksz) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	struct fs_stats st;
+	fs_stats_get(sb, &st);
+	if(!journal && st.io_requests >= n) ERROR("FAIL one write per file\n");
+
+	// overwritten before and after reaching the disk, and read back
+	// while the new contents are only in memory
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		fill(buf, i, file_size(blksz, i));
+		if(fs_write_file(sb, name, buf, file_size(blksz, i)) < 0)
+			ERROR("FAIL fs_write_file again\n");
+	}
+	if(check_files(sb, blksz, n)) ERROR("FAIL contents in memory\n");
+
+	// a large file pushes the small ones out of the cache
+	size_t bigsz = (sb->freeblks / 2) * blksz;
+	char *big = malloc(bigsz);
+	memset(big, 'b', bigsz);
+	if(fs_write_file(sb, "/big", big, bigsz) < 0) ERROR("FAIL fs_write_file /big\n");
+	if(fs_read_file(sb, "/big", big, bigsz) != bigsz) ERROR("FAIL fs_read_file /big\n");
+	if(check_files(sb, blksz, n)) ERROR("FAIL contents after eviction\n");
+
+	free(big);
+	free(buf);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,288 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int journal);
+int fs_snapshot_test(struct superblock *sb, uint64_t blksz);
+int check_file(struct superblock *sb, const char *fname, char c, size_t len, size_t patch);
+int check_snapshots(struct superblock *sb, uint64_t blksz);
+int fs_snapshot_nospace_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < 2; k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j], (int)blkszs[i], k);
+		if(test(fsizes[j], blkszs[i], k)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int journal)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(journal && fs_journal_enable(sb, 64) < 0) ERROR("FAIL fs_journal_enable\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_snapshot_test(sb, blksz)) ERROR("FAIL fs_snapshot_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// the snapshots are found again, copies included
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_snapshots(sb, blksz)) ERROR("FAIL snapshots after fs_open\n");
+	if(fs_open_mode(fname, FS_IO_MMAP) != NULL) ERROR("FAIL fs_open_mode busy\n");
+
+	// deleting them gives back everything they kept
+	if(fs_snapshot_delete(sb, "one") < 0) ERROR("FAIL fs_snapshot_delete one\n");
+	if(fs_snapshot_delete(sb, "one") == 0 || errno != ENOENT)
+		ERROR("FAIL fs_snapshot_delete twice\n");
+	struct superblock *view = fs_snapshot_open(sb, "two");
+	if(view == NULL) ERROR("FAIL fs_snapshot_open two\n");
+	if(check_file(view, "/d/b", 'b', 5 * blksz, blksz)) ERROR("FAIL two after deleting one\n");
+	if(fs_close(view)) ERROR("FAIL fs_close view\n");
+	if(fs_snapshot_delete(sb, "two") < 0) ERROR("FAIL fs_snapshot_delete two\n");
+	char *list = fs_snapshot_list(sb);
+	if(list == NULL || strcmp(list, "")) ERROR("FAIL fs_snapshot_list empty\n");
+	free(list);
+
+	if(fs_unlink(sb, "/a") < 0 || fs_unlink(sb, "/d/b") < 0 || fs_unlink(sb, "/e") < 0
+			|| fs_rmdir(sb, "/d") < 0)
+		ERROR("FAIL cleanup\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// without snapshots the image can be mapped again
+	sb = fs_open_mode(fname, FS_IO_MMAP);
+	if(sb == NULL) ERROR("FAIL fs_open_mode mmap\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(fs_snapshot_nospace_test(sb, blksz)) ERROR("FAIL fs_snapshot_nospace_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *fname, char c, size_t len, size_t patch)/*{{{*/
+{
+	// =len bytes of =c, with a block of 'X' at =patch, if =patch
+	char *buf = malloc(len + 1);
+	if(fs_read_file(sb, fname, buf, len + 1) != len) ERROR("FAIL size\n");
+	size_t i;
+	for(i = 0; i < len; i++) {
+		char want = (patch && i >= patch && i < patch + sb->blksz) ? 'X' : c;
+		if(buf[i] != want) ERROR("FAIL contents\n");
+	}
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+int check_snapshots(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	char *list = fs_snapshot_list(sb);
+	if(list == NULL || strcmp(list, "two one")) ERROR("FAIL fs_snapshot_list\n");
+	free(list);
+
+	// "one" holds the files as they were written
+	struct superblock *one = fs_snapshot_open(sb, "one");
+	if(one == NULL) ERROR("FAIL fs_snapshot_open one\n");
+	if(check_file(one, "/a", 'a', 10, 0)) ERROR("FAIL one /a\n");
+	if(check_file(one, "/c", 'c', 40 * blksz, 0)) ERROR("FAIL one /c\n");
+	if(check_file(one, "/d/b", 'b', 5 * blksz, 0)) ERROR("FAIL one /d/b\n");
+	struct fs_dirent st;
+	if(fs_stat(one, "/e", &st) == 0 || errno != ENOENT) ERROR("FAIL one /e\n");
+	list = fs_list_dir(one, "/");
+	if(list == NULL || strcmp(list, "a c d/")) ERROR("FAIL one fs_list_dir\n");
+	free(list);
+
+	// "two" was taken after the first round of changes
+	struct superblock *two = fs_snapshot_open(sb, "two");
+	if(two == NULL) ERROR("FAIL fs_snapshot_open two\n");
+	if(check_file(two, "/a", 'A', 3 * blksz, 0)) ERROR("FAIL two /a\n");
+	if(check_file(two, "/d/b", 'b', 5 * blksz, blksz)) ERROR("FAIL two /d/b\n");
+	if(fs_stat(two, "/c", &st) == 0 || errno != ENOENT) ERROR("FAIL two /c\n");
+	if(check_file(two, "/e", 'e', 7, 0)) ERROR("FAIL two /e\n");
+
+	// and the live tree has moved on since
+	if(check_file(sb, "/d/b", 'b', 5 * blksz, 2 * blksz)) ERROR("FAIL live /d/b\n");
+	if(check_file(sb, "/a", 'A', 3 * blksz, 0)) ERROR("FAIL live /a\n");
+
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+	if(fs_close(one) || fs_close(two)) ERROR("FAIL fs_close view\n");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_snapshot_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	char *buf = malloc(40 * blksz);
+	memset(buf, 'a', 10);
+	if(fs_write_file(sb, "/a", buf, 10) < 0) ERROR("FAIL fs_write_file /a\n");
+	memset(buf, 'c', 40 * blksz);
+	if(fs_write_file(sb, "/c", buf, 40 * blksz) < 0) ERROR("FAIL fs_write_file /c\n");
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir /d\n");
+	memset(buf, 'b', 5 * blksz);
+	if(fs_write_file(sb, "/d/b", buf, 5 * blksz) < 0) ERROR("FAIL fs_write_file /d/b\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_snapshot_create(sb, "one") < 0) ERROR("FAIL fs_snapshot_create\n");
+	if(sb->freeblks != freeblks - 1) ERROR("FAIL snapshot takes one block\n");
+	if(fs_snapshot_create(sb, "one") == 0 || errno != EEXIST) ERROR("FAIL fs_snapshot_create twice\n");
+	if(fs_snapshot_create(sb, "o/ne") == 0 || errno != EINVAL) ERROR("FAIL fs_snapshot_create name\n");
+
+	// removed files keep their blocks, rewritten ones are copied
+	freeblks = sb->freeblks;
+	if(fs_unlink(sb, "/c") < 0) ERROR("FAIL fs_unlink /c\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL unlinked blocks freed\n");
+	memset(buf, 'A', 3 * blksz);
+	if(fs_write_file(sb, "/a", buf, 3 * blksz) < 0) ERROR("FAIL fs_write_file /a again\n");
+	memset(buf, 'e', 7);
+	if(fs_write_file(sb, "/e", buf, 7) < 0) ERROR("FAIL fs_write_file /e\n");
+	struct fsfile *f = fs_file_open(sb, "/d/b", 0);
+	if(f == NULL) ERROR("FAIL fs_file_open\n");
+	memset(buf, 'X', blksz);
+	if(fs_file_pwrite(f, buf, blksz, blksz) != blksz) ERROR("FAIL fs_file_pwrite\n");
+
+	// the snapshot reads the old contents, before and after the flush
+	struct superblock *one = fs_snapshot_open(sb, "one");
+	if(one == NULL) ERROR("FAIL fs_snapshot_open\n");
+	int round;
+	for(round = 0; round < 2; round++) {
+		if(check_file(one, "/a", 'a', 10, 0)) ERROR("FAIL snapshot /a\n");
+		if(check_file(one, "/c", 'c', 40 * blksz, 0)) ERROR("FAIL snapshot /c\n");
+		if(check_file(one, "/d/b", 'b', 5 * blksz, 0)) ERROR("FAIL snapshot /d/b\n");
+		if(check_file(sb, "/d/b", 'b', 5 * blksz, blksz)) ERROR("FAIL live /d/b\n");
+		if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	}
+	if(fs_write_file(one, "/a", buf, 1) == 0 || errno != EROFS) ERROR("FAIL snapshot writable\n");
+	if(fs_unlink(one, "/a") == 0 || errno != EROFS) ERROR("FAIL snapshot unlink\n");
+	if(fs_file_open(one, "/a", FS_TRUNC) != NULL || errno != EROFS) ERROR("FAIL snapshot trunc\n");
+	if(fs_snapshot_delete(sb, "one") == 0 || errno != EBUSY) ERROR("FAIL delete open snapshot\n");
+	if(fs_close(one)) ERROR("FAIL fs_close snapshot\n");
+
+	// a second snapshot, then the same blocks change again
+	if(fs_snapshot_create(sb, "two") < 0) ERROR("FAIL fs_snapshot_create two\n");
+	if(fs_file_pwrite(f, buf, blksz, 2 * blksz) != blksz) ERROR("FAIL fs_file_pwrite again\n");
+	memset(buf, 'b', blksz);
+	if(fs_file_pwrite(f, buf, blksz, blksz) != blksz) ERROR("FAIL fs_file_pwrite back\n");
+	fs_file_close(f);
+	if(check_snapshots(sb, blksz)) ERROR("FAIL check_snapshots\n");
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* With a snapshot on a full image, operations fail with ENOSPC up front,
+ * the snapshot is kept and the image stays consistent; what was written
+ * since the snapshot can still be removed. */
+int fs_snapshot_nospace_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	char name[32];
+	char *buf = malloc(8 * blksz);
+	memset(buf, 's', 8 * blksz);
+	if(fs_write_file(sb, "/s", buf, 8 * blksz) < 0) ERROR("FAIL fs_write_file /s\n");
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir /d\n");
+	if(fs_snapshot_create(sb, "full") < 0) ERROR("FAIL fs_snapshot_create\n");
+
+	// fill the image with small files, which grow /d, then with one
+	// large file
+	int n;
+	for(n = 0; ; n++) {
+		sprintf(name, "/d/n%d", n);
+		if(fs_write_file(sb, name, buf, blksz) < 0) break;
+	}
+	if(errno != ENOSPC || n == 0) ERROR("FAIL small files did not end with ENOSPC\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck after small files\n");
+	if(fs_unlink(sb, "/d/n0") < 0) ERROR("FAIL fs_unlink /d/n0\n");
+	struct fsfile *fill = fs_file_open(sb, "/fill", FS_CREAT);
+	if(fill == NULL) ERROR("FAIL fs_file_open /fill\n");
+	uint64_t off = 0;
+	while(fs_file_pwrite(fill, buf, blksz, off) == blksz) off += blksz;
+	if(errno != ENOSPC) ERROR("FAIL fill did not end with ENOSPC\n");
+	fs_file_close(fill);
+	if(fs_write_file(sb, "/d/n0", buf, blksz) == 0 || errno != ENOSPC)
+		ERROR("FAIL fs_write_file on a full image\n");
+	if(fs_mkdir(sb, "/e") == 0 || errno != ENOSPC) ERROR("FAIL fs_mkdir on a full image\n");
+
+	// no room left for the snapshot's copies
+	struct fsfile *f = fs_file_open(sb, "/s", 0);
+	if(f == NULL) ERROR("FAIL fs_file_open /s\n");
+	memset(buf, 'X', blksz);
+	if(fs_file_pwrite(f, buf, blksz, blksz) >= 0 || errno != ENOSPC)
+		ERROR("FAIL fs_file_pwrite without room\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	struct superblock *view = fs_snapshot_open(sb, "full");
+	if(view == NULL) ERROR("FAIL fs_snapshot_open\n");
+	if(check_file(view, "/s", 's', 8 * blksz, 0)) ERROR("FAIL snapshot /s\n");
+	if(check_file(sb, "/s", 's', 8 * blksz, 0)) ERROR("FAIL live /s\n");
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck when full\n");
+
+	// removing what came after the snapshot makes room again
+	if(fs_unlink(sb, "/fill") < 0) ERROR("FAIL fs_unlink /fill\n");
+	if(fs_file_pwrite(f, buf, blksz, blksz) != blksz) ERROR("FAIL fs_file_pwrite\n");
+	fs_file_close(f);
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	if(check_file(view, "/s", 's', 8 * blksz, 0)) ERROR("FAIL snapshot /s after write\n");
+	if(check_file(sb, "/s", 's', 8 * blksz, blksz)) ERROR("FAIL live /s after write\n");
+	if(fs_close(view)) ERROR("FAIL fs_close view\n");
+
+	if(fs_snapshot_delete(sb, "full") < 0) ERROR("FAIL fs_snapshot_delete\n");
+	int i;
+	for(i = 1; i < n; i++) {
+		sprintf(name, "/d/n%d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink /d/n*\n");
+	}
+	if(fs_rmdir(sb, "/d") < 0 || fs_unlink(sb, "/s") < 0) ERROR("FAIL cleanup\n");
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+	free(buf);
+	return 0;
+}
+/*}}}*/
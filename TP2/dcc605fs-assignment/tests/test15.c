@@ -0,0 +1,208 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int journal);
+int fs_inline_test(struct superblock *sb, uint64_t blksz, int n);
+int fs_inline_handle_test(struct superblock *sb, uint64_t blksz);
+int check_files(struct superblock *sb, uint64_t blksz, int n);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < 2; k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j], (int)blkszs[i], k);
+		if(test(fsizes[j], blkszs[i], k)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int journal)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(journal && fs_journal_enable(sb, 64) < 0) ERROR("FAIL fs_journal_enable\n");
+
+	uint64_t freeblks = sb->freeblks;
+	// a tiny file takes its nodeinfo and its inode, leaving room for /h
+	int n = freeblks / 4;
+	if(n > 100) n = 100;
+	if(fs_inline_test(sb, blksz, n)) ERROR("FAIL fs_inline_test\n");
+	if(fs_inline_handle_test(sb, blksz)) ERROR("FAIL fs_inline_handle_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_files(sb, blksz, n)) ERROR("FAIL contents after fs_open\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+
+	char name[64];
+	int i;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_unlink(sb, "/h") < 0) ERROR("FAIL fs_unlink /h\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck after unlink\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+void fill(char *buf, int i, size_t len)/*{{{*/
+{
+	size_t k;
+	for(k = 0; k < len; k++) buf[k] = (char)(i * 31 + k);
+}
+/*}}}*/
+
+
+size_t file_size(uint64_t blksz, int i)/*{{{*/
+{
+	// what fits in the inode, past its header of four fields
+	return i % (blksz - 4 * sizeof(uint64_t) + 1);
+}
+/*}}}*/
+
+
+int check_files(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	char name[64];
+	char *want = malloc(blksz);
+	char *back = malloc(blksz + 1);
+	int i;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		size_t len = file_size(blksz, i);
+		fill(want, i, len);
+		if(fs_read_file(sb, name, back, blksz + 1) != len) ERROR("FAIL size\n");
+		if(memcmp(want, back, len)) ERROR("FAIL contents\n");
+	}
+	free(want);
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_inline_test(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	char name[64];
+	char *buf = malloc(2 * blksz);
+	size_t max = blksz - 4 * sizeof(uint64_t);
+	int i;
+
+	// a tiny file takes its nodeinfo and its inode, and no data block
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		if(fs_write_file(sb, name, buf, 0) < 0) ERROR("FAIL fs_write_file empty\n");
+	}
+	uint64_t freeblks = sb->freeblks;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		fill(buf, i, file_size(blksz, i));
+		if(fs_write_file(sb, name, buf, file_size(blksz, i)) < 0) ERROR("FAIL fs_write_file\n");
+		if(sb->freeblks != freeblks) ERROR("FAIL data block for a tiny file\n");
+	}
+	if(check_files(sb, blksz, n)) ERROR("FAIL contents in memory\n");
+
+	// reading it back needs nothing past the inode, still in the cache
+	struct fs_stats st;
+	fs_stats_reset(sb);
+	if(check_files(sb, blksz, 10)) ERROR("FAIL contents again\n");
+	fs_stats_get(sb, &st);
+	if(st.blk_reads != 0) ERROR("FAIL tiny files read from disk\n");
+
+	// one byte too many needs a block, which goes away with the next
+	// rewrite that fits again
+	fill(buf, 7, max + 1);
+	if(fs_write_file(sb, "/f7", buf, max + 1) < 0) ERROR("FAIL fs_write_file big\n");
+	if(sb->freeblks != freeblks - 1) ERROR("FAIL no data block\n");
+	if(fs_read_file(sb, "/f7", buf + blksz, blksz) != max + 1) ERROR("FAIL size big\n");
+	if(memcmp(buf, buf + blksz, max + 1)) ERROR("FAIL contents big\n");
+	fill(buf, 7, file_size(blksz, 7));
+	if(fs_write_file(sb, "/f7", buf, file_size(blksz, 7)) < 0) ERROR("FAIL fs_write_file back\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL data block kept\n");
+
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_inline_handle_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	size_t max = blksz - 4 * sizeof(uint64_t);
+	char *buf = malloc(3 * blksz);
+	char *back = malloc(3 * blksz);
+
+	// small writes through a handle stay in the inode, holes included
+	struct fsfile *f = fs_file_open(sb, "/h", FS_CREAT);
+	if(f == NULL) ERROR("FAIL fs_file_open\n");
+	uint64_t freeblks = sb->freeblks;
+	memset(buf, 0, 3 * blksz);
+	fill(buf + 10, 1, 5);
+	if(fs_file_pwrite(f, buf + 10, 5, 10) != 5) ERROR("FAIL fs_file_pwrite\n");
+	fill(buf, 2, 4);
+	if(fs_file_pwrite(f, buf, 4, 0) != 4) ERROR("FAIL fs_file_pwrite start\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL data block for a small handle\n");
+	if(fs_file_size(f) != 15) ERROR("FAIL fs_file_size\n");
+	if(fs_file_pread(f, back, 3 * blksz, 0) != 15) ERROR("FAIL fs_file_pread\n");
+	if(memcmp(buf, back, 15)) ERROR("FAIL fs_file_pread contents\n");
+	if(fs_read_file(sb, "/h", back, 3 * blksz) != 15) ERROR("FAIL fs_read_file\n");
+	if(memcmp(buf, back, 15)) ERROR("FAIL fs_read_file contents\n");
+
+	// growing past the inode moves the contents to data blocks
+	fill(buf + max - 1, 3, 2 * blksz);
+	size_t len = max - 1 + 2 * blksz;
+	if(fs_file_pwrite(f, buf + max - 1, 2 * blksz, max - 1) != 2 * blksz) ERROR("FAIL fs_file_pwrite grow\n");
+	if(fs_file_size(f) != len) ERROR("FAIL fs_file_size grow\n");
+	if(fs_file_pread(f, back, 3 * blksz, 0) != len) ERROR("FAIL fs_file_pread grow\n");
+	if(memcmp(buf, back, len)) ERROR("FAIL fs_file_pread grow contents\n");
+	if(fs_file_close(f)) ERROR("FAIL fs_file_close\n");
+	if(fs_read_file(sb, "/h", back, 3 * blksz) != len) ERROR("FAIL fs_read_file grow\n");
+	if(memcmp(buf, back, len)) ERROR("FAIL fs_read_file grow contents\n");
+
+	free(buf);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,196 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int journal);
+int fs_compact_test(struct superblock *sb, uint64_t blksz, int n);
+int fs_compact_stat_test(struct superblock *sb, uint64_t blksz, int n);
+int check_files(struct superblock *sb, uint64_t blksz, int n);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < 2; k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j], (int)blkszs[i], k);
+		if(test(fsizes[j], blkszs[i], k)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int journal)/*{{{*/
+{
+	generate_file(fsize);
+	if(fs_format_flags(fname, blksz, 4) != NULL || errno != EINVAL) ERROR("FAIL bad flags\n");
+	struct superblock *sb = fs_format_flags(fname, blksz, FS_FMT_COMPACT);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	int compact = sb->format == FORMAT_COMPACT;
+	// blocks too small for the inode and its nodeinfo keep the classic layout
+	if(compact != (blksz >= 272)) ERROR("FAIL format\n");
+	if(journal && fs_journal_enable(sb, 64) < 0) ERROR("FAIL fs_journal_enable\n");
+
+	// an entry in an empty directory takes its inode, and its nodeinfo
+	// unless the two share a block
+	uint64_t freeblks = sb->freeblks;
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	if(freeblks - sb->freeblks != (compact ? 1 : 2)) ERROR("FAIL blocks for a directory\n");
+
+	int n = sb->freeblks / 8;
+	if(n > 200) n = 200;
+	if(fs_compact_test(sb, blksz, n)) ERROR("FAIL fs_compact_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// the format is found again in the superblock
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if((sb->format == FORMAT_COMPACT) != compact) ERROR("FAIL format after fs_open\n");
+	if(check_files(sb, blksz, n)) ERROR("FAIL contents after fs_open\n");
+	if(compact && fs_compact_stat_test(sb, blksz, n)) ERROR("FAIL fs_compact_stat_test\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+
+	char name[64];
+	int i;
+	if(fs_rmdir(sb, "/d") == 0 || errno != ENOTEMPTY) ERROR("FAIL fs_rmdir not empty\n");
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck after unlink\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+void fill(char *buf, int i, size_t len)/*{{{*/
+{
+	size_t k;
+	for(k = 0; k < len; k++) buf[k] = (char)(i * 31 + k);
+}
+/*}}}*/
+
+
+size_t file_size(uint64_t blksz, int i)/*{{{*/
+{
+	// inline, one block and a few blocks
+	return (i * 37) % (3 * blksz);
+}
+/*}}}*/
+
+
+int check_files(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	char name[64];
+	char *want = malloc(3 * blksz);
+	char *back = malloc(3 * blksz + 1);
+	int i;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/d/f%d", i);
+		size_t len = file_size(blksz, i);
+		fill(want, i, len);
+		if(fs_read_file(sb, name, back, 3 * blksz + 1) != len) ERROR("FAIL size\n");
+		if(memcmp(want, back, len)) ERROR("FAIL contents\n");
+	}
+	free(want);
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_compact_test(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	char name[64];
+	char *buf = malloc(3 * blksz);
+	int i;
+
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/d/f%d", i);
+		fill(buf, i, file_size(blksz, i));
+		if(fs_write_file(sb, name, buf, file_size(blksz, i)) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	if(check_files(sb, blksz, n)) ERROR("FAIL contents in memory\n");
+
+	// growing a file through a handle keeps its nodeinfo intact
+	struct fsfile *f = fs_file_open(sb, "/d/f1", 0);
+	if(f == NULL) ERROR("FAIL fs_file_open\n");
+	fill(buf, 1, 3 * blksz);
+	if(fs_file_pwrite(f, buf, 3 * blksz, 0) != 3 * blksz) ERROR("FAIL fs_file_pwrite\n");
+	if(fs_file_close(f)) ERROR("FAIL fs_file_close\n");
+	if(fs_read_file(sb, "/d/f1", buf, 3 * blksz) != 3 * blksz) ERROR("FAIL size grown\n");
+	fill(buf, 1, file_size(blksz, 1));
+	if(fs_write_file(sb, "/d/f1", buf, file_size(blksz, 1)) < 0) ERROR("FAIL fs_write_file back\n");
+
+	char *list = fs_list_dir(sb, "/d");
+	if(list == NULL || strstr(list, "f0 ") == NULL) ERROR("FAIL fs_list_dir\n");
+	free(list);
+
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_compact_stat_test(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	char name[64];
+	int i;
+
+	// with the directory in the cache, the size and name of each entry
+	// come from a single block
+	char *list = fs_list_dir(sb, "/d");
+	if(list == NULL) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	struct fs_dirent st;
+	if(fs_stat(sb, "/d/f0", &st) < 0) ERROR("FAIL fs_stat first\n");
+
+	struct fs_stats stats;
+	fs_stats_reset(sb);
+	for(i = 1; i < n; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(fs_stat(sb, name, &st) < 0) ERROR("FAIL fs_stat\n");
+		if(st.size != file_size(blksz, i) || st.isdir) ERROR("FAIL fs_stat size\n");
+		sprintf(name, "f%d", i);
+		if(strcmp(st.name, name) != 0) ERROR("FAIL fs_stat name\n");
+	}
+	fs_stats_get(sb, &stats);
+	if(stats.cache_misses > n - 1) ERROR("FAIL more than one block per entry\n");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,255 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int journal);
+int fs_zip_test(struct superblock *sb, uint64_t blksz);
+int fs_zip_handle_test(struct superblock *sb, uint64_t blksz);
+int fs_zip_snapshot_test(struct superblock *sb);
+int check_file(struct superblock *sb, const char *name, const char *want, size_t len);
+void fill_log(char *buf, size_t len, int seed);
+void fill_random(char *buf, size_t len, int seed);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define LOG_SIZE (3 * 65536 + 1000)
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j, k;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < 2; k++) {
+		printf("fsize %d blksz %d journal %d\n", (int)fsizes[j], (int)blkszs[i], k);
+		if(test(fsizes[j], blkszs[i], k)) exit(EXIT_FAILURE);
+	}
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int journal)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(journal && fs_journal_enable(sb, 64) < 0) ERROR("FAIL fs_journal_enable\n");
+	uint64_t freeblks = sb->freeblks;
+
+	char buf[16];
+	if(fs_write_file_flags(sb, "/x", buf, sizeof(buf), 2) == 0 || errno != EINVAL) ERROR("FAIL bad flags\n");
+	if(fs_zip_test(sb, blksz)) ERROR("FAIL fs_zip_test\n");
+	if(fs_zip_handle_test(sb, blksz)) ERROR("FAIL fs_zip_handle_test\n");
+	if(fs_zip_snapshot_test(sb)) ERROR("FAIL fs_zip_snapshot_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// compressed files read back the same from the image
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	char *want = malloc(LOG_SIZE);
+	fill_log(want, LOG_SIZE, 1);
+	if(check_file(sb, "/log", want, LOG_SIZE)) ERROR("FAIL contents after fs_open\n");
+	free(want);
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+
+	if(fs_unlink(sb, "/log") < 0) ERROR("FAIL fs_unlink /log\n");
+	if(fs_unlink(sb, "/plain") < 0) ERROR("FAIL fs_unlink /plain\n");
+	if(fs_unlink(sb, "/rand") < 0) ERROR("FAIL fs_unlink /rand\n");
+	if(fs_unlink(sb, "/h") < 0) ERROR("FAIL fs_unlink /h\n");
+	if(fs_unlink(sb, "/s") < 0) ERROR("FAIL fs_unlink /s\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck after unlink\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+void fill_log(char *buf, size_t len, int seed)/*{{{*/
+{
+	char line[160];
+	size_t k = 0;
+	int i;
+	for(i = 0; k < len; i++) {
+		int n = sprintf(line, "2026-10-17 %02d:%02d:%02d host%d sshd[%d]: Accepted publickey for user%d from 10.0.%d.%d port %d\n",
+				(i / 3600) % 24, (i / 60) % 60, i % 60, seed, 1000 + i % 97,
+				i % 13, i % 7, (i * 31) % 256, 40000 + (i * 17) % 20000);
+		if(n > len - k) n = len - k;
+		memcpy(buf + k, line, n);
+		k += n;
+	}
+}
+/*}}}*/
+
+
+void fill_random(char *buf, size_t len, int seed)/*{{{*/
+{
+	size_t k;
+	srand(seed);
+	for(k = 0; k < len; k++) buf[k] = (char)rand();
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, const char *name, const char *want, size_t len)/*{{{*/
+{
+	char *back = malloc(len + 1);
+	if(fs_read_file(sb, name, back, len + 1) != len) ERROR("FAIL size\n");
+	if(memcmp(want, back, len)) ERROR("FAIL contents\n");
+	struct fs_dirent st;
+	if(fs_stat(sb, name, &st) < 0 || st.size != len) ERROR("FAIL fs_stat size\n");
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_zip_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	char *buf = malloc(LOG_SIZE);
+	char *back = malloc(LOG_SIZE);
+	fill_log(buf, LOG_SIZE, 1);
+
+	// text takes less than half the blocks once compressed
+	uint64_t freeblks = sb->freeblks;
+	if(fs_write_file(sb, "/plain", buf, LOG_SIZE) < 0) ERROR("FAIL fs_write_file\n");
+	uint64_t plain = freeblks - sb->freeblks;
+	freeblks = sb->freeblks;
+	if(fs_write_file_flags(sb, "/log", buf, LOG_SIZE, FS_WR_COMPRESS) < 0) ERROR("FAIL fs_write_file_flags\n");
+	uint64_t zip = freeblks - sb->freeblks;
+	if(zip * 2 > plain) ERROR("FAIL not compressed\n");
+	if(check_file(sb, "/log", buf, LOG_SIZE)) ERROR("FAIL contents\n");
+
+	// a buffer that ends inside a group
+	if(fs_read_file(sb, "/log", back, 70000) != 70000) ERROR("FAIL short read\n");
+	if(memcmp(buf, back, 70000)) ERROR("FAIL short read contents\n");
+
+	// data that does not compress is stored as it is
+	size_t len = 16 * blksz + 7;
+	fill_random(buf, len, 3);
+	freeblks = sb->freeblks;
+	if(fs_write_file_flags(sb, "/rand", buf, len, FS_WR_COMPRESS) < 0) ERROR("FAIL fs_write_file_flags random\n");
+	if(freeblks - sb->freeblks < (len + blksz - 1) / blksz) ERROR("FAIL random data compressed\n");
+	if(check_file(sb, "/rand", buf, len)) ERROR("FAIL random contents\n");
+
+	free(buf);
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_zip_handle_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	char *want = malloc(LOG_SIZE);
+	char *back = malloc(LOG_SIZE);
+	fill_log(want, LOG_SIZE, 2);
+	if(fs_write_file_flags(sb, "/h", want, LOG_SIZE, FS_WR_COMPRESS) < 0) ERROR("FAIL fs_write_file_flags\n");
+
+	struct fsfile *f = fs_file_open(sb, "/h", 0);
+	if(f == NULL) ERROR("FAIL fs_file_open\n");
+	if(fs_file_size(f) != LOG_SIZE) ERROR("FAIL fs_file_size\n");
+	int i;
+	srand(7);
+	for(i = 0; i < 200; i++) {
+		uint64_t off = rand() % LOG_SIZE;
+		size_t len = rand() % 3000;
+		size_t got = (off + len > LOG_SIZE) ? LOG_SIZE - off : len;
+		if(fs_file_pread(f, back, len, off) != got) ERROR("FAIL fs_file_pread size\n");
+		if(memcmp(want + off, back, got)) ERROR("FAIL fs_file_pread contents\n");
+	}
+	if(fs_file_pread(f, back, LOG_SIZE, 0) != LOG_SIZE) ERROR("FAIL fs_file_pread whole\n");
+	if(memcmp(want, back, LOG_SIZE)) ERROR("FAIL fs_file_pread whole contents\n");
+
+	// small reads in a group decompress it once
+	struct fs_stats st;
+	if(fs_file_pread(f, back, 100, 65536 + 10) != 100) ERROR("FAIL fs_file_pread warm\n");
+	fs_stats_reset(sb);
+	for(i = 0; i < 50; i++) {
+		if(fs_file_pread(f, back, 100, 65536 + 100 * i) != 100) ERROR("FAIL fs_file_pread small\n");
+		if(memcmp(want + 65536 + 100 * i, back, 100)) ERROR("FAIL fs_file_pread small contents\n");
+	}
+	fs_stats_get(sb, &st);
+	if(st.blk_reads != 0) ERROR("FAIL group read again\n");
+
+	// writing through the handle stores the file uncompressed
+	uint64_t freeblks = sb->freeblks;
+	memcpy(want + 5, "XYZ", 3);
+	if(fs_file_pwrite(f, "XYZ", 3, 5) != 3) ERROR("FAIL fs_file_pwrite\n");
+	want = realloc(want, LOG_SIZE + 3);
+	memcpy(want + LOG_SIZE, "end", 3);
+	if(fs_file_pwrite(f, "end", 3, LOG_SIZE) != 3) ERROR("FAIL fs_file_pwrite append\n");
+	if(sb->freeblks >= freeblks) ERROR("FAIL still compressed\n");
+	back = realloc(back, LOG_SIZE + 3);
+	if(fs_file_pread(f, back, LOG_SIZE + 3, 0) != LOG_SIZE + 3) ERROR("FAIL fs_file_pread after write\n");
+	if(memcmp(want, back, LOG_SIZE + 3)) ERROR("FAIL fs_file_pread after write contents\n");
+	if(fs_file_close(f)) ERROR("FAIL fs_file_close\n");
+	if(check_file(sb, "/h", want, LOG_SIZE + 3)) ERROR("FAIL contents after write\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck after write\n");
+
+	free(want);
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_zip_snapshot_test(struct superblock *sb)/*{{{*/
+{
+	char *old = malloc(LOG_SIZE);
+	char *new = malloc(LOG_SIZE);
+	char *back = malloc(LOG_SIZE);
+	fill_log(old, LOG_SIZE, 4);
+	fill_log(new, LOG_SIZE, 5);
+
+	// a snapshot keeps the compressed blocks a rewrite frees
+	if(fs_write_file_flags(sb, "/s", old, LOG_SIZE, FS_WR_COMPRESS) < 0) ERROR("FAIL fs_write_file_flags\n");
+	if(fs_snapshot_create(sb, "snap") < 0) ERROR("FAIL fs_snapshot_create\n");
+	if(fs_write_file_flags(sb, "/s", new, LOG_SIZE, FS_WR_COMPRESS) < 0) ERROR("FAIL fs_write_file_flags again\n");
+	struct superblock *view = fs_snapshot_open(sb, "snap");
+	if(view == NULL) ERROR("FAIL fs_snapshot_open\n");
+	if(check_file(view, "/s", old, LOG_SIZE)) ERROR("FAIL contents in the snapshot\n");
+	struct fsfile *f = fs_file_open(view, "/s", 0);
+	if(f == NULL) ERROR("FAIL fs_file_open in the snapshot\n");
+	if(fs_file_pread(f, back, 500, 70000) != 500) ERROR("FAIL fs_file_pread in the snapshot\n");
+	if(memcmp(old + 70000, back, 500)) ERROR("FAIL fs_file_pread contents in the snapshot\n");
+	fs_file_close(f);
+	if(fs_close(view)) ERROR("FAIL fs_close snapshot\n");
+	if(check_file(sb, "/s", new, LOG_SIZE)) ERROR("FAIL contents after the snapshot\n");
+	if(fs_snapshot_delete(sb, "snap") < 0) ERROR("FAIL fs_snapshot_delete\n");
+
+	free(old);
+	free(new);
+	free(back);
+	return 0;
+}
+/*}}}*/
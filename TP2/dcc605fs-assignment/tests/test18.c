@@ -0,0 +1,152 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_cache_test(struct superblock *sb, uint64_t blksz, int n);
+int check_files(struct superblock *sb, int n);
+uint64_t disk_freeblks(void);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {256, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* =freeblks of the superblock as it is on disk, bypassing the fs. */
+uint64_t disk_freeblks(void)/*{{{*/
+{
+	struct superblock disk;
+	int fd = open(fname, O_RDONLY);
+	assert(fd >= 0);
+	assert(pread(fd, &disk, sizeof(disk), 0) == sizeof(disk));
+	close(fd);
+	return disk.freeblks;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	// every file takes an inode and a nodeinfo: twice as many blocks as
+	// the cache holds, and as many blocks as the image can spare
+	int n = 300;
+	if(n > sb->freeblks / 4) n = sb->freeblks / 4;
+	if(fs_cache_test(sb, blksz, n)) ERROR("FAIL fs_cache_test\n");
+
+	// fs_close writes back whatever is still dirty
+	uint64_t freeblks = sb->freeblks;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	if(disk_freeblks() != freeblks) ERROR("FAIL superblock not written by fs_close\n");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_open\n");
+	if(check_files(sb, n)) ERROR("FAIL contents after fs_open\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_cache_test(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	struct fs_stats st, st2;
+	struct fs_dirent de;
+	char name[32], data[32];
+	int i;
+
+	uint64_t formatted = disk_freeblks();
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		sprintf(data, "file %d", i);
+		if(fs_write_file(sb, name, data, strlen(data) + 1) < 0) ERROR("FAIL fs_write_file\n");
+	}
+
+	// the superblock is written back on flush only, not on every update
+	if(sb->freeblks >= formatted) ERROR("FAIL no blocks allocated\n");
+	if(disk_freeblks() != formatted) ERROR("FAIL superblock written through\n");
+
+	// the first file's blocks are the least recently used: evicted
+	fs_stats_reset(sb);
+	if(fs_stat(sb, "/f0", &de) < 0) ERROR("FAIL fs_stat /f0\n");
+	fs_stats_get(sb, &st);
+	if(st.cache_misses == 0) ERROR("FAIL /f0 not evicted\n");
+
+	// and now they are the most recently used: cached
+	if(fs_stat(sb, "/f0", &de) < 0) ERROR("FAIL fs_stat /f0\n");
+	fs_stats_get(sb, &st2);
+	if(st2.cache_misses != st.cache_misses) ERROR("FAIL /f0 evicted again\n");
+	if(st2.cache_hits == st.cache_hits) ERROR("FAIL no cache hits\n");
+	if(st2.io_requests != st.io_requests) ERROR("FAIL cached stat read the image\n");
+
+	// so are the last file's
+	fs_stats_reset(sb);
+	sprintf(name, "/f%d", n - 1);
+	if(fs_stat(sb, name, &de) < 0) ERROR("FAIL fs_stat last\n");
+	fs_stats_get(sb, &st);
+	if(st.cache_misses != 0 || st.io_requests != 0) ERROR("FAIL last file evicted\n");
+
+	// evicted dirty blocks were written back: reads see every update
+	if(check_files(sb, n)) ERROR("FAIL contents before fs_close\n");
+	return 0;
+}
+/*}}}*/
+
+
+int check_files(struct superblock *sb, int n)/*{{{*/
+{
+	char name[32], data[32], back[32];
+	int i;
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/f%d", i);
+		sprintf(data, "file %d", i);
+		memset(back, 0, sizeof(back));
+		if(fs_read_file(sb, name, back, sizeof(back)) != strlen(data) + 1)
+			ERROR("FAIL fs_read_file size\n");
+		if(strcmp(back, data)) ERROR("FAIL fs_read_file contents\n");
+	}
+	return 0;
+}
+/*}}}*/
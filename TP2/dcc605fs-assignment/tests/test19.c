@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_mmap_test(struct superblock *sb, uint64_t blksz, char *buf, uint64_t size);
+int check_files(struct superblock *sb, char *buf, uint64_t size);
+void fill(char *buf, uint64_t size);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	srand(605);
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, uint64_t size)/*{{{*/
+{
+	uint64_t i;
+	for(i = 0; i < size; i++) buf[i] = rand();
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	if(fs_open_mode(fname, 3) != NULL || errno != EINVAL) ERROR("FAIL bad mode\n");
+	sb = fs_open_mode(fname, FS_IO_MMAP);
+	if(sb == NULL) ERROR("FAIL fs_open_mode\n");
+	if(fs_journal_enable(sb, 32) == 0 || errno != EINVAL) ERROR("FAIL journal in mmap mode\n");
+
+	uint64_t size = 10 * blksz + blksz / 2;
+	char *buf = malloc(size);
+	fill(buf, size);
+	uint64_t freeblks = sb->freeblks;
+	if(fs_mmap_test(sb, blksz, buf, size)) ERROR("FAIL fs_mmap_test\n");
+	uint64_t used = freeblks - sb->freeblks;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// the same image through the block cache
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(freeblks - sb->freeblks != used) ERROR("FAIL freeblks after fs_open\n");
+	if(check_files(sb, buf, size)) ERROR("FAIL contents after fs_open\n");
+	fill(buf, size);
+	if(fs_write_file(sb, "/d/f", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// and mapped again
+	sb = fs_open_mode(fname, FS_IO_MMAP);
+	if(sb == NULL) ERROR("FAIL fs_open_mode\n");
+	if(check_files(sb, buf, size)) ERROR("FAIL contents after fs_open_mode\n");
+	if(fs_unlink(sb, "/d/f") < 0 || fs_unlink(sb, "/d/g") < 0) ERROR("FAIL fs_unlink\n");
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_mmap_test(struct superblock *sb, uint64_t blksz, char *buf, uint64_t size)/*{{{*/
+{
+	struct fs_stats st;
+	struct fs_dirent de;
+
+	fs_stats_reset(sb);
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/d/f", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/d/g", "small", 6) < 0) ERROR("FAIL fs_write_file\n");
+	if(check_files(sb, buf, size)) ERROR("FAIL contents\n");
+
+	// blocks are used in place: no request goes to the kernel
+	fs_stats_get(sb, &st);
+	if(st.io_requests || st.cache_hits || st.cache_misses) ERROR("FAIL requests in mmap mode\n");
+	if(st.bytes_written < size || st.bytes_read < size) ERROR("FAIL bytes not counted\n");
+
+	// and the mapping is shared: the image file sees the data at once
+	if(fs_stat(sb, "/d/f", &de) < 0) ERROR("FAIL fs_stat\n");
+	char *node = malloc(blksz);
+	char *disk = malloc(size);
+	int fd = open("img", O_RDONLY);
+	assert(fd >= 0);
+	assert(pread(fd, node, blksz, de.inode * blksz) == blksz);
+	struct inode *inode = (struct inode *)node;
+	if(!(inode->mode & IMEXTENT)) ERROR("FAIL file not mapped with extents\n");
+	uint64_t first = inode->links[0], len = inode->links[1];
+	if(first == 0) ERROR("FAIL no data extent\n");
+	// the data may be split in a few extents; compare the first one
+	if(len * blksz < size) size = len * blksz;
+	assert(pread(fd, disk, size, first * blksz) == size);
+	close(fd);
+	if(memcmp(disk, buf, size)) ERROR("FAIL data not in the image file\n");
+	free(node);
+	free(disk);
+	return 0;
+}
+/*}}}*/
+
+
+int check_files(struct superblock *sb, char *buf, uint64_t size)/*{{{*/
+{
+	char *back = malloc(size + 1);
+	if(fs_read_file(sb, "/d/f", back, size + 1) != size) ERROR("FAIL fs_read_file size\n");
+	if(memcmp(back, buf, size)) ERROR("FAIL fs_read_file contents\n");
+	if(fs_read_file(sb, "/d/g", back, size) != 6 || strcmp(back, "small"))
+		ERROR("FAIL fs_read_file small\n");
+	char *list = fs_list_dir(sb, "/d");
+	if(list == NULL || (strcmp(list, "f g") && strcmp(list, "g f"))) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,177 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_runs_test(struct superblock *sb, uint64_t blksz);
+int fs_file_run_test(struct superblock *sb, uint64_t blksz);
+int check_freelist(uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(sb->freeblks != sb->blks - 3) ERROR("FAIL freeblks after fs_format\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	// a fresh image describes its free space with a single extent
+	if(check_freelist(blksz)) ERROR("FAIL free list after fs_format\n");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(fs_runs_test(sb, blksz)) ERROR("FAIL fs_runs_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	if(check_freelist(blksz)) ERROR("FAIL free list after fs_runs_test\n");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(fs_file_run_test(sb, blksz)) ERROR("FAIL fs_file_run_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	if(check_freelist(blksz)) ERROR("FAIL free list after fs_file_run_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* The image on disk has all its free blocks in one extent of one
+ * freepage, right after the root directory. */
+int check_freelist(uint64_t blksz)/*{{{*/
+{
+	struct superblock disk;
+	struct freepage *fp = malloc(blksz);
+	int fd = open(fname, O_RDONLY);
+	assert(fd >= 0);
+	assert(pread(fd, &disk, sizeof(disk), 0) == sizeof(disk));
+	if(disk.freelist != 3) ERROR("FAIL freelist moved\n");
+	assert(pread(fd, fp, blksz, disk.freelist * blksz) == blksz);
+	close(fd);
+	if(fp->next != 0 || fp->count != 1) ERROR("FAIL free space not merged\n");
+	if(fp->links[0] != 4 || fp->links[1] != disk.blks - 4) ERROR("FAIL free extent\n");
+	if(disk.freeblks != disk.blks - 3) ERROR("FAIL freeblks on disk\n");
+	free(fp);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_runs_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	uint64_t nblocks, n2, i;
+
+	// runs are carved front to back from the free extent
+	uint64_t run = fs_get_blocks(sb, 10, &nblocks);
+	if(run == 0 || nblocks != 10) ERROR("FAIL fs_get_blocks\n");
+	uint64_t run2 = fs_get_blocks(sb, 5, &n2);
+	if(run2 != run + 10 || n2 != 5) ERROR("FAIL runs not sequential\n");
+	uint64_t one = fs_get_block(sb);
+	if(one != run2 + 5) ERROR("FAIL fs_get_block not sequential\n");
+	if(sb->freeblks != freeblks - 16) ERROR("FAIL freeblks after fs_get_blocks\n");
+
+	// freeing every other block of the first run leaves holes of one block
+	for(i = 0; i < 10; i += 2) {
+		if(fs_put_block(sb, run + i) < 0) ERROR("FAIL fs_put_block\n");
+	}
+	if(sb->freeblks != freeblks - 11) ERROR("FAIL freeblks after fs_put_block\n");
+
+	// a run longer than the holes comes whole from the large extent
+	uint64_t big = fs_get_blocks(sb, 3, &nblocks);
+	if(big != one + 1 || nblocks != 3) ERROR("FAIL run not taken whole\n");
+	if(fs_put_blocks(sb, big, 3) < 0) ERROR("FAIL fs_put_blocks\n");
+
+	// freeing the rest merges every extent back into one
+	for(i = 1; i < 10; i += 2) {
+		if(fs_put_block(sb, run + i) < 0) ERROR("FAIL fs_put_block\n");
+	}
+	if(fs_put_blocks(sb, run2, 5) < 0 || fs_put_block(sb, one) < 0)
+		ERROR("FAIL fs_put_blocks\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after fs_put_blocks\n");
+
+	// a request larger than the image gets the longest extent
+	uint64_t all = fs_get_blocks(sb, sb->blks, &nblocks);
+	if(all != run || nblocks != freeblks - 1) ERROR("FAIL longest extent\n");
+	if(fs_get_blocks(sb, 2, &n2) == 0 || n2 != 1) ERROR("FAIL freepage not handed out\n");
+	if(sb->freeblks != 0 || fs_get_block(sb) != 0) ERROR("FAIL image not full\n");
+	// the freepage goes back first, and becomes the freepage again
+	if(fs_put_block(sb, all - 1) < 0) ERROR("FAIL fs_put_block\n");
+	if(fs_put_blocks(sb, all, nblocks) < 0) ERROR("FAIL fs_put_blocks\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL freeblks after filling the image\n");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_file_run_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	uint64_t size = 40 * blksz + 1;
+	uint64_t nblocks = 41;
+	char *buf = malloc(size);
+	char *node = malloc(blksz);
+	struct fs_dirent de;
+	memset(buf, 'r', size);
+
+	// a file written in one call gets its data in a single run
+	if(fs_write_file(sb, "/run", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_stat(sb, "/run", &de) < 0) ERROR("FAIL fs_stat\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	int fd = open(fname, O_RDONLY);
+	assert(fd >= 0);
+	assert(pread(fd, node, blksz, de.inode * blksz) == blksz);
+	close(fd);
+	struct inode *inode = (struct inode *)node;
+	if(!(inode->mode & IMEXTENT)) ERROR("FAIL file not mapped with extents\n");
+	if(inode->links[1] != nblocks) ERROR("FAIL data not contiguous\n");
+	if(inode->next != 0) ERROR("FAIL file needs a child inode\n");
+	if(freeblks - sb->freeblks != nblocks + 2) ERROR("FAIL blocks used\n");
+
+	if(fs_unlink(sb, "/run") < 0) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	free(buf);
+	free(node);
+	return 0;
+}
+/*}}}*/
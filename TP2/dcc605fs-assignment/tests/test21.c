@@ -0,0 +1,324 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int make_legacy_file(struct superblock *sb, const char *name, char *buf, uint64_t size);
+int fs_legacy_test(struct superblock *sb, uint64_t blksz);
+int fs_extent_test(struct superblock *sb, uint64_t blksz);
+int check_clean(struct superblock *sb);
+void fill(char *buf, uint64_t size);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+/* blocks written by hand, which fs_close must not overwrite */
+static char **pending;
+static uint64_t *pending_blk;
+static int npending;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	srand(605);
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, uint64_t size)/*{{{*/
+{
+	uint64_t i;
+	for(i = 0; i < size; i++) buf[i] = rand();
+}
+/*}}}*/
+
+
+char * pending_block(uint64_t blksz, uint64_t block)/*{{{*/
+{
+	pending = realloc(pending, (npending + 1) * sizeof(char *));
+	pending_blk = realloc(pending_blk, (npending + 1) * sizeof(uint64_t));
+	pending[npending] = calloc(1, blksz);
+	pending_blk[npending] = block;
+	return pending[npending++];
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	uint64_t freeblks = sb->freeblks;
+
+	// two files in the layout older images use, one link per data block
+	uint64_t maxlinks = (blksz - sizeof(struct inode)) / sizeof(uint64_t) - 1;
+	uint64_t nblocks = 2 * maxlinks + 3;
+	if(nblocks > freeblks / 4) nblocks = freeblks / 4;
+	uint64_t size = nblocks * blksz - blksz / 3;
+	char *buf = malloc(size);
+	char *buf2 = malloc(size);
+	fill(buf, size);
+	fill(buf2, size);
+	if(make_legacy_file(sb, "legacy", buf, size)) ERROR("FAIL make_legacy_file\n");
+	if(make_legacy_file(sb, "legacy2", buf2, size / 2)) ERROR("FAIL make_legacy_file\n");
+	uint64_t used = freeblks - sb->freeblks;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	int fd = open(fname, O_RDWR);
+	assert(fd >= 0);
+	int i;
+	for(i = 0; i < npending; i++) {
+		assert(pwrite(fd, pending[i], blksz, pending_blk[i] * blksz) == blksz);
+		free(pending[i]);
+	}
+	close(fd);
+	npending = 0;
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(freeblks - sb->freeblks != used) ERROR("FAIL freeblks after fs_open\n");
+	if(check_clean(sb)) ERROR("FAIL legacy image not clean\n");
+
+	char *back = malloc(size + 1);
+	if(fs_read_file(sb, "/legacy", back, size + 1) != size) ERROR("FAIL legacy size\n");
+	if(memcmp(back, buf, size)) ERROR("FAIL legacy contents\n");
+	if(fs_read_file(sb, "/legacy2", back, size) != size / 2) ERROR("FAIL legacy2 size\n");
+	if(memcmp(back, buf2, size / 2)) ERROR("FAIL legacy2 contents\n");
+
+	// a handle reads any range, across data blocks and child inodes
+	struct fsfile *f = fs_file_open(sb, "/legacy", 0);
+	if(f == NULL || fs_file_size(f) != size) ERROR("FAIL fs_file_open legacy\n");
+	uint64_t len = 3 * blksz;
+	uint64_t off = (maxlinks - 1) * blksz + 7;
+	if(off + len > size) off = size - len - 1;
+	if(fs_file_pread(f, back, len, off) != len) ERROR("FAIL fs_file_pread legacy\n");
+	if(memcmp(back, buf + off, len)) ERROR("FAIL fs_file_pread legacy contents\n");
+	fs_file_close(f);
+
+	if(fs_legacy_test(sb, blksz)) ERROR("FAIL fs_legacy_test\n");
+	if(fs_extent_test(sb, blksz)) ERROR("FAIL fs_extent_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	free(buf);
+	free(buf2);
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+/* Build a file of =size bytes from =buf in the root directory, in the old
+ * layout: one link per data block, in a chain of plain inodes.  The root
+ * keeps the link layout too.  Blocks are reserved through =sb and written
+ * to the image after fs_close. */
+int make_legacy_file(struct superblock *sb, const char *name, char *buf, uint64_t size)/*{{{*/
+{
+	uint64_t blksz = sb->blksz;
+	uint64_t maxlinks = (blksz - sizeof(struct inode)) / sizeof(uint64_t) - 1;
+	uint64_t nblocks = (size + blksz - 1) / blksz;
+	uint64_t nnodes = (nblocks + maxlinks - 1) / maxlinks;
+	uint64_t *nodes = malloc(nnodes * sizeof(uint64_t));
+	uint64_t meta = fs_get_block(sb);
+	uint64_t i;
+	for(i = 0; i < nnodes; i++) nodes[i] = fs_get_block(sb);
+	if(meta == 0 || nodes[nnodes - 1] == 0) ERROR("FAIL fs_get_block\n");
+
+	struct inode *node = NULL;
+	for(i = 0; i < nblocks; i++) {
+		uint64_t n = i / maxlinks;
+		if(i % maxlinks == 0) {
+			node = (struct inode *)pending_block(blksz, nodes[n]);
+			node->mode = n ? IMCHILD : IMREG;
+			node->parent = n ? nodes[0] : 1;
+			node->meta = n ? nodes[n - 1] : meta;
+			node->next = (n + 1 < nnodes) ? nodes[n + 1] : 0;
+		}
+		// data blocks are not contiguous: every other block stays free
+		uint64_t data = fs_get_block(sb);
+		uint64_t skip = fs_get_block(sb);
+		if(data == 0 || skip == 0) ERROR("FAIL fs_get_block\n");
+		if(fs_put_block(sb, skip) < 0) ERROR("FAIL fs_put_block\n");
+		node->links[i % maxlinks] = data;
+		char *blk = pending_block(blksz, data);
+		uint64_t left = size - i * blksz;
+		memcpy(blk, buf + i * blksz, left < blksz ? left : blksz);
+	}
+
+	struct nodeinfo *info = (struct nodeinfo *)pending_block(blksz, meta);
+	info->size = size;
+	strcpy(info->name, name);
+
+	// the root directory, which only the test changes, lists the file
+	static struct inode *root;
+	static struct nodeinfo *rootinfo;
+	if(npending == nnodes + nblocks + 1) {
+		root = (struct inode *)pending_block(blksz, 1);
+		root->mode = IMDIR;
+		root->parent = 1;
+		root->meta = 2;
+		rootinfo = (struct nodeinfo *)pending_block(blksz, 2);
+		strcpy(rootinfo->name, "/");
+	}
+	root->links[rootinfo->size++] = nodes[0];
+	free(nodes);
+	return 0;
+}
+/*}}}*/
+
+
+int check_clean(struct superblock *sb)/*{{{*/
+{
+	struct fsck_report rep;
+	if(fs_fsck(sb, 2, stdout, &rep) != 0) ERROR("FAIL fs_fsck\n");
+	if(rep.errors || rep.leaked) ERROR("FAIL fs_fsck report\n");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_legacy_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	struct fs_dirent de;
+	char *node = malloc(blksz);
+	char *list = fs_list_dir(sb, "/");
+	if(list == NULL || strcmp(list, "legacy legacy2")) ERROR("FAIL fs_list_dir legacy\n");
+	free(list);
+
+	// removing a legacy file frees its data blocks and all its inodes
+	if(fs_stat(sb, "/legacy2", &de) < 0) ERROR("FAIL fs_stat legacy2\n");
+	uint64_t nblocks = (de.size + blksz - 1) / blksz;
+	uint64_t maxlinks = (blksz - sizeof(struct inode)) / sizeof(uint64_t) - 1;
+	uint64_t nnodes = (nblocks + maxlinks - 1) / maxlinks;
+	if(fs_unlink(sb, "/legacy2") < 0) ERROR("FAIL fs_unlink legacy2\n");
+	if(sb->freeblks != freeblks + nblocks + nnodes + 1) ERROR("FAIL legacy2 blocks not freed\n");
+
+	// overwriting a legacy file converts it to extents
+	uint64_t size = 5 * blksz + 3;
+	char *buf = malloc(size);
+	char *back = malloc(size);
+	fill(buf, size);
+	if(fs_write_file(sb, "/legacy", buf, size) < 0) ERROR("FAIL fs_write_file legacy\n");
+	if(fs_read_file(sb, "/legacy", back, size) != size) ERROR("FAIL legacy size\n");
+	if(memcmp(back, buf, size)) ERROR("FAIL legacy contents\n");
+	if(fs_stat(sb, "/legacy", &de) < 0) ERROR("FAIL fs_stat legacy\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	int fd = open(fname, O_RDONLY);
+	assert(pread(fd, node, blksz, de.inode * blksz) == blksz);
+	close(fd);
+	struct inode *inode = (struct inode *)node;
+	if(inode->mode != (IMREG | IMEXTENT)) ERROR("FAIL legacy not converted\n");
+	if(inode->next != 0) ERROR("FAIL child inodes kept\n");
+	if(check_clean(sb)) ERROR("FAIL image not clean after conversion\n");
+
+	if(fs_unlink(sb, "/legacy") < 0) ERROR("FAIL fs_unlink legacy\n");
+	free(buf);
+	free(back);
+	free(node);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_extent_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks;
+	uint64_t maxext = ((blksz - sizeof(struct inode)) / sizeof(uint64_t) - 1) / 2;
+	uint64_t nruns = 2 * maxext + 1;
+	if(nruns > freeblks / 3) nruns = freeblks / 3;
+	uint64_t i;
+	struct fs_dirent de;
+
+	// two files grown a block at a time, in turns, get interleaved blocks:
+	// one extent per block, and child inodes once the head inode is full
+	uint64_t size = nruns * blksz;
+	char *buf = malloc(size);
+	char *buf2 = malloc(size);
+	char *back = malloc(size);
+	char *node = malloc(blksz);
+	fill(buf, size);
+	fill(buf2, size);
+	struct fsfile *f = fs_file_open(sb, "/frag", FS_CREAT);
+	struct fsfile *f2 = fs_file_open(sb, "/frag2", FS_CREAT);
+	if(f == NULL || f2 == NULL) ERROR("FAIL fs_file_open\n");
+	for(i = 0; i < nruns; i++) {
+		if(fs_file_pwrite(f, buf + i * blksz, blksz, i * blksz) != blksz)
+			ERROR("FAIL fs_file_pwrite\n");
+		if(fs_file_pwrite(f2, buf2 + i * blksz, blksz, i * blksz) != blksz)
+			ERROR("FAIL fs_file_pwrite\n");
+	}
+	fs_file_close(f);
+	fs_file_close(f2);
+	if(fs_read_file(sb, "/frag", back, size) != size) ERROR("FAIL frag size\n");
+	if(memcmp(back, buf, size)) ERROR("FAIL frag contents\n");
+	if(fs_read_file(sb, "/frag2", back, size) != size) ERROR("FAIL frag2 size\n");
+	if(memcmp(back, buf2, size)) ERROR("FAIL frag2 contents\n");
+	if(fs_stat(sb, "/frag", &de) < 0) ERROR("FAIL fs_stat frag\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+
+	int fd = open(fname, O_RDONLY);
+	assert(pread(fd, node, blksz, de.inode * blksz) == blksz);
+	struct inode *inode = (struct inode *)node;
+	if(inode->mode != (IMREG | IMEXTENT)) ERROR("FAIL file not mapped with extents\n");
+	uint64_t found = 0, extents = 0, nnodes = 1;
+	while(1) {
+		for(i = 0; i < maxext && inode->links[2 * i]; i++) {
+			found += inode->links[2 * i + 1];
+			extents++;
+		}
+		if(inode->next == 0) break;
+		uint64_t next = inode->next;
+		assert(pread(fd, node, blksz, next * blksz) == blksz);
+		if(!(inode->mode & IMCHILD) || inode->parent != de.inode) ERROR("FAIL child inode\n");
+		nnodes++;
+	}
+	close(fd);
+	if(found != nruns) ERROR("FAIL extents do not cover the file\n");
+	if(extents < nruns / 2) ERROR("FAIL too few extents\n");
+	if(extents > maxext && nnodes < 2) ERROR("FAIL no child inode\n");
+	if(check_clean(sb)) ERROR("FAIL image not clean with extents\n");
+
+	if(fs_unlink(sb, "/frag") < 0 || fs_unlink(sb, "/frag2") < 0) ERROR("FAIL fs_unlink frag\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL frag blocks leaked\n");
+	free(buf);
+	free(buf2);
+	free(back);
+	free(node);
+	return 0;
+}
+/*}}}*/
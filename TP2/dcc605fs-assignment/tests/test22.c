@@ -0,0 +1,160 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_batch_test(struct superblock *sb, uint64_t blksz);
+int read_counted(struct superblock *sb, const char *name, char *buf, uint64_t size,
+		uint64_t bufsz, struct fs_stats *st);
+void fill(char *buf, uint64_t size);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	srand(605);
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, uint64_t size)/*{{{*/
+{
+	uint64_t i;
+	for(i = 0; i < size; i++) buf[i] = rand();
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_batch_test(sb, blksz)) ERROR("FAIL fs_batch_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* Read =name with fs_read_file into =buf, whose =bufsz first bytes may be
+ * written, and check them against the first bytes of the =size bytes the
+ * file should hold.  The counters of the read itself go to =st. */
+int read_counted(struct superblock *sb, const char *name, char *buf, uint64_t size,
+		uint64_t bufsz, struct fs_stats *st)/*{{{*/
+{
+	struct fs_dirent de;
+	uint64_t want = (size < bufsz) ? size : bufsz;
+	char *back = malloc(bufsz + 16);
+	memset(back, 0x5a, bufsz + 16);
+
+	// the file's inode and nodeinfo are cached: only data is read
+	if(fs_stat(sb, name, &de) < 0 || de.size != size) ERROR("FAIL fs_stat\n");
+	fs_stats_reset(sb);
+	if(fs_read_file(sb, name, back, bufsz) != want) ERROR("FAIL fs_read_file size\n");
+	fs_stats_get(sb, st);
+	if(memcmp(back, buf, want)) ERROR("FAIL fs_read_file contents\n");
+	for(uint64_t i = bufsz; i < bufsz + 16; i++) {
+		if(back[i] != 0x5a) ERROR("FAIL fs_read_file wrote past bufsz\n");
+	}
+	if(st->cache_misses != 0) ERROR("FAIL metadata read\n");
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_batch_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_stats st;
+	uint64_t n = 60;
+	if(n > sb->freeblks / 3) n = sb->freeblks / 3;
+	uint64_t size = n * blksz - blksz / 2;
+	char *buf = malloc(n * blksz);
+	char *buf2 = malloc(n * blksz);
+	uint64_t i;
+	fill(buf, n * blksz);
+	fill(buf2, n * blksz);
+
+	// a contiguous file is read with a single request
+	if(fs_write_file(sb, "/seq", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	if(read_counted(sb, "/seq", buf, size, size, &st)) ERROR("FAIL read /seq\n");
+	if(st.io_requests != 1) ERROR("FAIL /seq not read in one request\n");
+	if(st.blk_reads != n) ERROR("FAIL /seq blocks read\n");
+
+	// and so is its beginning, without touching the caller's buffer past bufsz
+	if(read_counted(sb, "/seq", buf, size, size / 2 + 3, &st)) ERROR("FAIL short read /seq\n");
+	if(st.io_requests != 1) ERROR("FAIL short /seq not read in one request\n");
+	if(fs_unlink(sb, "/seq") < 0) ERROR("FAIL fs_unlink\n");
+
+	// two files grown in turns have one extent per block, one block apart;
+	// a single preadv reads all of them, and the blocks in between
+	struct fsfile *f = fs_file_open(sb, "/a", FS_CREAT);
+	struct fsfile *f2 = fs_file_open(sb, "/b", FS_CREAT);
+	if(f == NULL || f2 == NULL) ERROR("FAIL fs_file_open\n");
+	for(i = 0; i < n; i++) {
+		if(fs_file_pwrite(f, buf + i * blksz, blksz, i * blksz) != blksz)
+			ERROR("FAIL fs_file_pwrite\n");
+		if(fs_file_pwrite(f2, buf2 + i * blksz, blksz, i * blksz) != blksz)
+			ERROR("FAIL fs_file_pwrite\n");
+	}
+	fs_file_close(f);
+	fs_file_close(f2);
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	if(read_counted(sb, "/a", buf, n * blksz, n * blksz, &st)) ERROR("FAIL read /a\n");
+	if(st.io_requests != 1) ERROR("FAIL /a not read in one request\n");
+	if(st.blk_reads < 2 * n - 1 || st.blk_reads > 3 * n) ERROR("FAIL /a blocks read\n");
+	if(read_counted(sb, "/b", buf2, n * blksz, n * blksz, &st)) ERROR("FAIL read /b\n");
+	if(st.io_requests != 1) ERROR("FAIL /b not read in one request\n");
+
+	// blocks still in the cache win over what the image holds
+	f = fs_file_open(sb, "/a", 0);
+	memset(buf + blksz, 'c', blksz);
+	if(fs_file_pwrite(f, buf + blksz, blksz, blksz) != blksz) ERROR("FAIL fs_file_pwrite\n");
+	fs_file_close(f);
+	if(read_counted(sb, "/a", buf, n * blksz, n * blksz, &st)) ERROR("FAIL read /a again\n");
+
+	if(fs_unlink(sb, "/a") < 0 || fs_unlink(sb, "/b") < 0) ERROR("FAIL fs_unlink\n");
+	free(buf);
+	free(buf2);
+	return 0;
+}
+/*}}}*/
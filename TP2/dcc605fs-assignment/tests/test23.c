@@ -0,0 +1,188 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_nospace_test(struct superblock *sb, uint64_t blksz);
+int fs_fragmented_test(struct superblock *sb, uint64_t blksz);
+int check_keep(struct superblock *sb, char *buf, uint64_t size);
+void fill(char *buf, uint64_t size);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 23, 1 << 24};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	srand(605);
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, uint64_t size)/*{{{*/
+{
+	uint64_t i;
+	for(i = 0; i < size; i++) buf[i] = rand();
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_nospace_test(sb, blksz)) ERROR("FAIL fs_nospace_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_fragmented_test(sb, blksz)) ERROR("FAIL fs_fragmented_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_fsck(sb, 1, stdout, NULL) != 0) ERROR("FAIL fs_fsck\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* /keep holds the =size bytes of =buf. */
+int check_keep(struct superblock *sb, char *buf, uint64_t size)/*{{{*/
+{
+	char *back = malloc(size + 1);
+	if(fs_read_file(sb, "/keep", back, size + 1) != size) ERROR("FAIL fs_read_file size\n");
+	if(memcmp(back, buf, size)) ERROR("FAIL fs_read_file contents\n");
+	free(back);
+	return 0;
+}
+/*}}}*/
+
+
+int fs_nospace_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_dirent de;
+	uint64_t size = 3 * blksz + 7;
+	char *buf = malloc(size);
+	fill(buf, size);
+	if(fs_write_file(sb, "/keep", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+
+	// one byte more than the free blocks hold is one block too many
+	uint64_t freeblks = sb->freeblks;
+	uint64_t big = freeblks * blksz + 1;
+	char *huge = calloc(big, 1);
+	if(fs_write_file(sb, "/big", huge, big) != -1 || errno != ENOSPC)
+		ERROR("FAIL oversized write\n");
+	if(fs_stat(sb, "/big", &de) != -1 || errno != ENOENT) ERROR("FAIL file left behind\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked by new file\n");
+
+	// and a new file needs room for its inode and nodeinfo too
+	if(fs_write_file(sb, "/big", huge, (freeblks - 1) * blksz) != -1 || errno != ENOSPC)
+		ERROR("FAIL write without room for metadata\n");
+	if(fs_stat(sb, "/big", &de) != -1 || errno != ENOENT) ERROR("FAIL file left behind\n");
+
+	// an overwrite that does not fit leaves the file alone
+	if(fs_write_file(sb, "/keep", huge, big + size) != -1 || errno != ENOSPC)
+		ERROR("FAIL oversized overwrite\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked by overwrite\n");
+	if(check_keep(sb, buf, size)) ERROR("FAIL /keep changed\n");
+
+	if(fs_unlink(sb, "/keep") < 0) ERROR("FAIL fs_unlink\n");
+	free(huge);
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* With free space in single blocks, the data of a write fits but the
+ * child inodes for its extents do not: this is only found out once the
+ * data blocks are reserved. */
+int fs_fragmented_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t size = 2 * blksz + 1;
+	uint64_t n = 600, i, nruns = 0, nblocks;
+	char *buf = malloc(size);
+	char *block = malloc(blksz);
+	fill(buf, size);
+	fill(block, blksz);
+	if(n > sb->freeblks / 3) ERROR("FAIL image too small\n");
+	if(fs_write_file(sb, "/keep", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+
+	// two files grown in turns, then the rest of the image taken away
+	struct fsfile *f = fs_file_open(sb, "/a", FS_CREAT);
+	struct fsfile *f2 = fs_file_open(sb, "/b", FS_CREAT);
+	if(f == NULL || f2 == NULL) ERROR("FAIL fs_file_open\n");
+	for(i = 0; i < n; i++) {
+		if(fs_file_pwrite(f, block, blksz, i * blksz) != blksz) ERROR("FAIL fs_file_pwrite\n");
+		if(fs_file_pwrite(f2, block, blksz, i * blksz) != blksz) ERROR("FAIL fs_file_pwrite\n");
+	}
+	fs_file_close(f);
+	fs_file_close(f2);
+	uint64_t *runs = malloc(2 * sb->blks * sizeof(uint64_t));
+	while(sb->freeblks > 0) {
+		runs[2 * nruns] = fs_get_blocks(sb, sb->freeblks, &nblocks);
+		if(runs[2 * nruns] == 0) ERROR("FAIL fs_get_blocks\n");
+		runs[2 * nruns + 1] = nblocks;
+		nruns++;
+	}
+
+	// what /b gave back is the only free space, one block at a time
+	if(fs_unlink(sb, "/b") < 0) ERROR("FAIL fs_unlink\n");
+	uint64_t freeblks = sb->freeblks;
+	char *huge = calloc(freeblks * blksz, 1);
+	if(fs_write_file(sb, "/keep", huge, freeblks * blksz) != -1 || errno != ENOSPC)
+		ERROR("FAIL fragmented overwrite\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked by overwrite\n");
+	if(check_keep(sb, buf, size)) ERROR("FAIL /keep changed\n");
+
+	// a new file is created, cannot be written, and is removed again: at
+	// most one block is left for the child inodes of its 600 extents
+	struct fs_dirent de;
+	if(fs_write_file(sb, "/new", huge, (freeblks - 3) * blksz) != -1 || errno != ENOSPC)
+		ERROR("FAIL fragmented write\n");
+	if(fs_stat(sb, "/new", &de) != -1 || errno != ENOENT) ERROR("FAIL file left behind\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked by new file\n");
+
+	for(i = 0; i < nruns; i++) {
+		if(fs_put_blocks(sb, runs[2 * i], runs[2 * i + 1]) < 0) ERROR("FAIL fs_put_blocks\n");
+	}
+	if(check_keep(sb, buf, size)) ERROR("FAIL /keep changed\n");
+	if(fs_unlink(sb, "/keep") < 0 || fs_unlink(sb, "/a") < 0) ERROR("FAIL fs_unlink\n");
+	free(runs);
+	free(huge);
+	free(block);
+	free(buf);
+	return 0;
+}
+/*}}}*/
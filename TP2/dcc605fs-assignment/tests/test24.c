@@ -0,0 +1,263 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_fill_test(struct superblock *sb, int n, uint64_t *nblocks);
+int fs_dirent_test(struct superblock *sb, int n, uint64_t nblocks);
+int check_dir(struct superblock *sb, int n, int step, uint64_t *nblocks);
+int check_listing(struct superblock *sb, int n, int step);
+void entry_name(char *name, int i);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* Names of several lengths, so that records of several sizes are packed;
+ * every third entry is a directory. */
+void entry_name(char *name, int i)/*{{{*/
+{
+	sprintf(name, "%s%d%.*s", (i % 3) ? "f" : "d", i, i % 23, "abcdefghijklmnopqrstuvw");
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	// enough entries to need several inodes in the directory chain
+	int n = 200;
+	if(n > sb->freeblks / 4) n = sb->freeblks / 4;
+	uint64_t freeblks = sb->freeblks;
+	uint64_t nblocks;
+	if(fs_fill_test(sb, n, &nblocks)) ERROR("FAIL fs_fill_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// with a cold cache, to count what is read
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(fs_dirent_test(sb, n, nblocks)) ERROR("FAIL fs_dirent_test\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* Walk the chain of /d on disk: every inode holds packed entries, and
+ * together they hold entries 0, =step, 2 * =step, ... below =n, each with
+ * its type.  The chain length goes to =nblocks. */
+int check_dir(struct superblock *sb, int n, int step, uint64_t *nblocks)/*{{{*/
+{
+	struct fs_dirent de;
+	char name[FS_NAME_MAX];
+	uint64_t blksz = sb->blksz;
+	char *node = malloc(blksz);
+	char *seen = calloc(n, 1);
+	int i, count = 0;
+
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	if(fs_stat(sb, "/d", &de) < 0 || !de.isdir) ERROR("FAIL fs_stat /d\n");
+	int fd = open(fname, O_RDONLY);
+	assert(fd >= 0);
+	uint64_t blk = de.inode;
+	*nblocks = 0;
+	while(blk != 0) {
+		assert(pread(fd, node, blksz, blk * blksz) == blksz);
+		struct inode *inode = (struct inode *)node;
+		if(blk == de.inode && inode->mode != (IMDIR | IMDIRENT))
+			ERROR("FAIL directory does not use packed entries\n");
+		size_t area = blksz - sizeof(struct inode);
+		if(sb->format == FORMAT_COMPACT && blk == de.inode) area -= COMPACT_INFO_SIZE;
+		size_t used = 0;
+		while(used + sizeof(struct direntry) <= area) {
+			struct direntry *ent = (struct direntry *)((char *)inode->links + used);
+			if(ent->inode == 0) break;
+			if(ent->reclen % 8 || ent->reclen < sizeof(struct direntry) ||
+					used + ent->reclen > area)
+				ERROR("FAIL bad record length\n");
+			if(sscanf(ent->name + 1, "%d", &i) != 1 || i < 0 || i >= n || seen[i])
+				ERROR("FAIL bad entry\n");
+			entry_name(name, i);
+			if(strcmp(ent->name, name)) ERROR("FAIL entry name\n");
+			if(ent->type != ((i % 3) ? IMREG : IMDIR)) ERROR("FAIL entry type\n");
+			seen[i] = 1;
+			count++;
+			used += ent->reclen;
+		}
+		blk = inode->next;
+		(*nblocks)++;
+	}
+	close(fd);
+	for(i = 0; i < n; i += step) {
+		if(!seen[i]) ERROR("FAIL entry missing\n");
+	}
+	if(count != (n + step - 1) / step) ERROR("FAIL extra entries\n");
+	if(de.size != count) ERROR("FAIL directory size\n");
+	free(seen);
+	free(node);
+	return 0;
+}
+/*}}}*/
+
+
+/* fs_list_dir and fs_readdir return entries 0, =step, ... below =n. */
+int check_listing(struct superblock *sb, int n, int step)/*{{{*/
+{
+	char name[FS_NAME_MAX];
+	struct fs_dirent *de;
+	int i, count = 0;
+	char *list = fs_list_dir(sb, "/d");
+	if(list == NULL) ERROR("FAIL fs_list_dir\n");
+	for(char *tok = strtok(list, " "); tok != NULL; tok = strtok(NULL, " ")) count++;
+	if(count != (n + step - 1) / step) ERROR("FAIL fs_list_dir count\n");
+	free(list);
+
+	count = 0;
+	struct fsdir *d = fs_opendir(sb, "/d");
+	if(d == NULL) ERROR("FAIL fs_opendir\n");
+	while((de = fs_readdir(d)) != NULL) {
+		if(sscanf(de->name + 1, "%d", &i) != 1 || i % step) ERROR("FAIL fs_readdir entry\n");
+		entry_name(name, i);
+		if(strcmp(de->name, name) || de->isdir != (i % 3 == 0)) ERROR("FAIL fs_readdir name\n");
+		count++;
+	}
+	fs_closedir(d);
+	if(count != (n + step - 1) / step) ERROR("FAIL fs_readdir count\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* Fill /d with =n entries; the length of its chain goes to =nblocks. */
+int fs_fill_test(struct superblock *sb, int n, uint64_t *nblocks)/*{{{*/
+{
+	char name[FS_NAME_MAX], path[FS_NAME_MAX + 4];
+	int i;
+
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < n; i++) {
+		entry_name(name, i);
+		sprintf(path, "/d/%s", name);
+		if(i % 3 == 0) {
+			if(fs_mkdir(sb, path) < 0) ERROR("FAIL fs_mkdir\n");
+		} else if(fs_write_file(sb, path, name, strlen(name) + 1) < 0) {
+			ERROR("FAIL fs_write_file\n");
+		}
+	}
+	if(check_dir(sb, n, 1, nblocks)) ERROR("FAIL check_dir\n");
+	if(*nblocks < 2) ERROR("FAIL directory fits in one inode\n");
+	if(check_listing(sb, n, 1)) ERROR("FAIL check_listing\n");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_dirent_test(struct superblock *sb, int n, uint64_t nblocks)/*{{{*/
+{
+	struct fs_stats st;
+	struct fs_dirent de;
+	char name[FS_NAME_MAX], path[FS_NAME_MAX + 4];
+	uint64_t full = nblocks;
+	int i;
+
+	// listing reads the directory's own blocks, not one per entry
+	fs_stats_reset(sb);
+	char *list = fs_list_dir(sb, "/d");
+	if(list == NULL) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	fs_stats_get(sb, &st);
+	if(st.cache_misses > nblocks + 1) ERROR("FAIL fs_list_dir read the entries\n");
+
+	// the chain is now cached: a lookup only reads the entry itself
+	fs_stats_reset(sb);
+	entry_name(name, n - 1);
+	sprintf(path, "/d/%s", name);
+	if(fs_stat(sb, path, &de) < 0) ERROR("FAIL fs_stat\n");
+	fs_stats_get(sb, &st);
+	if(st.cache_misses > 2) ERROR("FAIL lookup read the entries\n");
+
+	// removals keep the remaining records packed and readable
+	for(i = 0; i < n; i++) {
+		if(i % 2 == 0) continue;
+		entry_name(name, i);
+		sprintf(path, "/d/%s", name);
+		if(i % 3 == 0) {
+			if(fs_rmdir(sb, path) < 0) ERROR("FAIL fs_rmdir\n");
+		} else if(fs_unlink(sb, path) < 0) {
+			ERROR("FAIL fs_unlink\n");
+		}
+		if(fs_stat(sb, path, &de) != -1 || errno != ENOENT) ERROR("FAIL entry not removed\n");
+	}
+	if(check_dir(sb, n, 2, &nblocks)) ERROR("FAIL check_dir after removals\n");
+	if(check_listing(sb, n, 2)) ERROR("FAIL check_listing after removals\n");
+	if(fs_fsck(sb, 1, stdout, NULL) != 0) ERROR("FAIL fs_fsck\n");
+
+	// new entries reuse the room left by the removed ones
+	for(i = 1; i < n; i += 2) {
+		entry_name(name, i);
+		sprintf(path, "/d/%s", name);
+		if(i % 3 == 0) {
+			if(fs_mkdir(sb, path) < 0) ERROR("FAIL fs_mkdir\n");
+		} else if(fs_write_file(sb, path, name, strlen(name) + 1) < 0) {
+			ERROR("FAIL fs_write_file\n");
+		}
+	}
+	if(check_dir(sb, n, 1, &nblocks)) ERROR("FAIL check_dir after adding back\n");
+	if(nblocks > full + 1) ERROR("FAIL chain grew\n");
+
+	for(i = 0; i < n; i++) {
+		entry_name(name, i);
+		sprintf(path, "/d/%s", name);
+		if(i % 3 == 0) {
+			if(fs_rmdir(sb, path) < 0) ERROR("FAIL fs_rmdir\n");
+		} else if(fs_unlink(sb, path) < 0) {
+			ERROR("FAIL fs_unlink\n");
+		}
+	}
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir /d\n");
+	return 0;
+}
+/*}}}*/
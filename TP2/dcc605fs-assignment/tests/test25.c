@@ -0,0 +1,267 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_crash_test(uint64_t blksz, int round);
+int fs_overflow_test(struct superblock *sb, uint64_t blksz);
+void writer(int fd, uint64_t blksz);
+int check_file(struct superblock *sb, int i, uint64_t blksz);
+void file_data(char *buf, int i, uint64_t size);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define ROUNDS 16
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 4096};
+	int i, j;
+	srand(605);
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* The contents of file =i: a few blocks, so that each write dirties
+ * several metadata blocks. */
+void file_data(char *buf, int i, uint64_t size)/*{{{*/
+{
+	uint64_t j;
+	for(j = 0; j < size; j++) buf[j] = (char)(i * 31 + j);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_journal_enable(sb, 3) == 0 || errno != EINVAL) ERROR("FAIL tiny journal\n");
+	if(fs_journal_enable(sb, JOURNAL_MIN_BLOCKS - 1) == 0 || errno != EINVAL)
+		ERROR("FAIL journal below the minimum\n");
+	if(fs_journal_enable(sb, 64) < 0) ERROR("FAIL fs_journal_enable\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	int round;
+	for(round = 0; round < ROUNDS; round++) {
+		if(fs_crash_test(blksz, round)) ERROR("FAIL fs_crash_test\n");
+	}
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(fs_journal_disable(sb) < 0) ERROR("FAIL fs_journal_disable\n");
+	if(fs_journal_enable(sb, JOURNAL_MIN_BLOCKS) < 0) ERROR("FAIL fs_journal_enable\n");
+	if(fs_overflow_test(sb, blksz)) ERROR("FAIL fs_overflow_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* Create files /w<i> forever, keeping the last 40, and report on =fd the
+ * number of the last file known to be on disk after each fs_sync.  Killed by the parent, at any
+ * point of an operation or of a commit. */
+void writer(int fd, uint64_t blksz)/*{{{*/
+{
+	struct superblock *sb = fs_open(fname);
+	if(sb == NULL) _exit(EXIT_FAILURE);
+	uint64_t size = 3 * blksz + 5;
+	char *buf = malloc(size);
+	char name[32];
+	int i;
+	for(i = 0; ; i++) {
+		// make room again once the image fills up
+		if(i >= 40) {
+			sprintf(name, "/w%d", i - 40);
+			if(fs_unlink(sb, name) < 0) _exit(EXIT_FAILURE);
+		}
+		sprintf(name, "/w%d", i);
+		file_data(buf, i, size);
+		if(fs_write_file(sb, name, buf, size) < 0) _exit(EXIT_FAILURE);
+		if(i % 4 == 3) {
+			if(fs_sync(sb) < 0) _exit(EXIT_FAILURE);
+			if(write(fd, &i, sizeof(i)) != sizeof(i)) _exit(EXIT_FAILURE);
+		}
+	}
+}
+/*}}}*/
+
+
+int check_file(struct superblock *sb, int i, uint64_t blksz)/*{{{*/
+{
+	uint64_t size = 3 * blksz + 5;
+	char *buf = malloc(size);
+	char *back = malloc(size + 1);
+	char name[32];
+	sprintf(name, "/w%d", i);
+	file_data(buf, i, size);
+	if(fs_read_file(sb, name, back, size + 1) != size) ERROR("FAIL synced file size\n");
+	if(memcmp(back, buf, size)) ERROR("FAIL synced file contents\n");
+	free(back);
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* Let a writer run on the image for a while, kill it and check that
+ * reopening the image gives a consistent filesystem that holds what the
+ * writer last synced.  Each round kills the writer after a different
+ * number of syncs and a random delay. */
+int fs_crash_test(uint64_t blksz, int round)/*{{{*/
+{
+	int fds[2];
+	assert(pipe(fds) == 0);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if(pid == 0) {
+		close(fds[0]);
+		writer(fds[1], blksz);
+	}
+	close(fds[1]);
+
+	// wait for some syncs, then kill the writer wherever it is
+	int last = -1, got, nsyncs = 2 + round;
+	while(nsyncs-- > 0 && read(fds[0], &got, sizeof(got)) == sizeof(got)) last = got;
+	usleep(rand() % 2000);
+	kill(pid, SIGKILL);
+	while(read(fds[0], &got, sizeof(got)) == sizeof(got)) last = got;
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	if(!WIFSIGNALED(status)) ERROR("FAIL writer failed\n");
+	if(last < 0) ERROR("FAIL writer never synced\n");
+
+	// fs_open replays the journal
+	struct superblock *sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open after crash\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck after crash\n");
+	if(report.leaked != 0) ERROR("FAIL blocks leaked by crash\n");
+	// the writer may have gone on for up to two more syncs without
+	// reporting them, removing old files and adding new ones; every file
+	// that is there is whole
+	int i;
+	struct fs_dirent st;
+	char name[32];
+	for(i = (last >= 39) ? last - 39 : 0; i <= last + 8; i++) {
+		sprintf(name, "/w%d", i);
+		if(fs_stat(sb, name, &st) < 0) {
+			if(i > last - 32 && i <= last) ERROR("FAIL synced file lost\n");
+			continue;
+		}
+		if(check_file(sb, i, blksz)) ERROR("FAIL check_file\n");
+	}
+
+	// start the next round from an empty image
+	struct fs_dirent *de;
+	struct fsdir *d = fs_opendir(sb, "/");
+	if(d == NULL) ERROR("FAIL fs_opendir\n");
+	int n = 0;
+	char (*names)[FS_NAME_MAX] = malloc(200 * FS_NAME_MAX);
+	while((de = fs_readdir(d)) != NULL && n < 200) strcpy(names[n++], de->name);
+	fs_closedir(d);
+	for(i = 0; i < n; i++) {
+		sprintf(name, "/%s", names[i]);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	free(names);
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* A transaction larger than the journal is written in place, and
+ * counted.  A write into fragmented free space needs a child inode for
+ * every few extents, all of them dirtied by a single operation. */
+int fs_overflow_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fs_stats st;
+	uint64_t n = 600, i;
+	char *block = malloc(blksz);
+	memset(block, 'o', blksz);
+	if(n > sb->freeblks / 3) n = sb->freeblks / 3;
+
+	// small writes go through the journal
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	fs_stats_reset(sb);
+	if(fs_write_file(sb, "/small", "small", 6) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	fs_stats_get(sb, &st);
+	if(st.journal_commits != 1 || st.journal_overflows != 0) ERROR("FAIL small commit\n");
+
+	// free space in single blocks, between the blocks of /a
+	struct fsfile *f = fs_file_open(sb, "/a", FS_CREAT);
+	struct fsfile *f2 = fs_file_open(sb, "/b", FS_CREAT);
+	if(f == NULL || f2 == NULL) ERROR("FAIL fs_file_open\n");
+	for(i = 0; i < n; i++) {
+		if(fs_file_pwrite(f, block, blksz, i * blksz) != blksz) ERROR("FAIL fs_file_pwrite\n");
+		if(fs_file_pwrite(f2, block, blksz, i * blksz) != blksz) ERROR("FAIL fs_file_pwrite\n");
+	}
+	fs_file_close(f);
+	fs_file_close(f2);
+	if(fs_unlink(sb, "/b") < 0) ERROR("FAIL fs_unlink\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+
+	// one extent per block: with small blocks the child inodes of /c
+	// alone outnumber the journal
+	uint64_t max_ext = ((blksz - sizeof(struct inode)) / 8 - 1) / 2;
+	char *buf = malloc(n * blksz);
+	memset(buf, 'c', n * blksz);
+	fs_stats_reset(sb);
+	if(fs_write_file(sb, "/c", buf, n * blksz) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	fs_stats_get(sb, &st);
+	if(n / max_ext > JOURNAL_MIN_BLOCKS && st.journal_overflows == 0)
+		ERROR("FAIL overflow not counted\n");
+	if(n / max_ext < JOURNAL_MIN_BLOCKS / 4 && st.journal_overflows != 0)
+		ERROR("FAIL overflow counted\n");
+
+	// written in place, but written all the same
+	if(fs_fsck(sb, 1, stdout, NULL) != 0) ERROR("FAIL fs_fsck\n");
+	char *back = malloc(n * blksz);
+	if(fs_read_file(sb, "/c", back, n * blksz) != n * blksz || memcmp(back, buf, n * blksz))
+		ERROR("FAIL fs_read_file\n");
+	if(fs_unlink(sb, "/a") < 0 || fs_unlink(sb, "/c") < 0 || fs_unlink(sb, "/small") < 0)
+		ERROR("FAIL fs_unlink\n");
+	free(back);
+	free(buf);
+	free(block);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,246 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, int ring);
+int fs_uring_test(struct superblock *sb, uint64_t blksz, int ring);
+int fs_dirscan_test(struct superblock *sb, int n);
+int check_files(struct superblock *sb, uint64_t blksz, int n);
+int kernel_has_uring(void);
+void fill(char *buf, uint64_t size, int seed);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NBLOCKS 60
+#define NENTRIES 100
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	// where the kernel has io_uring, check that it is used; then check
+	// the fallback to pread/pwrite, as on a kernel without it
+	int ring = kernel_has_uring();
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d ring %d\n", (int)fsizes[j], (int)blkszs[i], ring);
+		unsetenv("DCC605FS_NO_URING");
+		if(test(fsizes[j], blkszs[i], ring)) exit(EXIT_FAILURE);
+		printf("fsize %d blksz %d fallback\n", (int)fsizes[j], (int)blkszs[i]);
+		setenv("DCC605FS_NO_URING", "1", 1);
+		if(test(fsizes[j], blkszs[i], 0)) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+int kernel_has_uring(void)/*{{{*/
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, 4, &params);
+	if(fd < 0) return 0;
+	close(fd);
+	return 1;
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, uint64_t size, int seed)/*{{{*/
+{
+	uint64_t i;
+	for(i = 0; i < size; i++) buf[i] = (char)(seed * 131 + i * 7 + i / 251);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, int ring)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	uint64_t freeblks = sb->freeblks;
+	int n = NBLOCKS;
+	if(n > sb->freeblks / 4) n = sb->freeblks / 4;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	sb = fs_open_mode(fname, FS_IO_URING);
+	if(sb == NULL) ERROR("FAIL fs_open_mode\n");
+	if(fs_uring_test(sb, blksz, ring)) ERROR("FAIL fs_uring_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// the directory again, from a cold cache
+	sb = fs_open_mode(fname, FS_IO_URING);
+	if(sb == NULL) ERROR("FAIL fs_open_mode\n");
+	if(fs_dirscan_test(sb, NENTRIES)) ERROR("FAIL fs_dirscan_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// what went through the ring is on the image
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_files(sb, blksz, n)) ERROR("FAIL check_files\n");
+	if(fs_dirscan_test(sb, NENTRIES)) ERROR("FAIL fs_dirscan_test with pread\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0 || report.leaked != 0) ERROR("FAIL fs_fsck\n");
+	if(fs_unlink(sb, "/seq") < 0 || fs_unlink(sb, "/a") < 0 || fs_unlink(sb, "/b") < 0)
+		ERROR("FAIL fs_unlink\n");
+	char path[32];
+	for(int i = 0; i < NENTRIES; i++) {
+		sprintf(path, "/d/e%d", i);
+		if(fs_unlink(sb, path) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* /seq is one run of 2 * =n blocks; /a and /b were grown in turns, and
+ * have one extent per block. */
+int check_files(struct superblock *sb, uint64_t blksz, int n)/*{{{*/
+{
+	uint64_t size = 2 * n * blksz - blksz / 2;
+	char *buf = malloc(size);
+	char *back = malloc(size + 1);
+	fill(buf, size, 1);
+	if(fs_read_file(sb, "/seq", back, size + 1) != size) ERROR("FAIL /seq size\n");
+	if(memcmp(back, buf, size)) ERROR("FAIL /seq contents\n");
+	fill(buf, n * blksz, 2);
+	if(fs_read_file(sb, "/a", back, size + 1) != n * blksz) ERROR("FAIL /a size\n");
+	if(memcmp(back, buf, n * blksz)) ERROR("FAIL /a contents\n");
+	fill(buf, n * blksz, 3);
+	if(fs_read_file(sb, "/b", back, size + 1) != n * blksz) ERROR("FAIL /b size\n");
+	if(memcmp(back, buf, n * blksz)) ERROR("FAIL /b contents\n");
+	free(back);
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* Multi-block reads and writes.  With =ring, the extents of a fragmented
+ * file are read with one request each; without, with a single preadv. */
+int fs_uring_test(struct superblock *sb, uint64_t blksz, int ring)/*{{{*/
+{
+	struct fs_stats st;
+	struct fs_dirent de;
+	int n = NBLOCKS, i;
+	if(n > sb->freeblks / 4) n = sb->freeblks / 4;
+	uint64_t size = 2 * n * blksz - blksz / 2;
+	char *buf = malloc(size);
+	char *buf2 = malloc(n * blksz);
+	fill(buf, size, 1);
+
+	if(fs_write_file(sb, "/seq", buf, size) < 0) ERROR("FAIL fs_write_file\n");
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+
+	// the dirty blocks of /a and /b are written back in runs of one block
+	struct fsfile *f = fs_file_open(sb, "/a", FS_CREAT);
+	struct fsfile *f2 = fs_file_open(sb, "/b", FS_CREAT);
+	if(f == NULL || f2 == NULL) ERROR("FAIL fs_file_open\n");
+	fill(buf, n * blksz, 2);
+	fill(buf2, n * blksz, 3);
+	for(i = 0; i < n; i++) {
+		if(fs_file_pwrite(f, buf + i * blksz, blksz, i * blksz) != blksz)
+			ERROR("FAIL fs_file_pwrite\n");
+		if(fs_file_pwrite(f2, buf2 + i * blksz, blksz, i * blksz) != blksz)
+			ERROR("FAIL fs_file_pwrite\n");
+	}
+	fs_file_close(f);
+	fs_file_close(f2);
+	if(fs_sync(sb) < 0) ERROR("FAIL fs_sync\n");
+	if(check_files(sb, blksz, n)) ERROR("FAIL check_files\n");
+
+	// the file's inode and nodeinfo are cached: only data is read
+	if(fs_stat(sb, "/a", &de) < 0) ERROR("FAIL fs_stat\n");
+	char *back = malloc(n * blksz);
+	fs_stats_reset(sb);
+	if(fs_read_file(sb, "/a", back, n * blksz) != n * blksz) ERROR("FAIL fs_read_file\n");
+	fs_stats_get(sb, &st);
+	if(memcmp(back, buf, n * blksz)) ERROR("FAIL fs_read_file contents\n");
+	if(ring && st.io_requests < n) ERROR("FAIL /a not read through the ring\n");
+	if(!ring && st.io_requests != 1) ERROR("FAIL /a not read with one preadv\n");
+	if(st.blk_reads < n) ERROR("FAIL /a blocks read\n");
+
+	// a directory of several blocks
+	char name[32];
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < NENTRIES; i++) {
+		sprintf(name, "/d/e%d", i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	if(fs_dirscan_test(sb, NENTRIES)) ERROR("FAIL fs_dirscan_test\n");
+
+	free(back);
+	free(buf2);
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* /d holds e0 ... e<=n - 1>, each holding its own path. */
+int fs_dirscan_test(struct superblock *sb, int n)/*{{{*/
+{
+	struct fs_dirent *de;
+	char path[32], back[32];
+	int i, count = 0;
+	char *seen = calloc(n, 1);
+	struct fsdir *d = fs_opendir(sb, "/d");
+	if(d == NULL) ERROR("FAIL fs_opendir\n");
+	while((de = fs_readdir(d)) != NULL) {
+		if(sscanf(de->name, "e%d", &i) != 1 || i < 0 || i >= n || seen[i])
+			ERROR("FAIL fs_readdir entry\n");
+		if(de->isdir) ERROR("FAIL fs_readdir type\n");
+		seen[i] = 1;
+		count++;
+	}
+	fs_closedir(d);
+	if(count != n) ERROR("FAIL fs_readdir count\n");
+
+	char *list = fs_list_dir(sb, "/d");
+	if(list == NULL) ERROR("FAIL fs_list_dir\n");
+	count = 0;
+	for(char *tok = strtok(list, " "); tok != NULL; tok = strtok(NULL, " ")) count++;
+	free(list);
+	if(count != n) ERROR("FAIL fs_list_dir count\n");
+
+	for(i = 0; i < n; i++) {
+		sprintf(path, "/d/e%d", i);
+		if(fs_read_file(sb, path, back, sizeof(back)) != strlen(path) + 1) ERROR("FAIL entry size\n");
+		if(strcmp(back, path)) ERROR("FAIL entry contents\n");
+	}
+	free(seen);
+	return 0;
+}
+/*}}}*/
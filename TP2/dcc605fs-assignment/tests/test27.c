@@ -0,0 +1,148 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_discard_test(uint64_t fsize, uint64_t blksz);
+int fs_write_error_test(uint64_t fsize, uint64_t blksz);
+int check_block(uint64_t block, uint64_t blksz, char c);
+void generate_used_file(uint64_t fsize);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+/* An image whose every byte is 'u', as if a filesystem had filled it. */
+void generate_used_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 'u', fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* Every byte of =block of the image is =c. */
+int check_block(uint64_t block, uint64_t blksz, char c)/*{{{*/
+{
+	char *buf = malloc(blksz);
+	int fd = open(fname, O_RDONLY);
+	assert(fd >= 0);
+	assert(pread(fd, buf, blksz, block * blksz) == blksz);
+	close(fd);
+	for(uint64_t i = 0; i < blksz; i++) {
+		if(buf[i] != c) { free(buf); return -1; }
+	}
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	if(fs_discard_test(fsize, blksz)) ERROR("FAIL fs_discard_test\n");
+	if(fs_write_error_test(fsize, blksz)) ERROR("FAIL fs_write_error_test\n");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_discard_test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	struct stat st;
+	uint64_t last = fsize / blksz - 1;
+
+	// without FS_FMT_DISCARD, free blocks keep what they held
+	generate_used_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL fs_format\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	if(check_block(last, blksz, 'u')) ERROR("FAIL free block overwritten\n");
+	if(stat(fname, &st) < 0) ERROR("FAIL stat\n");
+	blkcnt_t used = st.st_blocks;
+
+	// with it, their storage goes back to the OS and they read as zeros
+	sb = fs_format_flags(fname, blksz, FS_FMT_DISCARD);
+	if(sb == NULL) {
+		// the OS cannot punch holes in the image
+		if(errno != EOPNOTSUPP) ERROR("FAIL fs_format_flags\n");
+		return 0;
+	}
+	if(fs_write_file(sb, "/f", "data", 5) < 0) ERROR("FAIL fs_write_file\n");
+	uint64_t freeblks = sb->freeblks;
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	if(check_block(last, blksz, 0)) ERROR("FAIL free block not discarded\n");
+	if(stat(fname, &st) < 0 || st.st_size != fsize) ERROR("FAIL image size\n");
+	if(st.st_blocks * 512 > used * 512 - fsize / 2) ERROR("FAIL storage not released\n");
+
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	char back[8];
+	if(fs_read_file(sb, "/f", back, sizeof(back)) != 5 || strcmp(back, "data"))
+		ERROR("FAIL fs_read_file\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0 || report.free != freeblks)
+		ERROR("FAIL fs_fsck\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* A format that cannot write its blocks fails with the write's errno: past
+ * RLIMIT_FSIZE, writes fail with EFBIG. */
+int fs_write_error_test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	struct rlimit old, lim;
+	generate_used_file(fsize);
+	signal(SIGXFSZ, SIG_IGN);
+	assert(getrlimit(RLIMIT_FSIZE, &old) == 0);
+	lim = old;
+	lim.rlim_cur = blksz;
+	assert(setrlimit(RLIMIT_FSIZE, &lim) == 0);
+	struct superblock *sb = fs_format(fname, blksz);
+	int err = errno;
+	assert(setrlimit(RLIMIT_FSIZE, &old) == 0);
+	signal(SIGXFSZ, SIG_DFL);
+	if(sb != NULL || err != EFBIG) ERROR("FAIL format with failed writes\n");
+
+	// the image is not locked by the failed format
+	sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL fs_format\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,186 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_dirindex_test(struct superblock *sb, int n);
+int check_entries(struct superblock *sb, int n, const char *removed, int round);
+int check_missing(struct superblock *sb, int n);
+void entry_data(char *buf, int i, int round);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NENTRIES 1500
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22, 1 << 23};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* The contents of /d/f<=i> after it was written =round times: its path
+ * and the round, so that a stale entry shows. */
+void entry_data(char *buf, int i, int round)/*{{{*/
+{
+	sprintf(buf, "/d/f%d round %d", i, round);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	uint64_t freeblks = sb->freeblks;
+	// each entry takes its inode and nodeinfo, and some directory space
+	int n = NENTRIES;
+	if(n > sb->freeblks / 4) n = sb->freeblks / 4;
+
+	if(fs_dirindex_test(sb, n)) ERROR("FAIL fs_dirindex_test\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+
+	// from a cold index, every entry is found again
+	sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	if(check_missing(sb, n)) ERROR("FAIL check_missing after fs_open\n");
+	if(check_entries(sb, n, NULL, 1)) ERROR("FAIL check_entries after fs_open\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+
+	char path[32];
+	for(int i = 0; i < n; i++) {
+		sprintf(path, "/d/f%d", i);
+		if(fs_unlink(sb, path) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	if(fs_rmdir(sb, "/d") < 0) ERROR("FAIL fs_rmdir\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* Every /d/f<i> but those marked in =removed holds entry_data for =round,
+ * and the directory lists exactly them. */
+int check_entries(struct superblock *sb, int n, const char *removed, int round)/*{{{*/
+{
+	char path[32], want[64], back[64];
+	struct fs_dirent st;
+	int i, count = 0;
+	for(i = 0; i < n; i++) {
+		sprintf(path, "/d/f%d", i);
+		if(removed != NULL && removed[i]) {
+			if(fs_stat(sb, path, &st) == 0 || errno != ENOENT) ERROR("FAIL removed entry found\n");
+			continue;
+		}
+		entry_data(want, i, round);
+		if(fs_stat(sb, path, &st) < 0) ERROR("FAIL fs_stat\n");
+		if(st.isdir || st.size != strlen(want) + 1 || strcmp(st.name, path + 3))
+			ERROR("FAIL fs_stat entry\n");
+		if(fs_read_file(sb, path, back, sizeof(back)) != strlen(want) + 1 || strcmp(back, want))
+			ERROR("FAIL entry contents\n");
+		count++;
+	}
+
+	char *list = fs_list_dir(sb, "/d");
+	if(list == NULL) ERROR("FAIL fs_list_dir\n");
+	int listed = 0;
+	for(char *tok = strtok(list, " "); tok != NULL; tok = strtok(NULL, " ")) listed++;
+	free(list);
+	if(listed != count) ERROR("FAIL fs_list_dir count\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* Names that are not in /d are not found, and once the index of /d is
+ * built, looking them up reads no block of the directory. */
+int check_missing(struct superblock *sb, int n)/*{{{*/
+{
+	char path[32];
+	struct fs_dirent st;
+	struct fs_stats stats;
+	if(fs_stat(sb, "/d/missing", &st) == 0 || errno != ENOENT) ERROR("FAIL missing entry found\n");
+	fs_stats_reset(sb);
+	for(int i = 0; i < n; i++) {
+		sprintf(path, "/d/g%d", i);
+		if(fs_stat(sb, path, &st) == 0 || errno != ENOENT) ERROR("FAIL missing entry found\n");
+	}
+	fs_stats_get(sb, &stats);
+	if(stats.cache_misses > 2) ERROR("FAIL lookups read the directory\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* A directory of =n entries, spread over many inodes of its chain; every
+ * third entry is removed and then created again. */
+int fs_dirindex_test(struct superblock *sb, int n)/*{{{*/
+{
+	char path[32], data[64];
+	struct fs_dirent st;
+	int i;
+	if(fs_mkdir(sb, "/d") < 0) ERROR("FAIL fs_mkdir\n");
+	for(i = 0; i < n; i++) {
+		sprintf(path, "/d/f%d", i);
+		entry_data(data, i, 0);
+		if(fs_write_file(sb, path, data, strlen(data) + 1) < 0) ERROR("FAIL fs_write_file\n");
+	}
+	if(check_entries(sb, n, NULL, 0)) ERROR("FAIL check_entries\n");
+	if(check_missing(sb, n)) ERROR("FAIL check_missing\n");
+
+	// the index follows removals
+	char *removed = calloc(n, 1);
+	for(i = 0; i < n; i += 3) {
+		sprintf(path, "/d/f%d", i);
+		if(fs_unlink(sb, path) < 0) ERROR("FAIL fs_unlink\n");
+		removed[i] = 1;
+	}
+	if(check_entries(sb, n, removed, 0)) ERROR("FAIL check_entries after fs_unlink\n");
+
+	// and insertions, which may reuse the blocks of removed entries
+	for(i = 0; i < n; i++) {
+		sprintf(path, "/d/f%d", i);
+		entry_data(data, i, 1);
+		if(fs_write_file(sb, path, data, strlen(data) + 1) < 0) ERROR("FAIL fs_write_file again\n");
+	}
+	if(check_entries(sb, n, NULL, 1)) ERROR("FAIL check_entries after reinsertion\n");
+	if(fs_stat(sb, "/d", &st) < 0 || !st.isdir || st.size != n) ERROR("FAIL fs_stat /d\n");
+	free(removed);
+	return 0;
+}
+/*}}}*/
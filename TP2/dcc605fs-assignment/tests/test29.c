@@ -0,0 +1,184 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_dcache_test(struct superblock *sb);
+int fs_dcache_reuse_test(struct superblock *sb);
+int check_file(struct superblock *sb, const char *path, const char *want);
+int check_gone(struct superblock *sb, const char *path);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define ROUNDS 64
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	uint64_t freeblks = sb->freeblks;
+
+	if(fs_dcache_test(sb)) ERROR("FAIL fs_dcache_test\n");
+	if(fs_dcache_reuse_test(sb)) ERROR("FAIL fs_dcache_reuse_test\n");
+
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* =path is a regular file holding the string =want, through every way of
+ * reaching it. */
+int check_file(struct superblock *sb, const char *path, const char *want)/*{{{*/
+{
+	struct fs_dirent st;
+	char back[64];
+	if(fs_stat(sb, path, &st) < 0) ERROR("FAIL fs_stat\n");
+	if(st.isdir || st.size != strlen(want) + 1) ERROR("FAIL fs_stat entry\n");
+	if(fs_read_file(sb, path, back, sizeof(back)) != strlen(want) + 1 || strcmp(back, want))
+		ERROR("FAIL fs_read_file\n");
+	struct fsfile *f = fs_file_open(sb, path, 0);
+	if(f == NULL) ERROR("FAIL fs_file_open\n");
+	memset(back, 0, sizeof(back));
+	if(fs_file_pread(f, back, sizeof(back), 0) != strlen(want) + 1 || strcmp(back, want))
+		ERROR("FAIL fs_file_pread\n");
+	fs_file_close(f);
+	return 0;
+}
+/*}}}*/
+
+
+int check_gone(struct superblock *sb, const char *path)/*{{{*/
+{
+	struct fs_dirent st;
+	char back[64];
+	if(fs_stat(sb, path, &st) == 0) ERROR("FAIL removed entry found by fs_stat\n");
+	if(fs_read_file(sb, path, back, sizeof(back)) >= 0) ERROR("FAIL removed entry read\n");
+	if(fs_file_open(sb, path, 0) != NULL) ERROR("FAIL removed entry opened\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* Paths resolved once, under several spellings, are removed and created
+ * again as something else; lookups that failed are followed by creates. */
+int fs_dcache_test(struct superblock *sb)/*{{{*/
+{
+	struct fs_dirent st;
+	if(fs_mkdir(sb, "/a") < 0 || fs_mkdir(sb, "/a/b") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/a/b/f", "one", 4) < 0) ERROR("FAIL fs_write_file\n");
+	if(check_file(sb, "/a/b/f", "one")) ERROR("FAIL /a/b/f\n");
+	if(check_file(sb, "//a/b//f/", "one")) ERROR("FAIL //a/b//f/\n");
+
+	// a file removed under another spelling is gone under all of them
+	if(fs_unlink(sb, "/a//b/f") < 0) ERROR("FAIL fs_unlink\n");
+	if(check_gone(sb, "/a/b/f") || check_gone(sb, "//a/b//f/")) ERROR("FAIL unlinked file\n");
+
+	// a lookup that failed does not hide what is created afterwards
+	if(fs_stat(sb, "/a/b/g", &st) == 0 || errno != ENOENT) ERROR("FAIL /a/b/g found\n");
+	if(fs_write_file(sb, "/a/b/g", "two", 4) < 0) ERROR("FAIL fs_write_file\n");
+	if(check_file(sb, "/a/b/g", "two")) ERROR("FAIL /a/b/g\n");
+	if(fs_stat(sb, "/a/b/e", &st) == 0 || errno != ENOENT) ERROR("FAIL /a/b/e found\n");
+	if(fs_mkdir(sb, "/a/b/e") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_stat(sb, "/a/b/e", &st) < 0 || !st.isdir || st.size != 0) ERROR("FAIL /a/b/e\n");
+
+	// the file comes back as a directory, and then as a file again
+	if(fs_mkdir(sb, "/a/b/f") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_stat(sb, "/a/b/f", &st) < 0 || !st.isdir || st.size != 0) ERROR("FAIL /a/b/f dir\n");
+	if(fs_write_file(sb, "/a/b/f/x", "three", 6) < 0) ERROR("FAIL fs_write_file\n");
+	if(check_file(sb, "/a/b/f/x", "three")) ERROR("FAIL /a/b/f/x\n");
+	if(fs_unlink(sb, "/a/b/f/x") < 0 || fs_rmdir(sb, "/a/b/f/") < 0) ERROR("FAIL remove /a/b/f\n");
+	if(check_gone(sb, "/a/b/f/x") || check_gone(sb, "/a/b/f")) ERROR("FAIL removed directory\n");
+	if(fs_write_file(sb, "/a/b/f", "four", 5) < 0) ERROR("FAIL fs_write_file\n");
+	if(check_file(sb, "/a/b/f", "four")) ERROR("FAIL /a/b/f again\n");
+	if(check_gone(sb, "/a/b/f/x")) ERROR("FAIL path through a file\n");
+
+	// a whole subtree goes, and its names come back elsewhere in the tree
+	if(fs_unlink(sb, "/a/b/f") < 0 || fs_unlink(sb, "/a/b/g") < 0 || fs_rmdir(sb, "/a/b/e") < 0
+			|| fs_rmdir(sb, "/a/b") < 0 || fs_rmdir(sb, "/a") < 0)
+		ERROR("FAIL remove /a\n");
+	if(check_gone(sb, "/a/b/g") || fs_stat(sb, "/a/b", &st) == 0 || fs_stat(sb, "/a", &st) == 0)
+		ERROR("FAIL removed subtree\n");
+	if(fs_mkdir(sb, "/a") < 0 || fs_write_file(sb, "/a/b", "five", 5) < 0) ERROR("FAIL recreate /a\n");
+	if(check_file(sb, "/a/b", "five")) ERROR("FAIL /a/b\n");
+	if(check_gone(sb, "/a/b/g")) ERROR("FAIL path through a new file\n");
+	if(fs_unlink(sb, "/a/b") < 0 || fs_rmdir(sb, "/a") < 0) ERROR("FAIL cleanup\n");
+	return 0;
+}
+/*}}}*/
+
+
+/* The same name is removed and created again, alternately as a file and
+ * as a directory, so that new entries reuse the blocks of old ones. */
+int fs_dcache_reuse_test(struct superblock *sb)/*{{{*/
+{
+	struct fs_dirent st;
+	char want[64], child[64];
+	int round;
+	if(fs_mkdir(sb, "/r") < 0) ERROR("FAIL fs_mkdir\n");
+	for(round = 0; round < ROUNDS; round++) {
+		sprintf(want, "round %d", round);
+		sprintf(child, "/r/n/c%d", round);
+		if(round % 2 == 0) {
+			if(fs_write_file(sb, "/r/n", want, strlen(want) + 1) < 0) ERROR("FAIL fs_write_file\n");
+			if(check_file(sb, "/r/n", want)) ERROR("FAIL /r/n file\n");
+			if(check_gone(sb, child)) ERROR("FAIL child of a file\n");
+			if(fs_unlink(sb, "/r/n") < 0) ERROR("FAIL fs_unlink\n");
+		} else {
+			if(fs_mkdir(sb, "/r/n") < 0) ERROR("FAIL fs_mkdir\n");
+			if(fs_stat(sb, "/r/n", &st) < 0 || !st.isdir || st.size != 0) ERROR("FAIL /r/n dir\n");
+			if(fs_write_file(sb, child, want, strlen(want) + 1) < 0) ERROR("FAIL fs_write_file\n");
+			if(check_file(sb, child, want)) ERROR("FAIL child\n");
+			if(fs_stat(sb, "/r/n", &st) < 0 || !st.isdir || st.size != 1) ERROR("FAIL /r/n size\n");
+			if(fs_unlink(sb, child) < 0 || fs_rmdir(sb, "/r/n") < 0) ERROR("FAIL remove /r/n\n");
+			if(check_gone(sb, child)) ERROR("FAIL removed child\n");
+		}
+		if(check_gone(sb, "/r/n")) ERROR("FAIL removed /r/n\n");
+	}
+	if(fs_rmdir(sb, "/r") < 0) ERROR("FAIL fs_rmdir\n");
+	return 0;
+}
+/*}}}*/
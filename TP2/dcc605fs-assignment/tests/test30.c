@@ -0,0 +1,106 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+/* Helper of test30.sh, which copies files in and out of an image with
+ * unmodified programs run under the shim:
+ *
+ *   test30 format fsize blksz      formats "img"
+ *   test30 check hostfile path     compares path in "img" with hostfile
+ *   test30 fsck                    checks "img" and that it is consistent */
+
+int test_format(uint64_t fsize, uint64_t blksz);
+int test_check(const char *hostfile, const char *path);
+int test_fsck(void);
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	int err = -1;
+	if(argc == 4 && !strcmp(argv[1], "format")) {
+		err = test_format(atoll(argv[2]), atoll(argv[3]));
+	} else if(argc == 4 && !strcmp(argv[1], "check")) {
+		err = test_check(argv[2], argv[3]);
+	} else if(argc == 2 && !strcmp(argv[1], "fsck")) {
+		err = test_fsck();
+	} else {
+		fprintf(stderr, "usage: %s format fsize blksz | check hostfile path | fsck\n", argv[0]);
+	}
+	exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test_format(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	printf("fsize %d blksz %d\n", (int)fsize, (int)blksz);
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* The file =path of the image holds what =hostfile does, read through
+ * the library rather than the shim. */
+int test_check(const char *hostfile, const char *path)/*{{{*/
+{
+	FILE *fd = fopen(hostfile, "r");
+	if(fd == NULL) ERROR("FAIL fopen\n");
+	fseek(fd, 0, SEEK_END);
+	long size = ftell(fd);
+	rewind(fd);
+	char *want = malloc(size + 1);
+	char *back = malloc(size + 1);
+	if(fread(want, 1, size, fd) != size) ERROR("FAIL fread\n");
+	fclose(fd);
+
+	struct superblock *sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	struct fs_dirent st;
+	if(fs_stat(sb, path, &st) < 0 || st.isdir || st.size != size) ERROR("FAIL fs_stat\n");
+	if(fs_read_file(sb, path, back, size + 1) != size) ERROR("FAIL fs_read_file\n");
+	if(memcmp(want, back, size)) ERROR("FAIL contents\n");
+	free(want);
+	free(back);
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+int test_fsck(void)/*{{{*/
+{
+	struct superblock *sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
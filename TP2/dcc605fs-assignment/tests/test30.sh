@@ -0,0 +1,45 @@
+#!/bin/bash
+set -u
+
+i=30
+
+gcc -g -Wall -c fs.c &>> gcc.log
+gcc -g -Wall -I. tests/test$i.c fs.o -o test$i &>> gcc.log
+gcc -g -Wall -fPIC -shared -I. fsshim.c fs.c -o test$i.so -ldl -pthread &>> gcc.log
+if [ ! -x test$i ] || [ ! -f test$i.so ] ; then
+    echo "[$i] compilation error"
+    exit 1 ;
+fi
+
+# unmodified programs copy files in and out of the image through the shim
+shim() {
+    DCC605FS_IMAGE=img DCC605FS_PREFIX=/fs LD_PRELOAD=$PWD/test$i.so "$@"
+}
+
+fail() {
+    echo "[$i] error: $1"
+    exit 1
+}
+
+head -c 1234567 /dev/urandom > test$i.big
+head -c 100 /dev/urandom > test$i.small
+: > test$i.empty
+for blksz in 128 512 4096 ; do
+    ./test$i format $(( 1 << 23 )) $blksz >> test$i.out 2>> test$i.err || fail "format"
+    shim mkdir /fs/d 2>> test$i.err || fail "mkdir"
+    for f in big small empty ; do
+        shim cp test$i.$f /fs/d/$f 2>> test$i.err || fail "cp $f"
+        shim cat /fs/d/$f > test$i.back 2>> test$i.err || fail "cat $f"
+        if [ "$(cksum < test$i.$f)" != "$(cksum < test$i.back)" ] ; then
+            fail "$f read back through the shim differs"
+        fi
+        ./test$i check test$i.$f /d/$f >> test$i.out 2>> test$i.err || fail "check $f"
+    done
+    # a copy from one image file to another never leaves the image
+    shim cp /fs/d/big /fs/copy 2>> test$i.err || fail "cp in the image"
+    ./test$i check test$i.big /copy >> test$i.out 2>> test$i.err || fail "check copy"
+    ./test$i fsck >> test$i.out 2>> test$i.err || fail "fsck"
+done
+
+rm -f test$i test$i.so test$i.out test$i.err test$i.big test$i.small test$i.empty test$i.back
+exit 0
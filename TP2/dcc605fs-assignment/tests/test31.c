@@ -0,0 +1,83 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+/* Helper of test31.sh, which imports a host tree into an image with bulk
+ * and exports it back:
+ *
+ *   test31 format fsize blksz      formats "img"
+ *   test31 check dir               checks the empty entries under dir of
+ *                                  "img" and that it is consistent */
+
+int test_format(uint64_t fsize, uint64_t blksz);
+int test_check(const char *dir);
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	int err = -1;
+	if(argc == 4 && !strcmp(argv[1], "format")) {
+		err = test_format(atoll(argv[2]), atoll(argv[3]));
+	} else if(argc == 3 && !strcmp(argv[1], "check")) {
+		err = test_check(argv[2]);
+	} else {
+		fprintf(stderr, "usage: %s format fsize blksz | check dir\n", argv[0]);
+	}
+	exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test_format(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	printf("fsize %d blksz %d\n", (int)fsize, (int)blksz);
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+/* The empty file and the empty directory of the tree were imported as
+ * such, not skipped nor turned into one another. */
+int test_check(const char *dir)/*{{{*/
+{
+	char path[256];
+	struct fs_dirent st;
+	struct superblock *sb = fs_open(fname);
+	if(sb == NULL) ERROR("FAIL fs_open\n");
+	sprintf(path, "%s/empty", dir);
+	if(fs_stat(sb, path, &st) < 0 || st.isdir || st.size != 0) ERROR("FAIL empty file\n");
+	sprintf(path, "%s/a/emptydir", dir);
+	if(fs_stat(sb, path, &st) < 0 || !st.isdir || st.size != 0) ERROR("FAIL empty directory\n");
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,40 @@
+#!/bin/bash
+set -u
+
+i=31
+
+gcc -g -Wall -c fs.c &>> gcc.log
+gcc -g -Wall -I. tests/test$i.c fs.o -o test$i &>> gcc.log
+gcc -g -Wall -I. bulk.c fs.c -o test$i.bulk -pthread &>> gcc.log
+if [ ! -x test$i ] || [ ! -x test$i.bulk ] ; then
+    echo "[$i] compilation error"
+    exit 1 ;
+fi
+
+fail() {
+    echo "[$i] error: $1"
+    exit 1
+}
+
+# a tree with files of one chunk and of many, an empty file and an empty
+# directory, imported and exported with small chunks and several workers
+rm -rf test$i.src test$i.dst
+mkdir -p test$i.src/a/b/c test$i.src/a/emptydir
+head -c 300000 /dev/urandom > test$i.src/big
+head -c 4096 /dev/urandom > test$i.src/a/chunk
+: > test$i.src/empty
+for n in 1 2 3 4 5 6 7 8 9 10 ; do
+    echo "file $n" > test$i.src/a/b/f$n
+    head -c $(( n * 1000 )) /dev/urandom > test$i.src/a/b/c/g$n
+done
+for blksz in 128 512 4096 ; do
+    ./test$i format $(( 1 << 23 )) $blksz >> test$i.out 2>> test$i.err || fail "format"
+    ./test$i.bulk -j 4 -c 4 import img test$i.src /t >> test$i.out 2>> test$i.err || fail "import"
+    ./test$i check /t >> test$i.out 2>> test$i.err || fail "check"
+    rm -rf test$i.dst
+    ./test$i.bulk -j 4 -c 4 export img /t test$i.dst >> test$i.out 2>> test$i.err || fail "export"
+    diff -r test$i.src test$i.dst >> test$i.err 2>&1 || fail "exported tree differs"
+done
+
+rm -rf test$i test$i.bulk test$i.out test$i.err test$i.src test$i.dst
+exit 0
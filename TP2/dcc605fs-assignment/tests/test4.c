@@ -88,8 +88,8 @@ int fs_free_check(struct superblock **sb, uint64_t fsize, uint64_t blksz)/*{{{*/
 	struct freepage *fp = malloc(blksz);
 	assert(fp);
 
-	lseek((*sb)->fd, (*sb)->freelist * blksz, SEEK_SET);
-	read((*sb)->fd, fp, blksz);
+	lseek((*sb)->state->fd, (*sb)->freelist * blksz, SEEK_SET);
+	read((*sb)->state->fd, fp, blksz);
 
 	usedblocks = (*sb)->freeblks;
 	uint64_t blknum = fs_get_block(*sb);
@@ -132,8 +132,8 @@ int fs_check(const struct superblock *sb, uint64_t fsize, uint64_t blksz)/*{{{*/
 	struct inode *inode = malloc(blksz);
 	if(!inode) { perror(NULL); exit(EXIT_FAILURE); }
 
-	lseek(sb->fd, sb->root * blksz, SEEK_SET);
-	read(sb->fd, inode, blksz);
+	lseek(sb->state->fd, sb->root * blksz, SEEK_SET);
+	read(sb->state->fd, inode, blksz);
 
 	if(inode->mode != IMDIR) ERROR("FAIL root IMDIR\n");
 	if(inode->next != 0) ERROR("FAIL root next\n");
@@ -141,8 +141,8 @@ int fs_check(const struct superblock *sb, uint64_t fsize, uint64_t blksz)/*{{{*/
 	struct nodeinfo *info = malloc(blksz);
 	assert(info);
 
-	lseek(sb->fd, inode->meta * blksz, SEEK_SET);
-	read(sb->fd, info, blksz);
+	lseek(sb->state->fd, inode->meta * blksz, SEEK_SET);
+	read(sb->state->fd, info, blksz);
 
 	if(info->size != 0) ERROR("FAIL root size\n");
 	if(info->name[0] != '/' || info->name[1] != '\0') ERROR("FAIL root name\n");
@@ -0,0 +1,130 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_file_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	srand(605);
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	uint64_t freeblks = sb->freeblks;
+	if(fs_file_test(sb, blksz)) ERROR("FAIL fs_file_test\n");
+	if(fs_unlink(sb, "/big") < 0) ERROR("FAIL fs_unlink /big\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_file_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	uint64_t maxsz = 64 * blksz;
+	char *shadow = calloc(1, maxsz);
+	char *buf = malloc(maxsz);
+	assert(shadow && buf);
+	uint64_t size = 0;
+
+	if(fs_file_open(sb, "/big", 0) != NULL || errno != ENOENT)
+		ERROR("FAIL opened missing file\n");
+	if(fs_mkdir(sb, "/dir") < 0) ERROR("FAIL fs_mkdir\n");
+	if(fs_file_open(sb, "/dir", FS_CREAT) != NULL || errno != EISDIR)
+		ERROR("FAIL opened directory\n");
+	if(fs_rmdir(sb, "/dir") < 0) ERROR("FAIL fs_rmdir\n");
+
+	struct fsfile *f = fs_file_open(sb, "/big", FS_CREAT);
+	if(f == NULL) ERROR("FAIL fs_file_open\n");
+
+	int i;
+	for(i = 0; i < 200; i++) {
+		uint64_t off = rand() % (maxsz / 2);
+		uint64_t cnt = 1 + rand() % (maxsz / 2 - 1);
+		int j;
+		for(j = 0; j < cnt; j++) buf[j] = rand();
+		if(fs_file_pwrite(f, buf, cnt, off) != cnt)
+			ERROR("FAIL fs_file_pwrite\n");
+		memcpy(shadow + off, buf, cnt);
+		if(off + cnt > size) size = off + cnt;
+		if(fs_file_size(f) != size) ERROR("FAIL fs_file_size\n");
+
+		off = rand() % maxsz;
+		cnt = rand() % maxsz;
+		uint64_t expect = (off >= size) ? 0 : (off + cnt > size ? size - off : cnt);
+		if(fs_file_pread(f, buf, cnt, off) != expect)
+			ERROR("FAIL fs_file_pread count\n");
+		if(memcmp(buf, shadow + off, expect))
+			ERROR("FAIL fs_file_pread data\n");
+	}
+
+	// sequential reads through the handle position
+	if(fs_file_seek(f, 0, SEEK_SET) != 0) ERROR("FAIL fs_file_seek\n");
+	uint64_t got = 0;
+	ssize_t ret;
+	while((ret = fs_file_read(f, buf + got, blksz / 2 + 3)) > 0) got += ret;
+	if(got != size || memcmp(buf, shadow, size))
+		ERROR("FAIL fs_file_read\n");
+	if(fs_file_seek(f, -1, SEEK_SET) != -1 || errno != EINVAL)
+		ERROR("FAIL fs_file_seek negative\n");
+	fs_file_close(f);
+
+	// the whole file API sees the same contents
+	if(fs_read_file(sb, "/big", buf, maxsz) != size || memcmp(buf, shadow, size))
+		ERROR("FAIL fs_read_file after fs_file_pwrite\n");
+
+	f = fs_file_open(sb, "/big", FS_TRUNC);
+	if(f == NULL || fs_file_size(f) != 0) ERROR("FAIL FS_TRUNC\n");
+	fs_file_close(f);
+
+	free(shadow);
+	free(buf);
+	return 0;
+}
+/*}}}*/
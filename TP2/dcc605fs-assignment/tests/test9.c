@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int fs_fsck_test(struct superblock *sb, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 4096};
+	int i, j;
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_fsck_test(sb, blksz)) ERROR("FAIL fs_fsck_test\n");
+
+	if(fs_close(sb)) ERROR("FAIL error on fs_close");
+	return 0;
+}
+/*}}}*/
+
+
+int fs_fsck_test(struct superblock *sb, uint64_t blksz)/*{{{*/
+{
+	struct fsck_report report;
+	if(fs_fsck(sb, 1, stdout, &report) != 0) ERROR("FAIL empty fs\n");
+	if(report.dirs != 1 || report.files != 0) ERROR("FAIL empty fs counts\n");
+	if(report.free != sb->freeblks || report.used + report.free != sb->blks)
+		ERROR("FAIL empty fs blocks\n");
+
+	uint64_t cnt = 5 * blksz + 7;
+	char *buf = malloc(cnt);
+	assert(buf);
+	memset(buf, 'x', cnt);
+	if(fs_mkdir(sb, "/a") < 0) ERROR("FAIL fs_mkdir /a\n");
+	if(fs_mkdir(sb, "/a/b") < 0) ERROR("FAIL fs_mkdir /a/b\n");
+	int i;
+	char name[32];
+	for(i = 0; i < 40; i++) {
+		sprintf(name, "/a/%sf%d", i % 2 ? "b/" : "", i);
+		if(fs_write_file(sb, name, buf, i * cnt / 40) < 0)
+			ERROR("FAIL fs_write_file\n");
+	}
+	for(i = 0; i < 40; i += 3) {
+		sprintf(name, "/a/%sf%d", i % 2 ? "b/" : "", i);
+		if(fs_unlink(sb, name) < 0) ERROR("FAIL fs_unlink\n");
+	}
+	free(buf);
+
+	if(fs_fsck(sb, 4, stdout, &report) != 0) ERROR("FAIL fs_fsck\n");
+	if(report.dirs != 3 || report.files != 26 || report.errors != 0)
+		ERROR("FAIL fs_fsck counts\n");
+	if(report.free != sb->freeblks || report.used + report.free != sb->blks)
+		ERROR("FAIL fs_fsck blocks\n");
+
+	// online check in small steps, with an update in between
+	struct fsck *ck = fs_fsck_begin(sb, 2, stdout);
+	if(ck == NULL) ERROR("FAIL fs_fsck_begin\n");
+	int steps = 0;
+	while(fs_fsck_step(ck, 2) > 0) {
+		if(++steps == 3 && fs_mkdir(sb, "/c") < 0) ERROR("FAIL fs_mkdir /c\n");
+	}
+	if(fs_fsck_end(ck, &report) != 0) ERROR("FAIL online fs_fsck\n");
+	if(steps < 3 || report.restarts != 1 || report.dirs != 4)
+		ERROR("FAIL online fs_fsck restart\n");
+
+	// a block taken off the free list and never used is leaked
+	uint64_t block = fs_get_block(sb);
+	if(fs_fsck(sb, 0, NULL, &report) != 1) ERROR("FAIL leak not found\n");
+	if(report.leaked != 1 || report.errors != 1) ERROR("FAIL leak counts\n");
+	if(fs_put_block(sb, block) < 0) ERROR("FAIL fs_put_block\n");
+	if(fs_fsck(sb, 0, NULL, NULL) != 0) ERROR("FAIL fs_fsck after fs_put_block\n");
+
+	// freeing the nodeinfo of the root makes it both used and free
+	if(fs_put_block(sb, 2) < 0) ERROR("FAIL fs_put_block\n");
+	if(fs_fsck(sb, 0, NULL, &report) != 1) ERROR("FAIL double use not found\n");
+
+	return 0;
+}
+/*}}}*/